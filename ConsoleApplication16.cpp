@@ -1,466 +1,110 @@
-#include <iostream>
-#include <vector>
-#include <string>
-#include <algorithm>
-#include <ctime>
-#include <cstdlib>
-#include <fstream>
-#include <map>
-#include <set>
-#include <sstream>
-#include <iterator>
-
-using namespace std;
-
-// Forward declarations
-class Artist;
-class Playlist;
-class User;
-class Admin;
-class Song;
-
-// Enum for playback modes
-enum class PlaybackMode {
-    SEQUENTIAL,
-    RANDOM,
-    REPEAT
-};
-
-// Global collections
-vector<Song*> allSongs;
-vector<Playlist*> allPlaylists;
-vector<Artist*> allArtists;
-vector<User*> allUsers;
-Admin* admin = nullptr;
-
-// Utility functions
-void trim(string& str) {
-    str.erase(str.begin(), find_if(str.begin(), str.end(), [](int ch) { return !isspace(ch); }));
-    str.erase(find_if(str.rbegin(), str.rend(), [](int ch) { return !isspace(ch); }).base(), str.end());
-}
-
-vector<string> split(const string& s, char delimiter) {
-    vector<string> tokens;
-    string token;
-    istringstream tokenStream(s);
-    while (getline(tokenStream, token, delimiter)) {
-        trim(token);
-        if (!token.empty()) tokens.push_back(token);
-    }
-    return tokens;
-}
-
-// Song class definition
-class Song {
-private:
-    string title;
-    Artist* artist;
-    int releaseYear;
-    string genre;
-
-public:
-    Song(const string& title, Artist* artist, int year, const string& genre)
-        : title(title), artist(artist), releaseYear(year), genre(genre) {}
-
-    string getTitle() const { return title; }
-    Artist* getArtist() const { return artist; }
-    int getReleaseYear() const { return releaseYear; }
-    string getGenre() const { return genre; }
-
-    void display() const;
-};
-
-// Artist class definition
-class Artist {
-private:
-    string name;
-    vector<Song*> songs;
-    vector<Playlist*> albums;
-
-public:
-    Artist(const string& name) : name(name) {}
-
-    string getName() const { return name; }
-    int getAlbumCount() const { return albums.size(); }
-    int getSongCount() const { return songs.size(); }
-    const vector<Song*>& getSongs() const { return songs; }
-    const vector<Playlist*>& getAlbums() const { return albums; }
-
-    void addSong(Song* song) {
-        if (find(songs.begin(), songs.end(), song) == songs.end()) {
-            songs.push_back(song);
-        }
-    }
-
-    void addAlbum(Playlist* album) {
-        if (find(albums.begin(), albums.end(), album) == albums.end()) {
-            albums.push_back(album);
-        }
-    }
-
-    void display() const;
-};
-
-// Playlist class definition
-class Playlist {
-private:
-    string name;
-    vector<Song*> songs;
-    User* creator;
-    bool isPublic;
-
-public:
-    Playlist(const string& name, User* creator, bool isPublic = true)
-        : name(name), creator(creator), isPublic(isPublic) {}
-
-    string getName() const { return name; }
-    int getSongCount() const { return songs.size(); }
-    const vector<Song*>& getSongs() const { return songs; }
-    User* getCreator() const { return creator; }
-    bool getIsPublic() const { return isPublic; }
-
-    void addSong(Song* song) {
-        if (find(songs.begin(), songs.end(), song) == songs.end()) {
-            songs.push_back(song);
-        }
-    }
-
-    void removeSong(Song* song) {
-        songs.erase(remove(songs.begin(), songs.end(), song), songs.end());
-    }
+// Console front end: the interactive menus, the batch command interface and
+// the session servers, on top of the model in MusicLibrary.h
+#include "MusicLibrary.h"
+
+#ifdef __linux__
+#include <cerrno>
+#include <csignal>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
 
-    void display() const;
-};
-
-// User base class definition
-class User {
-protected:
-    string username;
-    string password;
-    vector<Song*> favoriteSongs;
-    vector<Playlist*> favoritePlaylists;
-    vector<Playlist*> personalPlaylists;
-    Playlist* currentPlaylist = nullptr;
-    Song* currentSong = nullptr;
-    PlaybackMode playbackMode = PlaybackMode::SEQUENTIAL;
-    bool isLooping = false;
-
-public:
-    User(const string& username, const string& password)
-        : username(username), password(password) {}
-
-    string getUsername() const { return username; }
-    string getPassword() const { return password; }
-    const vector<Song*>& getFavoriteSongs() const { return favoriteSongs; }
-    const vector<Playlist*>& getFavoritePlaylists() const { return favoritePlaylists; }
-    const vector<Playlist*>& getPersonalPlaylists() const { return personalPlaylists; }
-    Playlist* getCurrentPlaylist() const { return currentPlaylist; }
-    Song* getCurrentSong() const { return currentSong; }
-    bool isLoopingEnabled() const { return isLooping; }
-
-    void setCurrentSong(Song* song) { currentSong = song; }
-
-    bool authenticate(const string& uname, const string& pwd) const {
-        return username == uname && password == pwd;
-    }
-
-    void createPlaylist(const string& name, bool isPublic = true);
-    void deletePlaylist(Playlist* playlist);
-
-    void addFavoriteSong(Song* song) {
-        if (find(favoriteSongs.begin(), favoriteSongs.end(), song) == favoriteSongs.end()) {
-            favoriteSongs.push_back(song);
-        }
-    }
-
-    void removeFavoriteSong(Song* song) {
-        favoriteSongs.erase(remove(favoriteSongs.begin(), favoriteSongs.end(), song), favoriteSongs.end());
-    }
-
-    void addFavoritePlaylist(Playlist* playlist) {
-        if (find(favoritePlaylists.begin(), favoritePlaylists.end(), playlist) == favoritePlaylists.end()) {
-            favoritePlaylists.push_back(playlist);
-        }
-    }
-
-    void removeFavoritePlaylist(Playlist* playlist) {
-        favoritePlaylists.erase(remove(favoritePlaylists.begin(), favoritePlaylists.end(), playlist), favoritePlaylists.end());
-    }
-
-    void setCurrentPlaylist(Playlist* playlist) {
-        currentPlaylist = playlist;
-        if (playlist && !playlist->getSongs().empty()) {
-            currentSong = playlist->getSongs()[0];
-        }
-        else {
-            currentSong = nullptr;
+// UI functions
+const size_t BROWSE_PAGE_SIZE = 20;
+
+// Prints a listing one page at a time, numbering items continuously, and asks
+// before fetching the next page. Returns every item shown so a selection can
+// refer to it by number.
+template <typename T, typename Fetch, typename Print>
+vector<T> browsePages(const string& heading, size_t total, Fetch fetch, Print print) {
+    cout << "\n" << heading << " (" << total << "):" << endl;
+    vector<T> shown;
+    BrowseCursor cursor;
+    while (true) {
+        BrowsePage<T> page = fetch(cursor, BROWSE_PAGE_SIZE);
+        for (const auto& item : page.items) {
+            shown.push_back(item);
+            cout << shown.size() << ". ";
+            print(item);
         }
-    }
-
-    void setPlaybackMode(PlaybackMode mode) {
-        playbackMode = mode;
-    }
-
-    void toggleLoop() {
-        isLooping = !isLooping;
-    }
-
-    Song* getNextSong();
-    Song* getPreviousSong();
-
-    vector<Song*> searchSongs(const string& query) const;
-    vector<Playlist*> searchPlaylists(const string& query) const;
-
-    void displayFavoriteSongs() const;
-    void displayFavoritePlaylists() const;
-    void displayPersonalPlaylists() const;
-
-    virtual void displayMenu();
-    virtual ~User();
-};
-
-// Admin class definition
-class Admin : public User {
-public:
-    Admin(const string& username, const string& password)
-        : User(username, password) {}
-
-    void addSong(const string& title, Artist* artist, int year, const string& genre);
-    void removeSong(Song* song);
-    void createArtist(const string& name);
-    void removeArtist(Artist* artist);
-    void createAlbum(Artist* artist, const string& name);
+        if (!page.hasMore) break;
 
-    void displayMenu() override;
-};
-
-// Implementations of methods that require complete types
-void Song::display() const {
-    cout << "Title: " << title << endl;
-    cout << "Artist: " << artist->getName() << endl;
-    cout << "Year: " << releaseYear << endl;
-    cout << "Genre: " << genre << endl;
-}
-
-void Artist::display() const {
-    cout << "Artist: " << name << endl;
-    cout << "Total Songs: " << songs.size() << endl;
-    cout << "Total Albums: " << albums.size() << endl;
-
-    cout << "\nPopular Songs:" << endl;
-    for (int i = 0; i < min(5, (int)songs.size()); i++) {
-        cout << "- " << songs[i]->getTitle() << endl;
-    }
-
-    cout << "\nAlbums:" << endl;
-    for (const auto& album : albums) {
-        cout << "- " << album->getName() << endl;
+        cout << "1. Next page  0. Done: ";
+        int more;
+        cin >> more;
+        cin.ignore();
+        if (more != 1) break;
+        cursor = page.next;
     }
+    return shown;
 }
 
-void Playlist::display() const {
-    cout << "Playlist: " << name << endl;
-    cout << "Creator: " << creator->getUsername() << endl;
-    cout << "Songs (" << songs.size() << "):" << endl;
-    for (const auto& song : songs) {
-        cout << "- " << song->getTitle() << " by " << song->getArtist()->getName() << endl;
-    }
+void printSongLine(SongRef song) {
+    cout << song->getTitle() << " by " << song->getArtist()->getName() << endl;
 }
 
-void User::createPlaylist(const string& name, bool isPublic) {
-    personalPlaylists.push_back(new Playlist(name, this, isPublic));
+void printPlaylistLine(Playlist* playlist) {
+    cout << playlist->getName() << " by " << playlist->getCreator()->getUsername()
+        << " (" << playlist->getSongCount() << " songs)" << endl;
 }
 
-void User::deletePlaylist(Playlist* playlist) {
-    auto it = find(personalPlaylists.begin(), personalPlaylists.end(), playlist);
-    if (it != personalPlaylists.end()) {
-        delete* it;
-        personalPlaylists.erase(it);
-    }
-}
-
-Song* User::getNextSong() {
-    if (!currentPlaylist || currentPlaylist->getSongs().empty()) return nullptr;
-
-    const auto& songs = currentPlaylist->getSongs();
-    auto it = find(songs.begin(), songs.end(), currentSong);
-
-    if (it == songs.end()) return nullptr;
-
-    switch (playbackMode) {
-    case PlaybackMode::SEQUENTIAL: {
-        if (next(it) != songs.end()) {
-            return *(next(it));
-        }
-        else if (isLooping) {
-            return songs[0];
-        }
-        break;
-    }
-    case PlaybackMode::RANDOM: {
-        return songs[rand() % songs.size()];
-    }
-    case PlaybackMode::REPEAT: {
-        return currentSong;
-    }
+void displaySongs(const vector<SongRef>& songs) {
+    cout << "\nSongs (" << songs.size() << "):" << endl;
+    for (size_t i = 0; i < songs.size(); i++) {
+        cout << i + 1 << ". ";
+        printSongLine(songs[i]);
     }
-    return nullptr;
 }
 
-Song* User::getPreviousSong() {
-    if (!currentPlaylist || currentPlaylist->getSongs().empty()) return nullptr;
-
-    const auto& songs = currentPlaylist->getSongs();
-    auto it = find(songs.begin(), songs.end(), currentSong);
-
-    if (it == songs.end()) return nullptr;
-
-    if (playbackMode == PlaybackMode::SEQUENTIAL) {
-        if (it != songs.begin()) {
-            return *(prev(it));
-        }
-        else if (isLooping) {
-            return songs.back();
-        }
+// What each edit still in the playlist's history changed, newest first
+void displayChanges(const Playlist* playlist) {
+    const auto& history = playlist->getHistory();
+    if (history.empty()) {
+        cout << "No recent changes." << endl;
+        return;
     }
-    return currentSong;
-}
-
-vector<Song*> User::searchSongs(const string& query) const {
-    vector<Song*> results;
-    for (const auto& song : allSongs) {
-        if (song->getTitle().find(query) != string::npos ||
-            song->getArtist()->getName().find(query) != string::npos) {
-            results.push_back(song);
+    PlaylistVersion newer = playlist->snapshot();
+    for (auto older = history.rbegin(); older != history.rend(); ++older) {
+        PlaylistDiff change = Playlist::diff(older->songs, newer.songs);
+        cout << "\nVersion " << newer.number << " (" << newer.songs.size() << " songs):" << endl;
+        for (const auto& song : change.added) {
+            cout << "  + ";
+            printSongLine(song);
         }
-    }
-    return results;
-}
-
-vector<Playlist*> User::searchPlaylists(const string& query) const {
-    vector<Playlist*> results;
-    for (const auto& playlist : allPlaylists) {
-        if (playlist->getName().find(query) != string::npos) {
-            results.push_back(playlist);
+        for (const auto& song : change.removed) {
+            cout << "  - ";
+            printSongLine(song);
         }
-    }
-    return results;
-}
-
-void User::displayFavoriteSongs() const {
-    cout << "Favorite Songs:" << endl;
-    for (const auto& song : favoriteSongs) {
-        cout << "- " << song->getTitle() << " by " << song->getArtist()->getName() << endl;
+        if (change.reordered) cout << "  songs reordered" << endl;
+        newer = *older;
     }
 }
 
-void User::displayFavoritePlaylists() const {
-    cout << "Favorite Playlists:" << endl;
-    for (const auto& playlist : favoritePlaylists) {
-        cout << "- " << playlist->getName() << " by " << playlist->getCreator()->getUsername() << endl;
-    }
+vector<SongRef> browseCatalogSongs() {
+    return browsePages<SongRef>("Songs", allSongs.size(),
+        [](const BrowseCursor& after, size_t limit) { return idOrderPage(allSongs, after, limit); },
+        printSongLine);
 }
 
-void User::displayPersonalPlaylists() const {
-    cout << "Personal Playlists:" << endl;
-    for (const auto& playlist : personalPlaylists) {
-        cout << "- " << playlist->getName() << " (" << playlist->getSongCount() << " songs)" << endl;
-    }
+vector<SongRef> browseSortedSongs(SongOrder order) {
+    indexCatalog();
+    return browsePages<SongRef>("Songs", catalog.orders.size(),
+        [order](const BrowseCursor& after, size_t limit) { return catalog.orders.page(order, after, limit); },
+        printSongLine);
 }
 
-void User::displayMenu() {
-    cout << "\nWelcome, " << username << "!" << endl;
-    cout << "1. Browse Songs" << endl;
-    cout << "2. Browse Playlists" << endl;
-    cout << "3. My Favorite Songs" << endl;
-    cout << "4. My Favorite Playlists" << endl;
-    cout << "5. My Playlists" << endl;
-    cout << "6. Search" << endl;
-    cout << "7. Play Music" << endl;
-    cout << "8. Logout" << endl;
+vector<SongRef> browseSongList(const vector<SongRef>& songs) {
+    return browsePages<SongRef>("Songs", songs.size(),
+        [&songs](const BrowseCursor& after, size_t limit) { return offsetPage(songs, after, limit); },
+        printSongLine);
 }
 
-User::~User() {
-    for (auto& playlist : personalPlaylists) {
-        delete playlist;
-    }
-}
-
-void Admin::addSong(const string& title, Artist* artist, int year, const string& genre) {
-    Song* song = new Song(title, artist, year, genre);
-    allSongs.push_back(song);
-    artist->addSong(song);
-}
-
-void Admin::removeSong(Song* song) {
-    // Remove from global list
-    allSongs.erase(remove(allSongs.begin(), allSongs.end(), song), allSongs.end());
-
-    // Remove from artist's songs
-    Artist* artist = song->getArtist();
-    vector<Song*>& artistSongs = const_cast<vector<Song*>&>(artist->getSongs());
-    artistSongs.erase(remove(artistSongs.begin(), artistSongs.end(), song), artistSongs.end());
-
-    // Remove from all playlists
-    for (auto& playlist : allPlaylists) {
-        playlist->removeSong(song);
-    }
-
-    // Remove from users' favorites
-    for (auto& user : allUsers) {
-        user->removeFavoriteSong(song);
-    }
-
-    delete song;
-}
-
-void Admin::createArtist(const string& name) {
-    allArtists.push_back(new Artist(name));
-}
-
-void Admin::removeArtist(Artist* artist) {
-    // First remove all songs by this artist
-    vector<Song*> artistSongs = artist->getSongs();
-    for (auto& song : artistSongs) {
-        removeSong(song);
-    }
-
-    // Then remove the artist
-    allArtists.erase(remove(allArtists.begin(), allArtists.end(), artist), allArtists.end());
-    delete artist;
-}
-
-void Admin::createAlbum(Artist* artist, const string& name) {
-    Playlist* album = new Playlist(name, this, true);
-    allPlaylists.push_back(album);
-    artist->addAlbum(album);
-}
-
-void Admin::displayMenu() {
-    cout << "\nAdmin Panel - Welcome, " << username << "!" << endl;
-    cout << "1. Add Song" << endl;
-    cout << "2. Create Artist" << endl;
-    cout << "3. Create Album" << endl;
-    cout << "4. Browse Songs" << endl;
-    cout << "5. Browse Playlists" << endl;
-    cout << "6. Browse Artists" << endl;
-    cout << "7. Logout" << endl;
-}
-
-// UI functions
-void displaySongs(const vector<Song*>& songs) {
-    cout << "\nSongs (" << songs.size() << "):" << endl;
-    for (size_t i = 0; i < songs.size(); i++) {
-        cout << i + 1 << ". " << songs[i]->getTitle() << " by " << songs[i]->getArtist()->getName() << endl;
-    }
-}
-
-void displayPlaylists(const vector<Playlist*>& playlists) {
-    cout << "\nPlaylists (" << playlists.size() << "):" << endl;
-    for (size_t i = 0; i < playlists.size(); i++) {
-        cout << i + 1 << ". " << playlists[i]->getName() << " by " << playlists[i]->getCreator()->getUsername()
-            << " (" << playlists[i]->getSongCount() << " songs)" << endl;
-    }
+vector<Playlist*> browseCatalogPlaylists() {
+    return browsePages<Playlist*>("Playlists", allPlaylists.size(),
+        [](const BrowseCursor& after, size_t limit) { return idOrderPage(allPlaylists, after, limit); },
+        printPlaylistLine);
 }
 
 void displayArtists(const vector<Artist*>& artists) {
@@ -471,7 +115,9 @@ void displayArtists(const vector<Artist*>& artists) {
 }
 
 void userMenu(User* user) {
+    Player player;
     while (true) {
+        wal.flush();
         user->displayMenu();
         cout << "Enter your choice: ";
         int choice;
@@ -480,7 +126,8 @@ void userMenu(User* user) {
 
         switch (choice) {
         case 1: { // Browse Songs
-            displaySongs(allSongs);
+            browseCatalogSongs();
+            indexCatalog();
 
             cout << "\nOptions:" << endl;
             cout << "1. Filter by artist" << endl;
@@ -488,33 +135,30 @@ void userMenu(User* user) {
             cout << "3. Filter by year" << endl;
             cout << "4. Sort A-Z" << endl;
             cout << "5. Sort by year" << endl;
-            cout << "6. Back" << endl;
+            cout << "6. Sort by artist" << endl;
+            cout << "7. Combined filter" << endl;
+            cout << "8. Filter expression" << endl;
+            cout << "9. Back" << endl;
 
             int filterChoice;
             cin >> filterChoice;
             cin.ignore();
 
-            vector<Song*> filteredSongs = allSongs;
+            vector<SongRef> filteredSongs;
 
             if (filterChoice == 1) {
                 cout << "Enter artist name: ";
                 string artistName;
                 getline(cin, artistName);
 
-                filteredSongs.erase(remove_if(filteredSongs.begin(), filteredSongs.end(),
-                    [&artistName](Song* song) {
-                        return song->getArtist()->getName().find(artistName) == string::npos;
-                    }), filteredSongs.end());
+                filteredSongs = browseSongList(catalog.columns.filterByArtist(artistName));
             }
             else if (filterChoice == 2) {
                 cout << "Enter genre: ";
                 string genre;
                 getline(cin, genre);
 
-                filteredSongs.erase(remove_if(filteredSongs.begin(), filteredSongs.end(),
-                    [&genre](Song* song) {
-                        return song->getGenre().find(genre) == string::npos;
-                    }), filteredSongs.end());
+                filteredSongs = browseSongList(catalog.columns.filterByGenre(genre));
             }
             else if (filterChoice == 3) {
                 cout << "Enter year: ";
@@ -522,23 +166,62 @@ void userMenu(User* user) {
                 cin >> year;
                 cin.ignore();
 
-                filteredSongs.erase(remove_if(filteredSongs.begin(), filteredSongs.end(),
-                    [year](Song* song) {
-                        return song->getReleaseYear() != year;
-                    }), filteredSongs.end());
+                filteredSongs = browseSongList(catalog.columns.filterByYear(year));
             }
             else if (filterChoice == 4) {
-                sort(filteredSongs.begin(), filteredSongs.end(),
-                    [](Song* a, Song* b) { return a->getTitle() < b->getTitle(); });
+                filteredSongs = browseSortedSongs(SongOrder::TITLE);
             }
             else if (filterChoice == 5) {
-                sort(filteredSongs.begin(), filteredSongs.end(),
-                    [](Song* a, Song* b) { return a->getReleaseYear() < b->getReleaseYear(); });
+                filteredSongs = browseSortedSongs(SongOrder::YEAR);
+            }
+            else if (filterChoice == 6) {
+                filteredSongs = browseSortedSongs(SongOrder::ARTIST);
             }
+            else if (filterChoice == 7) {
+                SongQuery query;
+                cout << "Artist name (blank for any): ";
+                getline(cin, query.artist);
+                cout << "Genre (blank for any): ";
+                getline(cin, query.genre);
+                cout << "From year (0 for any): ";
+                int year;
+                cin >> year;
+                if (year > 0) query.yearFrom = year;
+                cout << "To year (0 for any): ";
+                cin >> year;
+                cin.ignore();
+                if (year > 0) query.yearTo = year;
+                cout << "Sort by: 1. Title  2. Year  3. Artist  0. Catalog order: ";
+                int sortChoice;
+                cin >> sortChoice;
+                cin.ignore();
+                query.sorted = sortChoice >= 1 && sortChoice <= 3;
+                if (sortChoice == 2) query.order = SongOrder::YEAR;
+                else if (sortChoice == 3) query.order = SongOrder::ARTIST;
 
-            if (filterChoice != 6) {
-                displaySongs(filteredSongs);
+                if (query.yearFrom > query.yearTo) {
+                    cout << "Invalid year range." << endl;
+                }
+                else {
+                    filteredSongs = browseSongList(catalog.columns.query(query));
+                }
+            }
+            else if (filterChoice == 8) {
+                cout << "Conditions on artist, genre or year, joined with AND, OR and NOT" << endl;
+                cout << "(e.g. genre=Rock AND year>=2015 AND artist~\"Two\"): ";
+                string expression;
+                getline(cin, expression);
+
+                SongFilter filter;
+                string error;
+                if (filter.parse(expression, error)) filteredSongs = browseSongList(filter.run(catalog.filters));
+                else cout << "Invalid filter: " << error << endl;
+            }
+            else if (filterChoice != 9) {
+                filteredSongs = browseCatalogSongs();
+            }
 
+            if (filterChoice != 9) {
                 cout << "\nSelect a song to add to favorites (0 to cancel): ";
                 int songChoice;
                 cin >> songChoice;
@@ -552,15 +235,15 @@ void userMenu(User* user) {
             break;
         }
         case 2: { // Browse Playlists
-            displayPlaylists(allPlaylists);
+            vector<Playlist*> shownPlaylists = browseCatalogPlaylists();
 
             cout << "\nSelect a playlist to view (0 to cancel): ";
             int plChoice;
             cin >> plChoice;
             cin.ignore();
 
-            if (plChoice > 0 && plChoice <= static_cast<int>(allPlaylists.size())) {
-                Playlist* selected = allPlaylists[plChoice - 1];
+            if (plChoice > 0 && plChoice <= static_cast<int>(shownPlaylists.size())) {
+                Playlist* selected = shownPlaylists[plChoice - 1];
                 selected->display();
 
                 cout << "\n1. Add to favorites" << endl;
@@ -576,15 +259,23 @@ void userMenu(User* user) {
                     cout << "Playlist added to favorites!" << endl;
                 }
                 else if (plAction == 2) {
-                    user->setCurrentPlaylist(selected);
+                    player.setCurrentPlaylist(selected);
                     cout << "Playlist set as current!" << endl;
                 }
             }
             break;
         }
-        case 3: // Favorite Songs
+        case 3: { // Favorite Songs
             user->displayFavoriteSongs();
+            vector<SongRef> recommended = user->recommendedSongs(5);
+            if (!recommended.empty()) {
+                cout << "\nRecommended for you:" << endl;
+                for (const auto& song : recommended) {
+                    cout << "- " << song->getTitle() << " by " << song->getArtist()->getName() << endl;
+                }
+            }
             break;
+        }
         case 4: // Favorite Playlists
             user->displayFavoritePlaylists();
             break;
@@ -619,33 +310,39 @@ void userMenu(User* user) {
                     cout << "\n1. Add song" << endl;
                     cout << "2. Remove song" << endl;
                     cout << "3. Delete playlist" << endl;
-                    cout << "4. Back" << endl;
+                    cout << "4. Undo last change" << endl;
+                    cout << "5. Show recent changes" << endl;
+                    cout << "6. Insert song at position" << endl;
+                    cout << "7. Move songs" << endl;
+                    cout << "8. Sort songs" << endl;
+                    cout << "9. Back" << endl;
 
                     int manageChoice;
                     cin >> manageChoice;
                     cin.ignore();
 
                     if (manageChoice == 1) {
-                        displaySongs(allSongs);
+                        vector<SongRef> shownSongs = browseCatalogSongs();
                         cout << "Select song to add: ";
                         int songNum;
                         cin >> songNum;
                         cin.ignore();
 
-                        if (songNum > 0 && songNum <= static_cast<int>(allSongs.size())) {
-                            pl->addSong(allSongs[songNum - 1]);
+                        if (songNum > 0 && songNum <= static_cast<int>(shownSongs.size())) {
+                            pl->addSong(shownSongs[songNum - 1]);
                             cout << "Song added to playlist!" << endl;
                         }
                     }
                     else if (manageChoice == 2 && !pl->getSongs().empty()) {
-                        displaySongs(pl->getSongs());
+                        PlaylistVersion shown = pl->snapshot();
+                        displaySongs(shown.songs.toVector());
                         cout << "Select song to remove: ";
                         int songNum;
                         cin >> songNum;
                         cin.ignore();
 
-                        if (songNum > 0 && songNum <= static_cast<int>(pl->getSongs().size())) {
-                            pl->removeSong(pl->getSongs()[songNum - 1]);
+                        if (songNum > 0 && songNum <= static_cast<int>(shown.songs.size())) {
+                            pl->removeSong(shown.songs[songNum - 1]);
                             cout << "Song removed from playlist!" << endl;
                         }
                     }
@@ -653,6 +350,63 @@ void userMenu(User* user) {
                         user->deletePlaylist(pl);
                         cout << "Playlist deleted!" << endl;
                     }
+                    else if (manageChoice == 4) {
+                        if (pl->undo()) cout << "Undone; now at version " << pl->getVersion() << "." << endl;
+                        else cout << "Nothing to undo." << endl;
+                    }
+                    else if (manageChoice == 5) {
+                        displayChanges(pl);
+                    }
+                    else if (manageChoice == 6) {
+                        vector<SongRef> shownSongs = browseCatalogSongs();
+                        cout << "Select song to insert: ";
+                        int songNum;
+                        cin >> songNum;
+                        cout << "Insert at position (1-" << pl->getSongCount() + 1 << "): ";
+                        int position;
+                        cin >> position;
+                        cin.ignore();
+
+                        if (songNum > 0 && songNum <= static_cast<int>(shownSongs.size()) && position > 0) {
+                            if (pl->containsSong(shownSongs[songNum - 1])) {
+                                cout << "The song is already in the playlist." << endl;
+                            }
+                            else {
+                                pl->insertSong(shownSongs[songNum - 1], position - 1);
+                                cout << "Song inserted!" << endl;
+                            }
+                        }
+                    }
+                    else if (manageChoice == 7 && !pl->getSongs().empty()) {
+                        displaySongs(pl->getSongs().toVector());
+                        cout << "First song to move: ";
+                        int from;
+                        cin >> from;
+                        cout << "How many songs: ";
+                        int count;
+                        cin >> count;
+                        cout << "New position of the first one: ";
+                        int to;
+                        cin >> to;
+                        cin.ignore();
+
+                        if (from > 0 && count > 0 && to > 0 && pl->moveSongs(from - 1, count, to - 1)) {
+                            cout << "Songs moved!" << endl;
+                        }
+                        else {
+                            cout << "Invalid positions." << endl;
+                        }
+                    }
+                    else if (manageChoice == 8) {
+                        cout << "Sort by: 1. Title  2. Year  3. Artist: ";
+                        int sortChoice;
+                        cin >> sortChoice;
+                        cin.ignore();
+                        if (sortChoice >= 1 && sortChoice <= 3) {
+                            pl->sortSongs(sortChoice == 1 ? SongOrder::TITLE : sortChoice == 2 ? SongOrder::YEAR : SongOrder::ARTIST);
+                            cout << "Playlist sorted!" << endl;
+                        }
+                    }
                 }
             }
             break;
@@ -662,10 +416,15 @@ void userMenu(User* user) {
             string query;
             getline(cin, query);
 
-            vector<Song*> songResults = user->searchSongs(query);
+            vector<SongRef> songResults = user->searchSongs(query);
             vector<Playlist*> plResults = user->searchPlaylists(query);
 
             cout << "\nSearch Results:" << endl;
+            if (songResults.empty()) {
+                // Nothing contains the query as typed; try near spellings
+                songResults = user->rankSongs(query, 10);
+                if (!songResults.empty()) cout << "No exact matches. Closest songs:" << endl;
+            }
             cout << "Songs (" << songResults.size() << "):" << endl;
             for (size_t i = 0; i < songResults.size(); i++) {
                 cout << i + 1 << ". " << songResults[i]->getTitle() << " by "
@@ -692,18 +451,17 @@ void userMenu(User* user) {
             break;
         }
         case 7: { // Play Music
-            if (!user->getCurrentPlaylist()) {
+            if (!player.getCurrentPlaylist()) {
                 cout << "No playlist selected. Please select a playlist first." << endl;
                 break;
             }
 
-            Playlist* current = user->getCurrentPlaylist();
-            Song* currentSong = user->getCurrentSong();
+            Song* currentSong = player.getCurrentSong();
 
             if (!currentSong) {
                 cout << "No song selected. Starting from first song." << endl;
-                currentSong = current->getSongs().empty() ? nullptr : current->getSongs()[0];
-                user->setCurrentSong(currentSong);
+                player.playFrom(0);
+                currentSong = player.getCurrentSong();
             }
 
             if (currentSong) {
@@ -713,7 +471,7 @@ void userMenu(User* user) {
                 cout << "\nPlayback Controls:" << endl;
                 cout << "1. Next" << endl;
                 cout << "2. Previous" << endl;
-                cout << "3. Toggle Loop (" << (user->isLoopingEnabled() ? "ON" : "OFF") << ")" << endl;
+                cout << "3. Toggle Loop (" << (player.isLoopingEnabled() ? "ON" : "OFF") << ")" << endl;
                 cout << "4. Change Playback Mode" << endl;
                 cout << "5. Back" << endl;
 
@@ -723,9 +481,8 @@ void userMenu(User* user) {
 
                 switch (playChoice) {
                 case 1: {
-                    Song* next = user->getNextSong();
+                    SongRef next = player.playNext();
                     if (next) {
-                        user->setCurrentSong(next);
                         cout << "Playing next: " << next->getTitle() << endl;
                     }
                     else {
@@ -734,9 +491,8 @@ void userMenu(User* user) {
                     break;
                 }
                 case 2: {
-                    Song* prev = user->getPreviousSong();
+                    SongRef prev = player.playPrevious();
                     if (prev) {
-                        user->setCurrentSong(prev);
                         cout << "Playing previous: " << prev->getTitle() << endl;
                     }
                     else {
@@ -745,8 +501,8 @@ void userMenu(User* user) {
                     break;
                 }
                 case 3:
-                    user->toggleLoop();
-                    cout << "Loop " << (user->isLoopingEnabled() ? "enabled" : "disabled") << endl;
+                    player.toggleLoop();
+                    cout << "Loop " << (player.isLoopingEnabled() ? "enabled" : "disabled") << endl;
                     break;
                 case 4: {
                     cout << "Select playback mode:" << endl;
@@ -759,9 +515,9 @@ void userMenu(User* user) {
                     cin.ignore();
 
                     switch (modeChoice) {
-                    case 1: user->setPlaybackMode(PlaybackMode::SEQUENTIAL); break;
-                    case 2: user->setPlaybackMode(PlaybackMode::RANDOM); break;
-                    case 3: user->setPlaybackMode(PlaybackMode::REPEAT); break;
+                    case 1: player.setPlaybackMode(PlaybackMode::SEQUENTIAL); break;
+                    case 2: player.setPlaybackMode(PlaybackMode::RANDOM); break;
+                    case 3: player.setPlaybackMode(PlaybackMode::REPEAT); break;
                     }
                     cout << "Playback mode updated." << endl;
                     break;
@@ -783,6 +539,7 @@ void userMenu(User* user) {
 
 void adminMenu(Admin* admin) {
     while (true) {
+        wal.flush();
         admin->displayMenu();
         cout << "Enter your choice: ";
         int choice;
@@ -877,15 +634,60 @@ void adminMenu(Admin* admin) {
             break;
         }
         case 4: // Browse Songs
-            displaySongs(allSongs);
+            browseCatalogSongs();
             break;
         case 5: // Browse Playlists
-            displayPlaylists(allPlaylists);
+            browseCatalogPlaylists();
             break;
-        case 6: // Browse Artists
+        case 6: { // Browse Artists
             displayArtists(allArtists);
+
+            cout << "\nSelect an artist to view (0 to cancel): ";
+            int artistChoice;
+            cin >> artistChoice;
+            cin.ignore();
+
+            if (artistChoice > 0 && artistChoice <= static_cast<int>(allArtists.size())) {
+                cout << endl;
+                allArtists[artistChoice - 1]->display();
+            }
             break;
-        case 7: // Logout
+        }
+        case 7: { // Import Songs
+            cout << "CSV or TSV file (title, artist, year, genre[, album]): ";
+            string path;
+            getline(cin, path);
+
+            CatalogImporter importer(admin);
+            if (!importer.importFile(path)) {
+                cout << "Could not open " << path << endl;
+                break;
+            }
+            const CatalogImporter::Result& result = importer.getResult();
+            cout << "Imported " << result.rows << " songs (" << result.skipped << " rows skipped, "
+                << result.artistsCreated << " new artists, " << result.albumsCreated << " new albums)." << endl;
+            if (result.tooLong > 0 || result.multiline > 0) {
+                cout << "Rejected " << result.tooLong << " rows over " << CatalogImporter::Options().maxRowSize
+                    << " bytes and " << result.multiline << " rows with a line break in a quoted field." << endl;
+            }
+            if (!checkpoint()) {
+                cout << "Warning: could not save the library snapshot." << endl;
+            }
+            break;
+        }
+        case 8: { // Export Metrics
+#if MUSIC_METRICS
+            cout << "File (.json for JSON, anything else for Prometheus text): ";
+            string path;
+            getline(cin, path);
+            if (metrics.writeFile(path)) cout << "Metrics written to " << path << endl;
+            else cout << "Could not write " << path << endl;
+#else
+            cout << "Metrics are disabled in this build." << endl;
+#endif
+            break;
+        }
+        case 9: // Logout
             return;
         default:
             cout << "Invalid choice. Try again." << endl;
@@ -895,6 +697,7 @@ void adminMenu(Admin* admin) {
 
 void loginMenu() {
     while (true) {
+        wal.flush();
         cout << "\nMusic Player System" << endl;
         cout << "1. Login" << endl;
         cout << "2. Register" << endl;
@@ -915,22 +718,12 @@ void loginMenu() {
             string password;
             getline(cin, password);
 
-            // Check admin
-            if (admin && admin->authenticate(username, password)) {
-                adminMenu(admin);
-                break;
-            }
+            User* loggedInUser = userDirectory.authenticate(username, password);
 
-            // Check users
-            User* loggedInUser = nullptr;
-            for (auto& user : allUsers) {
-                if (user->authenticate(username, password)) {
-                    loggedInUser = user;
-                    break;
-                }
+            if (loggedInUser && loggedInUser == admin) {
+                adminMenu(admin);
             }
-
-            if (loggedInUser) {
+            else if (loggedInUser) {
                 userMenu(loggedInUser);
             }
             else {
@@ -943,16 +736,7 @@ void loginMenu() {
             string username;
             getline(cin, username);
 
-            // Check if username exists
-            bool exists = false;
-            for (auto& user : allUsers) {
-                if (user->getUsername() == username) {
-                    exists = true;
-                    break;
-                }
-            }
-
-            if (exists) {
+            if (userDirectory.contains(username)) {
                 cout << "Username already exists." << endl;
                 break;
             }
@@ -961,7 +745,7 @@ void loginMenu() {
             string password;
             getline(cin, password);
 
-            allUsers.push_back(new User(username, password));
+            registerUser(username, password);
             cout << "Registration successful! You can now login." << endl;
             break;
         }
@@ -973,45 +757,1174 @@ void loginMenu() {
     }
 }
 
-void initializeSystem() {
-    // Create admin
-    admin = new Admin("admin", "admin123");
+// Serves many listener sessions from one process. Song catalog reads (search,
+// sorted listings, browse filters) go to a published CatalogView and take no
+// lock: the reader only announces its epoch, and a view, or a song removed
+// from it, is freed once no reader can still see it. Everything else sessions
+// share (accounts, playlists, favorites, the playlist cursors of their
+// players) sits behind a reader-writer lock. Writes take it exclusively, so
+// they run one at a time; catalog writes then publish a fresh view, which
+// copies only chunk pointers. Playback state is session-local.
+class SessionHost {
+public:
+    struct Stats {
+        size_t sessions = 0;
+        size_t commands = 0;
+        size_t errors = 0;
+        double seconds = 0;
+    };
+
+private:
+    shared_mutex libraryLock;
+    atomic<const CatalogView*> published{ nullptr };
+
+    // Call with the lock held exclusively
+    void publish() {
+        indexCatalog();
+        const CatalogView* previous = published.exchange(new CatalogView(catalog));
+        if (previous) catalogEpochs.retire([previous] { delete previous; });
+        catalogEpochs.advance();
+        catalogEpochs.reclaim();
+    }
+
+public:
+    SessionHost() {
+        catalogEpochs.setDeferring(true);
+        publish();
+    }
+
+    ~SessionHost() {
+        const CatalogView* last = published.exchange(nullptr);
+        catalogEpochs.retire([last] { delete last; });
+        catalogEpochs.setDeferring(false);
+    }
+
+    SessionHost(const SessionHost&) = delete;
+    SessionHost& operator=(const SessionHost&) = delete;
+
+    // Runs `read` on the latest published catalog view without locking
+    template <typename Read>
+    void readCatalog(Read read) {
+        EpochDomain::Guard guard(catalogEpochs);
+        read(*published.load(memory_order_acquire));
+    }
+
+    // Runs `read` alongside other readers, with writes held off
+    template <typename Read>
+    void readLibrary(Read read) {
+        shared_lock<shared_mutex> lock(libraryLock);
+        read();
+    }
+
+    // Runs `write` alone; a catalog write then publishes a new view
+    template <typename Write>
+    void write(Write write, bool catalogChanged) {
+        unique_lock<shared_mutex> lock(libraryLock);
+        write();
+        if (catalogChanged) publish();
+        else catalogEpochs.reclaim();
+    }
+
+    // Runs `sessions` sessions that each replay `script` (batch commands),
+    // multiplexed over `threads` worker threads
+    Stats serve(const vector<vector<string>>& script, size_t sessions, unsigned threads);
+};
+
+// Headless command interface. Each input line is one command with
+// tab-separated arguments; each command answers with one "ok ..." or
+// "error ..." line, and listings follow their "ok" line. Output is buffered
+// and the whole run is logged to the WAL as one batch. A session served by a
+// SessionHost takes the host's locks around each command.
+class BatchSession {
+private:
+    enum class Access {
+        CATALOG_READ,   // Song catalog only: a published view, no locks
+        READ,           // Shared library state, read lock
+        WRITE,          // Exclusive
+        CATALOG_WRITE   // Exclusive, then publishes a new catalog view
+    };
+
+    ostream& out;
+    SessionHost* host;
+    User* user = nullptr;
+    Player player;
+    size_t commands = 0;
+    size_t operations = 0;
+
+    static Access accessOf(const string& command) {
+        static const unordered_map<string, Access> access = {
+            { "search", Access::CATALOG_READ }, { "songs", Access::CATALOG_READ },
+            { "filter", Access::CATALOG_READ }, { "rank", Access::CATALOG_READ },
+            { "complete", Access::CATALOG_READ }, { "query", Access::CATALOG_READ },
+            { "where", Access::CATALOG_READ },
+            { "login", Access::READ }, { "logout", Access::READ }, { "stats", Access::READ },
+            { "next", Access::READ }, { "prev", Access::READ }, { "mode", Access::READ },
+            { "loop", Access::READ }, { "similar", Access::READ }, { "recommend", Access::READ },
+            { "popular", Access::READ }, { "plays", Access::READ },
+            { "metrics", Access::READ }, { "export-metrics", Access::READ },
+            { "playlist-songs", Access::READ }, { "playlist-history", Access::READ },
+            { "playlist-diff", Access::READ },
+            { "add-artist", Access::CATALOG_WRITE }, { "remove-artist", Access::CATALOG_WRITE },
+            { "add-song", Access::CATALOG_WRITE }, { "remove-song", Access::CATALOG_WRITE },
+            { "create-album", Access::CATALOG_WRITE }, { "import-songs", Access::CATALOG_WRITE }
+        };
+        auto it = access.find(command);
+        return it == access.end() ? Access::WRITE : it->second;
+    }
+
+    static bool parseNumber(const string& text, uint32_t& value) {
+        if (text.empty() || !isdigit(static_cast<unsigned char>(text[0]))) return false;
+        char* end = nullptr;
+        unsigned long parsed = strtoul(text.c_str(), &end, 10);
+        if (*end != '\0' || parsed > UINT32_MAX) return false;
+        value = static_cast<uint32_t>(parsed);
+        return true;
+    }
+
+    // Reads query arguments: artist=X genre=Y year=A[-B] sort=title|year|artist limit=N
+    static bool parseQuery(const vector<string>& args, SongQuery& query, string& error) {
+        for (size_t i = 1; i < args.size(); i++) {
+            size_t eq = args[i].find('=');
+            string key = args[i].substr(0, eq);
+            string value = eq == string::npos ? string() : args[i].substr(eq + 1);
+            uint32_t from = 0, to = 0;
+            if (key == "artist" && !value.empty()) query.artist = value;
+            else if (key == "genre" && !value.empty()) query.genre = value;
+            else if (key == "year") {
+                size_t dash = value.find('-');
+                if (!parseNumber(value.substr(0, dash), from)
+                    || !parseNumber(dash == string::npos ? value : value.substr(dash + 1), to) || from > to
+                    || to > INT_MAX) {
+                    error = "bad year range " + value;
+                    return false;
+                }
+                query.yearFrom = static_cast<int>(from);
+                query.yearTo = static_cast<int>(to);
+            }
+            else if (key == "sort") {
+                query.sorted = true;
+                if (value == "title") query.order = SongOrder::TITLE;
+                else if (value == "year") query.order = SongOrder::YEAR;
+                else if (value == "artist") query.order = SongOrder::ARTIST;
+                else {
+                    error = "unknown order " + value;
+                    return false;
+                }
+            }
+            else if (key == "limit" && parseNumber(value, to)) query.limit = to;
+            else {
+                error = "bad query argument " + args[i];
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void printSong(SongRef song) {
+        out << song->getId() << '\t' << song->getTitle() << '\t' << song->getArtist()->getName() << '\t'
+            << song->getReleaseYear() << '\t' << song->getGenre() << '\n';
+    }
 
-    // Create some sample data
-    Artist* artist1 = new Artist("Artist One");
-    Artist* artist2 = new Artist("Artist Two");
-    allArtists.push_back(artist1);
-    allArtists.push_back(artist2);
+    void printSongs(const vector<SongRef>& songs) {
+        out << "ok " << songs.size() << '\n';
+        for (const auto& song : songs) printSong(song);
+    }
 
-    admin->addSong("Song One", artist1, 2020, "Pop");
-    admin->addSong("Song Two", artist1, 2021, "Rock");
-    admin->addSong("Song Three", artist2, 2019, "Jazz");
-    admin->addSong("Song Four", artist2, 2022, "Electronic");
+    // Playlists the session may edit: its own, or any album for the admin
+    Playlist* editablePlaylist(uint32_t id) const {
+        for (auto playlist : user->getPersonalPlaylists()) {
+            if (playlist->getId() == id) return playlist;
+        }
+        return user == admin ? findById(allPlaylists, id) : nullptr;
+    }
 
-    admin->createAlbum(artist1, "First Album");
-    admin->createAlbum(artist2, "Debut Album");
+    // Playlists the session may play: its own, or any catalog playlist
+    Playlist* playablePlaylist(uint32_t id) const {
+        for (auto playlist : user->getPersonalPlaylists()) {
+            if (playlist->getId() == id) return playlist;
+        }
+        return findById(allPlaylists, id);
+    }
 
-    // Add songs to albums
-    Playlist* album1 = allPlaylists[0];
-    Playlist* album2 = allPlaylists[1];
+    void printPlaying(SongRef song) {
+        if (song) out << "ok " << song->getId() << '\t' << song->getTitle() << '\n';
+        else out << "error end of playlist\n";
+    }
+
+    void dispatch(const vector<string>& args, const CatalogView& view) {
+        const string& command = args[0];
+        size_t argc = args.size() - 1;
+        uint32_t a = 0, b = 0, c = 0, d = 0;
 
-    album1->addSong(allSongs[0]);
-    album1->addSong(allSongs[1]);
-    album2->addSong(allSongs[2]);
-    album2->addSong(allSongs[3]);
+        if (command == "register" && argc == 2) {
+            if (registerUser(args[1], args[2])) out << "ok\n";
+            else out << "error username taken\n";
+            return;
+        }
+        if (command == "login" && argc == 2) {
+            user = userDirectory.authenticate(args[1], args[2]);
+            if (user) out << "ok " << (user == admin ? "admin" : "user") << '\n';
+            else out << "error invalid username or password\n";
+            return;
+        }
+        if (command == "stats" && argc == 0) {
+            out << "ok songs=" << allSongs.size() << " artists=" << allArtists.size()
+                << " playlists=" << allPlaylists.size() << " users=" << allUsers.size() << '\n';
+            return;
+        }
+        if (!user) {
+            out << "error not logged in\n";
+            return;
+        }
+        if (command == "logout" && argc == 0) {
+            user = nullptr;
+            out << "ok\n";
+            return;
+        }
+
+        // Catalog browsing
+        if (command == "search" && argc == 1) {
+            printSongs(user->searchSongs(args[1], view));
+        }
+        else if (command == "songs" && argc == 2 && parseNumber(args[2], a)) {
+            SongOrder order = SongOrder::TITLE;
+            if (args[1] == "year") order = SongOrder::YEAR;
+            else if (args[1] == "artist") order = SongOrder::ARTIST;
+            else if (args[1] != "title") {
+                out << "error unknown order " << args[1] << '\n';
+                return;
+            }
+            printSongs(view.orders.page(order, BrowseCursor(), a).items);
+        }
+        else if (command == "rank" && (argc == 1 || (argc == 2 && parseNumber(args[2], a)))) {
+            printSongs(user->rankSongs(args[1], argc == 2 ? a : 10, view));
+        }
+        else if (command == "complete" && (argc == 1 || (argc == 2 && parseNumber(args[2], a)))) {
+            vector<string> suggestions = user->completeQuery(args[1], argc == 2 ? a : 10, view);
+            out << "ok " << suggestions.size() << '\n';
+            for (const auto& suggestion : suggestions) out << suggestion << '\n';
+        }
+        else if (command == "similar" && (argc == 1 || argc == 2) && parseNumber(args[1], a)
+            && (argc == 1 || parseNumber(args[2], b))) {
+            SongRef song = findById(allSongs, a);
+            if (!song) {
+                out << "error no such song\n";
+                return;
+            }
+            printSongs(user->similarSongs(song, argc == 2 ? b : 10));
+        }
+        else if (command == "recommend" && (argc == 0 || (argc == 1 && parseNumber(args[1], a)))) {
+            printSongs(user->recommendedSongs(argc == 1 ? a : 10));
+        }
+        else if (command == "popular" && (argc == 1 || argc == 2) && parseNumber(args[1], a)
+            && (argc == 1 || parseNumber(args[2], b))) {
+            Artist* artist = findById(allArtists, a);
+            if (!artist) {
+                out << "error no such artist\n";
+                return;
+            }
+            vector<PlayStats::Play> top = playStats.topSongsOf(artist, argc == 2 ? b : 5);
+            out << "ok " << top.size() << '\n';
+            for (const auto& play : top) out << play.song->getId() << '\t' << play.song->getTitle() << '\t' << play.plays << '\n';
+        }
+        else if (command == "plays" && argc == 0) {
+            out << "ok total=" << playStats.allPlays() << " hour=" << playStats.recentPlays(1)
+                << " day=" << playStats.recentPlays(24) << '\n';
+        }
+        else if (command == "filter" && argc == 2) {
+            if (args[1] == "artist") printSongs(view.columns.filterByArtist(args[2]));
+            else if (args[1] == "genre") printSongs(view.columns.filterByGenre(args[2]));
+            else if (args[1] == "year" && parseNumber(args[2], a)) printSongs(view.columns.filterByYear(static_cast<int>(a)));
+            else out << "error unknown filter " << args[1] << '\n';
+        }
+        else if (command == "where" && (argc == 1 || (argc == 2 && parseNumber(args[2], a)))) {
+            SongFilter filter;
+            string error;
+            if (filter.parse(args[1], error)) printSongs(filter.run(view.filters, argc == 2 ? a : 0));
+            else out << "error " << error << '\n';
+        }
+        else if (command == "query") {
+            SongQuery query;
+            string error;
+            if (parseQuery(args, query, error)) printSongs(view.columns.query(query));
+            else out << "error " << error << '\n';
+        }
+        // Playback, local to the session
+        else if (command == "play" && argc == 1 && parseNumber(args[1], a)) {
+            Playlist* playlist = playablePlaylist(a);
+            if (!playlist) {
+                out << "error no such playlist\n";
+                return;
+            }
+            player.setCurrentPlaylist(playlist);
+            printPlaying(player.getCurrentSong());
+        }
+        else if (command == "next" && argc == 0) {
+            printPlaying(player.playNext());
+        }
+        else if (command == "prev" && argc == 0) {
+            printPlaying(player.playPrevious());
+        }
+        else if (command == "mode" && argc == 1) {
+            if (args[1] == "sequential") player.setPlaybackMode(PlaybackMode::SEQUENTIAL);
+            else if (args[1] == "random") player.setPlaybackMode(PlaybackMode::RANDOM);
+            else if (args[1] == "repeat") player.setPlaybackMode(PlaybackMode::REPEAT);
+            else {
+                out << "error unknown mode " << args[1] << '\n';
+                return;
+            }
+            out << "ok\n";
+        }
+        else if (command == "loop" && argc == 0) {
+            player.toggleLoop();
+            out << "ok " << (player.isLoopingEnabled() ? "on" : "off") << '\n';
+        }
+        // Playlists and favorites
+        else if (command == "create-playlist" && (argc == 1 || argc == 2)) {
+            user->createPlaylist(args[1], argc == 1 || args[2] != "private");
+            out << "ok " << user->getPersonalPlaylists().back()->getId() << '\n';
+        }
+        else if (command == "delete-playlist" && argc == 1 && parseNumber(args[1], a)) {
+            size_t before = user->getPersonalPlaylists().size();
+            for (auto playlist : user->getPersonalPlaylists()) {
+                if (playlist->getId() == a) {
+                    user->deletePlaylist(playlist);
+                    break;
+                }
+            }
+            if (user->getPersonalPlaylists().size() < before) out << "ok\n";
+            else out << "error no such playlist\n";
+        }
+        else if ((command == "playlist-add" || command == "playlist-remove") && argc == 2 &&
+            parseNumber(args[1], a) && parseNumber(args[2], b)) {
+            Playlist* playlist = editablePlaylist(a);
+            SongRef song = findById(allSongs, b);
+            if (!playlist || !song) {
+                out << "error no such " << (playlist ? "song" : "playlist") << '\n';
+                return;
+            }
+            if (command == "playlist-add") playlist->addSong(song);
+            else playlist->removeSong(song);
+            out << "ok " << playlist->getSongCount() << '\n';
+        }
+        // Positions are 1-based, like the numbered lists in the menus
+        else if (command == "playlist-insert" && argc == 3 && parseNumber(args[1], a) && parseNumber(args[2], b) &&
+            parseNumber(args[3], c) && c > 0) {
+            Playlist* playlist = editablePlaylist(a);
+            SongRef song = findById(allSongs, b);
+            if (!playlist || !song) {
+                out << "error no such " << (playlist ? "song" : "playlist") << '\n';
+                return;
+            }
+            playlist->insertSong(song, c - 1);
+            out << "ok " << playlist->positionOf(song) + 1 << '\n';
+        }
+        else if (command == "playlist-move" && (argc == 3 || argc == 4) && parseNumber(args[1], a) &&
+            parseNumber(args[2], b) && parseNumber(args[3], c) && (argc == 3 || parseNumber(args[4], d))) {
+            Playlist* playlist = editablePlaylist(a);
+            if (!playlist) {
+                out << "error no such playlist\n";
+                return;
+            }
+            size_t count = argc == 4 ? d : 1;
+            if (b == 0 || c == 0 || !playlist->moveSongs(b - 1, count, c - 1)) {
+                out << "error bad positions\n";
+                return;
+            }
+            out << "ok\n";
+        }
+        else if (command == "playlist-reorder" && argc >= 2 && parseNumber(args[1], a)) {
+            Playlist* playlist = editablePlaylist(a);
+            if (!playlist) {
+                out << "error no such playlist\n";
+                return;
+            }
+            vector<SongRef> order;
+            for (size_t i = 2; i <= argc; i++) {
+                SongRef song = parseNumber(args[i], b) ? findById(allSongs, b) : SongRef();
+                if (!song || !playlist->containsSong(song)) {
+                    out << "error song " << args[i] << " is not in the playlist\n";
+                    return;
+                }
+                order.push_back(song);
+            }
+            playlist->reorderSongs(order);
+            out << "ok\n";
+        }
+        else if (command == "playlist-sort" && argc == 2 && parseNumber(args[1], a)) {
+            Playlist* playlist = editablePlaylist(a);
+            if (!playlist) {
+                out << "error no such playlist\n";
+                return;
+            }
+            if (args[2] == "title") playlist->sortSongs(SongOrder::TITLE);
+            else if (args[2] == "year") playlist->sortSongs(SongOrder::YEAR);
+            else if (args[2] == "artist") playlist->sortSongs(SongOrder::ARTIST);
+            else {
+                out << "error unknown order " << args[2] << '\n';
+                return;
+            }
+            out << "ok\n";
+        }
+        else if (command == "playlist-songs" && argc == 1 && parseNumber(args[1], a)) {
+            Playlist* playlist = playablePlaylist(a);
+            if (!playlist) {
+                out << "error no such playlist\n";
+                return;
+            }
+            printSongs(playlist->snapshot().songs.toVector());
+        }
+        else if (command == "playlist-history" && argc == 1 && parseNumber(args[1], a)) {
+            Playlist* playlist = playablePlaylist(a);
+            if (!playlist) {
+                out << "error no such playlist\n";
+                return;
+            }
+            // Newest first: version number and song count
+            const auto& history = playlist->getHistory();
+            out << "ok " << history.size() + 1 << '\n';
+            out << playlist->getVersion() << '\t' << playlist->getSongCount() << '\n';
+            for (auto it = history.rbegin(); it != history.rend(); ++it) {
+                out << it->number << '\t' << it->songs.size() << '\n';
+            }
+        }
+        else if (command == "playlist-diff" && argc == 2 && parseNumber(args[1], a) && parseNumber(args[2], b)) {
+            Playlist* playlist = playablePlaylist(a);
+            PlaylistVersion older;
+            if (!playlist || !playlist->findVersion(b, older)) {
+                out << "error no such " << (playlist ? "version" : "playlist") << '\n';
+                return;
+            }
+            // From that version to the current one: "+" and "-" song lines,
+            // then "reordered" if the songs in both changed places
+            PlaylistDiff change = Playlist::diff(older.songs, playlist->getSongs());
+            out << "ok " << change.added.size() + change.removed.size() + (change.reordered ? 1 : 0) << '\n';
+            for (const auto& song : change.added) {
+                out << "+\t";
+                printSong(song);
+            }
+            for (const auto& song : change.removed) {
+                out << "-\t";
+                printSong(song);
+            }
+            if (change.reordered) out << "reordered\n";
+        }
+        else if (command == "playlist-undo" && argc == 1 && parseNumber(args[1], a)) {
+            Playlist* playlist = editablePlaylist(a);
+            if (!playlist) {
+                out << "error no such playlist\n";
+                return;
+            }
+            if (playlist->undo()) out << "ok " << playlist->getVersion() << '\n';
+            else out << "error nothing to undo\n";
+        }
+        else if ((command == "favorite-song" || command == "unfavorite-song") && argc == 1 && parseNumber(args[1], a)) {
+            SongRef song = findById(allSongs, a);
+            if (!song) {
+                out << "error no such song\n";
+                return;
+            }
+            if (command == "favorite-song") user->addFavoriteSong(song);
+            else user->removeFavoriteSong(song);
+            out << "ok\n";
+        }
+        else if ((command == "favorite-playlist" || command == "unfavorite-playlist") && argc == 1 &&
+            parseNumber(args[1], a)) {
+            Playlist* playlist = findById(allPlaylists, a);
+            if (!playlist) {
+                out << "error no such playlist\n";
+                return;
+            }
+            if (command == "favorite-playlist") user->addFavoritePlaylist(playlist);
+            else user->removeFavoritePlaylist(playlist);
+            out << "ok\n";
+        }
+        else if (user != admin) {
+            out << "error unknown command " << command << '\n';
+        }
+        // Admin commands
+        else if (command == "add-artist" && argc == 1) {
+            admin->createArtist(args[1]);
+            out << "ok " << allArtists.back()->getId() << '\n';
+        }
+        else if (command == "remove-artist" && argc == 1 && parseNumber(args[1], a)) {
+            Artist* artist = findById(allArtists, a);
+            if (artist) {
+                admin->removeArtist(artist);
+                out << "ok\n";
+            }
+            else {
+                out << "error no such artist\n";
+            }
+        }
+        else if (command == "add-song" && argc == 4 && parseNumber(args[2], a) && parseNumber(args[3], b)) {
+            Artist* artist = findById(allArtists, a);
+            if (artist) {
+                admin->addSong(args[1], artist, static_cast<int>(b), args[4]);
+                out << "ok " << allSongs.back()->getId() << '\n';
+            }
+            else {
+                out << "error no such artist\n";
+            }
+        }
+        else if (command == "remove-song" && argc == 1 && parseNumber(args[1], a)) {
+            SongRef song = findById(allSongs, a);
+            if (song) {
+                admin->removeSong(song);
+                out << "ok\n";
+            }
+            else {
+                out << "error no such song\n";
+            }
+        }
+        else if (command == "create-album" && argc == 2 && parseNumber(args[1], a)) {
+            Artist* artist = findById(allArtists, a);
+            if (artist) {
+                admin->createAlbum(artist, args[2]);
+                out << "ok " << allPlaylists.back()->getId() << '\n';
+            }
+            else {
+                out << "error no such artist\n";
+            }
+        }
+        else if (command == "metrics" && (argc == 0 || (argc == 1 && args[1] == "json"))) {
+#if MUSIC_METRICS
+            string text = argc == 1 ? metrics.json() : metrics.prometheusText();
+            out << "ok " << count(text.begin(), text.end(), '\n') << '\n' << text;
+#else
+            out << "error metrics are disabled in this build\n";
+#endif
+        }
+        else if (command == "export-metrics" && argc == 1) {
+#if MUSIC_METRICS
+            if (metrics.writeFile(args[1])) out << "ok\n";
+            else out << "error cannot write " << args[1] << '\n';
+#else
+            out << "error metrics are disabled in this build\n";
+#endif
+        }
+        else if (command == "import-songs" && argc == 1) {
+            WriteAheadLog::Batch batch(wal);
+            CatalogImporter importer(admin);
+            if (!importer.importFile(args[1])) {
+                out << "error cannot read " << args[1] << '\n';
+                return;
+            }
+            const CatalogImporter::Result& result = importer.getResult();
+            operations += result.rows;
+            if (checkpoint()) {
+                out << "ok " << result.rows << " skipped=" << result.skipped << " artists=" << result.artistsCreated
+                    << " albums=" << result.albumsCreated << " too-long=" << result.tooLong
+                    << " multiline=" << result.multiline << '\n';
+            }
+            else {
+                out << "error imported " << result.rows << " songs but could not save the snapshot\n";
+            }
+        }
+        else {
+            out << "error unknown command " << command << '\n';
+        }
+    }
+
+public:
+    explicit BatchSession(ostream& out, SessionHost* host = nullptr) : out(out), host(host) {}
+
+    size_t getCommands() const { return commands; }
+    size_t getOperations() const { return operations; }
+
+    // Splits a command line; blank lines and lines starting with '#' give no arguments
+    static vector<string> parse(string line) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (line.empty() || line[0] == '#') return vector<string>();
+        return split(line, '\t');
+    }
+
+    void execute(const vector<string>& args) {
+        commands++;
+        operations++;
+        if (!host) {
+            indexCatalog();
+            dispatch(args, catalog);
+            return;
+        }
+        switch (accessOf(args[0])) {
+        case Access::CATALOG_READ:
+            host->readCatalog([&](const CatalogView& view) { dispatch(args, view); });
+            break;
+        case Access::READ:
+            host->readLibrary([&] { dispatch(args, catalog); });
+            break;
+        case Access::WRITE:
+        case Access::CATALOG_WRITE:
+            host->write([&] { dispatch(args, catalog); }, accessOf(args[0]) == Access::CATALOG_WRITE);
+            break;
+        }
+    }
+
+    // Runs every command in `in`. Each command's records are committed the
+    // usual way, so a crash loses at most the last group commit.
+    void run(istream& in) {
+        string line;
+        while (getline(in, line)) {
+            vector<string> args = parse(line);
+            if (!args.empty()) execute(args);
+        }
+    }
+};
+
+SessionHost::Stats SessionHost::serve(const vector<vector<string>>& script, size_t sessions, unsigned threads) {
+    threads = static_cast<unsigned>(max<size_t>(1, min<size_t>(threads, sessions)));
+    vector<Stats> perThread(threads);
+    auto start = chrono::steady_clock::now();
+
+    // Each worker interleaves its share of the sessions one command at a time
+    auto work = [&](unsigned worker) {
+        Stats& stats = perThread[worker];
+        vector<unique_ptr<ostringstream>> outputs;
+        vector<unique_ptr<BatchSession>> mine;
+        for (size_t i = worker; i < sessions; i += threads) {
+            outputs.emplace_back(new ostringstream);
+            mine.emplace_back(new BatchSession(*outputs.back(), this));
+        }
+        stats.sessions = mine.size();
+        for (const auto& args : script) {
+            for (size_t i = 0; i < mine.size(); i++) {
+                outputs[i]->str(string());
+                mine[i]->execute(args);
+                stats.commands++;
+                if (outputs[i]->str().compare(0, 5, "error") == 0) stats.errors++;
+            }
+        }
+        // Players leave their playlists' cursor lists
+        write([&] { mine.clear(); }, false);
+    };
+
+    vector<thread> workers;
+    for (unsigned w = 1; w < threads; w++) workers.emplace_back(work, w);
+    work(0);
+    for (auto& worker : workers) worker.join();
+
+    Stats total;
+    for (const auto& stats : perThread) {
+        total.sessions += stats.sessions;
+        total.commands += stats.commands;
+        total.errors += stats.errors;
+    }
+    total.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    return total;
 }
 
-int main() {
-    srand(static_cast<unsigned int>(time(nullptr)));
-    initializeSystem();
-    loginMenu();
-
-    // Cleanup
-    delete admin;
-    for (auto& user : allUsers) delete user;
-    for (auto& song : allSongs) delete song;
-    for (auto& playlist : allPlaylists) delete playlist;
-    for (auto& artist : allArtists) delete artist;
+
+#ifdef __linux__
+// Unix-domain socket front end for a SessionHost. Each connection is one
+// session speaking the batch command protocol, one command per line; every
+// response is preceded by its length in bytes on a line of its own, so a
+// response may hold any text. A command line longer than MAX_LINE gets an
+// error and the connection is dropped. A client that shuts down its sending
+// side still gets every answer before the connection closes. Connections
+// are spread over one epoll loop per thread, and every loop waits on the
+// listening socket with EPOLLEXCLUSIVE, so one process can hold tens of
+// thousands of mostly idle clients without a thread each.
+class SocketServer {
+public:
+    static const size_t MAX_LINE = 64 * 1024;
+
+private:
+    struct Connection {
+        int fd;
+        string input;
+        string output;
+        size_t written = 0;
+        uint32_t events = EPOLLIN | EPOLLRDHUP;     // What epoll watches for
+        bool peerClosed = false;                    // Nothing more will arrive
+        ostringstream responses;
+        unique_ptr<BatchSession> session;
+    };
+
+    SessionHost& host;
+    string path;
+    int listenFd = -1;
+    static atomic<bool> stopping;
+
+    static bool setNonBlocking(int fd) {
+        int flags = fcntl(fd, F_GETFL, 0);
+        return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+    }
+
+    // Sends what it can; returns false if the peer is gone
+    static bool flushOutput(Connection& connection) {
+        while (connection.written < connection.output.size()) {
+            ssize_t sent = ::send(connection.fd, connection.output.data() + connection.written,
+                connection.output.size() - connection.written, MSG_NOSIGNAL);
+            if (sent < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return true;
+                if (errno == EINTR) continue;
+                return false;
+            }
+            connection.written += sent;
+        }
+        connection.output.clear();
+        connection.written = 0;
+        return true;
+    }
+
+    static void respond(Connection& connection, const string& response) {
+        connection.output += to_string(response.size());
+        connection.output += '\n';
+        connection.output += response;
+    }
+
+    static void answer(Connection& connection, const string& line) {
+        vector<string> args = BatchSession::parse(line);
+        if (args.empty()) return;
+        connection.session->execute(args);
+        respond(connection, connection.responses.str());
+        connection.responses.str(string());
+    }
+
+    // Answers every complete line in the input; returns false if what is
+    // left is already longer than a line may be
+    static bool answerLines(Connection& connection) {
+        size_t start = 0;
+        for (size_t newline; (newline = connection.input.find('\n', start)) != string::npos; start = newline + 1) {
+            answer(connection, connection.input.substr(start, newline - start));
+        }
+        connection.input.erase(0, start);
+        return connection.input.size() <= MAX_LINE;
+    }
+
+    // Reads what has arrived and answers every complete line; returns false
+    // once the connection should be closed. When the peer has finished
+    // sending, an unterminated last line is answered too, and the connection
+    // stays open until the answers have gone out.
+    bool serviceInput(Connection& connection) {
+        char buffer[16 * 1024];
+        while (!connection.peerClosed) {
+            ssize_t received = ::recv(connection.fd, buffer, sizeof(buffer), 0);
+            if (received == 0) {
+                connection.peerClosed = true;
+                break;
+            }
+            if (received < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                if (errno == EINTR) continue;
+                return false;
+            }
+            connection.input.append(buffer, received);
+            if (!answerLines(connection)) {
+                respond(connection, "error line too long (max " + to_string(MAX_LINE / 1024) + "K)\n");
+                flushOutput(connection);
+                return false;
+            }
+        }
+        if (connection.peerClosed && !connection.input.empty()) {
+            answer(connection, connection.input);
+            connection.input.clear();
+        }
+        return flushOutput(connection);
+    }
+
+    void loop(bool flushesLog) {
+        int epollFd = epoll_create1(0);
+        if (epollFd < 0) return;
+        epoll_event listenEvent = {};
+        listenEvent.events = EPOLLIN | EPOLLEXCLUSIVE;
+        listenEvent.data.ptr = nullptr;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &listenEvent);
+
+        unordered_map<int, unique_ptr<Connection>> connections;
+        auto close = [&](Connection* connection) {
+            epoll_ctl(epollFd, EPOLL_CTL_DEL, connection->fd, nullptr);
+            ::close(connection->fd);
+            // The session's player leaves its playlist's cursor list
+            host.write([&] { connections.erase(connection->fd); }, false);
+        };
+
+        vector<epoll_event> events(256);
+        auto lastFlush = chrono::steady_clock::now();
+        while (!stopping.load()) {
+            int ready = epoll_wait(epollFd, events.data(), static_cast<int>(events.size()), 100);
+            for (int i = 0; i < ready; i++) {
+                auto* connection = static_cast<Connection*>(events[i].data.ptr);
+                if (!connection) {
+                    int fd;
+                    while ((fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+                        unique_ptr<Connection> accepted(new Connection());
+                        accepted->fd = fd;
+                        accepted->session.reset(new BatchSession(accepted->responses, &host));
+                        epoll_event event = {};
+                        event.events = accepted->events;
+                        event.data.ptr = accepted.get();
+                        epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event);
+                        connections.emplace(fd, std::move(accepted));
+                    }
+                    continue;
+                }
+                bool open = !(events[i].events & (EPOLLERR | EPOLLHUP));
+                if (open && (events[i].events & EPOLLOUT)) open = flushOutput(*connection);
+                if (open && (events[i].events & (EPOLLIN | EPOLLRDHUP))) open = serviceInput(*connection);
+                if (open && connection->peerClosed && connection->output.empty()) open = false;
+                if (!open) {
+                    close(connection);
+                    continue;
+                }
+                // Ask for EPOLLOUT only while a response is stuck in the
+                // buffer, and stop reading once the peer has finished
+                uint32_t wanted = connection->peerClosed ? 0u : uint32_t(EPOLLIN | EPOLLRDHUP);
+                if (!connection->output.empty()) wanted |= EPOLLOUT;
+                if (wanted != connection->events) {
+                    epoll_event event = {};
+                    event.events = wanted;
+                    event.data.ptr = connection;
+                    epoll_ctl(epollFd, EPOLL_CTL_MOD, connection->fd, &event);
+                    connection->events = wanted;
+                }
+            }
+            // Records a quiet server would otherwise hold back
+            if (flushesLog && chrono::steady_clock::now() - lastFlush >= wal.getOptions().groupCommitDelay) {
+                host.write([] { wal.flush(); }, false);
+                lastFlush = chrono::steady_clock::now();
+            }
+        }
+
+        host.write([&] { connections.clear(); }, false);
+        ::close(epollFd);
+    }
+
+    static void onSignal(int) { stopping.store(true); }
+
+public:
+    explicit SocketServer(SessionHost& host) : host(host) {}
+
+    ~SocketServer() {
+        if (listenFd >= 0) {
+            ::close(listenFd);
+            unlink(path.c_str());
+        }
+    }
+
+    SocketServer(const SocketServer&) = delete;
+    SocketServer& operator=(const SocketServer&) = delete;
+
+    bool listen(const string& socketPath) {
+        sockaddr_un address = {};
+        if (socketPath.size() >= sizeof(address.sun_path)) return false;
+        address.sun_family = AF_UNIX;
+        memcpy(address.sun_path, socketPath.c_str(), socketPath.size() + 1);
+
+        listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (listenFd < 0) return false;
+        unlink(socketPath.c_str());
+        if (bind(listenFd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+            ::listen(listenFd, SOMAXCONN) != 0 || !setNonBlocking(listenFd)) {
+            ::close(listenFd);
+            listenFd = -1;
+            return false;
+        }
+        path = socketPath;
+        return true;
+    }
+
+    // Serves until SIGINT or SIGTERM
+    void run(unsigned threads) {
+        // Every client holds a descriptor
+        rlimit limit;
+        if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+            limit.rlim_cur = limit.rlim_max;
+            setrlimit(RLIMIT_NOFILE, &limit);
+        }
+        stopping.store(false);
+        signal(SIGINT, onSignal);
+        signal(SIGTERM, onSignal);
+        signal(SIGPIPE, SIG_IGN);
+
+        vector<thread> loops;
+        for (unsigned i = 1; i < threads; i++) loops.emplace_back([this] { loop(false); });
+        loop(true);
+        for (auto& other : loops) other.join();
+    }
+};
+
+atomic<bool> SocketServer::stopping{ false };
+
+// Client side of the socket protocol for measuring the server: opens
+// `clients` connections and has each send `requests` commands from a script
+// (cycling through it), one outstanding request per connection, all driven
+// by one epoll loop. Latencies are measured from send to the end of the
+// response.
+class LoadGenerator {
+public:
+    struct Result {
+        size_t connected = 0;
+        size_t requests = 0;
+        size_t errors = 0;
+        size_t dropped = 0;     // Clients cut off with requests still to run
+        double seconds = 0;
+        LatencyHistogram latencyNanos;
+    };
+
+private:
+    struct Client {
+        int fd = -1;
+        size_t next = 0;
+        size_t remaining = 0;
+        string input;
+        string output;          // Request bytes the socket has not taken yet
+        bool writing = false;   // Also waiting for EPOLLOUT
+        chrono::steady_clock::time_point sentAt;
+    };
+
+    vector<string> script;
+
+    // Sends as much pending output as the socket takes; when it is full, the
+    // client also waits for EPOLLOUT to send the rest. Returns false if the
+    // connection failed.
+    static bool flush(int epollFd, Client& client) {
+        size_t sent = 0;
+        while (sent < client.output.size()) {
+            ssize_t n = ::send(client.fd, client.output.data() + sent, client.output.size() - sent, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+            if (n < 0) return false;
+            sent += n;
+        }
+        client.output.erase(0, sent);
+        bool writing = !client.output.empty();
+        if (writing != client.writing) {
+            epoll_event event = {};
+            event.events = EPOLLIN | EPOLLRDHUP;
+            if (writing) event.events |= EPOLLOUT;
+            event.data.ptr = &client;
+            epoll_ctl(epollFd, EPOLL_CTL_MOD, client.fd, &event);
+            client.writing = writing;
+        }
+        return true;
+    }
+
+    bool sendNext(int epollFd, Client& client) {
+        client.output += script[client.next++ % script.size()];
+        client.sentAt = chrono::steady_clock::now();
+        client.remaining--;
+        return flush(epollFd, client);
+    }
+
+public:
+    explicit LoadGenerator(const vector<string>& lines) {
+        for (const auto& line : lines) script.push_back(line + "\n");
+    }
+
+    Result run(const string& socketPath, size_t clientCount, size_t requestsPerClient) {
+        Result result;
+        if (script.empty()) return result;
+        sockaddr_un address = {};
+        if (socketPath.size() >= sizeof(address.sun_path)) return result;
+        address.sun_family = AF_UNIX;
+        memcpy(address.sun_path, socketPath.c_str(), socketPath.size() + 1);
+
+        rlimit limit;
+        if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+            limit.rlim_cur = limit.rlim_max;
+            setrlimit(RLIMIT_NOFILE, &limit);
+        }
+
+        int epollFd = epoll_create1(0);
+        vector<Client> clients(clientCount);
+        for (auto& client : clients) {
+            int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            if (fd < 0 || connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+                if (fd >= 0) ::close(fd);
+                continue;
+            }
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+            client.fd = fd;
+            client.remaining = requestsPerClient;
+            epoll_event event = {};
+            event.events = EPOLLIN | EPOLLRDHUP;
+            event.data.ptr = &client;
+            epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event);
+            result.connected++;
+        }
+
+        auto start = chrono::steady_clock::now();
+        size_t active = 0;
+        for (auto& client : clients) {
+            if (client.fd < 0 || client.remaining == 0) continue;
+            if (sendNext(epollFd, client)) {
+                active++;
+            }
+            else {
+                result.dropped++;
+                ::close(client.fd);
+                client.fd = -1;
+            }
+        }
+
+        vector<epoll_event> events(1024);
+        char buffer[64 * 1024];
+        while (active > 0) {
+            int ready = epoll_wait(epollFd, events.data(), static_cast<int>(events.size()), 1000);
+            if (ready < 0 && errno != EINTR) break;
+            for (int i = 0; i < ready; i++) {
+                Client& client = *static_cast<Client*>(events[i].data.ptr);
+                bool open = !(events[i].events & EPOLLOUT) || flush(epollFd, client);
+                while (open) {
+                    ssize_t n = ::recv(client.fd, buffer, sizeof(buffer), 0);
+                    if (n > 0) {
+                        client.input.append(buffer, n);
+                        continue;
+                    }
+                    if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) open = false;
+                    if (n < 0 && errno == EINTR) continue;
+                    break;
+                }
+                // A response is its length on a line of its own, then the text
+                size_t newline;
+                bool waiting = true;
+                while ((newline = client.input.find('\n')) != string::npos) {
+                    size_t length = strtoull(client.input.c_str(), nullptr, 10);
+                    if (client.input.size() - newline - 1 < length) break;
+                    auto now = chrono::steady_clock::now();
+                    result.latencyNanos.record(chrono::duration_cast<chrono::nanoseconds>(now - client.sentAt).count());
+                    result.requests++;
+                    if (client.input.compare(newline + 1, 5, "error") == 0) result.errors++;
+                    client.input.erase(0, newline + 1 + length);
+                    if (client.remaining == 0) waiting = false;
+                    else if (!open || !sendNext(epollFd, client)) open = false;
+                }
+                if (!open || !waiting) {
+                    if (waiting) result.dropped++;
+                    epoll_ctl(epollFd, EPOLL_CTL_DEL, client.fd, nullptr);
+                    ::close(client.fd);
+                    client.fd = -1;
+                    active--;
+                }
+            }
+        }
+        result.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        for (auto& client : clients) {
+            if (client.fd >= 0) ::close(client.fd);
+        }
+        ::close(epollFd);
+        return result;
+    }
+};
+#endif
+
+int main(int argc, char* argv[]) {
+    // --batch [file]: run commands from the file (or stdin) instead of the menus
+    // --sessions <count> <file> [threads]: replay the file in that many concurrent sessions
+    // --serve <socket> [threads]: serve sessions on a Unix-domain socket until interrupted
+    // --load <socket> <clients> <requests> <file>: measure a running server with the file's commands
+    bool batchMode = argc > 1 && string(argv[1]) == "--batch";
+    bool sessionMode = argc > 3 && string(argv[1]) == "--sessions";
+    bool serveMode = argc > 2 && string(argv[1]) == "--serve";
+    bool loadMode = argc > 5 && string(argv[1]) == "--load";
+    if (batchMode) ios::sync_with_stdio(false);
+
+    if (loadMode) {
+#ifdef __linux__
+        vector<string> script;
+        ifstream file(argv[5]);
+        string line;
+        while (getline(file, line)) {
+            if (!BatchSession::parse(line).empty()) script.push_back(line);
+        }
+        LoadGenerator generator(script);
+        LoadGenerator::Result result = generator.run(argv[2], strtoul(argv[3], nullptr, 10), strtoul(argv[4], nullptr, 10));
+        const LatencyHistogram& latency = result.latencyNanos;
+        cerr << result.connected << " clients (" << result.dropped << " dropped), " << result.requests << " requests ("
+            << result.errors << " errors) in " << result.seconds << " s ("
+            << static_cast<uint64_t>(result.requests / max(result.seconds, 1e-9)) << " requests/sec)" << endl;
+        cerr << "latency us: p50 " << latency.percentile(0.50) / 1000.0 << ", p90 " << latency.percentile(0.90) / 1000.0
+            << ", p99 " << latency.percentile(0.99) / 1000.0 << ", p99.9 " << latency.percentile(0.999) / 1000.0
+            << ", max " << latency.maximum() / 1000.0 << endl;
+        return result.requests > 0 ? 0 : 1;
+#else
+        cerr << "--load needs Unix-domain sockets and epoll (Linux)" << endl;
+        return 1;
+#endif
+    }
+
+    if (!loadSnapshot(SNAPSHOT_PATH)) {
+        initializeSystem();
+    }
+    uint64_t walLength = replayWriteAheadLog(WAL_PATH);
+    if (!wal.open(WAL_PATH, walLength)) {
+        cout << "Warning: changes will not be logged to " << WAL_PATH << endl;
+    }
+    rebuildRecommendations(max(1u, thread::hardware_concurrency()));
+    if (batchMode) {
+        BatchSession session(cout);
+        ifstream file;
+        if (argc > 2) {
+            file.open(argv[2]);
+            if (!file) {
+                cerr << "Cannot open " << argv[2] << endl;
+            }
+        }
+        auto start = chrono::steady_clock::now();
+        session.run(argc > 2 ? static_cast<istream&>(file) : cin);
+        cout.flush();
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cerr << session.getCommands() << " commands, " << session.getOperations() << " operations in "
+            << seconds << " s (" << static_cast<uint64_t>(session.getOperations() / max(seconds, 1e-9))
+            << " ops/sec)" << endl;
+    }
+    else if (sessionMode) {
+        vector<vector<string>> script;
+        ifstream file(argv[3]);
+        string line;
+        while (getline(file, line)) {
+            vector<string> args = BatchSession::parse(line);
+            if (!args.empty()) script.push_back(args);
+        }
+        size_t sessions = strtoul(argv[2], nullptr, 10);
+        SessionHost::Stats stats;
+        {
+            SessionHost host;
+            unsigned threads = argc > 4 ? static_cast<unsigned>(strtoul(argv[4], nullptr, 10))
+                : thread::hardware_concurrency();
+            stats = host.serve(script, sessions, max(1u, threads));
+        }
+        cerr << stats.sessions << " sessions, " << stats.commands << " commands (" << stats.errors
+            << " errors) in " << stats.seconds << " s ("
+            << static_cast<uint64_t>(stats.commands / max(stats.seconds, 1e-9)) << " commands/sec)" << endl;
+    }
+#ifdef __linux__
+    else if (serveMode) {
+        SessionHost host;
+        SocketServer server(host);
+        if (!server.listen(argv[2])) {
+            cerr << "Cannot listen on " << argv[2] << endl;
+        }
+        else {
+            unsigned threads = argc > 3 ? static_cast<unsigned>(strtoul(argv[3], nullptr, 10))
+                : thread::hardware_concurrency();
+            cerr << "Serving on " << argv[2] << endl;
+            server.run(max(1u, threads));
+        }
+    }
+#else
+    else if (serveMode) {
+        cerr << "--serve needs Unix-domain sockets and epoll (Linux)" << endl;
+    }
+#endif
+    else {
+        loginMenu();
+    }
+
+    if (!checkpoint()) {
+        cout << "Warning: could not save the library to " << SNAPSHOT_PATH << endl;
+    }
+#if MUSIC_METRICS
+    // MUSIC_METRICS_FILE: where to leave the metrics when the program ends
+    const char* metricsPath = getenv("MUSIC_METRICS_FILE");
+    if (metricsPath && !metrics.writeFile(metricsPath)) {
+        cerr << "Could not write metrics to " << metricsPath << endl;
+    }
+#endif
+    wal.close();
+    shutdownSystem();
 
     return 0;
 }
\ No newline at end of file
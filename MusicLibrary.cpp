@@ -0,0 +1,1789 @@
+#include "MusicLibrary.h"
+
+// Global collections
+IdOrderedList<SongRef> allSongs;
+vector<Playlist*> allPlaylists;
+vector<Artist*> allArtists;
+vector<User*> allUsers;
+Admin* admin = nullptr;
+
+// Utility functions
+void trim(string& str) {
+    str.erase(str.begin(), find_if(str.begin(), str.end(), [](int ch) { return !isspace(ch); }));
+    str.erase(find_if(str.rbegin(), str.rend(), [](int ch) { return !isspace(ch); }).base(), str.end());
+}
+
+vector<string> split(const string& s, char delimiter) {
+    vector<string> tokens;
+    string token;
+    istringstream tokenStream(s);
+    while (getline(tokenStream, token, delimiter)) {
+        trim(token);
+        if (!token.empty()) tokens.push_back(token);
+    }
+    return tokens;
+}
+
+#if MUSIC_METRICS
+Metrics metrics;
+
+const char* Metrics::nameOf(MetricTimer timer) {
+    static const char* const names[TIMERS] = { "search_songs", "search_playlists", "rank_songs", "browse_filter",
+        "browse_sort", "remove_song", "remove_artist", "authenticate", "playback" };
+    return names[static_cast<size_t>(timer)];
+}
+
+const char* Metrics::nameOf(MetricCounter counter) {
+    static const char* const names[COUNTERS] = { "search_results", "failed_logins", "songs_removed",
+        "playback_ends" };
+    return names[static_cast<size_t>(counter)];
+}
+
+Metrics::Snapshot Metrics::snapshot() const {
+    Snapshot total;
+    lock_guard<mutex> lock(registry);
+    for (const auto& shard : shards) {
+        for (size_t t = 0; t < TIMERS; t++) {
+            for (size_t b = 0; b < LatencyHistogram::BUCKETS; b++) {
+                uint64_t count = shard->buckets[t][b].load(memory_order_relaxed);
+                if (count > 0) total.latencies[t].add(b, count);
+            }
+            total.totalNanos[t] += shard->totalNanos[t].load(memory_order_relaxed);
+        }
+        for (size_t c = 0; c < COUNTERS; c++) total.counters[c] += shard->counters[c].load(memory_order_relaxed);
+    }
+    return total;
+}
+
+namespace {
+const double QUANTILES[] = { 0.5, 0.9, 0.99, 0.999 };
+}
+
+string Metrics::prometheusText() const {
+    Snapshot total = snapshot();
+    ostringstream out;
+    for (size_t t = 0; t < TIMERS; t++) {
+        string name = string("music_") + nameOf(static_cast<MetricTimer>(t)) + "_seconds";
+        const LatencyHistogram& latency = total.latencies[t];
+        out << "# TYPE " << name << " summary\n";
+        for (double quantile : QUANTILES) {
+            out << name << "{quantile=\"" << quantile << "\"} " << latency.percentile(quantile) / 1e9 << '\n';
+        }
+        out << name << "_sum " << total.totalNanos[t] / 1e9 << '\n';
+        out << name << "_count " << latency.count() << '\n';
+        out << "# TYPE " << name << "_max gauge\n";
+        out << name << "_max " << latency.maximum() / 1e9 << '\n';
+    }
+    for (size_t c = 0; c < COUNTERS; c++) {
+        string name = string("music_") + nameOf(static_cast<MetricCounter>(c)) + "_total";
+        out << "# TYPE " << name << " counter\n";
+        out << name << ' ' << total.counters[c] << '\n';
+    }
+    return out.str();
+}
+
+string Metrics::json() const {
+    Snapshot total = snapshot();
+    ostringstream out;
+    out << "{\"timers\":{";
+    for (size_t t = 0; t < TIMERS; t++) {
+        const LatencyHistogram& latency = total.latencies[t];
+        out << (t ? "," : "") << '"' << nameOf(static_cast<MetricTimer>(t)) << "\":{\"count\":" << latency.count()
+            << ",\"sum_ns\":" << total.totalNanos[t] << ",\"p50_ns\":" << latency.percentile(0.5)
+            << ",\"p90_ns\":" << latency.percentile(0.9) << ",\"p99_ns\":" << latency.percentile(0.99)
+            << ",\"p999_ns\":" << latency.percentile(0.999) << ",\"max_ns\":" << latency.maximum() << '}';
+    }
+    out << "},\"counters\":{";
+    for (size_t c = 0; c < COUNTERS; c++) {
+        out << (c ? "," : "") << '"' << nameOf(static_cast<MetricCounter>(c)) << "\":" << total.counters[c];
+    }
+    out << "}}\n";
+    return out.str();
+}
+
+bool Metrics::writeFile(const string& path) const {
+    bool asJson = path.size() >= 5 && path.compare(path.size() - 5, 5, ".json") == 0;
+    string text = asJson ? json() : prometheusText();
+    string temporary = path + ".tmp";
+    {
+        ofstream file(temporary, ios::binary | ios::trunc);
+        if (!file.write(text.data(), text.size())) return false;
+    }
+    remove(path.c_str());
+    return rename(temporary.c_str(), path.c_str()) == 0;
+}
+#endif
+
+uint32_t PasswordHash::defaultIterations = 10000;
+
+// Model globals, in dependency order
+WriteAheadLog wal;
+StringPool titlePool;
+StringPool genrePool;
+StringPool namePool;
+Recommender recommender;
+PlayStats playStats;
+
+uint32_t Song::nextId = 0;
+uint32_t Artist::nextId = 0;
+uint32_t Playlist::nextId = 0;
+uint32_t User::nextId = 0;
+
+SlabPool<Song> Song::pool;
+SlabPool<Artist> Artist::pool;
+SlabPool<Playlist> Playlist::pool;
+
+CatalogView catalog;
+// Set by loadSnapshot until indexCatalog has indexed what it loaded
+bool catalogUnindexed = false;
+EpochDomain catalogEpochs;
+UserDirectory userDirectory;
+
+WorkStealingPool& queryPool() {
+    static WorkStealingPool pool(max(1u, thread::hardware_concurrency()));
+    return pool;
+}
+
+// Implementations of methods that require complete types
+void Song::display() const {
+    cout << "Title: " << getTitle() << endl;
+    cout << "Artist: " << artist->getName() << endl;
+    cout << "Year: " << releaseYear << endl;
+    cout << "Genre: " << getGenre() << endl;
+}
+
+void Song::attachPlaylist(Playlist* playlist) { playlists.attach(playlist); }
+void Song::detachPlaylist(Playlist* playlist) { playlists.detach(playlist); }
+void Song::attachFavorite(User* user) { favoritedBy.attach(user); }
+void Song::detachFavorite(User* user) { favoritedBy.detach(user); }
+
+void Artist::addAlbum(Playlist* album) {
+    if (albumIds.insert(album->getId())) {
+        albums.push_back(album);
+    }
+}
+
+vector<PlayStats::Play> PlayStats::topSongsOf(const Artist* artist, size_t n) {
+    lock_guard<mutex> lock(merging);
+    drain();
+    uint32_t id = artist->getId();
+    if (id >= topSongs.size()) return vector<Play>();
+    vector<Play>& heap = topSongs[id];
+    if (any_of(heap.begin(), heap.end(), [](const Play& play) { return !play.song; })) {
+        heap.clear();
+        for (const auto& song : artist->getSongs()) {
+            uint32_t songId = song->getId();
+            if (songId < songPlays.size() && songPlays[songId] > 0) promote(heap, song, songPlays[songId]);
+        }
+    }
+    vector<Play> top(heap);
+    sort(top.begin(), top.end(), [](const Play& a, const Play& b) {
+        return a.plays != b.plays ? a.plays > b.plays : a.song->getId() < b.song->getId();
+    });
+    if (top.size() > n) top.resize(n);
+    return top;
+}
+
+void Artist::display() const {
+    cout << "Artist: " << getName() << endl;
+    cout << "Total Songs: " << songs.size() << endl;
+    cout << "Total Albums: " << albums.size() << endl;
+
+    cout << "\nPopular Songs:" << endl;
+    vector<PlayStats::Play> top = playStats.topSongsOf(this, 5);
+    for (const auto& play : top) {
+        cout << "- " << play.song->getTitle() << " (" << play.plays << (play.plays == 1 ? " play)" : " plays)") << endl;
+    }
+    if (top.empty()) {
+        cout << "No plays yet" << endl;
+    }
+
+    cout << "\nAlbums:" << endl;
+    for (const auto& album : albums) {
+        cout << "- " << album->getName() << endl;
+    }
+}
+
+void Playlist::display() const {
+    cout << "Playlist: " << getName() << endl;
+    cout << "Creator: " << creator->getUsername() << endl;
+    cout << "Songs (" << songs.size() << "):" << endl;
+    for (const auto& song : songs) {
+        cout << "- " << song->getTitle() << " by " << song->getArtist()->getName() << endl;
+    }
+}
+
+bool Playlist::findVersion(uint64_t number, PlaylistVersion& found) const {
+    if (number == version) {
+        found = snapshot();
+        return true;
+    }
+    for (const auto& old : history) {
+        if (old.number == number) {
+            found = old;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Songs deleted from the catalog since either version are left out
+PlaylistDiff Playlist::diff(const PersistentList<SongRef>& older, const PersistentList<SongRef>& newer) {
+    PlaylistDiff result;
+    if (older.sameVersion(newer)) return result;
+
+    unordered_set<uint32_t> inOlder, inNewer;
+    inOlder.reserve(older.size());
+    inNewer.reserve(newer.size());
+    for (const auto& song : older) inOlder.insert(song.value());
+    for (const auto& song : newer) inNewer.insert(song.value());
+
+    // Songs in both, in their old order, to compare with their new order
+    vector<uint32_t> kept;
+    for (const auto& song : older) {
+        if (!song) continue;
+        if (inNewer.count(song.value())) kept.push_back(song.value());
+        else result.removed.push_back(song);
+    }
+    size_t next = 0;
+    for (const auto& song : newer) {
+        if (!song) continue;
+        if (!inOlder.count(song.value())) result.added.push_back(song);
+        else if (kept[next++] != song.value()) result.reordered = true;
+    }
+    return result;
+}
+
+void Playlist::restoreSongs(const vector<SongRef>& restored) {
+    labels.reserve(restored.size());
+    vector<SongRef> distinct;
+    distinct.reserve(restored.size());
+    for (const auto& song : restored) {
+        if (labels.contains(song->getId())) continue;
+        labels.set(song->getId(), 0);
+        song->attachPlaylist(this);
+        distinct.push_back(song);
+    }
+    songs.assign(distinct.begin(), distinct.end());
+    labelAll();
+    recommender.addBasket(basket());
+}
+
+// Fresh labels for every song, in order
+void Playlist::labelAll() {
+    uint64_t step = min(LABEL_STEP, (LABEL_LIMIT - 1) / (songs.size() + 1));
+    uint64_t label = 0;
+    for (const auto& song : songs) labels.set(song->getId(), label += step);
+}
+
+// Labels for `count` songs going in before `position`: the first, and the
+// step between them. They are spread evenly over the gap between the
+// neighbouring labels (at most LABEL_STEP apart at either end); a gap too
+// narrow is widened first.
+void Playlist::labelsFor(size_t position, size_t count, uint64_t& first, uint64_t& step) {
+    while (true) {
+        bool atStart = position == 0, atEnd = position == songs.size();
+        uint64_t low = atStart ? 0 : labelAt(position - 1);
+        uint64_t high = atEnd ? LABEL_LIMIT : labelAt(position);
+        step = (high - low) / (count + 1);
+        if (atStart || atEnd) step = min(step, LABEL_STEP);
+        if (step >= 1) {
+            first = atStart && !atEnd ? high - count * step : low + step;
+            return;
+        }
+        spreadLabels(position, count);
+    }
+}
+
+// Opens room for `count` labels before `position` by relabelling the
+// smallest aligned block of labels around it that is sparse enough: a block
+// of 2^bits labels may hold up to 1.5^bits songs, new ones included, and its
+// songs are spaced out evenly with the gap left where the new ones go.
+// Thresholds that fall as blocks grow keep the relabelling to amortised
+// O(log n) songs per insertion (Bender et al., "Two simplified algorithms for
+// maintaining order in a list").
+void Playlist::spreadLabels(size_t position, size_t count) {
+    uint64_t pivot = labelAt(position > 0 ? position - 1 : position);
+    double capacity = 1;
+    for (unsigned bits = 1; bits <= LABEL_BITS; bits++) {
+        capacity *= 1.5;
+        uint64_t mask = (uint64_t(1) << bits) - 1;
+        uint64_t start = max<uint64_t>(pivot & ~mask, 1);
+        uint64_t end = (pivot | mask) + 1;
+        if ((end - start) / (count + 2) < 2) continue;
+        size_t first = rankOf(start), last = rankOf(end);
+        size_t total = last - first + count;
+        uint64_t step = (end - start) / (total + 1);
+        if ((total > capacity || step < 2) && bits < LABEL_BITS) continue;
+
+        size_t slot = 0;
+        auto it = songs.at(first);
+        for (size_t i = first; i < last; i++, ++it) {
+            if (i == position) slot += count;
+            labels.set((*it)->getId(), start + ++slot * step);
+        }
+        return;
+    }
+}
+
+// Moves the songs without touching the others: the range is cut out of the
+// tree and spliced back in, and only its songs get new labels
+void Playlist::moveAt(size_t from, size_t count, size_t to) {
+    size_t lowest = min(from, to), highest = max(from, to) + count;
+    bool recount = recommender.isTracking() && lowest < Recommender::BASKET_LIMIT && highest > Recommender::BASKET_LIMIT;
+    vector<SongRef> before;
+    if (recount) before = basket();
+
+    PersistentList<SongRef> moved = songs.slice(from, from + count);
+    songs.erase(from, from + count);
+    uint64_t label, step;
+    labelsFor(to, count, label, step);
+    for (const auto& song : moved) {
+        labels.set(song->getId(), label);
+        label += step;
+    }
+    songs.insert(to, moved);
+
+    for (auto cursor : cursors) {
+        if (cursor->index < songs.size()) cursor->index = movedPosition(cursor->index, from, count, to);
+        cursor->shuffle.move(from, count, to);
+    }
+    if (recount) recommender.changed(before, basket());
+}
+
+void Playlist::reorderSongs(const vector<SongRef>& order) {
+    vector<SongRef> next;
+    next.reserve(songs.size());
+    IdSet placed;
+    placed.reserve(order.size());
+    for (const auto& song : order) {
+        if (containsSong(song) && placed.insert(song->getId())) next.push_back(song);
+    }
+    for (const auto& song : songs) {
+        if (!placed.contains(song->getId())) next.push_back(song);
+    }
+    setSongs(next);
+}
+
+void Playlist::sortSongs(SongOrder order) {
+    vector<SongRef> sorted = songs.toVector();
+    auto byKey = [order](SongRef a, SongRef b) {
+        switch (order) {
+        case SongOrder::TITLE: return a->getTitle() < b->getTitle();
+        case SongOrder::YEAR: return a->getReleaseYear() < b->getReleaseYear();
+        case SongOrder::ARTIST: return a->getArtist()->getName() < b->getArtist()->getName();
+        }
+        return false;
+    };
+    stable_sort(sorted.begin(), sorted.end(), byKey);
+    setSongs(sorted);
+}
+
+void Playlist::replaceSongs(const vector<SongRef>& next) {
+    vector<SongRef> current = songs.toVector();
+    vector<SongRef> before = basket();
+
+    unordered_map<uint32_t, uint32_t> nextPosition;
+    nextPosition.reserve(next.size());
+    for (size_t i = 0; i < next.size(); i++) nextPosition[next[i]->getId()] = static_cast<uint32_t>(i);
+    vector<uint32_t> newPositions(current.size());
+    for (size_t i = 0; i < current.size(); i++) {
+        auto it = nextPosition.find(current[i]->getId());
+        newPositions[i] = it == nextPosition.end() ? UINT32_MAX : it->second;
+    }
+
+    // A cursor on a dropped song moves to the first later song that stays
+    for (auto cursor : cursors) {
+        size_t i = cursor->index;
+        if (i < current.size() && newPositions[i] == UINT32_MAX) {
+            cursor->removed = true;
+            while (i < current.size() && newPositions[i] == UINT32_MAX) i++;
+        }
+        cursor->index = i < current.size() ? newPositions[i] : next.size();
+        cursor->shuffle.remap(newPositions);
+    }
+
+    for (size_t i = 0; i < current.size(); i++) {
+        if (newPositions[i] != UINT32_MAX) continue;
+        labels.erase(current[i]->getId());
+        current[i]->detachPlaylist(this);
+    }
+    for (size_t i = 0; i < next.size(); i++) {
+        if (labels.contains(next[i]->getId())) continue;
+        labels.set(next[i]->getId(), 0);
+        next[i]->attachPlaylist(this);
+        for (auto cursor : cursors) cursor->shuffle.append(i);
+    }
+
+    songs.assign(next.begin(), next.end());
+    labelAll();
+    recommender.changed(before, basket());
+}
+
+void Playlist::logSongs() const {
+    if (!wal.isRecording()) return;
+    vector<uint32_t> ids;
+    ids.reserve(songs.size());
+    for (const auto& song : songs) ids.push_back(song->getId());
+    wal.setPlaylistSongs(id, ids);
+}
+
+void Playlist::setSongs(const vector<SongRef>& next) {
+    IdSet seen;
+    seen.reserve(next.size());
+    vector<SongRef> distinct;
+    distinct.reserve(next.size());
+    for (const auto& song : next) {
+        if (seen.insert(song->getId())) distinct.push_back(song);
+    }
+    remember();
+    replaceSongs(distinct);
+    logSongs();
+}
+
+bool Playlist::undo() {
+    auto inCatalog = [](SongRef song) { return song && findById(allSongs, song->getId()) == song; };
+    for (size_t i = history.size(); i-- > 0;) {
+        if (history[i].edit == PlaylistRevision::UNDO || history[i].undone) continue;
+        history[i].undone = true;
+        // A copy, since recording the new version may drop the oldest one
+        PlaylistRevision last = history[i];
+
+        if (last.edit == PlaylistRevision::INSERTED && last.position < songs.size() && songs[last.position] == last.song) {
+            remember(PlaylistRevision::UNDO);
+            eraseAt(last.position);
+            wal.log(WriteAheadLog::PLAYLIST_REMOVE_SONG, id, last.song->getId());
+        }
+        else if (last.edit == PlaylistRevision::MOVED && last.songs.size() == songs.size()) {
+            remember(PlaylistRevision::UNDO);
+            moveAt(last.target, last.count, last.position);
+            wal.movePlaylistSongs(id, last.target, last.count, last.position);
+        }
+        else if (last.edit == PlaylistRevision::REMOVED && songs.size() + 1 == last.songs.size()) {
+            // A song deleted from the catalog since stays out
+            if (!inCatalog(last.song)) continue;
+            remember(PlaylistRevision::UNDO);
+            insertAt(last.song, last.position);
+            wal.insertPlaylistSong(id, last.song->getId(), last.position);
+        }
+        else {
+            vector<SongRef> restored;
+            restored.reserve(last.songs.size());
+            for (const auto& song : last.songs) {
+                if (inCatalog(song)) restored.push_back(song);
+            }
+            // An edit that only dropped songs since deleted has nothing left to undo
+            if (restored == songs.toVector()) continue;
+            remember(PlaylistRevision::UNDO);
+            replaceSongs(restored);
+            logSongs();
+        }
+        return true;
+    }
+    return false;
+}
+
+void User::createPlaylist(const string& name, bool isPublic) {
+    Playlist* playlist = Playlist::pool.create(name, this, isPublic);
+    personalPlaylists.push_back(playlist);
+    wal.createPlaylist(playlist->getId(), id, isPublic, name);
+}
+
+void User::deletePlaylist(Playlist* playlist) {
+    auto it = find(personalPlaylists.begin(), personalPlaylists.end(), playlist);
+    if (it != personalPlaylists.end()) {
+        wal.log(WriteAheadLog::DELETE_PLAYLIST, id, playlist->getId());
+        Playlist::pool.destroy(*it);
+        personalPlaylists.erase(it);
+    }
+}
+
+SongRef Player::songAt(size_t index) const {
+    if (!playback.playlist) return SongRef();
+    const auto& songs = playback.playlist->getSongs();
+    return index < songs.size() ? songs[index] : SongRef();
+}
+
+// Positions past the end mean there is no next or previous song
+size_t Player::nextIndex() {
+    if (!playback.playlist || playback.playlist->getSongs().empty()) return SIZE_MAX;
+
+    size_t count = playback.playlist->getSongs().size();
+    switch (playbackMode) {
+    case PlaybackMode::SEQUENTIAL: {
+        // A removed current track leaves the cursor on the one that followed it
+        size_t next = playback.removed ? playback.index : playback.index + 1;
+        if (next < count) {
+            return next;
+        }
+        else if (isLooping) {
+            return 0;
+        }
+        break;
+    }
+    case PlaybackMode::RANDOM: {
+        return playback.shuffle.upcoming(isLooping);
+    }
+    case PlaybackMode::REPEAT: {
+        return playback.index;
+    }
+    }
+    return SIZE_MAX;
+}
+
+size_t Player::previousIndex() const {
+    if (!playback.playlist || playback.playlist->getSongs().empty()) return SIZE_MAX;
+
+    size_t count = playback.playlist->getSongs().size();
+    if (playbackMode == PlaybackMode::SEQUENTIAL) {
+        if (playback.index > 0) {
+            return min(playback.index, count) - 1;
+        }
+        else if (isLooping) {
+            return count - 1;
+        }
+        return SIZE_MAX;
+    }
+    else if (playbackMode == PlaybackMode::RANDOM) {
+        return playback.shuffle.previous(playback.removed);
+    }
+    return playback.index;
+}
+
+void Player::moveTo(size_t index) {
+    playback.index = index;
+    playback.removed = false;
+    currentSong = songAt(index);
+    playStats.record(currentSong);
+}
+
+// Deals a fresh shuffle with the current track first
+void Player::startShuffle() {
+    if (!playback.playlist) return;
+    size_t current = currentSong && !playback.removed ? playback.index : SIZE_MAX;
+    playback.shuffle.start(playback.playlist->getSongs().size(), current);
+}
+
+SongRef Player::playNext() {
+    TIME_SCOPE(PLAYBACK);
+    size_t index = nextIndex();
+    if (index == SIZE_MAX) {
+        COUNT_METRIC(PLAYBACK_ENDS, 1);
+        return SongRef();
+    }
+    if (playbackMode == PlaybackMode::RANDOM) playback.shuffle.advance();
+    moveTo(index);
+    return currentSong;
+}
+
+SongRef Player::playPrevious() {
+    TIME_SCOPE(PLAYBACK);
+    size_t index = previousIndex();
+    if (index == SIZE_MAX) return SongRef();
+    if (playbackMode == PlaybackMode::RANDOM && !playback.removed) playback.shuffle.retreat();
+    moveTo(index);
+    return currentSong;
+}
+
+vector<SongRef> User::searchSongs(const string& query) const {
+    indexCatalog();
+    return searchSongs(query, catalog);
+}
+
+vector<SongRef> User::searchSongs(const string& query, const CatalogView& view) const {
+    TIME_SCOPE(SEARCH_SONGS);
+    vector<SongRef> results = view.songSearch.search(query, [&query](SongRef song) {
+        return song->getTitle().find(query) != string::npos ||
+            song->getArtist()->getName().find(query) != string::npos;
+    });
+    COUNT_METRIC(SEARCH_RESULTS, results.size());
+    return results;
+}
+
+vector<Playlist*> User::searchPlaylists(const string& query) const {
+    indexCatalog();
+    return searchPlaylists(query, catalog);
+}
+
+vector<Playlist*> User::searchPlaylists(const string& query, const CatalogView& view) const {
+    TIME_SCOPE(SEARCH_PLAYLISTS);
+    return view.playlistSearch.search(query, [&query](const Playlist* playlist) {
+        return playlist->getName().find(query) != string::npos;
+    });
+}
+
+vector<SongRef> User::rankSongs(const string& query, size_t limit) const {
+    indexCatalog();
+    return rankSongs(query, limit, catalog);
+}
+
+vector<SongRef> User::rankSongs(const string& query, size_t limit, const CatalogView& view) const {
+    TIME_SCOPE(RANK_SONGS);
+    vector<SongRef> results;
+    for (const auto& match : view.songTerms.rank(query, limit)) {
+        results.push_back(match.doc);
+    }
+    return results;
+}
+
+vector<string> User::completeQuery(const string& text, size_t limit) const {
+    indexCatalog();
+    return completeQuery(text, limit, catalog);
+}
+
+vector<string> User::completeQuery(const string& text, size_t limit, const CatalogView& view) const {
+    vector<string> suggestions;
+    size_t start = TermIndex<Song, SongRef>::lastWordStart(text);
+    if (start == text.size()) return suggestions;
+    for (const auto& completion : view.songTerms.complete(text.substr(start), limit)) {
+        suggestions.push_back(text.substr(0, start) + completion.term);
+    }
+    return suggestions;
+}
+
+// Recursive-descent parser for SongFilter expressions:
+//     expression := term (OR term)*
+//     term       := factor (AND factor)*
+//     factor     := NOT factor | '(' expression ')' | field compare value
+class SongFilter::Parser {
+private:
+    const string& text;
+    size_t pos = 0;
+    string& error;
+
+    void skipSpace() {
+        while (pos < text.size() && isspace(static_cast<unsigned char>(text[pos]))) pos++;
+    }
+
+    static bool isWordChar(char c) {
+        return !isspace(static_cast<unsigned char>(c)) && !strchr("()=!<>~\"", c);
+    }
+
+    // Consumes the keyword `word` if it comes next as a whole word, in any case
+    bool keyword(const char* word) {
+        skipSpace();
+        size_t length = strlen(word);
+        if (text.size() - pos < length) return false;
+        for (size_t i = 0; i < length; i++) {
+            if (toupper(static_cast<unsigned char>(text[pos + i])) != word[i]) return false;
+        }
+        if (pos + length < text.size() && isWordChar(text[pos + length])) return false;
+        pos += length;
+        return true;
+    }
+
+    bool fail(const string& message) {
+        if (error.empty()) error = message + " at position " + to_string(pos + 1);
+        return false;
+    }
+
+    bool word(string& out) {
+        skipSpace();
+        size_t start = pos;
+        while (pos < text.size() && isWordChar(text[pos])) pos++;
+        out = text.substr(start, pos - start);
+        return !out.empty();
+    }
+
+    // A bare word or double-quoted text; \" and \\ escape inside quotes
+    bool value(string& out) {
+        skipSpace();
+        if (pos == text.size() || text[pos] != '"') {
+            if (!word(out)) return fail("expected a value");
+            return true;
+        }
+        out.clear();
+        for (pos++; pos < text.size() && text[pos] != '"'; pos++) {
+            if (text[pos] == '\\' && pos + 1 < text.size()) pos++;
+            out += text[pos];
+        }
+        if (pos == text.size()) return fail("unterminated quote");
+        pos++;
+        return true;
+    }
+
+    bool compare(Compare& out) {
+        skipSpace();
+        static const pair<const char*, Compare> operators[] = { { "!=", Compare::NOT_EQUAL },
+            { "<=", Compare::LESS_EQUAL }, { ">=", Compare::GREATER_EQUAL }, { "=", Compare::EQUAL },
+            { "<", Compare::LESS }, { ">", Compare::GREATER }, { "~", Compare::CONTAINS } };
+        for (const auto& op : operators) {
+            if (text.compare(pos, strlen(op.first), op.first) == 0) {
+                pos += strlen(op.first);
+                out = op.second;
+                return true;
+            }
+        }
+        return fail("expected one of = != < <= > >= ~");
+    }
+
+    unique_ptr<Node> condition() {
+        string name;
+        size_t start = (skipSpace(), pos);
+        if (!word(name)) {
+            fail("expected a condition");
+            return nullptr;
+        }
+        for (auto& c : name) c = static_cast<char>(tolower(static_cast<unsigned char>(c)));
+        auto node = make_unique<Node>();
+        node->kind = Node::TEST;
+        if (name == "artist") node->field = Field::ARTIST;
+        else if (name == "genre") node->field = Field::GENRE;
+        else if (name == "year") node->field = Field::YEAR;
+        else {
+            pos = start;
+            fail("unknown field '" + name + "'");
+            return nullptr;
+        }
+        size_t operatorStart = (skipSpace(), pos);
+        if (!compare(node->compare)) return nullptr;
+        size_t valueStart = (skipSpace(), pos);
+        if (!value(node->text)) return nullptr;
+
+        // Errors in a whole condition point at the part that is wrong
+        if (node->field == Field::YEAR) {
+            const char* end = node->text.data() + node->text.size();
+            auto parsed = from_chars(node->text.data(), end, node->year);
+            if (node->compare == Compare::CONTAINS) {
+                pos = operatorStart;
+                fail("~ does not apply to year");
+                return nullptr;
+            }
+            if (parsed.ec != errc() || parsed.ptr != end) {
+                pos = valueStart;
+                fail("year must be a number");
+                return nullptr;
+            }
+        }
+        else if (node->compare != Compare::EQUAL && node->compare != Compare::NOT_EQUAL
+            && node->compare != Compare::CONTAINS) {
+            pos = operatorStart;
+            fail("only = != ~ apply to " + name);
+            return nullptr;
+        }
+        return node;
+    }
+
+    unique_ptr<Node> factor() {
+        if (keyword("NOT")) {
+            unique_ptr<Node> operand = factor();
+            if (!operand) return nullptr;
+            auto node = make_unique<Node>();
+            node->kind = Node::NOT;
+            node->children.push_back(move(operand));
+            return node;
+        }
+        skipSpace();
+        if (pos < text.size() && text[pos] == '(') {
+            pos++;
+            unique_ptr<Node> inner = expression();
+            skipSpace();
+            if (!inner) return nullptr;
+            if (pos == text.size() || text[pos] != ')') {
+                fail("expected )");
+                return nullptr;
+            }
+            pos++;
+            return inner;
+        }
+        return condition();
+    }
+
+    // Parses operands of `kind` joined by `word`; a single operand is returned as is
+    template <typename Operand>
+    unique_ptr<Node> chain(typename Node::Kind kind, const char* word, Operand operand) {
+        unique_ptr<Node> first = (this->*operand)();
+        if (!first) return nullptr;
+        if (!keyword(word)) return first;
+        auto node = make_unique<Node>();
+        node->kind = kind;
+        node->children.push_back(move(first));
+        do {
+            unique_ptr<Node> next = (this->*operand)();
+            if (!next) return nullptr;
+            node->children.push_back(move(next));
+        } while (keyword(word));
+        return node;
+    }
+
+    unique_ptr<Node> term() { return chain(Node::AND, "AND", &Parser::factor); }
+    unique_ptr<Node> expression() { return chain(Node::OR, "OR", &Parser::term); }
+
+public:
+    Parser(const string& text, string& error) : text(text), error(error) {}
+
+    unique_ptr<Node> parse() {
+        unique_ptr<Node> root = expression();
+        skipSpace();
+        if (root && pos < text.size()) {
+            fail("unexpected '" + text.substr(pos, 10) + "'");
+            return nullptr;
+        }
+        return root;
+    }
+};
+
+bool SongFilter::parse(const string& text, string& error) {
+    error.clear();
+    root = Parser(text, error).parse();
+    return root != nullptr;
+}
+
+IdBitmap SongFilter::evaluate(const Node& node, const SongFilterIndex& index) {
+    switch (node.kind) {
+    case Node::AND: {
+        // Narrowest first, stopping as soon as nothing is left
+        vector<IdBitmap> operands;
+        for (const auto& child : node.children) operands.push_back(evaluate(*child, index));
+        sort(operands.begin(), operands.end(), [](const IdBitmap& a, const IdBitmap& b) { return a.size() < b.size(); });
+        IdBitmap result = operands[0];
+        for (size_t i = 1; i < operands.size() && !result.empty(); i++) result = IdBitmap::intersect(result, operands[i]);
+        return result;
+    }
+    case Node::OR: {
+        vector<IdBitmap> operands;
+        for (const auto& child : node.children) operands.push_back(evaluate(*child, index));
+        vector<const IdBitmap*> parts;
+        for (const auto& operand : operands) parts.push_back(&operand);
+        return IdBitmap::uniteAll(parts);
+    }
+    case Node::NOT:
+        return IdBitmap::subtract(index.all(), evaluate(*node.children[0], index));
+    case Node::TEST:
+        break;
+    }
+
+    if (node.field == Field::YEAR) {
+        int32_t year = node.year;
+        switch (node.compare) {
+        case Compare::EQUAL: return index.years(year, year);
+        case Compare::NOT_EQUAL: return IdBitmap::subtract(index.all(), index.years(year, year));
+        case Compare::LESS: return year == INT32_MIN ? IdBitmap() : index.years(INT32_MIN, year - 1);
+        case Compare::LESS_EQUAL: return index.years(INT32_MIN, year);
+        case Compare::GREATER: return year == INT32_MAX ? IdBitmap() : index.years(year + 1, INT32_MAX);
+        case Compare::GREATER_EQUAL: return index.years(year, INT32_MAX);
+        case Compare::CONTAINS: break;
+        }
+        return IdBitmap();
+    }
+    bool exact = node.compare != Compare::CONTAINS;
+    IdBitmap matches = node.field == Field::ARTIST ? index.artists(node.text, exact) : index.genres(node.text, exact);
+    return node.compare == Compare::NOT_EQUAL ? IdBitmap::subtract(index.all(), matches) : matches;
+}
+
+IdBitmap SongFilter::evaluate(const SongFilterIndex& index) const {
+    return root ? evaluate(*root, index) : IdBitmap();
+}
+
+vector<SongRef> SongFilter::run(const SongFilterIndex& index, size_t limit) const {
+    TIME_SCOPE(BROWSE_FILTER);
+    return index.songsOf(evaluate(index), limit);
+}
+
+vector<SongRef> User::similarSongs(SongRef song, size_t limit) const {
+    vector<SongRef> results;
+    for (const auto& scored : recommender.similar(song, limit)) results.push_back(scored.song);
+    return results;
+}
+
+vector<SongRef> User::recommendedSongs(size_t limit) const {
+    vector<SongRef> results;
+    for (const auto& scored : recommender.recommend(favoriteSongs, limit)) results.push_back(scored.song);
+    return results;
+}
+
+void User::displayFavoriteSongs() const {
+    cout << "Favorite Songs:" << endl;
+    for (const auto& song : favoriteSongs) {
+        cout << "- " << song->getTitle() << " by " << song->getArtist()->getName() << endl;
+    }
+}
+
+void User::displayFavoritePlaylists() const {
+    cout << "Favorite Playlists:" << endl;
+    for (const auto& playlist : favoritePlaylists) {
+        cout << "- " << playlist->getName() << " by " << playlist->getCreator()->getUsername() << endl;
+    }
+}
+
+void User::displayPersonalPlaylists() const {
+    cout << "Personal Playlists:" << endl;
+    for (const auto& playlist : personalPlaylists) {
+        cout << "- " << playlist->getName() << " (" << playlist->getSongCount() << " songs)" << endl;
+    }
+}
+
+void User::displayMenu() {
+    cout << "\nWelcome, " << getUsername() << "!" << endl;
+    cout << "1. Browse Songs" << endl;
+    cout << "2. Browse Playlists" << endl;
+    cout << "3. My Favorite Songs" << endl;
+    cout << "4. My Favorite Playlists" << endl;
+    cout << "5. My Playlists" << endl;
+    cout << "6. Search" << endl;
+    cout << "7. Play Music" << endl;
+    cout << "8. Logout" << endl;
+}
+
+User::~User() {
+    recommender.removeBasket(favoriteSongs);
+    for (auto& song : favoriteSongs) {
+        song->detachFavorite(this);
+    }
+    for (auto& playlist : personalPlaylists) {
+        Playlist::pool.destroy(playlist);
+    }
+}
+
+void Admin::addSong(const string& title, Artist* artist, int year, const string& genre) {
+    indexCatalog();
+    Song* song = Song::pool.create(title, artist, year, genre);
+    allSongs.push_back(song);
+    catalog.columns.append(song);
+    catalog.filters.add(song);
+    catalog.orders.add(song);
+    artist->addSong(song);
+    catalog.songSearch.add(song, { song->getTitle(), artist->getName() });
+    catalog.songTerms.add(song, { song->getTitle(), artist->getName() });
+    wal.addSong(song->getId(), artist->getId(), year, title, genre);
+}
+
+void Admin::removeSong(SongRef song) {
+    TIME_SCOPE(REMOVE_SONG);
+    COUNT_METRIC(SONGS_REMOVED, 1);
+    indexCatalog();
+    wal.log(WriteAheadLog::REMOVE_SONG, song->getId());
+    WriteAheadLog::Mute mute(wal);
+    catalog.songSearch.remove(song, { song->getTitle(), song->getArtist()->getName() });
+    catalog.songTerms.remove(song, { song->getTitle(), song->getArtist()->getName() });
+    catalog.orders.remove(song.get());
+    catalog.filters.remove(song.get());
+
+    allSongs.erase(song->getId());
+    catalog.columns.remove(song);
+
+    // Remove from artist's songs
+    song->getArtist()->removeSong(song);
+
+    // Remove from the playlists and favorite lists that hold it; each call
+    // drops the last back-reference, so this only touches the real holders
+    while (!song->getPlaylists().empty()) {
+        song->getPlaylists().back()->removeSong(song);
+    }
+    while (!song->getFavoritedBy().empty()) {
+        song->getFavoritedBy().back()->removeFavoriteSong(song);
+    }
+
+    // Published catalog views may still list it
+    catalogEpochs.retire([song] { Song::pool.destroy(song.get()); });
+}
+
+void Admin::createArtist(const string& name) {
+    Artist* artist = Artist::pool.create(name);
+    allArtists.push_back(artist);
+    wal.addArtist(artist->getId(), name);
+}
+
+void Admin::removeArtist(Artist* artist) {
+    TIME_SCOPE(REMOVE_ARTIST);
+    COUNT_METRIC(SONGS_REMOVED, artist->getSongs().size());
+    indexCatalog();
+    wal.log(WriteAheadLog::REMOVE_ARTIST, artist->getId());
+    WriteAheadLog::Mute mute(wal);
+
+    // Remove all songs by this artist in one batch: the search indexes merge
+    // them out of each posting list at once, and every holder is collected
+    // once and gets a single pass
+    vector<SongRef> artistSongs = artist->getSongs();
+    auto fieldsOf = [artist](SongRef song) { return vector<string_view>{ song->getTitle(), artist->getName() }; };
+    catalog.songSearch.removeAll(artistSongs, fieldsOf);
+    catalog.songTerms.removeAll(artistSongs, fieldsOf);
+    vector<Playlist*> holders;
+    vector<User*> fans;
+    for (auto& song : artistSongs) {
+        allSongs.erase(song->getId());
+        catalog.orders.remove(song.get());
+        catalog.filters.remove(song.get());
+        holders.insert(holders.end(), song->getPlaylists().begin(), song->getPlaylists().end());
+        fans.insert(fans.end(), song->getFavoritedBy().begin(), song->getFavoritedBy().end());
+    }
+    sort(holders.begin(), holders.end());
+    holders.erase(unique(holders.begin(), holders.end()), holders.end());
+    sort(fans.begin(), fans.end());
+    fans.erase(unique(fans.begin(), fans.end()), fans.end());
+
+    auto byArtist = [artist](SongRef song) { return song->getArtist() == artist; };
+    for (auto& playlist : holders) {
+        playlist->removeSongsIf(byArtist);
+    }
+    for (auto& user : fans) {
+        user->removeFavoriteSongsIf(byArtist);
+    }
+    catalog.columns.removeArtist(artist->getId());
+
+    // Then remove the artist. Published catalog views may still list its
+    // songs, so they and the artist are freed once no session can see them.
+    allArtists.erase(remove(allArtists.begin(), allArtists.end(), artist), allArtists.end());
+    catalogEpochs.retire([artistSongs, artist] {
+        for (auto& song : artistSongs) {
+            Song::pool.destroy(song.get());
+        }
+        Artist::pool.destroy(artist);
+    });
+}
+
+void Admin::createAlbum(Artist* artist, const string& name) {
+    indexCatalog();
+    Playlist* album = Playlist::pool.create(name, this, true);
+    allPlaylists.push_back(album);
+    artist->addAlbum(album);
+    catalog.playlistSearch.add(album, { album->getName() });
+    wal.createAlbum(album->getId(), artist->getId(), name);
+}
+
+void Admin::displayMenu() {
+    cout << "\nAdmin Panel - Welcome, " << getUsername() << "!" << endl;
+    cout << "1. Add Song" << endl;
+    cout << "2. Create Artist" << endl;
+    cout << "3. Create Album" << endl;
+    cout << "4. Browse Songs" << endl;
+    cout << "5. Browse Playlists" << endl;
+    cout << "6. Browse Artists" << endl;
+    cout << "7. Import Songs from File" << endl;
+    cout << "8. Export Metrics" << endl;
+    cout << "9. Logout" << endl;
+}
+
+// Recounts song co-occurrence from every playlist (albums and personal ones)
+// and every favorites list
+void rebuildRecommendations(unsigned threads) {
+    // Only the counted part of each playlist is copied out of its tree
+    vector<vector<SongRef>> playlistBaskets;
+    vector<const vector<SongRef>*> baskets;
+    vector<User*> users(allUsers);
+    if (admin) users.push_back(admin);
+    auto addPlaylist = [&](const Playlist* playlist) {
+        playlistBaskets.push_back(playlist->getSongs().prefix(Recommender::BASKET_LIMIT));
+    };
+    for (auto playlist : allPlaylists) addPlaylist(playlist);
+    for (auto user : users) {
+        for (auto playlist : user->getPersonalPlaylists()) addPlaylist(playlist);
+    }
+    for (const auto& basket : playlistBaskets) baskets.push_back(&basket);
+    for (auto user : users) baskets.push_back(&user->getFavoriteSongs());
+    recommender.rebuild(baskets, threads);
+}
+
+// Creates a regular account; returns nullptr if the username is taken
+User* registerUser(const string& username, const string& password) {
+    if (userDirectory.contains(username)) return nullptr;
+    User* user = new User(username, password);
+    allUsers.push_back(user);
+    userDirectory.add(user);
+    wal.registerUser(user->getId(), username, user->getPasswordHash());
+    return user;
+}
+
+// Binary snapshot format. Every section is an array of fixed-size records;
+// objects refer to each other by id, and strings point into one pool at the
+// end of the file. Values are stored in host byte order, so a snapshot is only
+// meant to be reopened on the same kind of machine that wrote it.
+const char SNAPSHOT_MAGIC[4] = { 'M', 'P', 'S', 'N' };
+const uint32_t SNAPSHOT_VERSION = 1;
+const uint32_t SNAPSHOT_NONE = 0xFFFFFFFFu;
+
+struct SnapshotString {
+    uint32_t offset;
+    uint32_t length;
+};
+
+struct SnapshotHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t artistCount;
+    uint32_t songCount;
+    uint32_t playlistCount;
+    uint32_t userCount;
+    uint32_t nextArtistId;
+    uint32_t nextSongId;
+    uint32_t nextPlaylistId;
+    uint32_t nextUserId;
+    uint32_t adminId;
+    uint32_t reserved;
+    uint64_t refCount;
+    uint64_t stringsSize;
+};
+
+struct SnapshotArtist {
+    uint32_t id;
+    SnapshotString name;
+};
+
+struct SnapshotSong {
+    uint32_t id;
+    uint32_t artistId;
+    int32_t releaseYear;
+    SnapshotString title;
+    SnapshotString genre;
+};
+
+// Catalog playlists (allPlaylists) come first, then each user's personal ones
+struct SnapshotPlaylist {
+    uint32_t id;
+    uint32_t creatorId;
+    uint32_t albumArtistId;
+    uint32_t isPublic;
+    uint32_t inCatalog;
+    uint32_t songCount;
+    uint64_t firstSong;
+    SnapshotString name;
+};
+
+struct SnapshotUser {
+    uint32_t id;
+    uint32_t iterations;
+    uint8_t salt[16];
+    uint8_t digest[32];
+    SnapshotString username;
+    uint32_t favoriteSongCount;
+    uint32_t favoritePlaylistCount;
+    uint64_t firstFavorite;
+};
+
+// Section layout: header, artists, songs, playlists, users, refs, strings
+struct SnapshotLayout {
+    uint64_t artists, songs, playlists, users, refs, strings, end;
+
+    static uint64_t align(uint64_t offset) { return (offset + 7) & ~uint64_t(7); }
+
+    explicit SnapshotLayout(const SnapshotHeader& h) {
+        artists = align(sizeof(SnapshotHeader));
+        songs = align(artists + uint64_t(h.artistCount) * sizeof(SnapshotArtist));
+        playlists = align(songs + uint64_t(h.songCount) * sizeof(SnapshotSong));
+        users = align(playlists + uint64_t(h.playlistCount) * sizeof(SnapshotPlaylist));
+        refs = align(users + uint64_t(h.userCount) * sizeof(SnapshotUser));
+        strings = refs + h.refCount * sizeof(uint32_t);
+        end = strings + h.stringsSize;
+    }
+};
+
+// Read-only view of a whole file; memory-mapped where the platform allows it
+class MappedFile {
+private:
+    const char* data = nullptr;
+    size_t length = 0;
+#ifdef _WIN32
+    vector<char> buffer;
+#endif
+
+public:
+    explicit MappedFile(const string& path) {
+#ifdef _WIN32
+        ifstream in(path, ios::binary);
+        if (!in) return;
+        buffer.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+        data = buffer.data();
+        length = buffer.size();
+#else
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) return;
+        struct stat info;
+        if (fstat(fd, &info) == 0 && info.st_size > 0) {
+            void* mapped = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapped != MAP_FAILED) {
+                data = static_cast<const char*>(mapped);
+                length = info.st_size;
+            }
+        }
+        close(fd);
+#endif
+    }
+
+    ~MappedFile() {
+#ifndef _WIN32
+        if (data) munmap(const_cast<char*>(data), length);
+#endif
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char* begin() const { return data; }
+    size_t size() const { return length; }
+};
+
+void initializeSystem() {
+    // Create admin
+    admin = new Admin("admin", "admin123");
+    userDirectory.add(admin);
+
+    // Create some sample data
+    Artist* artist1 = Artist::pool.create("Artist One");
+    Artist* artist2 = Artist::pool.create("Artist Two");
+    allArtists.push_back(artist1);
+    allArtists.push_back(artist2);
+
+    admin->addSong("Song One", artist1, 2020, "Pop");
+    admin->addSong("Song Two", artist1, 2021, "Rock");
+    admin->addSong("Song Three", artist2, 2019, "Jazz");
+    admin->addSong("Song Four", artist2, 2022, "Electronic");
+
+    admin->createAlbum(artist1, "First Album");
+    admin->createAlbum(artist2, "Debut Album");
+
+    // Add songs to albums
+    Playlist* album1 = allPlaylists[0];
+    Playlist* album2 = allPlaylists[1];
+
+    album1->addSong(allSongs[0]);
+    album1->addSong(allSongs[1]);
+    album2->addSong(allSongs[2]);
+    album2->addSong(allSongs[3]);
+}
+
+// Frees every object and empties the global collections and indexes
+void shutdownSystem() {
+    recommender.clear();
+    delete admin;
+    admin = nullptr;
+    for (auto& user : allUsers) delete user;
+
+    // Everything else lives in the slab pools and is torn down in bulk
+    Playlist::pool.clear();
+    Song::pool.clear();
+    Artist::pool.clear();
+    allUsers.clear();
+    allPlaylists.clear();
+    allSongs.clear();
+    allArtists.clear();
+    // A library built or loaded next numbers from scratch, so log records
+    // replayed on top of a snapshot get the ids they were written with
+    Artist::resetIds();
+    Song::resetIds();
+    Playlist::resetIds();
+    User::resetIds();
+
+    catalog = CatalogView();
+    catalogUnindexed = false;
+    userDirectory = UserDirectory();
+    titlePool = StringPool();
+    genrePool = StringPool();
+    namePool = StringPool();
+}
+
+// Writes the whole catalog and all accounts to `path`. The file is written
+// next to the target and renamed over it, so a crash never leaves half a
+// snapshot behind.
+bool saveSnapshot(const string& path) {
+    SnapshotHeader header = {};
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.nextArtistId = Artist::getNextId();
+    header.nextSongId = Song::getNextId();
+    header.nextPlaylistId = Playlist::getNextId();
+    header.nextUserId = User::getNextId();
+    header.adminId = admin ? admin->getId() : SNAPSHOT_NONE;
+
+    string strings;
+    auto addString = [&strings](string_view text) {
+        SnapshotString ref = { static_cast<uint32_t>(strings.size()), static_cast<uint32_t>(text.size()) };
+        strings += text;
+        return ref;
+    };
+    // Genres repeat across most of the catalog, so each is stored once
+    vector<SnapshotString> genres(genrePool.size());
+    for (uint32_t id = 0; id < genrePool.size(); id++) genres[id] = addString(genrePool.view(id));
+
+    vector<SnapshotArtist> artists;
+    unordered_map<const Playlist*, uint32_t> albumArtist;
+    artists.reserve(allArtists.size());
+    for (const auto& artist : allArtists) {
+        artists.push_back({ artist->getId(), addString(artist->getName()) });
+        for (const auto& album : artist->getAlbums()) albumArtist[album] = artist->getId();
+    }
+
+    vector<SnapshotSong> songs;
+    songs.reserve(allSongs.size());
+    for (const auto& song : allSongs) {
+        songs.push_back({ song->getId(), song->getArtist()->getId(), song->getReleaseYear(),
+            addString(song->getTitle()), genres[song->getGenreId()] });
+    }
+
+    vector<User*> accounts;
+    if (admin) accounts.push_back(admin);
+    accounts.insert(accounts.end(), allUsers.begin(), allUsers.end());
+
+    vector<uint32_t> refs;
+    vector<SnapshotPlaylist> playlists;
+    auto addPlaylist = [&](const Playlist* playlist, bool inCatalog) {
+        auto owner = albumArtist.find(playlist);
+        SnapshotPlaylist record = {};
+        record.id = playlist->getId();
+        record.creatorId = playlist->getCreator()->getId();
+        record.albumArtistId = owner == albumArtist.end() ? SNAPSHOT_NONE : owner->second;
+        record.isPublic = playlist->getIsPublic();
+        record.inCatalog = inCatalog;
+        record.songCount = playlist->getSongCount();
+        record.firstSong = refs.size();
+        record.name = addString(playlist->getName());
+        for (const auto& song : playlist->getSongs()) refs.push_back(song->getId());
+        playlists.push_back(record);
+    };
+    for (const auto& playlist : allPlaylists) addPlaylist(playlist, true);
+    for (const auto& user : accounts) {
+        for (const auto& playlist : user->getPersonalPlaylists()) addPlaylist(playlist, false);
+    }
+
+    vector<SnapshotUser> users;
+    users.reserve(accounts.size());
+    for (const auto& user : accounts) {
+        const PasswordHash& hash = user->getPasswordHash();
+        SnapshotUser record = {};
+        record.id = user->getId();
+        record.iterations = hash.getIterations();
+        copy(hash.getSalt().begin(), hash.getSalt().end(), record.salt);
+        copy(hash.getDigest().begin(), hash.getDigest().end(), record.digest);
+        record.username = addString(user->getUsername());
+        record.favoriteSongCount = user->getFavoriteSongs().size();
+        record.favoritePlaylistCount = user->getFavoritePlaylists().size();
+        record.firstFavorite = refs.size();
+        for (const auto& song : user->getFavoriteSongs()) refs.push_back(song->getId());
+        for (const auto& playlist : user->getFavoritePlaylists()) refs.push_back(playlist->getId());
+        users.push_back(record);
+    }
+
+    header.artistCount = artists.size();
+    header.songCount = songs.size();
+    header.playlistCount = playlists.size();
+    header.userCount = users.size();
+    header.refCount = refs.size();
+    header.stringsSize = strings.size();
+
+    string tempPath = path + ".tmp";
+    {
+        ofstream out(tempPath, ios::binary | ios::trunc);
+        if (!out) return false;
+
+        SnapshotLayout layout(header);
+        auto writeAt = [&out](uint64_t offset, const void* data, size_t size) {
+            while (static_cast<uint64_t>(out.tellp()) < offset) out.put('\0');
+            out.write(static_cast<const char*>(data), size);
+        };
+        writeAt(0, &header, sizeof(header));
+        writeAt(layout.artists, artists.data(), artists.size() * sizeof(SnapshotArtist));
+        writeAt(layout.songs, songs.data(), songs.size() * sizeof(SnapshotSong));
+        writeAt(layout.playlists, playlists.data(), playlists.size() * sizeof(SnapshotPlaylist));
+        writeAt(layout.users, users.data(), users.size() * sizeof(SnapshotUser));
+        writeAt(layout.refs, refs.data(), refs.size() * sizeof(uint32_t));
+        writeAt(layout.strings, strings.data(), strings.size());
+        if (!out.flush()) return false;
+    }
+    remove(path.c_str());
+    return rename(tempPath.c_str(), path.c_str()) == 0;
+}
+
+// Rebuilds the catalog and accounts from a snapshot written by saveSnapshot.
+// The file is mapped rather than read, and records are consumed in place, so
+// start-up cost is one pass over the data with no text parsing. The search,
+// term, filter and sort indexes are left for indexCatalog to build on first
+// use, as they cost several times more than the records. Returns false,
+// leaving the system empty, if the file is missing or fails validation.
+bool loadSnapshot(const string& path) {
+    MappedFile file(path);
+    if (file.size() < sizeof(SnapshotHeader)) return false;
+
+    const SnapshotHeader& header = *reinterpret_cast<const SnapshotHeader*>(file.begin());
+    if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != SNAPSHOT_VERSION) {
+        return false;
+    }
+    SnapshotLayout layout(header);
+    if (layout.end > file.size()) return false;
+
+    auto section = [&file](uint64_t offset) { return file.begin() + offset; };
+    const auto* artistRecords = reinterpret_cast<const SnapshotArtist*>(section(layout.artists));
+    const auto* songRecords = reinterpret_cast<const SnapshotSong*>(section(layout.songs));
+    const auto* playlistRecords = reinterpret_cast<const SnapshotPlaylist*>(section(layout.playlists));
+    const auto* userRecords = reinterpret_cast<const SnapshotUser*>(section(layout.users));
+    const auto* refs = reinterpret_cast<const uint32_t*>(section(layout.refs));
+    const char* strings = section(layout.strings);
+
+    bool valid = true;
+    auto text = [&](const SnapshotString& ref) {
+        if (uint64_t(ref.offset) + ref.length > header.stringsSize) {
+            valid = false;
+            return string_view();
+        }
+        return string_view(strings + ref.offset, ref.length);
+    };
+    auto refRange = [&](uint64_t first, uint64_t count) {
+        if (first + count > header.refCount) valid = false;
+        return valid;
+    };
+    auto lookup = [&valid](auto& table, uint32_t id) {
+        if (id >= table.size() || !table[id]) {
+            valid = false;
+            return static_cast<typename decay<decltype(table[0])>::type>(nullptr);
+        }
+        return table[id];
+    };
+
+    vector<Artist*> artistsById(header.nextArtistId, nullptr);
+    vector<Song*> songsById(header.nextSongId, nullptr);
+    vector<Playlist*> playlistsById(header.nextPlaylistId, nullptr);
+    vector<User*> usersById(header.nextUserId, nullptr);
+
+    allArtists.reserve(header.artistCount);
+    for (uint32_t i = 0; i < header.artistCount && valid; i++) {
+        const SnapshotArtist& record = artistRecords[i];
+        if (record.id >= artistsById.size()) {
+            valid = false;
+            break;
+        }
+        Artist* artist = Artist::pool.create(record.id, text(record.name));
+        artistsById[record.id] = artist;
+        allArtists.push_back(artist);
+    }
+
+    allSongs.reserve(header.songCount);
+    for (uint32_t i = 0; i < header.songCount && valid; i++) {
+        const SnapshotSong& record = songRecords[i];
+        Artist* artist = lookup(artistsById, record.artistId);
+        if (!valid || record.id >= songsById.size()) {
+            valid = false;
+            break;
+        }
+        Song* song = Song::pool.create(record.id, text(record.title), artist, record.releaseYear, text(record.genre));
+        songsById[record.id] = song;
+        allSongs.push_back(song);
+        artist->addSong(song);
+    }
+
+    allUsers.reserve(header.userCount);
+    userDirectory.reserve(header.userCount);
+    for (uint32_t i = 0; i < header.userCount && valid; i++) {
+        const SnapshotUser& record = userRecords[i];
+        if (record.id >= usersById.size()) {
+            valid = false;
+            break;
+        }
+        PasswordHash::Salt salt;
+        PasswordHash::Digest digest;
+        copy(record.salt, record.salt + salt.size(), salt.begin());
+        copy(record.digest, record.digest + digest.size(), digest.begin());
+        PasswordHash hash(salt, digest, record.iterations);
+
+        User* user;
+        if (record.id == header.adminId) {
+            admin = new Admin(record.id, text(record.username), hash);
+            user = admin;
+        }
+        else {
+            user = new User(record.id, text(record.username), hash);
+            allUsers.push_back(user);
+        }
+        usersById[record.id] = user;
+        userDirectory.add(user);
+    }
+
+    for (uint32_t i = 0; i < header.playlistCount && valid; i++) {
+        const SnapshotPlaylist& record = playlistRecords[i];
+        User* creator = lookup(usersById, record.creatorId);
+        if (!valid || record.id >= playlistsById.size() || !refRange(record.firstSong, record.songCount)) {
+            valid = false;
+            break;
+        }
+        Playlist* playlist = Playlist::pool.create(record.id, text(record.name), creator, record.isPublic != 0);
+        playlistsById[record.id] = playlist;
+        if (record.inCatalog) allPlaylists.push_back(playlist);
+        else creator->adoptPlaylist(playlist);
+        if (record.albumArtistId != SNAPSHOT_NONE) {
+            Artist* artist = lookup(artistsById, record.albumArtistId);
+            if (artist) artist->addAlbum(playlist);
+        }
+        vector<SongRef> songs;
+        songs.reserve(record.songCount);
+        for (uint32_t j = 0; j < record.songCount && valid; j++) {
+            Song* song = lookup(songsById, refs[record.firstSong + j]);
+            if (song) songs.push_back(song);
+        }
+        playlist->restoreSongs(songs);
+    }
+
+    for (uint32_t i = 0; i < header.userCount && valid; i++) {
+        const SnapshotUser& record = userRecords[i];
+        uint64_t first = record.firstFavorite;
+        if (!refRange(first, uint64_t(record.favoriteSongCount) + record.favoritePlaylistCount)) break;
+        User* user = usersById[record.id];
+        user->reserveFavorites(record.favoriteSongCount, record.favoritePlaylistCount);
+        for (uint32_t j = 0; j < record.favoriteSongCount && valid; j++) {
+            Song* song = lookup(songsById, refs[first + j]);
+            if (song) user->addFavoriteSong(song);
+        }
+        first += record.favoriteSongCount;
+        for (uint32_t j = 0; j < record.favoritePlaylistCount && valid; j++) {
+            Playlist* playlist = lookup(playlistsById, refs[first + j]);
+            if (playlist) user->addFavoritePlaylist(playlist);
+        }
+    }
+
+    if (!valid || !admin) {
+        shutdownSystem();
+        return false;
+    }
+
+    Artist::reserveIds(header.nextArtistId);
+    Song::reserveIds(header.nextSongId);
+    Playlist::reserveIds(header.nextPlaylistId);
+    User::reserveIds(header.nextUserId);
+    catalogUnindexed = true;
+    return true;
+}
+
+void indexCatalog() {
+    if (!catalogUnindexed) return;
+    catalogUnindexed = false;
+    catalog.columns.reserve(allSongs.size());
+    catalog.songSearch.reserve(Song::getNextId());
+    catalog.songTerms.reserve(Song::getNextId());
+    for (const auto& song : allSongs) {
+        catalog.columns.append(song.get());
+        catalog.filters.add(song.get());
+        catalog.songSearch.add(song, { song->getTitle(), song->getArtist()->getName() });
+        catalog.songTerms.add(song, { song->getTitle(), song->getArtist()->getName() });
+    }
+    catalog.orders.rebuild(allSongs);
+    for (const auto& playlist : allPlaylists) catalog.playlistSearch.add(playlist, { playlist->getName() });
+}
+
+// Re-applies the write-ahead log at `path` on top of the state built by
+// loadSnapshot or initializeSystem. Returns the length of the intact prefix
+// that was applied; a torn or inconsistent tail is skipped so that wal.open
+// can cut it off. Records that create an object are checked against the id
+// it would get before anything is applied, so a record that does not fit
+// leaves no trace. `applied` receives the number of records replayed.
+uint64_t replayWriteAheadLog(const string& path, size_t* applied) {
+    struct Cursor {
+        const char* pos;
+        const char* end;
+        bool ok;
+
+        uint64_t varint() {
+            uint64_t value = 0;
+            for (int shift = 0; pos < end && shift < 64; shift += 7) {
+                uint8_t byte = static_cast<uint8_t>(*pos++);
+                value |= uint64_t(byte & 0x7F) << shift;
+                if (!(byte & 0x80)) return value;
+            }
+            ok = false;
+            return 0;
+        }
+
+        uint32_t id() { return static_cast<uint32_t>(varint()); }
+
+        string text() {
+            uint64_t length = varint();
+            if (!ok || length > uint64_t(end - pos)) {
+                ok = false;
+                return string();
+            }
+            string result(pos, length);
+            pos += length;
+            return result;
+        }
+
+        void bytes(uint8_t* out, size_t length) {
+            if (!ok || length > size_t(end - pos)) {
+                ok = false;
+                return;
+            }
+            copy(pos, pos + length, out);
+            pos += length;
+        }
+    };
+
+    if (applied) *applied = 0;
+    MappedFile file(path);
+    if (file.size() == 0) return 0;
+
+    unordered_map<uint32_t, Artist*> artists;
+    unordered_map<uint32_t, Song*> songs;
+    unordered_map<uint32_t, Playlist*> playlists;
+    unordered_map<uint32_t, User*> users;
+    for (const auto& artist : allArtists) artists[artist->getId()] = artist;
+    for (const auto& song : allSongs) songs[song->getId()] = song.get();
+    for (const auto& playlist : allPlaylists) playlists[playlist->getId()] = playlist;
+    vector<User*> accounts(allUsers);
+    accounts.push_back(admin);
+    for (const auto& user : accounts) {
+        users[user->getId()] = user;
+        for (const auto& playlist : user->getPersonalPlaylists()) playlists[playlist->getId()] = playlist;
+    }
+    auto lookup = [](auto& table, uint32_t id) {
+        auto it = table.find(id);
+        return it == table.end() ? nullptr : it->second;
+    };
+
+    const char* pos = file.begin();
+    const char* end = file.begin() + file.size();
+    while (pos < end) {
+        Cursor frame = { pos, end, true };
+        uint64_t length = frame.varint();
+        if (!frame.ok || length == 0 || length + 4 > uint64_t(end - frame.pos)) break;
+        const char* body = frame.pos;
+        uint32_t storedCrc = 0;
+        for (int i = 0; i < 4; i++) storedCrc |= uint32_t(static_cast<uint8_t>(body[length + i])) << (i * 8);
+        if (storedCrc != WriteAheadLog::crc32(body, length)) break;
+
+        Cursor record = { body + 1, body + length, true };
+        bool ok = true;
+        switch (static_cast<uint8_t>(body[0])) {
+        case WriteAheadLog::ADD_ARTIST: {
+            uint32_t id = record.id();
+            string name = record.text();
+            if (!record.ok || id != Artist::getNextId()) { ok = false; break; }
+            admin->createArtist(name);
+            artists[id] = allArtists.back();
+            break;
+        }
+        case WriteAheadLog::REMOVE_ARTIST: {
+            Artist* artist = lookup(artists, record.id());
+            if (!artist) { ok = false; break; }
+            for (const auto& song : artist->getSongs()) songs.erase(song->getId());
+            artists.erase(artist->getId());
+            admin->removeArtist(artist);
+            break;
+        }
+        case WriteAheadLog::ADD_SONG: {
+            uint32_t id = record.id();
+            Artist* artist = lookup(artists, record.id());
+            int year = static_cast<int>(static_cast<uint32_t>(record.varint()));
+            string title = record.text();
+            string genre = record.text();
+            if (!record.ok || !artist || id != Song::getNextId()) { ok = false; break; }
+            admin->addSong(title, artist, year, genre);
+            songs[id] = allSongs.back().get();
+            break;
+        }
+        case WriteAheadLog::REMOVE_SONG: {
+            Song* song = lookup(songs, record.id());
+            if (!song) { ok = false; break; }
+            songs.erase(song->getId());
+            admin->removeSong(song);
+            break;
+        }
+        case WriteAheadLog::CREATE_ALBUM: {
+            uint32_t id = record.id();
+            Artist* artist = lookup(artists, record.id());
+            string name = record.text();
+            if (!record.ok || !artist || id != Playlist::getNextId()) { ok = false; break; }
+            admin->createAlbum(artist, name);
+            playlists[id] = allPlaylists.back();
+            break;
+        }
+        case WriteAheadLog::CREATE_PLAYLIST: {
+            uint32_t id = record.id();
+            User* user = lookup(users, record.id());
+            bool isPublic = record.varint() != 0;
+            string name = record.text();
+            if (!record.ok || !user || id != Playlist::getNextId()) { ok = false; break; }
+            user->createPlaylist(name, isPublic);
+            playlists[id] = user->getPersonalPlaylists().back();
+            break;
+        }
+        case WriteAheadLog::DELETE_PLAYLIST: {
+            User* user = lookup(users, record.id());
+            Playlist* playlist = lookup(playlists, record.id());
+            if (!user || !playlist) { ok = false; break; }
+            playlists.erase(playlist->getId());
+            user->deletePlaylist(playlist);
+            break;
+        }
+        case WriteAheadLog::PLAYLIST_ADD_SONG:
+        case WriteAheadLog::PLAYLIST_REMOVE_SONG: {
+            Playlist* playlist = lookup(playlists, record.id());
+            Song* song = lookup(songs, record.id());
+            if (!playlist || !song) { ok = false; break; }
+            if (body[0] == WriteAheadLog::PLAYLIST_ADD_SONG) playlist->addSong(song);
+            else playlist->removeSong(song);
+            break;
+        }
+        case WriteAheadLog::PLAYLIST_INSERT_SONG: {
+            Playlist* playlist = lookup(playlists, record.id());
+            Song* song = lookup(songs, record.id());
+            uint64_t position = record.varint();
+            if (!playlist || !song || !record.ok) { ok = false; break; }
+            playlist->insertSong(song, static_cast<size_t>(position));
+            break;
+        }
+        case WriteAheadLog::PLAYLIST_MOVE_SONGS: {
+            Playlist* playlist = lookup(playlists, record.id());
+            uint64_t from = record.varint(), count = record.varint(), to = record.varint();
+            if (!playlist || !record.ok || !playlist->moveSongs(from, count, to)) ok = false;
+            break;
+        }
+        case WriteAheadLog::PLAYLIST_SET_SONGS: {
+            Playlist* playlist = lookup(playlists, record.id());
+            uint64_t count = record.varint();
+            if (!playlist || !record.ok || count > uint64_t(record.end - record.pos)) { ok = false; break; }
+            vector<SongRef> contents;
+            contents.reserve(count);
+            for (uint64_t i = 0; i < count && ok; i++) {
+                Song* song = lookup(songs, record.id());
+                if (song) contents.push_back(song);
+                else ok = false;
+            }
+            if (ok && record.ok) playlist->setSongs(contents);
+            break;
+        }
+        case WriteAheadLog::FAVORITE_SONG_ADD:
+        case WriteAheadLog::FAVORITE_SONG_REMOVE: {
+            User* user = lookup(users, record.id());
+            Song* song = lookup(songs, record.id());
+            if (!user || !song) { ok = false; break; }
+            if (body[0] == WriteAheadLog::FAVORITE_SONG_ADD) user->addFavoriteSong(song);
+            else user->removeFavoriteSong(song);
+            break;
+        }
+        case WriteAheadLog::FAVORITE_PLAYLIST_ADD:
+        case WriteAheadLog::FAVORITE_PLAYLIST_REMOVE: {
+            User* user = lookup(users, record.id());
+            Playlist* playlist = lookup(playlists, record.id());
+            if (!user || !playlist) { ok = false; break; }
+            if (body[0] == WriteAheadLog::FAVORITE_PLAYLIST_ADD) user->addFavoritePlaylist(playlist);
+            else user->removeFavoritePlaylist(playlist);
+            break;
+        }
+        case WriteAheadLog::REGISTER_USER: {
+            uint32_t id = record.id();
+            string username = record.text();
+            uint32_t iterations = record.id();
+            PasswordHash::Salt salt;
+            PasswordHash::Digest digest;
+            record.bytes(salt.data(), salt.size());
+            record.bytes(digest.data(), digest.size());
+            if (!record.ok || users.count(id) || userDirectory.contains(username)) { ok = false; break; }
+            User* user = new User(id, username, PasswordHash(salt, digest, iterations));
+            allUsers.push_back(user);
+            userDirectory.add(user);
+            users[id] = user;
+            break;
+        }
+        default:
+            ok = false;
+        }
+        if (!ok || !record.ok) break;
+
+        pos = body + length + 4;
+        if (applied) (*applied)++;
+    }
+    return pos - file.begin();
+}
+
+// Writes a snapshot and empties the log it supersedes
+bool checkpoint() {
+    wal.flush();
+    if (!saveSnapshot(SNAPSHOT_PATH)) return false;
+    wal.truncate();
+    return true;
+}
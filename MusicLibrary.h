@@ -0,0 +1,5626 @@
+// Music library model: songs, artists, playlists, accounts, playback, search
+// indexes, recommendations and persistence. ConsoleApplication16.cpp puts the
+// menus and the session servers on top of it; definitions that are not inline
+// live in MusicLibrary.cpp.
+#pragma once
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <set>
+#include <sstream>
+#include <iterator>
+#include <unordered_map>
+#include <unordered_set>
+#include <queue>
+#include <cmath>
+#include <cstdint>
+#include <cctype>
+#include <array>
+#include <random>
+#include <cstring>
+#include <cstdio>
+#include <chrono>
+#include <memory>
+#include <new>
+#include <string_view>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <functional>
+#include <stdexcept>
+#include <charconv>
+#include <climits>
+#include <condition_variable>
+#include <deque>
+#include <cerrno>
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+// Forward declarations
+class Artist;
+class Playlist;
+class User;
+class Admin;
+class Song;
+struct CatalogView;
+enum class SongOrder;
+
+bool checkpoint();
+
+// Enum for playback modes
+enum class PlaybackMode {
+    SEQUENTIAL,
+    RANDOM,
+    REPEAT
+};
+
+// Typed slab allocator with generation-checked 32-bit handles. Objects live in
+// fixed-size chunks that never move; the low 24 bits of a handle select the
+// slot and the high 8 bits must match the slot's generation, which is bumped
+// whenever the slot is freed, so handles to a destroyed object stop resolving.
+// The chunk directory is allocated at full size up front, so lock-free
+// readers can resolve handles while the writer creates objects.
+template <typename T>
+class SlabPool {
+public:
+    static const uint32_t INDEX_BITS = 24;
+    static const uint32_t INDEX_MASK = (1u << INDEX_BITS) - 1;
+    static const uint32_t CHUNK_SIZE = 1024;
+    static const uint32_t MAX_CHUNKS = (INDEX_MASK + 1) / CHUNK_SIZE;
+
+private:
+    // `storage` must stay the first member so an object pointer is also a slot pointer
+    struct Slot {
+        alignas(T) unsigned char storage[sizeof(T)];
+        uint32_t index = 0;
+        uint8_t generation = 0;
+        bool live = false;
+    };
+
+    unique_ptr<unique_ptr<Slot[]>[]> chunks{ new unique_ptr<Slot[]>[MAX_CHUNKS] };
+    vector<uint32_t> freeSlots;
+    atomic<uint32_t> used{ 0 };
+    size_t liveCount = 0;
+
+    Slot& slotAt(uint32_t index) const { return chunks[index / CHUNK_SIZE][index % CHUNK_SIZE]; }
+    static Slot* slotOf(const T* object) { return reinterpret_cast<Slot*>(const_cast<T*>(object)); }
+
+public:
+    SlabPool() {}
+    SlabPool(const SlabPool&) = delete;
+    SlabPool& operator=(const SlabPool&) = delete;
+    ~SlabPool() { clear(); }
+
+    size_t size() const { return liveCount; }
+
+    template <typename... Args>
+    T* create(Args&&... args) {
+        uint32_t index;
+        if (!freeSlots.empty()) {
+            index = freeSlots.back();
+            freeSlots.pop_back();
+        }
+        else {
+            index = used.load(memory_order_relaxed);
+            if (index > INDEX_MASK) throw bad_alloc();
+            if (index % CHUNK_SIZE == 0) chunks[index / CHUNK_SIZE].reset(new Slot[CHUNK_SIZE]);
+            slotAt(index).index = index;
+            slotAt(index).generation = 1;
+            used.store(index + 1, memory_order_release);
+        }
+        Slot& slot = slotAt(index);
+        T* object;
+        try {
+            object = new (slot.storage) T(std::forward<Args>(args)...);
+        }
+        catch (...) {
+            slot.live = false;
+            freeSlots.push_back(index);
+            throw;
+        }
+        slot.live = true;
+        liveCount++;
+        return object;
+    }
+
+    void destroy(T* object) {
+        Slot* slot = slotOf(object);
+        object->~T();
+        slot->live = false;
+        slot->generation = slot->generation == 0xFF ? 1 : slot->generation + 1;
+        freeSlots.push_back(slot->index);
+        liveCount--;
+    }
+
+    // Returns nullptr for null, out-of-range and stale handles
+    T* get(uint32_t handle) const {
+        uint32_t index = handle & INDEX_MASK;
+        if (index >= used.load(memory_order_acquire)) return nullptr;
+        Slot& slot = slotAt(index);
+        if (!slot.live || slot.generation != (handle >> INDEX_BITS)) return nullptr;
+        return reinterpret_cast<T*>(slot.storage);
+    }
+
+    uint32_t handleOf(const T* object) const {
+        const Slot* slot = slotOf(object);
+        return (uint32_t(slot->generation) << INDEX_BITS) | slot->index;
+    }
+
+    // Bulk teardown: destroys every live object and releases the chunks at once
+    void clear() {
+        uint32_t count = used.load(memory_order_relaxed);
+        for (uint32_t i = 0; i < count; i++) {
+            Slot& slot = slotAt(i);
+            if (slot.live) reinterpret_cast<T*>(slot.storage)->~T();
+        }
+        for (uint32_t c = 0; c * CHUNK_SIZE < count; c++) chunks[c].reset();
+        freeSlots.clear();
+        used.store(0, memory_order_relaxed);
+        liveCount = 0;
+    }
+};
+
+// Reference to an object in T::pool. Generations start at 1, so the all-zero
+// handle is the null reference.
+template <typename T>
+class Handle {
+private:
+    uint32_t raw = 0;
+
+public:
+    Handle() {}
+    explicit Handle(uint32_t raw) : raw(raw) {}
+    Handle(const T* object) : raw(object ? T::pool.handleOf(object) : 0) {}
+
+    T* get() const { return T::pool.get(raw); }
+    T* operator->() const { return get(); }
+    T& operator*() const { return *get(); }
+    explicit operator bool() const { return get() != nullptr; }
+    uint32_t value() const { return raw; }
+
+    bool operator==(const Handle& other) const { return raw == other.raw; }
+    bool operator!=(const Handle& other) const { return raw != other.raw; }
+    bool operator<(const Handle& other) const { return raw < other.raw; }
+};
+
+typedef Handle<Song> SongRef;
+
+// Items kept in id order (the catalog's songs). Removing one leaves a null
+// tombstone found by binary search, instead of shifting everything after
+// it; tombstones are swept out once they make up half the list, so removal
+// is O(log n) amortized. Iteration skips them. Positional access walks past
+// tombstones, so it is meant for small lists and tests; look items up by id
+// with find().
+template <typename T>
+class IdOrderedList {
+private:
+    vector<T> items;            // Null where an item was removed
+    vector<uint32_t> ids;       // Id of every entry, removed ones included
+    size_t removedCount = 0;
+
+    void sweep() {
+        size_t out = 0;
+        for (size_t i = 0; i < items.size(); i++) {
+            if (items[i] == T()) continue;
+            items[out] = items[i];
+            ids[out] = ids[i];
+            out++;
+        }
+        items.resize(out);
+        ids.resize(out);
+        removedCount = 0;
+    }
+
+    // Tombstones at the end are dropped at once, so back() is an item
+    void removeAt(size_t i) {
+        items[i] = T();
+        removedCount++;
+        while (!items.empty() && items.back() == T()) {
+            items.pop_back();
+            ids.pop_back();
+            removedCount--;
+        }
+        if (removedCount * 2 > items.size()) sweep();
+    }
+
+public:
+    class const_iterator {
+    private:
+        const T* pos;
+        const T* end;
+
+        void skipRemoved() {
+            while (pos != end && *pos == T()) ++pos;
+        }
+
+    public:
+        typedef forward_iterator_tag iterator_category;
+        typedef T value_type;
+        typedef ptrdiff_t difference_type;
+        typedef const T* pointer;
+        typedef const T& reference;
+
+        const_iterator(const T* pos, const T* end) : pos(pos), end(end) { skipRemoved(); }
+
+        const T& operator*() const { return *pos; }
+        const T* operator->() const { return pos; }
+        const_iterator& operator++() {
+            ++pos;
+            skipRemoved();
+            return *this;
+        }
+        const_iterator operator++(int) {
+            const_iterator before = *this;
+            ++*this;
+            return before;
+        }
+        bool operator==(const const_iterator& other) const { return pos == other.pos; }
+        bool operator!=(const const_iterator& other) const { return pos != other.pos; }
+    };
+
+    const_iterator begin() const { return const_iterator(items.data(), items.data() + items.size()); }
+    const_iterator end() const { return const_iterator(items.data() + items.size(), items.data() + items.size()); }
+    size_t size() const { return items.size() - removedCount; }
+    bool empty() const { return size() == 0; }
+    const T& back() const { return items.back(); }
+
+    const T& operator[](size_t position) const {
+        if (removedCount == 0) return items[position];
+        const_iterator it = begin();
+        while (position-- > 0) ++it;
+        return *it;
+    }
+
+    void reserve(size_t count) {
+        items.reserve(count);
+        ids.reserve(count);
+    }
+
+    // `item` must have a higher id than every item already in the list
+    void push_back(const T& item) {
+        items.push_back(item);
+        ids.push_back(item->getId());
+    }
+
+    void clear() {
+        vector<T>().swap(items);
+        vector<uint32_t>().swap(ids);
+        removedCount = 0;
+    }
+
+    // The item with id `id`, or null
+    T find(uint32_t id) const {
+        size_t i = lower_bound(ids.begin(), ids.end(), id) - ids.begin();
+        return i < ids.size() && ids[i] == id ? items[i] : T();
+    }
+
+    // The first item with an id above `id`
+    const_iterator after(uint32_t id) const {
+        size_t i = upper_bound(ids.begin(), ids.end(), id) - ids.begin();
+        return const_iterator(items.data() + i, items.data() + items.size());
+    }
+
+    bool erase(uint32_t id) {
+        size_t i = lower_bound(ids.begin(), ids.end(), id) - ids.begin();
+        if (i == ids.size() || ids[i] != id || items[i] == T()) return false;
+        removeAt(i);
+        return true;
+    }
+};
+
+// Global collections
+extern IdOrderedList<SongRef> allSongs;
+extern vector<Playlist*> allPlaylists;
+extern vector<Artist*> allArtists;
+extern vector<User*> allUsers;
+extern Admin* admin;
+
+// Utility functions
+void trim(string& str);
+vector<string> split(const string& s, char delimiter);
+
+// Latency histogram with log-linear buckets: values below 2^SUB_BITS are
+// exact, and every power of two above that is split into 2^SUB_BITS buckets,
+// so a reported percentile is within about 3% of the true value
+class LatencyHistogram {
+public:
+    static const int SUB_BITS = 5;
+    static const uint64_t SUB_BUCKETS = uint64_t(1) << SUB_BITS;
+    static const size_t BUCKETS = 64 * SUB_BUCKETS;
+
+private:
+    array<uint64_t, BUCKETS> counts{};
+    uint64_t total = 0;
+    uint64_t largest = 0;
+
+public:
+    static size_t bucketOf(uint64_t value) {
+        if (value < SUB_BUCKETS) return static_cast<size_t>(value);
+#if defined(__GNUC__) || defined(__clang__)
+        int msb = 63 - __builtin_clzll(value);
+#else
+        int msb = 0;
+        for (uint64_t v = value; v > 1; v >>= 1) msb++;
+#endif
+        int shift = msb - SUB_BITS;
+        return static_cast<size_t>((shift + 1) * SUB_BUCKETS + ((value >> shift) - SUB_BUCKETS));
+    }
+
+    // Largest value that falls in `bucket`
+    static uint64_t highestIn(size_t bucket) {
+        if (bucket < SUB_BUCKETS) return bucket;
+        int shift = static_cast<int>(bucket / SUB_BUCKETS) - 1;
+        uint64_t low = (bucket % SUB_BUCKETS + SUB_BUCKETS) << shift;
+        return low + (uint64_t(1) << shift) - 1;
+    }
+
+    void record(uint64_t value) {
+        counts[bucketOf(value)]++;
+        total++;
+        largest = max(largest, value);
+    }
+
+    // Adds `count` values counted elsewhere in `bucket`
+    void add(size_t bucket, uint64_t count) {
+        counts[bucket] += count;
+        total += count;
+        if (count > 0) largest = max(largest, highestIn(bucket));
+    }
+
+    void merge(const LatencyHistogram& other) {
+        for (size_t i = 0; i < counts.size(); i++) counts[i] += other.counts[i];
+        total += other.total;
+        largest = max(largest, other.largest);
+    }
+
+    uint64_t count() const { return total; }
+    uint64_t maximum() const { return largest; }
+
+    // Value at or below which `fraction` of the recorded values fall
+    uint64_t percentile(double fraction) const {
+        if (total == 0) return 0;
+        uint64_t rank = max<uint64_t>(1, static_cast<uint64_t>(fraction * total + 0.5));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < counts.size(); i++) {
+            seen += counts[i];
+            if (seen >= rank) return min(highestIn(i), largest);
+        }
+        return largest;
+    }
+};
+
+
+// Built-in instrumentation. TIME_SCOPE(NAME) times the rest of the enclosing
+// block into the NAME latency histogram and COUNT_METRIC(NAME, n) adds to a
+// counter. Building with MUSIC_METRICS=0 turns both into nothing.
+#ifndef MUSIC_METRICS
+#define MUSIC_METRICS 1
+#endif
+
+#if MUSIC_METRICS
+enum class MetricTimer : size_t {
+    SEARCH_SONGS,
+    SEARCH_PLAYLISTS,
+    RANK_SONGS,
+    BROWSE_FILTER,
+    BROWSE_SORT,
+    REMOVE_SONG,
+    REMOVE_ARTIST,
+    AUTHENTICATE,
+    PLAYBACK,
+    COUNT
+};
+
+enum class MetricCounter : size_t {
+    SEARCH_RESULTS,
+    FAILED_LOGINS,
+    SONGS_REMOVED,
+    PLAYBACK_ENDS,
+    COUNT
+};
+
+// Each thread records into its own shard of atomics, which only that thread
+// writes, so recording is a few uncontended relaxed stores; an export sums
+// the shards. A shard is handed on to the next new thread when its thread
+// exits, so the totals survive. Latencies are in nanoseconds in
+// LatencyHistogram buckets; a shard takes about 150 KB.
+class Metrics {
+public:
+    static const size_t TIMERS = static_cast<size_t>(MetricTimer::COUNT);
+    static const size_t COUNTERS = static_cast<size_t>(MetricCounter::COUNT);
+
+    struct Snapshot {
+        array<LatencyHistogram, TIMERS> latencies;
+        array<uint64_t, TIMERS> totalNanos{};
+        array<uint64_t, COUNTERS> counters{};
+    };
+
+private:
+    struct Shard {
+        array<array<atomic<uint64_t>, LatencyHistogram::BUCKETS>, TIMERS> buckets{};
+        array<atomic<uint64_t>, TIMERS> totalNanos{};
+        array<atomic<uint64_t>, COUNTERS> counters{};
+    };
+
+    struct Owner {
+        Shard* shard = nullptr;
+        Metrics* metrics = nullptr;
+        ~Owner() {
+            if (!shard) return;
+            lock_guard<mutex> lock(metrics->registry);
+            metrics->spare.push_back(shard);
+        }
+    };
+
+    mutable mutex registry;
+    vector<unique_ptr<Shard>> shards;
+    vector<Shard*> spare;
+
+    static void bump(atomic<uint64_t>& value, uint64_t delta) {
+        value.store(value.load(memory_order_relaxed) + delta, memory_order_relaxed);
+    }
+
+    Shard& local() {
+        thread_local Owner owner;
+        if (!owner.shard) {
+            lock_guard<mutex> lock(registry);
+            if (spare.empty()) {
+                shards.push_back(make_unique<Shard>());
+                spare.push_back(shards.back().get());
+            }
+            owner.shard = spare.back();
+            owner.metrics = this;
+            spare.pop_back();
+        }
+        return *owner.shard;
+    }
+
+public:
+    static const char* nameOf(MetricTimer timer);
+    static const char* nameOf(MetricCounter counter);
+
+    void record(MetricTimer timer, uint64_t nanos) {
+        Shard& shard = local();
+        size_t index = static_cast<size_t>(timer);
+        bump(shard.buckets[index][LatencyHistogram::bucketOf(nanos)], 1);
+        bump(shard.totalNanos[index], nanos);
+    }
+
+    void count(MetricCounter counter, uint64_t delta) {
+        bump(local().counters[static_cast<size_t>(counter)], delta);
+    }
+
+    Snapshot snapshot() const;
+
+    // Prometheus text exposition (summaries with quantiles, and counters) or JSON
+    string prometheusText() const;
+    string json() const;
+
+    // Writes JSON if `path` ends in .json and Prometheus text otherwise
+    bool writeFile(const string& path) const;
+};
+
+extern Metrics metrics;
+
+class ScopedTimer {
+private:
+    MetricTimer timer;
+    chrono::steady_clock::time_point start;
+
+public:
+    explicit ScopedTimer(MetricTimer timer) : timer(timer), start(chrono::steady_clock::now()) {}
+    ScopedTimer(const ScopedTimer&) = delete;
+    ScopedTimer& operator=(const ScopedTimer&) = delete;
+
+    ~ScopedTimer() {
+        auto elapsed = chrono::steady_clock::now() - start;
+        metrics.record(timer, static_cast<uint64_t>(chrono::duration_cast<chrono::nanoseconds>(elapsed).count()));
+    }
+};
+
+#define METRICS_JOIN_(a, b) a##b
+#define METRICS_JOIN(a, b) METRICS_JOIN_(a, b)
+#define TIME_SCOPE(name) ScopedTimer METRICS_JOIN(scopedTimer, __LINE__)(MetricTimer::name)
+#define COUNT_METRIC(name, delta) metrics.count(MetricCounter::name, (delta))
+#else
+#define TIME_SCOPE(name) ((void)0)
+#define COUNT_METRIC(name, delta) ((void)0)
+#endif
+
+// Copy-on-write access to data that published catalog views may share:
+// clones the object first unless this is the only reference. Views are only
+// released by the writer, so the count cannot drop under us.
+template <typename T>
+T& writable(shared_ptr<T>& shared) {
+    if (shared.use_count() > 1) {
+        shared = make_shared<T>(*shared);
+    }
+    return *shared;
+}
+
+// Drops from the sorted ids in `list` the ids of the sorted (key, id) pairs
+// in [first, last), in one merge pass that starts at the first of them;
+// returns the new end of the list
+template <typename Hit>
+vector<uint32_t>::iterator removeSorted(vector<uint32_t>& list, Hit first, Hit last) {
+    auto out = lower_bound(list.begin(), list.end(), first->second);
+    for (auto in = out; in != list.end(); ++in) {
+        while (first != last && first->second < *in) ++first;
+        if (first == last) return move(in, list.end(), out);
+        if (first->second != *in) *out++ = *in;
+    }
+    return out;
+}
+
+// Random-access sequence kept in fixed-size chunks that are shared
+// copy-on-write. Copying one for a catalog view copies the chunk pointers;
+// later writes to the original clone only the chunks they touch.
+template <typename T>
+class ChunkedVector {
+private:
+    typedef vector<T> Chunk;
+    static const size_t CHUNK_BITS = 12;
+    static const size_t CHUNK_SIZE = size_t(1) << CHUNK_BITS;
+
+    vector<shared_ptr<Chunk>> chunks;
+    size_t count = 0;
+
+public:
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    void reserve(size_t n) { chunks.reserve((n + CHUNK_SIZE - 1) / CHUNK_SIZE); }
+
+    const T& operator[](size_t i) const { return (*chunks[i >> CHUNK_BITS])[i & (CHUNK_SIZE - 1)]; }
+
+    // Entry i and how many entries follow it contiguously, for tight scans
+    const T* run(size_t i, size_t& length) const {
+        const Chunk& chunk = *chunks[i >> CHUNK_BITS];
+        length = chunk.size() - (i & (CHUNK_SIZE - 1));
+        return chunk.data() + (i & (CHUNK_SIZE - 1));
+    }
+
+    void set(size_t i, const T& value) { modify(i) = value; }
+
+    // Mutable access; clones the chunk first if a view shares it
+    T& modify(size_t i) { return writable(chunks[i >> CHUNK_BITS])[i & (CHUNK_SIZE - 1)]; }
+
+    void push_back(const T& value) {
+        if (count % CHUNK_SIZE == 0) {
+            chunks.push_back(make_shared<Chunk>());
+            chunks.back()->reserve(CHUNK_SIZE);
+        }
+        writable(chunks.back()).push_back(value);
+        count++;
+    }
+
+    // Grows with copies of `value` or drops entries from the end
+    void resize(size_t n, const T& value = T()) {
+        while (count < n) push_back(value);
+        if (n < count) {
+            chunks.resize((n + CHUNK_SIZE - 1) / CHUNK_SIZE);
+            if (n % CHUNK_SIZE != 0) writable(chunks.back()).resize(n % CHUNK_SIZE);
+            count = n;
+        }
+    }
+};
+
+// Hash set of 32-bit ids: open addressing with linear probing and
+// backward-shift deletion, kept at most half full. Sits beside the ordered
+// vectors so duplicate checks do not scan them.
+class IdSet {
+private:
+    static constexpr uint32_t EMPTY = UINT32_MAX;
+
+    vector<uint32_t> slots;
+    size_t count = 0;
+
+    size_t slotOf(uint32_t id) const {
+        return (id * 0x9E3779B1u) & (slots.size() - 1);
+    }
+
+    void rehash(size_t capacity) {
+        vector<uint32_t> old(capacity, EMPTY);
+        old.swap(slots);
+        for (uint32_t id : old) {
+            if (id == EMPTY) continue;
+            size_t slot = slotOf(id);
+            while (slots[slot] != EMPTY) slot = (slot + 1) & (slots.size() - 1);
+            slots[slot] = id;
+        }
+    }
+
+public:
+    size_t size() const { return count; }
+
+    void reserve(size_t n) {
+        size_t capacity = 8;
+        while (capacity < n * 2) capacity *= 2;
+        if (capacity > slots.size()) rehash(capacity);
+    }
+
+    bool contains(uint32_t id) const {
+        if (slots.empty()) return false;
+        for (size_t slot = slotOf(id); slots[slot] != EMPTY; slot = (slot + 1) & (slots.size() - 1)) {
+            if (slots[slot] == id) return true;
+        }
+        return false;
+    }
+
+    // Returns false if the id was already present
+    bool insert(uint32_t id) {
+        if ((count + 1) * 2 > slots.size()) reserve(count + 1);
+        size_t slot = slotOf(id);
+        for (; slots[slot] != EMPTY; slot = (slot + 1) & (slots.size() - 1)) {
+            if (slots[slot] == id) return false;
+        }
+        slots[slot] = id;
+        count++;
+        return true;
+    }
+
+    // Returns false if the id was not present
+    bool erase(uint32_t id) {
+        if (slots.empty()) return false;
+        size_t mask = slots.size() - 1;
+        size_t slot = slotOf(id);
+        while (slots[slot] != id) {
+            if (slots[slot] == EMPTY) return false;
+            slot = (slot + 1) & mask;
+        }
+        // Pull later entries of the probe run back into the hole
+        size_t hole = slot;
+        for (size_t next = (hole + 1) & mask; slots[next] != EMPTY; next = (next + 1) & mask) {
+            size_t home = slotOf(slots[next]);
+            if (((next - home) & mask) >= ((next - hole) & mask)) {
+                slots[hole] = slots[next];
+                hole = next;
+            }
+        }
+        slots[hole] = EMPTY;
+        count--;
+        return true;
+    }
+
+    void clear() {
+        fill(slots.begin(), slots.end(), EMPTY);
+        count = 0;
+    }
+};
+
+// Hash map from 32-bit ids to their positions in an unordered vector, laid
+// out like IdSet. Lets a swap-with-last removal find its element without a
+// scan.
+class IdPositions {
+private:
+    static constexpr uint32_t EMPTY = UINT32_MAX;
+
+    struct Slot {
+        uint32_t id;
+        uint32_t position;
+    };
+
+    vector<Slot> slots;
+    size_t count = 0;
+
+    size_t slotOf(uint32_t id) const {
+        return (id * 0x9E3779B1u) & (slots.size() - 1);
+    }
+
+    size_t find(uint32_t id) const {
+        if (slots.empty()) return SIZE_MAX;
+        for (size_t slot = slotOf(id); slots[slot].id != EMPTY; slot = (slot + 1) & (slots.size() - 1)) {
+            if (slots[slot].id == id) return slot;
+        }
+        return SIZE_MAX;
+    }
+
+    void rehash(size_t capacity) {
+        vector<Slot> old(capacity, Slot{ EMPTY, 0 });
+        old.swap(slots);
+        for (const Slot& entry : old) {
+            if (entry.id == EMPTY) continue;
+            size_t slot = slotOf(entry.id);
+            while (slots[slot].id != EMPTY) slot = (slot + 1) & (slots.size() - 1);
+            slots[slot] = entry;
+        }
+    }
+
+public:
+    size_t size() const { return count; }
+
+    void reserve(size_t n) {
+        size_t capacity = 8;
+        while (capacity < n * 2) capacity *= 2;
+        if (capacity > slots.size()) rehash(capacity);
+    }
+
+    bool contains(uint32_t id) const { return find(id) != SIZE_MAX; }
+
+    // The id's position, or SIZE_MAX
+    size_t positionOf(uint32_t id) const {
+        size_t slot = find(id);
+        return slot == SIZE_MAX ? SIZE_MAX : slots[slot].position;
+    }
+
+    // Adds the id or moves it
+    void set(uint32_t id, size_t position) {
+        if ((count + 1) * 2 > slots.size()) reserve(count + 1);
+        size_t slot = slotOf(id);
+        for (; slots[slot].id != EMPTY; slot = (slot + 1) & (slots.size() - 1)) {
+            if (slots[slot].id == id) {
+                slots[slot].position = static_cast<uint32_t>(position);
+                return;
+            }
+        }
+        slots[slot] = Slot{ id, static_cast<uint32_t>(position) };
+        count++;
+    }
+
+    // Returns false if the id was not present
+    bool erase(uint32_t id) {
+        size_t hole = find(id);
+        if (hole == SIZE_MAX) return false;
+        size_t mask = slots.size() - 1;
+        for (size_t next = (hole + 1) & mask; slots[next].id != EMPTY; next = (next + 1) & mask) {
+            size_t home = slotOf(slots[next].id);
+            if (((next - home) & mask) >= ((next - hole) & mask)) {
+                slots[hole] = slots[next];
+                hole = next;
+            }
+        }
+        slots[hole].id = EMPTY;
+        count--;
+        return true;
+    }
+};
+
+// Compressed set of 32-bit ids in the style of a roaring bitmap: ids are
+// grouped by their high 16 bits, and each group keeps its low halves in a
+// sorted array while it holds at most ARRAY_LIMIT of them, or in a 64 Kbit
+// bitset once it is denser. Intersections, unions and differences work a
+// group at a time, so sparse sets cost little and dense ones a word at a
+// time. Groups are shared copy-on-write, so copying a bitmap for a catalog
+// view copies pointers.
+class IdBitmap {
+private:
+    static const size_t ARRAY_LIMIT = 4096;
+    static const size_t WORDS = 1024;
+
+    struct Container {
+        vector<uint16_t> values;    // Sorted, while the group is sparse
+        vector<uint64_t> bits;      // WORDS words, once it is dense
+        uint32_t count = 0;
+
+        bool dense() const { return !bits.empty(); }
+
+        bool contains(uint16_t low) const {
+            if (dense()) return (bits[low >> 6] >> (low & 63)) & 1;
+            return binary_search(values.begin(), values.end(), low);
+        }
+
+        void toBits() {
+            bits.assign(WORDS, 0);
+            for (uint16_t low : values) bits[low >> 6] |= uint64_t(1) << (low & 63);
+            vector<uint16_t>().swap(values);
+        }
+
+        // Switches to whichever form suits the current count
+        void settle() {
+            if (dense() && count <= ARRAY_LIMIT) {
+                values.reserve(count);
+                forEach([this](uint16_t low) { values.push_back(low); });
+                vector<uint64_t>().swap(bits);
+            }
+            else if (!dense() && count > ARRAY_LIMIT) {
+                toBits();
+            }
+        }
+
+        template <typename Visit>
+        void forEach(Visit visit) const {
+            if (!dense()) {
+                for (uint16_t low : values) visit(low);
+                return;
+            }
+            for (size_t w = 0; w < WORDS; w++) {
+                for (uint64_t word = bits[w]; word != 0; word &= word - 1) {
+                    visit(static_cast<uint16_t>(w * 64 + lowestBit(word)));
+                }
+            }
+        }
+    };
+
+    enum class Op { AND, OR, AND_NOT };
+
+    vector<uint16_t> keys;                      // High halves, ascending
+    vector<shared_ptr<Container>> containers;   // Never empty
+
+    static int lowestBit(uint64_t word) {
+#if defined(__GNUC__) || defined(__clang__)
+        return __builtin_ctzll(word);
+#else
+        int bit = 0;
+        while (!(word & 1)) {
+            word >>= 1;
+            bit++;
+        }
+        return bit;
+#endif
+    }
+
+    static uint32_t popCount(uint64_t word) {
+#if defined(__GNUC__) || defined(__clang__)
+        return static_cast<uint32_t>(__builtin_popcountll(word));
+#else
+        uint32_t bits = 0;
+        for (; word != 0; word &= word - 1) bits++;
+        return bits;
+#endif
+    }
+
+    // One group of a combination; null when the result is empty
+    static shared_ptr<Container> combine(const Container& a, const Container& b, Op op) {
+        auto result = make_shared<Container>();
+        if (!a.dense() && !b.dense()) {
+            auto out = back_inserter(result->values);
+            if (op == Op::AND) set_intersection(a.values.begin(), a.values.end(), b.values.begin(), b.values.end(), out);
+            else if (op == Op::OR) set_union(a.values.begin(), a.values.end(), b.values.begin(), b.values.end(), out);
+            else set_difference(a.values.begin(), a.values.end(), b.values.begin(), b.values.end(), out);
+            result->count = static_cast<uint32_t>(result->values.size());
+        }
+        else if (op != Op::OR && !a.dense()) {
+            // Probe the sparse side against the dense one
+            for (uint16_t low : a.values) {
+                if (b.contains(low) == (op == Op::AND)) result->values.push_back(low);
+            }
+            result->count = static_cast<uint32_t>(result->values.size());
+        }
+        else if (op == Op::AND && !b.dense()) {
+            return combine(b, a, op);
+        }
+        else {
+            Container left = a, right = b;
+            if (!left.dense()) left.toBits();
+            if (!right.dense()) right.toBits();
+            result->bits.resize(WORDS);
+            for (size_t w = 0; w < WORDS; w++) {
+                uint64_t word = op == Op::AND ? left.bits[w] & right.bits[w]
+                    : op == Op::OR ? left.bits[w] | right.bits[w] : left.bits[w] & ~right.bits[w];
+                result->bits[w] = word;
+                result->count += popCount(word);
+            }
+        }
+        if (result->count == 0) return nullptr;
+        result->settle();
+        return result;
+    }
+
+    static IdBitmap combine(const IdBitmap& a, const IdBitmap& b, Op op) {
+        IdBitmap result;
+        size_t i = 0, j = 0;
+        while (i < a.keys.size() || j < b.keys.size()) {
+            bool inA = i < a.keys.size() && (j == b.keys.size() || a.keys[i] <= b.keys[j]);
+            bool inB = j < b.keys.size() && (i == a.keys.size() || b.keys[j] <= a.keys[i]);
+            uint16_t key = inA ? a.keys[i] : b.keys[j];
+            shared_ptr<Container> group;
+            if (inA && inB) group = combine(*a.containers[i], *b.containers[j], op);
+            else if (inA && op != Op::AND) group = a.containers[i];
+            else if (inB && op == Op::OR) group = b.containers[j];
+            if (group) {
+                result.keys.push_back(key);
+                result.containers.push_back(move(group));
+            }
+            i += inA;
+            j += inB;
+        }
+        return result;
+    }
+
+public:
+    bool empty() const { return keys.empty(); }
+
+    size_t size() const {
+        size_t total = 0;
+        for (const auto& container : containers) total += container->count;
+        return total;
+    }
+
+    bool contains(uint32_t id) const {
+        auto it = lower_bound(keys.begin(), keys.end(), uint16_t(id >> 16));
+        return it != keys.end() && *it == (id >> 16) && containers[it - keys.begin()]->contains(uint16_t(id));
+    }
+
+    void add(uint32_t id) {
+        uint16_t key = uint16_t(id >> 16), low = uint16_t(id);
+        auto it = lower_bound(keys.begin(), keys.end(), key);
+        size_t index = it - keys.begin();
+        if (it == keys.end() || *it != key) {
+            keys.insert(it, key);
+            containers.insert(containers.begin() + index, make_shared<Container>());
+        }
+        Container& group = writable(containers[index]);
+        if (group.dense()) {
+            uint64_t& word = group.bits[low >> 6];
+            uint64_t bit = uint64_t(1) << (low & 63);
+            if (word & bit) return;
+            word |= bit;
+        }
+        else {
+            auto at = lower_bound(group.values.begin(), group.values.end(), low);
+            if (at != group.values.end() && *at == low) return;
+            group.values.insert(at, low);
+        }
+        group.count++;
+        group.settle();
+    }
+
+    void remove(uint32_t id) {
+        uint16_t key = uint16_t(id >> 16), low = uint16_t(id);
+        auto it = lower_bound(keys.begin(), keys.end(), key);
+        if (it == keys.end() || *it != key) return;
+        size_t index = it - keys.begin();
+        if (!containers[index]->contains(low)) return;
+        Container& group = writable(containers[index]);
+        if (group.dense()) group.bits[low >> 6] &= ~(uint64_t(1) << (low & 63));
+        else group.values.erase(lower_bound(group.values.begin(), group.values.end(), low));
+        if (--group.count == 0) {
+            keys.erase(it);
+            containers.erase(containers.begin() + index);
+        }
+        else {
+            group.settle();
+        }
+    }
+
+    // Ids in ascending order
+    template <typename Visit>
+    void forEach(Visit visit) const {
+        for (size_t i = 0; i < keys.size(); i++) {
+            uint32_t high = uint32_t(keys[i]) << 16;
+            containers[i]->forEach([&](uint16_t low) { visit(high | low); });
+        }
+    }
+
+    static IdBitmap intersect(const IdBitmap& a, const IdBitmap& b) { return combine(a, b, Op::AND); }
+    static IdBitmap unite(const IdBitmap& a, const IdBitmap& b) { return combine(a, b, Op::OR); }
+    static IdBitmap subtract(const IdBitmap& a, const IdBitmap& b) { return combine(a, b, Op::AND_NOT); }
+
+    // From ids in ascending order
+    static IdBitmap fromSorted(const vector<uint32_t>& ids) {
+        IdBitmap result;
+        for (size_t begin = 0; begin < ids.size();) {
+            uint16_t key = uint16_t(ids[begin] >> 16);
+            auto group = make_shared<Container>();
+            size_t end = begin;
+            for (; end < ids.size() && (ids[end] >> 16) == key; end++) group->values.push_back(uint16_t(ids[end]));
+            group->count = static_cast<uint32_t>(end - begin);
+            group->settle();
+            result.keys.push_back(key);
+            result.containers.push_back(move(group));
+            begin = end;
+        }
+        return result;
+    }
+
+    // From a flat bitset where bit i of word i / 64 stands for id i
+    static IdBitmap fromBits(const vector<uint64_t>& words) {
+        IdBitmap result;
+        for (size_t first = 0; first < words.size(); first += WORDS) {
+            size_t last = min(words.size(), first + WORDS);
+            uint32_t count = 0;
+            for (size_t w = first; w < last; w++) count += popCount(words[w]);
+            if (count == 0) continue;
+            auto group = make_shared<Container>();
+            group->bits.assign(WORDS, 0);
+            copy(words.begin() + first, words.begin() + last, group->bits.begin());
+            group->count = count;
+            group->settle();
+            result.keys.push_back(uint16_t(first / WORDS));
+            result.containers.push_back(move(group));
+        }
+        return result;
+    }
+
+    // Union of many bitmaps in one pass per group: groups whose parts add up
+    // to few ids are merged as arrays, the rest are OR-ed into a bitset
+    static IdBitmap uniteAll(const vector<const IdBitmap*>& bitmaps) {
+        if (bitmaps.empty()) return IdBitmap();
+        if (bitmaps.size() == 1) return *bitmaps[0];
+        map<uint16_t, vector<shared_ptr<Container>>> parts;
+        for (const IdBitmap* bitmap : bitmaps) {
+            for (size_t i = 0; i < bitmap->keys.size(); i++) parts[bitmap->keys[i]].push_back(bitmap->containers[i]);
+        }
+        IdBitmap result;
+        for (const auto& entry : parts) {
+            const vector<shared_ptr<Container>>& group = entry.second;
+            shared_ptr<Container> merged;
+            if (group.size() == 1) {
+                merged = group[0];
+            }
+            else {
+                merged = make_shared<Container>();
+                size_t total = 0;
+                for (const auto& part : group) total += part->count;
+                if (total <= ARRAY_LIMIT) {
+                    for (const auto& part : group) {
+                        merged->values.insert(merged->values.end(), part->values.begin(), part->values.end());
+                    }
+                    sort(merged->values.begin(), merged->values.end());
+                    merged->values.erase(unique(merged->values.begin(), merged->values.end()), merged->values.end());
+                    merged->count = static_cast<uint32_t>(merged->values.size());
+                }
+                else {
+                    merged->bits.assign(WORDS, 0);
+                    for (const auto& part : group) {
+                        if (part->dense()) {
+                            for (size_t w = 0; w < WORDS; w++) merged->bits[w] |= part->bits[w];
+                        }
+                        else {
+                            for (uint16_t low : part->values) merged->bits[low >> 6] |= uint64_t(1) << (low & 63);
+                        }
+                    }
+                    for (uint64_t word : merged->bits) merged->count += popCount(word);
+                    merged->settle();
+                }
+            }
+            result.keys.push_back(entry.first);
+            result.containers.push_back(move(merged));
+        }
+        return result;
+    }
+};
+
+// Hash map from 32-bit ids to counts, laid out like IdSet. An id whose count
+// drops to zero is removed, and the table shrinks once it is mostly empty,
+// so memory follows the live entries.
+class IdCounter {
+private:
+    static constexpr uint32_t EMPTY = UINT32_MAX;
+
+    struct Slot {
+        uint32_t id;
+        uint32_t count;
+    };
+
+    vector<Slot> slots;
+    size_t used = 0;
+
+    size_t slotOf(uint32_t id) const {
+        return (id * 0x9E3779B1u) & (slots.size() - 1);
+    }
+
+    void rehash(size_t capacity) {
+        vector<Slot> old(capacity, Slot{ EMPTY, 0 });
+        old.swap(slots);
+        for (const Slot& entry : old) {
+            if (entry.id == EMPTY) continue;
+            size_t slot = slotOf(entry.id);
+            while (slots[slot].id != EMPTY) slot = (slot + 1) & (slots.size() - 1);
+            slots[slot] = entry;
+        }
+    }
+
+    void erase(size_t slot) {
+        size_t mask = slots.size() - 1;
+        size_t hole = slot;
+        for (size_t next = (hole + 1) & mask; slots[next].id != EMPTY; next = (next + 1) & mask) {
+            size_t home = slotOf(slots[next].id);
+            if (((next - home) & mask) >= ((next - hole) & mask)) {
+                slots[hole] = slots[next];
+                hole = next;
+            }
+        }
+        slots[hole].id = EMPTY;
+        used--;
+        if (slots.size() > 8 && used * 8 < slots.size()) {
+            size_t capacity = 8;
+            while (capacity < used * 2) capacity *= 2;
+            rehash(capacity);
+        }
+    }
+
+public:
+    size_t size() const { return used; }
+    size_t bytes() const { return slots.capacity() * sizeof(Slot); }
+
+    uint32_t get(uint32_t id) const {
+        if (slots.empty()) return 0;
+        for (size_t slot = slotOf(id); slots[slot].id != EMPTY; slot = (slot + 1) & (slots.size() - 1)) {
+            if (slots[slot].id == id) return slots[slot].count;
+        }
+        return 0;
+    }
+
+    // Adds `delta` (which may be negative) to the id's count
+    void add(uint32_t id, int delta) {
+        if (delta > 0 && (used + 1) * 2 > slots.size()) {
+            size_t capacity = 8;
+            while (capacity < (used + 1) * 2) capacity *= 2;
+            rehash(capacity);
+        }
+        if (slots.empty()) return;
+        size_t slot = slotOf(id);
+        for (; slots[slot].id != EMPTY; slot = (slot + 1) & (slots.size() - 1)) {
+            if (slots[slot].id != id) continue;
+            slots[slot].count += delta;
+            if (slots[slot].count == 0) erase(slot);
+            return;
+        }
+        if (delta > 0) {
+            slots[slot] = Slot{ id, static_cast<uint32_t>(delta) };
+            used++;
+        }
+    }
+
+    // Keeps the `keep` largest counts and drops the rest; among equal counts
+    // the survivors are arbitrary
+    void trim(size_t keep) {
+        if (used <= keep) return;
+        vector<Slot> entries;
+        for (const Slot& entry : slots) {
+            if (entry.id != EMPTY) entries.push_back(entry);
+        }
+        nth_element(entries.begin(), entries.begin() + keep, entries.end(),
+            [](const Slot& a, const Slot& b) { return a.count > b.count; });
+        entries.resize(keep);
+        size_t capacity = 8;
+        while (capacity < keep * 2) capacity *= 2;
+        slots.assign(capacity, Slot{ EMPTY, 0 });
+        used = 0;
+        for (const Slot& entry : entries) add(entry.id, static_cast<int>(entry.count));
+    }
+
+    template <typename Visit>
+    void forEach(Visit visit) const {
+        for (const Slot& entry : slots) {
+            if (entry.id != EMPTY) visit(entry.id, entry.count);
+        }
+    }
+};
+
+// Inverted n-gram index behind the search functions. Text is lower-cased and
+// padded before being cut into trigrams, so any substring of one or more
+// characters can be looked up. Candidates are then checked against the original
+// strings, which keeps results identical to a plain find() scan. Postings hold
+// document ids in ascending order; ids are handed out in creation order, so the
+// results come back in catalog order. Posting lists and the document table are
+// shared copy-on-write, so a copy of the index for a catalog view costs one
+// pointer per gram.
+template <typename T, typename Ref = T*>
+class SearchIndex {
+private:
+    typedef vector<uint32_t> Postings;
+
+    // The posting lists of the grams that share their first two bytes, by
+    // third byte. Shards sit in a chunked vector indexed by those two bytes,
+    // so a copy of the index shares them all and an edit clones one chunk of
+    // pointers, one shard and one list.
+    typedef vector<pair<unsigned char, shared_ptr<Postings>>> Shard;
+    static const size_t SHARDS = size_t(1) << 16;
+
+    ChunkedVector<shared_ptr<Shard>> shards;
+    ChunkedVector<Ref> docs;
+
+    static const unsigned char FIELD_START = 0x02;
+    static const unsigned char FIELD_END = 0x03;
+
+    static uint32_t packGram(unsigned char a, unsigned char b, unsigned char c) {
+        return (uint32_t(a) << 16) | (uint32_t(b) << 8) | uint32_t(c);
+    }
+
+    static string normalize(string_view text) {
+        string result(text);
+        for (auto& ch : result) ch = static_cast<char>(tolower(static_cast<unsigned char>(ch)));
+        return result;
+    }
+
+    static void appendGrams(const string& text, vector<uint32_t>& grams) {
+        for (size_t i = 0; i + 2 < text.size(); i++) {
+            grams.push_back(packGram(text[i], text[i + 1], text[i + 2]));
+        }
+    }
+
+    static vector<uint32_t> documentGrams(const vector<string_view>& fields) {
+        vector<uint32_t> grams;
+        for (const auto& field : fields) {
+            if (field.empty()) continue;
+            string padded;
+            padded.reserve(field.size() + 2);
+            padded += static_cast<char>(FIELD_START);
+            padded += normalize(field);
+            padded += static_cast<char>(FIELD_END);
+            appendGrams(padded, grams);
+        }
+        sort(grams.begin(), grams.end());
+        grams.erase(unique(grams.begin(), grams.end()), grams.end());
+        return grams;
+    }
+
+    static bool thirdLess(const pair<unsigned char, shared_ptr<Postings>>& entry, unsigned char third) {
+        return entry.first < third;
+    }
+
+    const Shard* shardOf(unsigned char a, unsigned char b) const {
+        return shards.empty() ? nullptr : shards[(size_t(a) << 8) | b].get();
+    }
+
+    const Postings* find(uint32_t gram) const {
+        const Shard* shard = shardOf(gram >> 16, gram >> 8);
+        if (!shard) return nullptr;
+        auto it = lower_bound(shard->begin(), shard->end(), static_cast<unsigned char>(gram), thirdLess);
+        return it != shard->end() && it->first == static_cast<unsigned char>(gram) ? it->second.get() : nullptr;
+    }
+
+    Postings& writableList(uint32_t gram) {
+        if (shards.empty()) shards.resize(SHARDS);
+        shared_ptr<Shard>& slot = shards.modify(gram >> 8);
+        if (!slot) slot = make_shared<Shard>();
+        Shard& shard = writable(slot);
+        unsigned char third = static_cast<unsigned char>(gram);
+        auto it = lower_bound(shard.begin(), shard.end(), third, thirdLess);
+        if (it == shard.end() || it->first != third) it = shard.insert(it, { third, make_shared<Postings>() });
+        return writable(it->second);
+    }
+
+    // Drops a gram once its last document has gone
+    void dropIfEmpty(uint32_t gram) {
+        Shard& shard = writable(shards.modify(gram >> 8));
+        auto it = lower_bound(shard.begin(), shard.end(), static_cast<unsigned char>(gram), thirdLess);
+        if (it != shard.end() && it->second->empty()) shard.erase(it);
+        if (shard.empty()) shards.set(gram >> 8, nullptr);
+    }
+
+    // Union of sorted lists. When the lists hold many ids for the size of
+    // the catalog, marks a bitmap instead of sorting them all together.
+    vector<uint32_t> unite(const vector<const Postings*>& lists) const {
+        vector<uint32_t> result;
+        if (lists.size() == 1) return *lists[0];
+        size_t total = 0;
+        for (const Postings* list : lists) total += list->size();
+        if (total * 16 < docs.size()) {
+            result.reserve(total);
+            for (const Postings* list : lists) result.insert(result.end(), list->begin(), list->end());
+            sort(result.begin(), result.end());
+            result.erase(unique(result.begin(), result.end()), result.end());
+            return result;
+        }
+        vector<uint64_t> bits((docs.size() + 63) / 64);
+        for (const Postings* list : lists) {
+            for (uint32_t id : *list) bits[id >> 6] |= uint64_t(1) << (id & 63);
+        }
+        for (size_t w = 0; w < bits.size(); w++) {
+            for (uint64_t word = bits[w]; word; word &= word - 1) {
+                result.push_back(static_cast<uint32_t>(w * 64 + __builtin_ctzll(word)));
+            }
+        }
+        return result;
+    }
+
+    // Queries too short to form a trigram. Fields are padded at both ends,
+    // so every pair of bytes in a field starts some gram: "ab" is the union
+    // of the grams "ab?", found together in one shard. A single byte "a" is
+    // likewise "a??" or, at the end of a field, "?a" and the end marker.
+    vector<uint32_t> shortCandidates(const string& needle) const {
+        vector<const Postings*> lists;
+        unsigned char a = needle[0];
+        if (needle.size() == 2) {
+            if (const Shard* shard = shardOf(a, needle[1])) {
+                for (const auto& entry : *shard) lists.push_back(entry.second.get());
+            }
+        } else {
+            for (size_t b = 0; b < 256; b++) {
+                if (const Shard* shard = shardOf(a, b)) {
+                    for (const auto& entry : *shard) lists.push_back(entry.second.get());
+                }
+                if (const Postings* last = find(packGram(b, a, FIELD_END))) lists.push_back(last);
+            }
+        }
+        if (lists.empty()) return vector<uint32_t>();
+        return unite(lists);
+    }
+
+    vector<uint32_t> candidates(const string& query) const {
+        string needle = normalize(query);
+        if (needle.size() < 3) return shortCandidates(needle);
+
+        vector<uint32_t> result;
+        vector<uint32_t> grams;
+        appendGrams(needle, grams);
+        sort(grams.begin(), grams.end());
+        grams.erase(unique(grams.begin(), grams.end()), grams.end());
+
+        vector<const vector<uint32_t>*> lists;
+        for (uint32_t gram : grams) {
+            const Postings* list = find(gram);
+            if (!list) return result;
+            lists.push_back(list);
+        }
+        sort(lists.begin(), lists.end(),
+            [](const vector<uint32_t>* a, const vector<uint32_t>* b) { return a->size() < b->size(); });
+
+        result = *lists[0];
+        vector<uint32_t> next;
+        for (size_t i = 1; i < lists.size() && !result.empty(); i++) {
+            next.clear();
+            set_intersection(result.begin(), result.end(), lists[i]->begin(), lists[i]->end(),
+                back_inserter(next));
+            result.swap(next);
+        }
+        return result;
+    }
+
+public:
+    // Grams of a document, for callers that prepare documents on other
+    // threads and index them later with addGrams
+    static vector<uint32_t> gramsOf(const vector<string_view>& fields) { return documentGrams(fields); }
+
+    void reserve(size_t documents) { docs.reserve(documents); }
+
+    void add(Ref doc, const vector<string_view>& fields) {
+        vector<uint32_t> grams = documentGrams(fields);
+        addGrams(doc, grams.data(), grams.data() + grams.size());
+    }
+
+    void addGrams(Ref doc, const uint32_t* begin, const uint32_t* end) {
+        uint32_t id = doc->getId();
+        if (id >= docs.size()) docs.resize(id + 1, Ref());
+        docs.set(id, doc);
+        for (const uint32_t* gram = begin; gram != end; gram++) {
+            Postings& list = writableList(*gram);
+            if (list.empty() || list.back() < id) list.push_back(id);
+            else list.insert(lower_bound(list.begin(), list.end(), id), id);
+        }
+    }
+
+    void remove(Ref doc, const vector<string_view>& fields) {
+        uint32_t id = doc->getId();
+        if (id < docs.size()) docs.set(id, Ref());
+        for (uint32_t gram : documentGrams(fields)) {
+            const Postings* shared = find(gram);
+            if (!shared) continue;
+            auto found = lower_bound(shared->begin(), shared->end(), id);
+            if (found == shared->end() || *found != id) continue;
+            size_t offset = found - shared->begin();
+            Postings& list = writableList(gram);
+            list.erase(list.begin() + offset);
+            if (list.empty()) dropIfEmpty(gram);
+        }
+    }
+
+    // Removes many documents at once. Their ids are grouped by gram, so each
+    // posting list is rewritten in a single merge pass however many of them
+    // it holds. `fieldsOf` gives a document's fields as they were indexed.
+    template <typename FieldsOf>
+    void removeAll(const vector<Ref>& removed, FieldsOf fieldsOf) {
+        vector<pair<uint32_t, uint32_t>> hits;    // Gram, document id
+        for (const auto& doc : removed) {
+            uint32_t id = doc->getId();
+            if (id < docs.size()) docs.set(id, Ref());
+            for (uint32_t gram : documentGrams(fieldsOf(doc))) hits.emplace_back(gram, id);
+        }
+        sort(hits.begin(), hits.end());
+        for (size_t first = 0, last; first < hits.size(); first = last) {
+            for (last = first + 1; last < hits.size() && hits[last].first == hits[first].first; last++) {}
+            uint32_t gram = hits[first].first;
+            if (!find(gram)) continue;
+            Postings& list = writableList(gram);
+            list.erase(removeSorted(list, hits.begin() + first, hits.begin() + last), list.end());
+            if (list.empty()) dropIfEmpty(gram);
+        }
+    }
+
+    // Returns the documents accepted by `matches`, in id order
+    template <typename Match>
+    vector<Ref> search(const string& query, Match matches) const {
+        vector<Ref> results;
+        if (query.empty()) {
+            for (size_t id = 0; id < docs.size(); id++) {
+                const Ref& doc = docs[id];
+                if (doc && matches(doc)) results.push_back(doc);
+            }
+            return results;
+        }
+        for (uint32_t id : candidates(query)) {
+            const Ref& doc = docs[id];
+            if (doc && matches(doc)) results.push_back(doc);
+        }
+        return results;
+    }
+};
+
+// Word dictionary behind ranked search. Fields are cut into words (runs of
+// letters and digits, lower-cased; bytes of multi-byte UTF-8 characters count
+// as letters) and each word keeps the ids of the documents that contain it.
+// The words live in a ternary search tree whose nodes carry an upper bound on
+// the document count of any word below them, so the most common completions
+// of a prefix are found without visiting the rest of the subtree, and a
+// Levenshtein walk over the same tree finds the words within a few edits of
+// a misspelling. Shared copy-on-write like SearchIndex.
+template <typename T, typename Ref = T*>
+class TermIndex {
+public:
+    static const size_t MAX_TERM_LENGTH = 48;
+
+    struct Completion {
+        string term;
+        uint32_t documents;
+    };
+
+    struct Match {
+        Ref doc;
+        float score;
+    };
+
+private:
+    typedef vector<uint32_t> Postings;
+    static const uint32_t NONE = 0xFFFFFFFFu;
+    static const size_t MAX_EXPANSIONS = 64;   // Dictionary words tried per query word
+    static const size_t MAX_QUERY_TERMS = 8;
+    static const size_t MAX_POSTINGS_VISITED = 1 << 18;
+
+    struct Node {
+        uint32_t lo = NONE;
+        uint32_t eq = NONE;
+        uint32_t hi = NONE;
+        uint32_t term = NONE;   // Posting list of the word ending here
+        uint32_t best = 0;      // No word in this subtree is in more documents
+        unsigned char ch = 0;
+    };
+
+    // A dictionary word standing in for one query word
+    struct Expansion {
+        uint32_t term;
+        float score;
+    };
+
+    ChunkedVector<Node> nodes;
+    ChunkedVector<shared_ptr<Postings>> postings;
+    ChunkedVector<Ref> docs;
+    size_t documentCount = 0;
+
+    static bool isWordByte(unsigned char ch) { return ch >= 0x80 || isalnum(ch); }
+
+    static vector<string> documentTerms(const vector<string_view>& fields) {
+        vector<string> terms;
+        for (const auto& field : fields) {
+            vector<string> words = wordsOf(field);
+            terms.insert(terms.end(), words.begin(), words.end());
+        }
+        sort(terms.begin(), terms.end());
+        terms.erase(unique(terms.begin(), terms.end()), terms.end());
+        return terms;
+    }
+
+    uint32_t documentsOf(uint32_t term) const { return static_cast<uint32_t>(postings[term]->size()); }
+
+    uint32_t findNode(string_view word) const {
+        uint32_t n = nodes.empty() || word.empty() ? NONE : 0;
+        size_t i = 0;
+        while (n != NONE) {
+            const Node& node = nodes[n];
+            unsigned char ch = word[i];
+            if (ch < node.ch) n = node.lo;
+            else if (ch > node.ch) n = node.hi;
+            else if (++i == word.size()) return n;
+            else n = node.eq;
+        }
+        return NONE;
+    }
+
+    // Adds the word's nodes if needed; `path` receives every node passed
+    uint32_t insertTerm(string_view word, vector<uint32_t>& path) {
+        path.clear();
+        if (nodes.empty()) {
+            Node root;
+            root.ch = word[0];
+            nodes.push_back(root);
+        }
+        uint32_t n = 0;
+        size_t i = 0;
+        while (true) {
+            path.push_back(n);
+            const Node& node = nodes[n];
+            unsigned char ch = word[i];
+            uint32_t Node::*link = &Node::eq;
+            if (ch < node.ch) link = &Node::lo;
+            else if (ch > node.ch) link = &Node::hi;
+            else if (i + 1 == word.size()) {
+                if (node.term == NONE) {
+                    nodes.modify(n).term = static_cast<uint32_t>(postings.size());
+                    postings.push_back(make_shared<Postings>());
+                }
+                return nodes[n].term;
+            }
+            else i++;
+
+            uint32_t next = node.*link;
+            if (next == NONE) {
+                next = static_cast<uint32_t>(nodes.size());
+                Node child;
+                child.ch = word[i];
+                nodes.push_back(child);
+                nodes.modify(n).*link = next;
+            }
+            n = next;
+        }
+    }
+
+    typedef pair<uint32_t, string> Candidate;   // Documents, word
+
+    static bool better(const Candidate& a, const Candidate& b) {
+        return a.first != b.first ? a.first > b.first : a.second < b.second;
+    }
+
+    // In-order walk (so ties go to the alphabetically first word) keeping the
+    // k words in most documents; `word` holds the letters above `n`
+    void collectTop(uint32_t n, string& word, size_t k, vector<Candidate>& heap) const {
+        if (n == NONE) return;
+        const Node& node = nodes[n];
+        if (heap.size() == k && node.best <= heap.front().first) return;
+        collectTop(node.lo, word, k, heap);
+        word.push_back(static_cast<char>(node.ch));
+        if (node.term != NONE) {
+            uint32_t documents = documentsOf(node.term);
+            if (documents > 0 && (heap.size() < k || documents > heap.front().first)) {
+                if (heap.size() == k) {
+                    pop_heap(heap.begin(), heap.end(), better);
+                    heap.pop_back();
+                }
+                heap.emplace_back(documents, word);
+                push_heap(heap.begin(), heap.end(), better);
+            }
+        }
+        collectTop(node.eq, word, k, heap);
+        word.pop_back();
+        collectTop(node.hi, word, k, heap);
+    }
+
+    // Edit-distance walk (Levenshtein plus swapped neighbours): `rows` holds
+    // one row of the distance table per depth and `letters` the word above
+    // `n`; a branch is left as soon as its row has no entry within maxEdits
+    void collectNear(uint32_t n, const string& word, size_t depth, unsigned maxEdits,
+        vector<uint8_t>& rows, string& letters, vector<pair<uint32_t, unsigned>>& found) const {
+        if (n == NONE) return;
+        const Node& node = nodes[n];
+        collectNear(node.lo, word, depth, maxEdits, rows, letters, found);
+        size_t width = word.size() + 1;
+        const uint8_t* previous = &rows[depth * width];
+        uint8_t* row = &rows[(depth + 1) * width];
+        row[0] = static_cast<uint8_t>(depth + 1);
+        uint8_t smallest = row[0];
+        for (size_t j = 1; j < width; j++) {
+            unsigned char wanted = static_cast<unsigned char>(word[j - 1]);
+            uint8_t substitute = previous[j - 1] + (wanted == node.ch ? 0 : 1);
+            row[j] = min<uint8_t>(substitute, min<uint8_t>(previous[j], row[j - 1]) + 1);
+            if (depth > 0 && j > 1 && wanted == static_cast<unsigned char>(letters[depth - 1]) &&
+                static_cast<unsigned char>(word[j - 2]) == node.ch) {
+                row[j] = min<uint8_t>(row[j], rows[(depth - 1) * width + j - 2] + 1);
+            }
+            smallest = min(smallest, row[j]);
+        }
+        if (node.term != NONE && row[width - 1] <= maxEdits && documentsOf(node.term) > 0) {
+            found.emplace_back(node.term, row[width - 1]);
+        }
+        if (smallest <= maxEdits && depth + 1 < MAX_TERM_LENGTH) {
+            letters.push_back(static_cast<char>(node.ch));
+            collectNear(node.eq, word, depth + 1, maxEdits, rows, letters, found);
+            letters.pop_back();
+        }
+        collectNear(node.hi, word, depth, maxEdits, rows, letters, found);
+    }
+
+    // Dictionary words a query word may stand for, best first. Short words
+    // must match exactly; longer ones may be one or two edits off. The last
+    // word of a query may still be half typed, so it also matches as a prefix.
+    vector<Expansion> expand(const string& word, bool asPrefix) const {
+        vector<Expansion> expansions;
+        unsigned maxEdits = word.size() <= 2 ? 0 : word.size() <= 5 ? 1 : 2;
+        vector<pair<uint32_t, unsigned>> near;
+        vector<uint8_t> rows((MAX_TERM_LENGTH + 1) * (word.size() + 1));
+        for (size_t j = 0; j <= word.size(); j++) rows[j] = static_cast<uint8_t>(j);
+        string letters;
+        if (!nodes.empty()) collectNear(0, word, 0, maxEdits, rows, letters, near);
+        for (const auto& hit : near) {
+            expansions.push_back({ hit.first, 1.0f / (1 + hit.second) });
+        }
+
+        if (asPrefix) {
+            uint32_t n = findNode(word);
+            if (n != NONE) {
+                vector<Candidate> heap;
+                string completion = word;
+                collectTop(nodes[n].eq, completion, MAX_EXPANSIONS, heap);
+                for (const auto& candidate : heap) {
+                    uint32_t term = nodes[findNode(candidate.second)].term;
+                    expansions.push_back({ term, 0.5f + 0.5f * word.size() / candidate.second.size() });
+                }
+            }
+        }
+
+        // Keep the best score per dictionary word
+        sort(expansions.begin(), expansions.end(), [](const Expansion& a, const Expansion& b) {
+            return a.term != b.term ? a.term < b.term : a.score > b.score;
+        });
+        expansions.erase(unique(expansions.begin(), expansions.end(),
+            [](const Expansion& a, const Expansion& b) { return a.term == b.term; }), expansions.end());
+
+        // Weight the query word by how rare it is, judged by its most common
+        // reading, so a rare completion never outranks an exact match
+        uint32_t documents = 1;
+        for (const auto& expansion : expansions) documents = max(documents, documentsOf(expansion.term));
+        float rarity = static_cast<float>(log(1.0 + double(documentCount) / documents));
+        for (auto& expansion : expansions) expansion.score *= rarity;
+
+        auto byScore = [this](const Expansion& a, const Expansion& b) {
+            if (a.score != b.score) return a.score > b.score;
+            uint32_t aDocuments = documentsOf(a.term), bDocuments = documentsOf(b.term);
+            return aDocuments != bDocuments ? aDocuments > bDocuments : a.term < b.term;
+        };
+        if (expansions.size() > MAX_EXPANSIONS) {
+            partial_sort(expansions.begin(), expansions.begin() + MAX_EXPANSIONS, expansions.end(), byScore);
+            expansions.resize(MAX_EXPANSIONS);
+        }
+        else {
+            sort(expansions.begin(), expansions.end(), byScore);
+        }
+        return expansions;
+    }
+
+    // Calls visit(id) for the ids in every list, in ascending order, until
+    // it returns false. Walks the shortest list and gallops through the
+    // others; `budget` counts down the postings looked at.
+    template <typename Visit>
+    static void intersect(vector<const Postings*>& lists, size_t& budget, Visit visit) {
+        sort(lists.begin(), lists.end(), [](const Postings* a, const Postings* b) { return a->size() < b->size(); });
+        vector<size_t> positions(lists.size(), 0);
+        for (uint32_t id : *lists[0]) {
+            if (budget == 0) return;
+            budget--;
+            bool everywhere = true;
+            for (size_t l = 1; l < lists.size() && everywhere; l++) {
+                const Postings& list = *lists[l];
+                size_t& at = positions[l];
+                size_t step = 1;
+                while (at + step < list.size() && list[at + step] < id) {
+                    at += step;
+                    step *= 2;
+                }
+                at = lower_bound(list.begin() + at, list.begin() + min(at + step + 1, list.size()), id) - list.begin();
+                budget -= min(budget, step);
+                everywhere = at < list.size() && list[at] == id;
+                if (at == list.size()) return;
+            }
+            if (everywhere && !visit(id)) return;
+        }
+    }
+
+public:
+    // Lower-cased words of `text`, in order
+    static vector<string> wordsOf(string_view text) {
+        vector<string> words;
+        string word;
+        for (size_t i = 0; i <= text.size(); i++) {
+            unsigned char ch = i < text.size() ? static_cast<unsigned char>(text[i]) : ' ';
+            if (isWordByte(ch)) {
+                if (word.size() < MAX_TERM_LENGTH) word.push_back(static_cast<char>(tolower(ch)));
+            }
+            else if (!word.empty()) {
+                words.push_back(word);
+                word.clear();
+            }
+        }
+        return words;
+    }
+
+    // Where the last word of `text` starts, or text.size() if it ends
+    // between words
+    static size_t lastWordStart(string_view text) {
+        size_t start = text.size();
+        while (start > 0 && isWordByte(static_cast<unsigned char>(text[start - 1]))) start--;
+        return start;
+    }
+
+    size_t terms() const { return postings.size(); }
+    void reserve(size_t documents) { docs.reserve(documents); }
+
+    void add(Ref doc, const vector<string_view>& fields) {
+        uint32_t id = doc->getId();
+        if (id >= docs.size()) docs.resize(id + 1, Ref());
+        if (!docs[id]) documentCount++;
+        docs.set(id, doc);
+        vector<uint32_t> path;
+        for (const auto& word : documentTerms(fields)) {
+            uint32_t term = insertTerm(word, path);
+            Postings& list = writable(postings.modify(term));
+            if (list.empty() || list.back() < id) list.push_back(id);
+            else list.insert(lower_bound(list.begin(), list.end(), id), id);
+            uint32_t documents = static_cast<uint32_t>(list.size());
+            for (uint32_t n : path) {
+                if (nodes[n].best < documents) nodes.modify(n).best = documents;
+            }
+        }
+    }
+
+    // Bounds in the tree are left as they are; they only get looser
+    void remove(Ref doc, const vector<string_view>& fields) {
+        uint32_t id = doc->getId();
+        if (id < docs.size() && docs[id]) {
+            docs.set(id, Ref());
+            documentCount--;
+        }
+        for (const auto& word : documentTerms(fields)) {
+            uint32_t n = findNode(word);
+            if (n == NONE || nodes[n].term == NONE) continue;
+            uint32_t term = nodes[n].term;
+            const Postings& shared = *postings[term];
+            auto found = lower_bound(shared.begin(), shared.end(), id);
+            if (found == shared.end() || *found != id) continue;
+            size_t offset = found - shared.begin();
+            Postings& list = writable(postings.modify(term));
+            list.erase(list.begin() + offset);
+        }
+    }
+
+    // Removes many documents with one merge pass per posting list, as
+    // SearchIndex::removeAll does
+    template <typename FieldsOf>
+    void removeAll(const vector<Ref>& removed, FieldsOf fieldsOf) {
+        vector<pair<uint32_t, uint32_t>> hits;    // Term, document id
+        for (const auto& doc : removed) {
+            uint32_t id = doc->getId();
+            if (id < docs.size() && docs[id]) {
+                docs.set(id, Ref());
+                documentCount--;
+            }
+            for (const auto& word : documentTerms(fieldsOf(doc))) {
+                uint32_t n = findNode(word);
+                if (n != NONE && nodes[n].term != NONE) hits.emplace_back(nodes[n].term, id);
+            }
+        }
+        sort(hits.begin(), hits.end());
+        for (size_t first = 0, last; first < hits.size(); first = last) {
+            for (last = first + 1; last < hits.size() && hits[last].first == hits[first].first; last++) {}
+            Postings& list = writable(postings.modify(hits[first].first));
+            list.erase(removeSorted(list, hits.begin() + first, hits.begin() + last), list.end());
+        }
+    }
+
+    // The `k` words starting with `prefix` that are in the most documents
+    vector<Completion> complete(const string& prefix, size_t k) const {
+        vector<Completion> completions;
+        vector<string> words = wordsOf(prefix);
+        if (words.size() != 1 || k == 0) return completions;
+        uint32_t n = findNode(words[0]);
+        if (n == NONE) return completions;
+
+        vector<Candidate> heap;
+        const Node& node = nodes[n];
+        if (node.term != NONE && documentsOf(node.term) > 0) heap.emplace_back(documentsOf(node.term), words[0]);
+        collectTop(node.eq, words[0], k, heap);
+        sort(heap.begin(), heap.end(), better);
+        for (auto& candidate : heap) completions.push_back({ std::move(candidate.second), candidate.first });
+        return completions;
+    }
+
+    // Up to `k` documents that match every word of `query`, best first. Each
+    // query word scores its best dictionary match (exact, a few edits off, or
+    // a completion of the last word) weighted by how rare the word is, and a
+    // document's score is the sum. Combinations of dictionary words are
+    // visited best first, so a document is found under its best combination
+    // and the walk ends as soon as k documents are in hand; a budget on the
+    // postings visited bounds the rest, in which case fewer may come back.
+    vector<Match> rank(const string& query, size_t k) const {
+        vector<Match> results;
+        vector<string> words = wordsOf(query);
+        if (words.size() > MAX_QUERY_TERMS) words.resize(MAX_QUERY_TERMS);
+        if (words.empty() || k == 0) return results;
+
+        vector<vector<Expansion>> expansions;
+        for (const auto& word : words) {
+            expansions.push_back(expand(word, &word == &words.back()));
+            if (expansions.back().empty()) return results;
+        }
+
+        // A combination picks one expansion per query word; its indexes
+        // (each below MAX_EXPANSIONS) are packed a byte apiece
+        auto indexOf = [](uint64_t combination, size_t w) { return size_t((combination >> (w * 8)) & 0xFF); };
+        auto scoreOf = [&](uint64_t combination) {
+            float score = 0;
+            for (size_t w = 0; w < words.size(); w++) score += expansions[w][indexOf(combination, w)].score;
+            return score;
+        };
+        priority_queue<pair<float, uint64_t>> frontier;
+        unordered_set<uint64_t> queued;
+        frontier.emplace(scoreOf(0), 0);
+        queued.insert(0);
+
+        IdSet found;
+        size_t budget = MAX_POSTINGS_VISITED;
+        vector<const Postings*> lists;
+        while (!frontier.empty() && results.size() < k && budget > 0) {
+            auto best = frontier.top();
+            frontier.pop();
+            lists.clear();
+            for (size_t w = 0; w < words.size(); w++) {
+                lists.push_back(postings[expansions[w][indexOf(best.second, w)].term].get());
+            }
+            intersect(lists, budget, [&](uint32_t id) {
+                if (found.insert(id) && docs[id]) results.push_back({ docs[id], best.first });
+                return results.size() < k;
+            });
+            for (size_t w = 0; w < words.size(); w++) {
+                if (indexOf(best.second, w) + 1 >= expansions[w].size()) continue;
+                uint64_t next = best.second + (uint64_t(1) << (w * 8));
+                if (queued.insert(next).second) frontier.emplace(scoreOf(next), next);
+            }
+        }
+        return results;
+    }
+};
+
+// Password hashing: PBKDF2-HMAC-SHA256 with a random per-user salt
+class PasswordHash {
+public:
+    typedef array<uint8_t, 32> Digest;
+    typedef array<uint8_t, 16> Salt;
+
+    // Work factor for newly created hashes; stored hashes keep their own
+    static uint32_t defaultIterations;
+
+private:
+    Salt salt{};
+    Digest digest{};
+    uint32_t iterations = 0;
+
+    static uint32_t rotr(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+    struct Sha256 {
+        uint32_t state[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                              0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+        uint8_t block[64];
+        size_t blockLen = 0;
+        uint64_t totalLen = 0;
+
+        void compress() {
+            static const uint32_t k[64] = {
+                0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+                0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+                0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+                0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+                0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+                0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+                0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+                0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+            };
+            uint32_t w[64];
+            for (int i = 0; i < 16; i++) {
+                w[i] = (uint32_t(block[i * 4]) << 24) | (uint32_t(block[i * 4 + 1]) << 16) |
+                    (uint32_t(block[i * 4 + 2]) << 8) | uint32_t(block[i * 4 + 3]);
+            }
+            for (int i = 16; i < 64; i++) {
+                uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+                uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+                w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+            }
+            uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+            uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+            for (int i = 0; i < 64; i++) {
+                uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+                uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+                h = g; g = f; f = e; e = d + t1;
+                d = c; c = b; b = a; a = t1 + t2;
+            }
+            state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+            state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+        }
+
+        void update(const uint8_t* data, size_t len) {
+            totalLen += len;
+            while (len > 0) {
+                size_t n = min(len, sizeof(block) - blockLen);
+                copy(data, data + n, block + blockLen);
+                blockLen += n;
+                data += n;
+                len -= n;
+                if (blockLen == sizeof(block)) {
+                    compress();
+                    blockLen = 0;
+                }
+            }
+        }
+
+        Digest finish() {
+            uint64_t bits = totalLen * 8;
+            uint8_t pad = 0x80;
+            update(&pad, 1);
+            pad = 0;
+            while (blockLen != 56) update(&pad, 1);
+            uint8_t length[8];
+            for (int i = 0; i < 8; i++) length[i] = uint8_t(bits >> (56 - i * 8));
+            update(length, 8);
+            Digest out;
+            for (int i = 0; i < 8; i++) {
+                for (int j = 0; j < 4; j++) out[i * 4 + j] = uint8_t(state[i] >> (24 - j * 8));
+            }
+            return out;
+        }
+    };
+
+    static Digest hmac(const string& key, const uint8_t* msg, size_t len) {
+        uint8_t keyBlock[64] = {};
+        if (key.size() > sizeof(keyBlock)) {
+            Sha256 keyHash;
+            keyHash.update(reinterpret_cast<const uint8_t*>(key.data()), key.size());
+            Digest d = keyHash.finish();
+            copy(d.begin(), d.end(), keyBlock);
+        }
+        else {
+            copy(key.begin(), key.end(), keyBlock);
+        }
+        uint8_t inner[64], outer[64];
+        for (int i = 0; i < 64; i++) {
+            inner[i] = keyBlock[i] ^ 0x36;
+            outer[i] = keyBlock[i] ^ 0x5c;
+        }
+        Sha256 in;
+        in.update(inner, sizeof(inner));
+        in.update(msg, len);
+        Digest innerDigest = in.finish();
+        Sha256 out;
+        out.update(outer, sizeof(outer));
+        out.update(innerDigest.data(), innerDigest.size());
+        return out.finish();
+    }
+
+    // PBKDF2 with a single output block, which is all a 32-byte key needs
+    static Digest derive(const string& password, const Salt& salt, uint32_t iterations) {
+        uint8_t first[sizeof(Salt) + 4];
+        copy(salt.begin(), salt.end(), first);
+        first[sizeof(Salt)] = 0;
+        first[sizeof(Salt) + 1] = 0;
+        first[sizeof(Salt) + 2] = 0;
+        first[sizeof(Salt) + 3] = 1;
+        Digest u = hmac(password, first, sizeof(first));
+        Digest result = u;
+        for (uint32_t i = 1; i < iterations; i++) {
+            u = hmac(password, u.data(), u.size());
+            for (size_t j = 0; j < result.size(); j++) result[j] ^= u[j];
+        }
+        return result;
+    }
+
+public:
+    PasswordHash() {}
+    PasswordHash(const Salt& salt, const Digest& digest, uint32_t iterations)
+        : salt(salt), digest(digest), iterations(iterations) {}
+
+    static PasswordHash create(const string& password) {
+        static random_device device;
+        Salt salt;
+        for (auto& byte : salt) byte = static_cast<uint8_t>(device());
+        return PasswordHash(salt, derive(password, salt, defaultIterations), defaultIterations);
+    }
+
+    const Salt& getSalt() const { return salt; }
+    const Digest& getDigest() const { return digest; }
+    uint32_t getIterations() const { return iterations; }
+
+    // Compares without an early exit so timing does not leak the match length
+    bool verify(const string& password) const {
+        Digest candidate = derive(password, salt, iterations);
+        uint8_t diff = 0;
+        for (size_t i = 0; i < digest.size(); i++) diff |= candidate[i] ^ digest[i];
+        return diff == 0;
+    }
+};
+
+// Append-only redo log of catalog and account mutations. Each record is a
+// varint payload length, a payload (type byte followed by varint ids and
+// length-prefixed strings) and a CRC-32 of the payload. Records are buffered
+// and written in groups; Options decides how many records or how much time a
+// group may span and whether each group write is followed by an fsync.
+class WriteAheadLog {
+public:
+    enum RecordType : uint8_t {
+        ADD_ARTIST = 1,
+        REMOVE_ARTIST,
+        ADD_SONG,
+        REMOVE_SONG,
+        CREATE_ALBUM,
+        CREATE_PLAYLIST,
+        DELETE_PLAYLIST,
+        PLAYLIST_ADD_SONG,
+        PLAYLIST_REMOVE_SONG,
+        FAVORITE_SONG_ADD,
+        FAVORITE_SONG_REMOVE,
+        FAVORITE_PLAYLIST_ADD,
+        FAVORITE_PLAYLIST_REMOVE,
+        REGISTER_USER,
+        PLAYLIST_SET_SONGS,
+        PLAYLIST_INSERT_SONG,
+        PLAYLIST_MOVE_SONGS
+    };
+
+    struct Options {
+        size_t groupCommitRecords = 32;                   // Records per group write
+        chrono::milliseconds groupCommitDelay{ 20 };      // Oldest record may wait this long
+        bool syncToDisk = true;                           // fsync after every group write
+    };
+
+    // Suppresses logging for the nested mutations of a logged operation
+    class Mute {
+    private:
+        WriteAheadLog& log;
+
+    public:
+        explicit Mute(WriteAheadLog& log) : log(log) { log.muted++; }
+        ~Mute() { log.muted--; }
+    };
+
+    // Writes the records of a bulk operation in large groups and syncs once
+    // when the scope ends, instead of after every group
+    class Batch {
+    private:
+        WriteAheadLog& log;
+        Options saved;
+
+    public:
+        explicit Batch(WriteAheadLog& log) : log(log), saved(log.options) {
+            log.options.groupCommitRecords = 1 << 16;
+            log.options.groupCommitDelay = chrono::hours(24);
+            log.options.syncToDisk = false;
+        }
+        ~Batch() {
+            log.flush();
+            log.options = saved;
+            if (saved.syncToDisk) log.sync();
+        }
+    };
+
+private:
+    int fd = -1;
+    Options options;
+    string pending;
+    size_t pendingRecords = 0;
+    chrono::steady_clock::time_point oldestPending;
+    int muted = 0;
+    string payload;
+
+    void begin(RecordType type) {
+        payload.clear();
+        payload.push_back(static_cast<char>(type));
+    }
+
+    void putVarint(uint64_t value) { appendVarint(payload, value); }
+
+    void putString(string_view text) {
+        putVarint(text.size());
+        payload += text;
+    }
+
+    void commitRecord() {
+        if (pendingRecords == 0) oldestPending = chrono::steady_clock::now();
+        appendVarint(pending, payload.size());
+        pending += payload;
+        uint32_t crc = crc32(payload.data(), payload.size());
+        for (int i = 0; i < 4; i++) pending.push_back(static_cast<char>(crc >> (i * 8)));
+        pendingRecords++;
+        if (pendingRecords >= options.groupCommitRecords ||
+            chrono::steady_clock::now() - oldestPending >= options.groupCommitDelay) {
+            flush();
+        }
+    }
+
+public:
+    static void appendVarint(string& out, uint64_t value) {
+        while (value >= 0x80) {
+            out.push_back(static_cast<char>(value | 0x80));
+            value >>= 7;
+        }
+        out.push_back(static_cast<char>(value));
+    }
+
+    static uint32_t crc32(const char* data, size_t length) {
+        static uint32_t table[256];
+        static bool ready = false;
+        if (!ready) {
+            for (uint32_t i = 0; i < 256; i++) {
+                uint32_t c = i;
+                for (int k = 0; k < 8; k++) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+                table[i] = c;
+            }
+            ready = true;
+        }
+        uint32_t crc = 0xFFFFFFFFu;
+        for (size_t i = 0; i < length; i++) {
+            crc = table[(crc ^ static_cast<uint8_t>(data[i])) & 0xFF] ^ (crc >> 8);
+        }
+        return crc ^ 0xFFFFFFFFu;
+    }
+
+    ~WriteAheadLog() { close(); }
+
+    void setOptions(const Options& newOptions) { options = newOptions; }
+    const Options& getOptions() const { return options; }
+    bool isRecording() const { return fd >= 0 && muted == 0; }
+
+    // Opens `path` for appending, cutting off anything past `validLength`
+    // (a torn record left by a crash)
+    bool open(const string& path, uint64_t validLength) {
+        close();
+#ifdef _WIN32
+        fd = _open(path.c_str(), _O_WRONLY | _O_CREAT | _O_BINARY, _S_IREAD | _S_IWRITE);
+        if (fd < 0) return false;
+        _chsize_s(fd, validLength);
+        _lseeki64(fd, 0, SEEK_END);
+#else
+        fd = ::open(path.c_str(), O_WRONLY | O_CREAT, 0644);
+        if (fd < 0) return false;
+        if (ftruncate(fd, validLength) != 0 || lseek(fd, 0, SEEK_END) < 0) {
+            close();
+            return false;
+        }
+#endif
+        return true;
+    }
+
+    void close() {
+        if (fd < 0) return;
+        flush();
+#ifdef _WIN32
+        _close(fd);
+#else
+        ::close(fd);
+#endif
+        fd = -1;
+    }
+
+    // Writes every buffered record as one group and syncs it if configured.
+    // If a write fails partway, the bytes that reached the file are dropped
+    // from the buffer, so the next flush carries on after them instead of
+    // writing them twice.
+    bool flush() {
+        if (fd < 0 || pending.empty()) return true;
+        size_t done = 0;
+        while (done < pending.size()) {
+#ifdef _WIN32
+            int written = _write(fd, pending.data() + done, static_cast<unsigned>(pending.size() - done));
+#else
+            ssize_t written = ::write(fd, pending.data() + done, pending.size() - done);
+#endif
+            if (written < 0 && errno == EINTR) continue;
+            if (written <= 0) {
+                pending.erase(0, done);
+                return false;
+            }
+            done += written;
+        }
+        pending.clear();
+        pendingRecords = 0;
+        return !options.syncToDisk || sync();
+    }
+
+    bool sync() {
+        if (fd < 0) return true;
+#ifdef _WIN32
+        return _commit(fd) == 0;
+#else
+        return fsync(fd) == 0;
+#endif
+    }
+
+    // Drops all records once a snapshot has made them redundant
+    bool truncate() {
+        if (fd < 0) return false;
+        pending.clear();
+        pendingRecords = 0;
+#ifdef _WIN32
+        return _chsize_s(fd, 0) == 0 && _lseeki64(fd, 0, SEEK_SET) == 0;
+#else
+        return ftruncate(fd, 0) == 0 && lseek(fd, 0, SEEK_SET) == 0;
+#endif
+    }
+
+    void addArtist(uint32_t artistId, string_view name) {
+        if (!isRecording()) return;
+        begin(ADD_ARTIST);
+        putVarint(artistId);
+        putString(name);
+        commitRecord();
+    }
+
+    void addSong(uint32_t songId, uint32_t artistId, int year, string_view title, string_view genre) {
+        if (!isRecording()) return;
+        begin(ADD_SONG);
+        putVarint(songId);
+        putVarint(artistId);
+        putVarint(static_cast<uint32_t>(year));
+        putString(title);
+        putString(genre);
+        commitRecord();
+    }
+
+    void createAlbum(uint32_t playlistId, uint32_t artistId, string_view name) {
+        if (!isRecording()) return;
+        begin(CREATE_ALBUM);
+        putVarint(playlistId);
+        putVarint(artistId);
+        putString(name);
+        commitRecord();
+    }
+
+    void createPlaylist(uint32_t playlistId, uint32_t userId, bool isPublic, string_view name) {
+        if (!isRecording()) return;
+        begin(CREATE_PLAYLIST);
+        putVarint(playlistId);
+        putVarint(userId);
+        putVarint(isPublic ? 1 : 0);
+        putString(name);
+        commitRecord();
+    }
+
+    void registerUser(uint32_t userId, string_view username, const PasswordHash& hash) {
+        if (!isRecording()) return;
+        begin(REGISTER_USER);
+        putVarint(userId);
+        putString(username);
+        putVarint(hash.getIterations());
+        payload.append(reinterpret_cast<const char*>(hash.getSalt().data()), hash.getSalt().size());
+        payload.append(reinterpret_cast<const char*>(hash.getDigest().data()), hash.getDigest().size());
+        commitRecord();
+    }
+
+    void insertPlaylistSong(uint32_t playlistId, uint32_t songId, size_t position) {
+        if (!isRecording()) return;
+        begin(PLAYLIST_INSERT_SONG);
+        putVarint(playlistId);
+        putVarint(songId);
+        putVarint(position);
+        commitRecord();
+    }
+
+    void movePlaylistSongs(uint32_t playlistId, size_t from, size_t count, size_t to) {
+        if (!isRecording()) return;
+        begin(PLAYLIST_MOVE_SONGS);
+        putVarint(playlistId);
+        putVarint(from);
+        putVarint(count);
+        putVarint(to);
+        commitRecord();
+    }
+
+    // The whole contents of a playlist after a bulk edit or an undo
+    void setPlaylistSongs(uint32_t playlistId, const vector<uint32_t>& songIds) {
+        if (!isRecording()) return;
+        begin(PLAYLIST_SET_SONGS);
+        putVarint(playlistId);
+        putVarint(songIds.size());
+        for (uint32_t songId : songIds) putVarint(songId);
+        commitRecord();
+    }
+
+    // Records that only carry ids: removals, playlist edits and favorites
+    void log(RecordType type, uint32_t first, uint32_t second = 0) {
+        if (!isRecording()) return;
+        begin(type);
+        putVarint(first);
+        putVarint(second);
+        commitRecord();
+    }
+};
+
+extern WriteAheadLog wal;
+const char* const WAL_PATH = "music_library.wal";
+
+// Append-only string interning. Each distinct string is stored once in a
+// chunked arena and named by a dense id; views stay valid for the life of the
+// pool because the chunks never move. Strings are not reclaimed when their
+// owners go away; a snapshot round-trip rebuilds the pools compactly. The id
+// table is also chunked behind a fixed directory, so view() and size() are
+// safe from lock-free readers while the writer interns new strings.
+class StringPool {
+private:
+    static const size_t BLOCK_SIZE = 64 * 1024;
+    static const uint32_t VALUE_BITS = 16;
+    static const uint32_t VALUES_PER_BLOCK = 1u << VALUE_BITS;
+    static const uint32_t MAX_VALUE_BLOCKS = 1024;
+
+    vector<unique_ptr<char[]>> blocks;
+    vector<unique_ptr<char[]>> largeBlocks;
+    size_t blockUsed = BLOCK_SIZE;
+    size_t storedBytes = 0;
+    unordered_map<string_view, uint32_t> ids;
+    unique_ptr<unique_ptr<string_view[]>[]> values{ new unique_ptr<string_view[]>[MAX_VALUE_BLOCKS] };
+    atomic<uint32_t> count{ 0 };
+
+    string_view store(string_view text) {
+        char* dest;
+        if (text.size() > BLOCK_SIZE / 4) {
+            largeBlocks.emplace_back(new char[text.size()]);
+            dest = largeBlocks.back().get();
+        }
+        else {
+            if (blockUsed + text.size() > BLOCK_SIZE) {
+                blocks.emplace_back(new char[BLOCK_SIZE]);
+                blockUsed = 0;
+            }
+            dest = blocks.back().get() + blockUsed;
+            blockUsed += text.size();
+        }
+        memcpy(dest, text.data(), text.size());
+        storedBytes += text.size();
+        return string_view(dest, text.size());
+    }
+
+public:
+    static const uint32_t NONE = 0xFFFFFFFFu;
+
+    StringPool() {}
+    StringPool(StringPool&& other) noexcept { *this = std::move(other); }
+
+    StringPool& operator=(StringPool&& other) noexcept {
+        blocks = std::move(other.blocks);
+        largeBlocks = std::move(other.largeBlocks);
+        blockUsed = other.blockUsed;
+        storedBytes = other.storedBytes;
+        ids = std::move(other.ids);
+        values = std::move(other.values);
+        count.store(other.count.load());
+        return *this;
+    }
+
+    void reserve(size_t strings) { ids.reserve(strings); }
+
+    uint32_t intern(string_view text) {
+        auto it = ids.find(text);
+        if (it != ids.end()) return it->second;
+        uint32_t id = count.load(memory_order_relaxed);
+        if (id >> VALUE_BITS >= MAX_VALUE_BLOCKS) throw bad_alloc();
+        unique_ptr<string_view[]>& block = values[id >> VALUE_BITS];
+        if (!block) block.reset(new string_view[VALUES_PER_BLOCK]);
+        string_view stored = store(text);
+        block[id & (VALUES_PER_BLOCK - 1)] = stored;
+        ids.emplace(stored, id);
+        count.store(id + 1, memory_order_release);
+        return id;
+    }
+
+    // Returns NONE if the string was never interned
+    uint32_t find(string_view text) const {
+        auto it = ids.find(text);
+        return it == ids.end() ? NONE : it->second;
+    }
+
+    string_view view(uint32_t id) const { return values[id >> VALUE_BITS][id & (VALUES_PER_BLOCK - 1)]; }
+    size_t size() const { return count.load(memory_order_acquire); }
+    size_t bytes() const { return storedBytes; }
+};
+
+// The distinct ids of some of a pool's strings, such as the artist names
+// among the usernames and playlist names in namePool, so a substring match
+// tests only those strings instead of the whole pool. Ids stay listed once
+// added. Copy-on-write like the indexes that hold it.
+class PoolSubset {
+private:
+    ChunkedVector<uint32_t> ids;        // In the order first added
+    ChunkedVector<uint8_t> present;     // By pool id
+
+public:
+    size_t size() const { return ids.size(); }
+    uint32_t operator[](size_t i) const { return ids[i]; }
+    // One past the highest id listed
+    size_t limit() const { return present.size(); }
+    bool contains(uint32_t id) const { return id < present.size() && present[id]; }
+
+    void add(uint32_t id) {
+        if (id >= present.size()) present.resize(id + 1);
+        if (present[id]) return;
+        present.set(id, 1);
+        ids.push_back(id);
+    }
+};
+
+// Interned text: song titles, genres, and names of artists, playlists and users
+extern StringPool titlePool;
+extern StringPool genrePool;
+extern StringPool namePool;
+
+// Song class definition
+class Song {
+private:
+    static uint32_t nextId;
+
+    uint32_t id;
+    uint32_t titleId;
+    Artist* artist;
+    int releaseYear;
+    uint32_t genreId;
+
+    // Back-references in no particular order. Most songs have a handful, which
+    // a scan finds fastest; past INDEX_FROM they get an id -> position index,
+    // so removing one from a popular song does not scan them all.
+    template <typename H>
+    struct Holders {
+        static const size_t INDEX_FROM = 16;
+
+        vector<H*> list;
+        unique_ptr<IdPositions> positions;
+
+        void attach(H* holder) {
+            list.push_back(holder);
+            if (positions) {
+                positions->set(holder->getId(), list.size() - 1);
+            }
+            else if (list.size() > INDEX_FROM) {
+                positions.reset(new IdPositions());
+                positions->reserve(list.size());
+                for (size_t i = 0; i < list.size(); i++) positions->set(list[i]->getId(), i);
+            }
+        }
+
+        void detach(H* holder) {
+            size_t i;
+            if (positions) {
+                i = positions->positionOf(holder->getId());
+                if (i == SIZE_MAX) return;
+                positions->erase(holder->getId());
+            }
+            else {
+                i = find(list.begin(), list.end(), holder) - list.begin();
+                if (i == list.size()) return;
+            }
+            if (i + 1 != list.size()) {
+                list[i] = list.back();
+                if (positions) positions->set(list[i]->getId(), i);
+            }
+            list.pop_back();
+        }
+    };
+
+    Holders<Playlist> playlists;   // Playlists that contain this song
+    Holders<User> favoritedBy;     // Users with this song in their favorites
+
+public:
+    Song(string_view title, Artist* artist, int year, string_view genre)
+        : id(nextId++), titleId(titlePool.intern(title)), artist(artist), releaseYear(year),
+        genreId(genrePool.intern(genre)) {}
+
+    // Restores a persisted song under its original id
+    Song(uint32_t id, string_view title, Artist* artist, int year, string_view genre)
+        : id(id), titleId(titlePool.intern(title)), artist(artist), releaseYear(year),
+        genreId(genrePool.intern(genre)) {
+        nextId = max(nextId, id + 1);
+    }
+
+    static SlabPool<Song> pool;
+
+    static uint32_t getNextId() { return nextId; }
+    static void reserveIds(uint32_t next) { nextId = max(nextId, next); }
+    static void resetIds() { nextId = 0; }
+
+    uint32_t getId() const { return id; }
+    SongRef getRef() const { return SongRef(this); }
+    string_view getTitle() const { return titlePool.view(titleId); }
+    uint32_t getTitleId() const { return titleId; }
+    Artist* getArtist() const { return artist; }
+    int getReleaseYear() const { return releaseYear; }
+    string_view getGenre() const { return genrePool.view(genreId); }
+    uint32_t getGenreId() const { return genreId; }
+    const vector<Playlist*>& getPlaylists() const { return playlists.list; }
+    const vector<User*>& getFavoritedBy() const { return favoritedBy.list; }
+
+    // Back-references, maintained by Playlist and User
+    void attachPlaylist(Playlist* playlist);
+    void detachPlaylist(Playlist* playlist);
+    void attachFavorite(User* user);
+    void detachFavorite(User* user);
+
+    void display() const;
+};
+
+// Artist class definition
+class Artist {
+private:
+    static uint32_t nextId;
+
+    uint32_t id;
+    uint32_t nameId;
+    vector<SongRef> songs;
+    vector<Playlist*> albums;
+    IdPositions songPositions;
+    IdSet albumIds;
+
+public:
+    Artist(string_view name) : id(nextId++), nameId(namePool.intern(name)) {}
+
+    // Restores a persisted artist under its original id
+    Artist(uint32_t id, string_view name) : id(id), nameId(namePool.intern(name)) {
+        nextId = max(nextId, id + 1);
+    }
+
+    static SlabPool<Artist> pool;
+
+    static uint32_t getNextId() { return nextId; }
+    static void reserveIds(uint32_t next) { nextId = max(nextId, next); }
+    static void resetIds() { nextId = 0; }
+
+    uint32_t getId() const { return id; }
+    string_view getName() const { return namePool.view(nameId); }
+    uint32_t getNameId() const { return nameId; }
+    int getAlbumCount() const { return albums.size(); }
+    int getSongCount() const { return songs.size(); }
+    const vector<SongRef>& getSongs() const { return songs; }
+    const vector<Playlist*>& getAlbums() const { return albums; }
+
+    void addSong(SongRef song) {
+        if (!songPositions.contains(song->getId())) {
+            songPositions.set(song->getId(), songs.size());
+            songs.push_back(song);
+        }
+    }
+
+    // The artist's song order carries no meaning, so removal swaps with the last song
+    void removeSong(SongRef song) {
+        size_t i = songPositions.positionOf(song->getId());
+        if (i == SIZE_MAX) return;
+        songPositions.erase(song->getId());
+        if (i + 1 != songs.size()) {
+            songs[i] = songs.back();
+            songPositions.set(songs[i]->getId(), i);
+        }
+        songs.pop_back();
+    }
+
+    void addAlbum(Playlist* album);
+
+    void display() const;
+};
+
+// Item-to-item recommendations from co-occurrence. Every playlist (albums
+// included) and every favorites list is a basket, and two songs co-occur
+// once for each basket that holds both; the counts form a sparse symmetric
+// matrix with one IdCounter row per song. Only the first BASKET_LIMIT songs
+// of a basket count, so adding or removing a song touches at most that many
+// rows and no basket puts more than BASKET_LIMIT^2 entries in the matrix.
+// A row that reaches 2 * ROW_LIMIT songs keeps only its ROW_LIMIT largest
+// counts, so a row never outgrows 4 * ROW_LIMIT slots (2 KB) however popular
+// the song; a pair dropped this way starts again from zero if it comes back.
+// Similarity is cosine over basket membership: c(a,b) / sqrt(n(a) n(b)).
+// Baskets report their changes while tracking is on; bulk loads leave it off
+// and rebuild once, on several threads, when they are done. Reads may run
+// concurrently with each other but not with changes.
+class Recommender {
+public:
+    static constexpr size_t BASKET_LIMIT = 200;
+    static constexpr size_t ROW_LIMIT = 64;
+    static constexpr size_t MAX_SEEDS = 50;    // Most recent favorites behind "for you"
+
+    struct Scored {
+        SongRef song;
+        float score;
+    };
+
+private:
+    vector<IdCounter> rows;     // By song id
+    vector<uint32_t> baskets;   // Counted baskets holding each song
+    vector<SongRef> songs;      // By song id, for answers
+    bool tracking = false;
+
+    void ensure(uint32_t id) {
+        if (id < rows.size()) return;
+        rows.resize(id + 1);
+        baskets.resize(id + 1);
+        songs.resize(id + 1);
+    }
+
+    // Adds (delta 1) or drops (delta -1) the co-occurrence of `song` with
+    // each of `others`, and its membership of one more or one less basket
+    void link(SongRef song, const SongRef* others, size_t count, int delta) {
+        uint32_t id = song->getId();
+        ensure(id);
+        songs[id] = song;
+        baskets[id] += delta;
+        for (size_t i = 0; i < count; i++) {
+            uint32_t other = others[i]->getId();
+            ensure(other);
+            tally(id, other, delta);
+            tally(other, id, delta);
+        }
+    }
+
+    void tally(uint32_t id, uint32_t other, int delta) {
+        rows[id].add(other, delta);
+        if (rows[id].size() + 1 >= 2 * ROW_LIMIT) rows[id].trim(ROW_LIMIT);
+    }
+
+    float similarity(uint32_t a, uint32_t b, uint32_t count) const {
+        return static_cast<float>(count / sqrt(double(baskets[a]) * baskets[b]));
+    }
+
+    vector<Scored> best(vector<pair<uint32_t, float>>& scored, size_t n) const {
+        auto byScore = [](const pair<uint32_t, float>& a, const pair<uint32_t, float>& b) {
+            return a.second != b.second ? a.second > b.second : a.first < b.first;
+        };
+        size_t top = min(n, scored.size());
+        partial_sort(scored.begin(), scored.begin() + top, scored.end(), byScore);
+        vector<Scored> results;
+        for (size_t i = 0; i < top; i++) {
+            if (songs[scored[i].first]) results.push_back({ songs[scored[i].first], scored[i].second });
+        }
+        return results;
+    }
+
+public:
+    bool isTracking() const { return tracking; }
+
+    // `basket` has just gained its last song
+    void added(const vector<SongRef>& basket) {
+        if (tracking && basket.size() <= BASKET_LIMIT) link(basket.back(), basket.data(), basket.size() - 1, 1);
+    }
+
+    // `song` has just left `basket` from `position`; the first song past the
+    // limit, if any, moves up into the counted part
+    void removed(SongRef song, size_t position, const vector<SongRef>& basket) {
+        if (!tracking || position >= BASKET_LIMIT) return;
+        link(song, basket.data(), min(basket.size(), BASKET_LIMIT - 1), -1);
+        if (basket.size() >= BASKET_LIMIT) link(basket[BASKET_LIMIT - 1], basket.data(), BASKET_LIMIT - 1, 1);
+    }
+
+    // A basket's counted songs went from `before` to `after`. Only the pairs
+    // with a song that left or entered change, so an edit that pushes one
+    // song out of a full basket costs O(BASKET_LIMIT), not a recount of
+    // every pair in it.
+    void changed(const vector<SongRef>& before, const vector<SongRef>& after) {
+        if (!tracking) return;
+        IdSet inBefore, inAfter;
+        inBefore.reserve(before.size());
+        inAfter.reserve(after.size());
+        for (const auto& song : before) inBefore.insert(song->getId());
+        for (const auto& song : after) inAfter.insert(song->getId());
+
+        vector<SongRef> others;
+        for (const auto& song : before) {
+            if (inAfter.contains(song->getId())) others.push_back(song);
+        }
+        size_t kept = others.size();
+        // Each song that left drops its pairs with the songs kept and with
+        // those that left before it; each one that entered gains the same
+        for (const auto& song : before) {
+            if (inAfter.contains(song->getId())) continue;
+            link(song, others.data(), others.size(), -1);
+            others.push_back(song);
+        }
+        others.resize(kept);
+        for (const auto& song : after) {
+            if (inBefore.contains(song->getId())) continue;
+            link(song, others.data(), others.size(), 1);
+            others.push_back(song);
+        }
+    }
+
+    // Whole baskets, for bulk edits and baskets that are created or destroyed
+    void addBasket(const vector<SongRef>& basket) {
+        if (!tracking) return;
+        for (size_t i = 0; i < min(basket.size(), BASKET_LIMIT); i++) link(basket[i], basket.data(), i, 1);
+    }
+
+    void removeBasket(const vector<SongRef>& basket) {
+        if (!tracking) return;
+        for (size_t i = 0; i < min(basket.size(), BASKET_LIMIT); i++) link(basket[i], basket.data(), i, -1);
+    }
+
+    // Recounts everything from `all` and turns tracking on. Each thread owns
+    // the rows of the song ids equal to its number modulo `threads`, so the
+    // threads never write to the same row.
+    void rebuild(const vector<const vector<SongRef>*>& all, unsigned threads) {
+        vector<uint32_t> ids;
+        vector<size_t> starts;
+        uint32_t idLimit = 0;
+        for (auto basket : all) {
+            starts.push_back(ids.size());
+            for (size_t i = 0; i < min(basket->size(), BASKET_LIMIT); i++) {
+                ids.push_back((*basket)[i]->getId());
+                idLimit = max(idLimit, ids.back() + 1);
+            }
+        }
+        starts.push_back(ids.size());
+
+        rows.assign(idLimit, IdCounter());
+        baskets.assign(idLimit, 0);
+        songs.assign(idLimit, SongRef());
+        for (auto basket : all) {
+            for (size_t i = 0; i < min(basket->size(), BASKET_LIMIT); i++) songs[(*basket)[i]->getId()] = (*basket)[i];
+        }
+
+        threads = max(1u, threads);
+        auto work = [&](unsigned worker) {
+            for (size_t b = 0; b + 1 < starts.size(); b++) {
+                for (size_t i = starts[b]; i < starts[b + 1]; i++) {
+                    uint32_t id = ids[i];
+                    if (id % threads != worker) continue;
+                    baskets[id]++;
+                    for (size_t j = starts[b]; j < starts[b + 1]; j++) {
+                        if (j != i) tally(id, ids[j], 1);
+                    }
+                }
+            }
+        };
+        vector<thread> workers;
+        for (unsigned w = 1; w < threads; w++) workers.emplace_back(work, w);
+        work(0);
+        for (auto& worker : workers) worker.join();
+        tracking = true;
+    }
+
+    void clear() {
+        rows = vector<IdCounter>();
+        baskets = vector<uint32_t>();
+        songs = vector<SongRef>();
+        tracking = false;
+    }
+
+    // Songs that share baskets with `song`, most similar first
+    vector<Scored> similar(SongRef song, size_t n) const {
+        uint32_t id = song->getId();
+        vector<pair<uint32_t, float>> scored;
+        if (id >= rows.size()) return vector<Scored>();
+        rows[id].forEach([&](uint32_t other, uint32_t count) {
+            scored.emplace_back(other, similarity(id, other, count));
+        });
+        return best(scored, n);
+    }
+
+    // Songs most similar to the last MAX_SEEDS of `seeds` taken together,
+    // leaving out the seeds themselves
+    vector<Scored> recommend(const vector<SongRef>& seeds, size_t n) const {
+        IdSet exclude;
+        for (const auto& seed : seeds) exclude.insert(seed->getId());
+        unordered_map<uint32_t, float> totals;
+        for (size_t i = seeds.size() > MAX_SEEDS ? seeds.size() - MAX_SEEDS : 0; i < seeds.size(); i++) {
+            uint32_t id = seeds[i]->getId();
+            if (id >= rows.size()) continue;
+            rows[id].forEach([&](uint32_t other, uint32_t count) {
+                if (!exclude.contains(other)) totals[other] += similarity(id, other, count);
+            });
+        }
+        vector<pair<uint32_t, float>> scored(totals.begin(), totals.end());
+        return best(scored, n);
+    }
+
+    // Matrix size: stored pairs (each counted in both rows) and bytes
+    size_t pairs() const {
+        size_t total = 0;
+        for (const auto& row : rows) total += row.size();
+        return total / 2;
+    }
+
+    size_t bytes() const {
+        size_t total = rows.capacity() * sizeof(IdCounter) + baskets.capacity() * sizeof(uint32_t) +
+            songs.capacity() * sizeof(SongRef);
+        for (const auto& row : rows) total += row.bytes();
+        return total;
+    }
+};
+
+extern Recommender recommender;
+
+// Listening statistics. Players record every song they make current into a
+// ring owned by the calling thread, which only that thread writes, so
+// recording takes no lock and shares no cache line with other players.
+// Readers, and a thread that finds its ring full, take the merge lock and
+// drain every ring into compact counters: plays per song and per artist
+// (indexed by id), plays in each of the last WINDOW_HOURS hours, and for
+// each artist a min-heap of its TOP_SONGS most played songs. Counts only
+// grow, so a song belongs in the heap exactly when it passes the smallest
+// count there. The counters are not persisted.
+class PlayStats {
+public:
+    static constexpr size_t RING_SIZE = 4096;
+    static constexpr size_t TOP_SONGS = 10;
+    static constexpr size_t WINDOW_HOURS = 48;
+
+    struct Play {
+        SongRef song;
+        uint32_t plays;
+    };
+
+private:
+    struct Event {
+        SongRef song;
+        uint32_t artist;
+        uint32_t hour;
+    };
+
+    // Single producer (the owning thread), single consumer (the merge lock holder)
+    struct Ring {
+        Event events[RING_SIZE];
+        atomic<size_t> head{ 0 };
+        atomic<size_t> tail{ 0 };
+        atomic<bool> retired{ false };  // Owner has exited; drop once drained
+    };
+
+    // Ties a thread to its ring for the thread's lifetime
+    struct Owner {
+        shared_ptr<Ring> ring;
+        ~Owner() {
+            if (ring) ring->retired.store(true, memory_order_release);
+        }
+    };
+
+    struct Window {
+        uint32_t hour;
+        uint64_t plays;
+    };
+
+    mutable mutex merging;
+    vector<shared_ptr<Ring>> rings;
+    vector<uint32_t> songPlays;         // By song id
+    vector<uint64_t> artistPlays;       // By artist id
+    vector<vector<Play>> topSongs;      // By artist id, min-heaps on plays
+    Window windows[WINDOW_HOURS] = {};  // By hour modulo WINDOW_HOURS
+    uint64_t totalPlays = 0;
+
+    static bool morePlays(const Play& a, const Play& b) { return a.plays > b.plays; }
+
+    static uint32_t currentHour() {
+        return static_cast<uint32_t>(chrono::duration_cast<chrono::hours>(
+            chrono::system_clock::now().time_since_epoch()).count());
+    }
+
+    Ring& localRing() {
+        thread_local Owner owner;
+        if (!owner.ring) {
+            owner.ring = make_shared<Ring>();
+            lock_guard<mutex> lock(merging);
+            rings.push_back(owner.ring);
+        }
+        return *owner.ring;
+    }
+
+    static void promote(vector<Play>& heap, SongRef song, uint32_t plays) {
+        for (auto& entry : heap) {
+            if (entry.song != song) continue;
+            entry.plays = plays;
+            make_heap(heap.begin(), heap.end(), morePlays);
+            return;
+        }
+        if (heap.size() < TOP_SONGS) {
+            heap.push_back({ song, plays });
+            push_heap(heap.begin(), heap.end(), morePlays);
+        }
+        else if (plays > heap.front().plays) {
+            pop_heap(heap.begin(), heap.end(), morePlays);
+            heap.back() = { song, plays };
+            push_heap(heap.begin(), heap.end(), morePlays);
+        }
+    }
+
+    void apply(const Event& event) {
+        uint32_t id = event.song.get() ? event.song->getId() : UINT32_MAX;
+        if (id == UINT32_MAX) return;  // Removed before the merge
+        if (id >= songPlays.size()) songPlays.resize(id + 1);
+        if (event.artist >= artistPlays.size()) {
+            artistPlays.resize(event.artist + 1);
+            topSongs.resize(event.artist + 1);
+        }
+        uint32_t plays = ++songPlays[id];
+        artistPlays[event.artist]++;
+        promote(topSongs[event.artist], event.song, plays);
+        totalPlays++;
+
+        Window& window = windows[event.hour % WINDOW_HOURS];
+        if (window.hour < event.hour) window = Window{ event.hour, 0 };
+        if (window.hour == event.hour) window.plays++;
+    }
+
+    // Caller holds `merging`
+    void drain() {
+        for (size_t i = 0; i < rings.size();) {
+            Ring& ring = *rings[i];
+            bool retired = ring.retired.load(memory_order_acquire);
+            size_t head = ring.head.load(memory_order_acquire);
+            size_t tail = ring.tail.load(memory_order_relaxed);
+            for (; tail != head; tail++) apply(ring.events[tail % RING_SIZE]);
+            ring.tail.store(tail, memory_order_release);
+            if (retired) {
+                rings[i] = rings.back();
+                rings.pop_back();
+            }
+            else {
+                i++;
+            }
+        }
+    }
+
+public:
+    // Called by the playing thread whenever a song becomes current
+    void record(SongRef song) {
+        if (!song) return;
+        Ring& ring = localRing();
+        size_t head = ring.head.load(memory_order_relaxed);
+        if (head - ring.tail.load(memory_order_acquire) == RING_SIZE) {
+            lock_guard<mutex> lock(merging);
+            drain();
+        }
+        ring.events[head % RING_SIZE] = Event{ song, song->getArtist()->getId(), currentHour() };
+        ring.head.store(head + 1, memory_order_release);
+    }
+
+    uint32_t playsOf(SongRef song) {
+        lock_guard<mutex> lock(merging);
+        drain();
+        uint32_t id = song->getId();
+        return id < songPlays.size() ? songPlays[id] : 0;
+    }
+
+    uint64_t playsOf(const Artist* artist) {
+        lock_guard<mutex> lock(merging);
+        drain();
+        uint32_t id = artist->getId();
+        return id < artistPlays.size() ? artistPlays[id] : 0;
+    }
+
+    // Plays in the last `hours` hours (the current one included), up to WINDOW_HOURS
+    uint64_t recentPlays(size_t hours) {
+        lock_guard<mutex> lock(merging);
+        drain();
+        uint32_t now = currentHour();
+        uint64_t total = 0;
+        for (const Window& window : windows) {
+            if (window.hour <= now && now - window.hour < min(hours, WINDOW_HOURS)) total += window.plays;
+        }
+        return total;
+    }
+
+    uint64_t allPlays() {
+        lock_guard<mutex> lock(merging);
+        drain();
+        return totalPlays;
+    }
+
+    // The artist's most played songs, most played first, at most TOP_SONGS.
+    // A heap holding a removed song is refilled from the artist's songs.
+    vector<Play> topSongsOf(const Artist* artist, size_t n);
+};
+
+extern PlayStats playStats;
+
+// xoshiro256** generator for shuffling and playlist tree priorities. Each
+// thread has its own, seeded from random_device, so sessions never share
+// generator state.
+class ShuffleRng {
+private:
+    uint64_t state[4];
+
+    static uint64_t rotl(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+
+public:
+    ShuffleRng() {
+        random_device device;
+        uint64_t seed = (static_cast<uint64_t>(device()) << 32) | device();
+        // splitmix64 spreads the seed over the whole state
+        for (auto& word : state) {
+            uint64_t z = (seed += 0x9E3779B97F4A7C15ULL);
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+            word = z ^ (z >> 31);
+        }
+    }
+
+    static ShuffleRng& local() {
+        thread_local ShuffleRng rng;
+        return rng;
+    }
+
+    uint64_t next() {
+        uint64_t result = rotl(state[1] * 5, 7) * 9;
+        uint64_t t = state[1] << 17;
+        state[2] ^= state[0];
+        state[3] ^= state[1];
+        state[1] ^= state[2];
+        state[0] ^= state[3];
+        state[2] ^= t;
+        state[3] = rotl(state[3], 45);
+        return result;
+    }
+
+    // Uniform in [0, bound) without modulo bias (Lemire's multiply-shift)
+    uint32_t below(uint32_t bound) {
+        uint64_t m = (next() >> 32) * bound;
+        uint32_t low = static_cast<uint32_t>(m);
+        if (low < bound) {
+            uint32_t threshold = (0u - bound) % bound;
+            while (low < threshold) {
+                m = (next() >> 32) * bound;
+                low = static_cast<uint32_t>(m);
+            }
+        }
+        return static_cast<uint32_t>(m >> 32);
+    }
+};
+
+// Where position p lands when the items at [from, from + count) are moved so
+// that the first of them ends up at `to`
+inline size_t movedPosition(size_t p, size_t from, size_t count, size_t to) {
+    if (p >= from && p < from + count) return p - from + to;
+    size_t rest = p < from ? p : p - count;
+    return rest < to ? rest : rest + count;
+}
+
+// Shuffled play order over playlist positions, dealt lazily by Fisher-Yates:
+// order[0, drawn) have been dealt, order[drawn, end) are still in the deck,
+// and order[played - 1] is the current track. Stepping back and forward
+// again replays the dealt prefix.
+class ShuffleOrder {
+private:
+    static const uint32_t NONE = UINT32_MAX;
+
+    vector<uint32_t> order;
+    size_t drawn = 0;
+    size_t played = 0;
+    bool active = false;
+
+    // Renumbers positions through `map` (NONE drops one), keeping the order
+    template <typename Map>
+    void compact(Map map) {
+        size_t kept = 0, keptDrawn = 0, keptPlayed = 0;
+        for (size_t k = 0; k < order.size(); k++) {
+            uint32_t position = map(order[k]);
+            if (position == NONE) continue;
+            if (k < drawn) keptDrawn++;
+            if (k < played) keptPlayed++;
+            order[kept++] = position;
+        }
+        order.resize(kept);
+        drawn = keptDrawn;
+        played = keptPlayed;
+    }
+
+public:
+    bool isActive() const { return active; }
+
+    // Starts a new deck over `count` tracks with `current` already dealt
+    void start(size_t count, size_t current) {
+        order.resize(count);
+        for (size_t i = 0; i < count; i++) order[i] = static_cast<uint32_t>(i);
+        drawn = played = 0;
+        active = true;
+        if (current < count) {
+            swap(order[0], order[current]);
+            drawn = played = 1;
+        }
+    }
+
+    void stop() {
+        order.clear();
+        drawn = played = 0;
+        active = false;
+    }
+
+    // Position of the track after the current one, dealing it if needed;
+    // SIZE_MAX once the deck is spent and `loop` is off
+    size_t upcoming(bool loop) {
+        if (played < drawn) return order[played];
+
+        size_t range = order.size() - drawn;
+        if (range == 0) {
+            if (!loop || order.empty()) return SIZE_MAX;
+            // Reshuffle, keeping the track just played out of the first draw
+            drawn = played = 0;
+            range = order.size() > 1 ? order.size() - 1 : 1;
+        }
+        size_t pick = drawn + ShuffleRng::local().below(static_cast<uint32_t>(range));
+        swap(order[drawn], order[pick]);
+        return order[drawn++];
+    }
+
+    // Position of the track before the current one; if the current track was
+    // removed, the track dealt before it
+    size_t previous(bool currentRemoved) const {
+        size_t back = currentRemoved ? 1 : 2;
+        return played >= back ? order[played - back] : SIZE_MAX;
+    }
+
+    void advance() { played++; }
+    void retreat() { played--; }
+
+    // Playlist edits. Appended tracks join the undealt part of the deck.
+    void append(size_t position) {
+        if (active) order.push_back(static_cast<uint32_t>(position));
+    }
+
+    // A track inserted mid-playlist also joins the undealt part of the deck
+    void insert(size_t position) {
+        if (!active) return;
+        uint32_t inserted = static_cast<uint32_t>(position);
+        if (inserted < order.size()) compact([inserted](uint32_t p) { return p >= inserted ? p + 1 : p; });
+        order.push_back(inserted);
+    }
+
+    void erase(size_t position) {
+        if (!active) return;
+        uint32_t removed = static_cast<uint32_t>(position);
+        compact([removed](uint32_t p) { return p == removed ? NONE : p > removed ? p - 1 : p; });
+    }
+
+    void move(size_t from, size_t count, size_t to) {
+        if (active) compact([=](uint32_t p) { return static_cast<uint32_t>(movedPosition(p, from, count, to)); });
+    }
+
+    // `newPositions` maps every old position to its new one, or UINT32_MAX
+    void remap(const vector<uint32_t>& newPositions) {
+        if (active) compact([&newPositions](uint32_t p) { return newPositions[p]; });
+    }
+};
+
+// Sequence kept as a persistent treap ordered by position: each node holds
+// one item, the size of its subtree and a random heap priority. Shared nodes
+// are never changed; an edit copies only the O(log n) nodes on its path, so
+// copying a list (a snapshot) is O(1) and versions share everything they
+// have in common. Counts are atomic, so a snapshot may be read and dropped
+// on another thread while the original is edited.
+template <typename T>
+class PersistentList {
+private:
+    struct Node {
+        T value;
+        uint32_t size;
+        uint32_t priority;
+        const Node* left;
+        const Node* right;
+        mutable atomic<uint32_t> refs;
+
+        Node(const T& value, uint32_t priority, const Node* left, const Node* right)
+            : value(value), size(1 + sizeOf(left) + sizeOf(right)), priority(priority),
+              left(left), right(right), refs(1) {}
+    };
+
+    const Node* root = nullptr;
+
+    static uint32_t sizeOf(const Node* node) { return node ? node->size : 0; }
+
+    static const Node* retain(const Node* node) {
+        if (node) node->refs.fetch_add(1, memory_order_relaxed);
+        return node;
+    }
+
+    static void release(const Node* node) {
+        while (node && node->refs.fetch_sub(1, memory_order_acq_rel) == 1) {
+            release(node->left);
+            const Node* right = node->right;
+            delete node;
+            node = right;
+        }
+    }
+
+    // The helpers below take ownership of the references they are passed
+    // as children and return owned references; `node` arguments are borrowed.
+    static const Node* copyWith(const Node* node, const Node* left, const Node* right) {
+        return new Node(node->value, node->priority, left, right);
+    }
+
+    // First `k` items into `left`, the rest into `right`
+    static void split(const Node* node, size_t k, const Node*& left, const Node*& right) {
+        if (k == 0) {
+            left = nullptr;
+            right = retain(node);
+        }
+        else if (k >= sizeOf(node)) {
+            left = retain(node);
+            right = nullptr;
+        }
+        else if (k <= sizeOf(node->left)) {
+            const Node* middle;
+            split(node->left, k, left, middle);
+            right = copyWith(node, middle, retain(node->right));
+        }
+        else {
+            const Node* middle;
+            split(node->right, k - sizeOf(node->left) - 1, middle, right);
+            left = copyWith(node, retain(node->left), middle);
+        }
+    }
+
+    static const Node* merge(const Node* left, const Node* right) {
+        if (!left) return right;
+        if (!right) return left;
+        const Node* joined;
+        if (left->priority > right->priority) {
+            joined = copyWith(left, retain(left->left), merge(retain(left->right), right));
+            release(left);
+        }
+        else {
+            joined = copyWith(right, merge(left, retain(right->left)), retain(right->right));
+            release(right);
+        }
+        return joined;
+    }
+
+    static uint32_t randomPriority() { return static_cast<uint32_t>(ShuffleRng::local().next() >> 32); }
+
+    explicit PersistentList(const Node* root) : root(root) {}
+
+public:
+    PersistentList() {}
+    PersistentList(const PersistentList& other) : root(retain(other.root)) {}
+    PersistentList(PersistentList&& other) noexcept : root(other.root) { other.root = nullptr; }
+
+    PersistentList& operator=(const PersistentList& other) {
+        const Node* old = root;
+        root = retain(other.root);
+        release(old);
+        return *this;
+    }
+
+    PersistentList& operator=(PersistentList&& other) noexcept {
+        swap(root, other.root);
+        return *this;
+    }
+
+    ~PersistentList() { release(root); }
+
+    size_t size() const { return sizeOf(root); }
+    bool empty() const { return root == nullptr; }
+
+    // True if both lists are the same version, without comparing items
+    bool sameVersion(const PersistentList& other) const { return root == other.root; }
+
+    const T& operator[](size_t i) const {
+        const Node* node = root;
+        while (true) {
+            size_t leftSize = sizeOf(node->left);
+            if (i < leftSize) node = node->left;
+            else if (i == leftSize) return node->value;
+            else {
+                i -= leftSize + 1;
+                node = node->right;
+            }
+        }
+    }
+
+    void insert(size_t i, const T& value) {
+        const Node *left, *right;
+        split(root, i, left, right);
+        release(root);
+        root = merge(merge(left, new Node(value, randomPriority(), nullptr, nullptr)), right);
+    }
+
+    void push_back(const T& value) { insert(size(), value); }
+
+    // Inserts all of `items` before position i, sharing their nodes
+    void insert(size_t i, const PersistentList& items) {
+        const Node *left, *right;
+        split(root, i, left, right);
+        release(root);
+        root = merge(merge(left, retain(items.root)), right);
+    }
+
+    // Items [begin, end) as a list of their own, sharing their nodes
+    PersistentList slice(size_t begin, size_t end) const {
+        const Node *left, *rest, *middle, *right;
+        split(root, begin, left, rest);
+        split(rest, end - begin, middle, right);
+        release(left);
+        release(rest);
+        release(right);
+        return PersistentList(middle);
+    }
+
+    // Given `pred` true for a prefix of the items and false for the rest,
+    // the length of that prefix, in O(log n)
+    template <typename Pred>
+    size_t partitionPoint(Pred pred) const {
+        size_t count = 0;
+        for (const Node* node = root; node;) {
+            if (pred(node->value)) {
+                count += sizeOf(node->left) + 1;
+                node = node->right;
+            }
+            else {
+                node = node->left;
+            }
+        }
+        return count;
+    }
+
+    // Drops items [begin, end)
+    void erase(size_t begin, size_t end) {
+        const Node *left, *rest, *middle, *right;
+        split(root, begin, left, rest);
+        split(rest, end - begin, middle, right);
+        release(rest);
+        release(middle);
+        release(root);
+        root = merge(left, right);
+    }
+
+    void erase(size_t i) { erase(i, i + 1); }
+
+    // Replaces the contents in O(n): builds the treap left to right along
+    // its right spine, a stack of falling priorities. A node's subtree is
+    // complete when it leaves the spine.
+    template <typename It>
+    void assign(It first, It last) {
+        vector<Node*> spine;
+        auto finish = [&spine]() {
+            Node* node = spine.back();
+            spine.pop_back();
+            node->size = 1 + sizeOf(node->left) + sizeOf(node->right);
+            return node;
+        };
+        for (; first != last; ++first) {
+            Node* node = new Node(*first, randomPriority(), nullptr, nullptr);
+            Node* below = nullptr;
+            while (!spine.empty() && spine.back()->priority < node->priority) below = finish();
+            node->left = below;
+            if (!spine.empty()) spine.back()->right = node;
+            spine.push_back(node);
+        }
+        Node* top = nullptr;
+        while (!spine.empty()) top = finish();
+        release(root);
+        root = top;
+    }
+
+    void clear() {
+        release(root);
+        root = nullptr;
+    }
+
+    // In-order walk holding the path to the current node; valid while the
+    // version it walks is alive
+    class const_iterator {
+    private:
+        vector<const Node*> path;
+
+        void descend(const Node* node) {
+            for (; node; node = node->left) path.push_back(node);
+        }
+
+        friend class PersistentList;
+
+    public:
+        typedef forward_iterator_tag iterator_category;
+        typedef T value_type;
+        typedef ptrdiff_t difference_type;
+        typedef const T* pointer;
+        typedef const T& reference;
+
+        const T& operator*() const { return path.back()->value; }
+        const T* operator->() const { return &path.back()->value; }
+
+        const_iterator& operator++() {
+            const Node* node = path.back();
+            path.pop_back();
+            descend(node->right);
+            return *this;
+        }
+
+        bool operator==(const const_iterator& other) const {
+            return path.empty() ? other.path.empty() : !other.path.empty() && path.back() == other.path.back();
+        }
+        bool operator!=(const const_iterator& other) const { return !(*this == other); }
+    };
+
+    const_iterator begin() const {
+        const_iterator it;
+        it.descend(root);
+        return it;
+    }
+    const_iterator end() const { return const_iterator(); }
+
+    // Iterator at item i, in O(log n)
+    const_iterator at(size_t i) const {
+        const_iterator it;
+        for (const Node* node = root; node;) {
+            size_t leftSize = sizeOf(node->left);
+            if (i <= leftSize) it.path.push_back(node);
+            if (i == leftSize) break;
+            if (i < leftSize) {
+                node = node->left;
+            }
+            else {
+                i -= leftSize + 1;
+                node = node->right;
+            }
+        }
+        return it;
+    }
+
+    // The first `n` items, or all of them
+    vector<T> prefix(size_t n) const {
+        vector<T> items;
+        items.reserve(min(n, size()));
+        for (auto it = begin(); it != end() && items.size() < n; ++it) items.push_back(*it);
+        return items;
+    }
+
+    vector<T> toVector() const { return prefix(size()); }
+};
+
+// Playback position in a playlist. The playlist keeps `index` on the current
+// track as songs are removed; if the current track itself is removed, `index`
+// moves to the track that followed it and `removed` is set. The playlist also
+// renumbers the shuffle order so it survives edits.
+struct PlaylistCursor {
+    Playlist* playlist = nullptr;
+    size_t index = 0;
+    bool removed = false;
+    ShuffleOrder shuffle;
+};
+
+// Song id -> order label for the songs of a playlist. Labels increase along
+// the playlist, so a song's position is found by descending its tree and
+// comparing labels. Open addressing with linear probing and backward-shift
+// deletion, like IdSet.
+class OrderLabels {
+private:
+    static constexpr uint32_t EMPTY = UINT32_MAX;
+
+    struct Slot {
+        uint32_t id;
+        uint64_t label;
+    };
+
+    vector<Slot> slots;
+    size_t count = 0;
+
+    size_t slotOf(uint32_t id) const {
+        return (id * 0x9E3779B1u) & (slots.size() - 1);
+    }
+
+    size_t find(uint32_t id) const {
+        if (slots.empty()) return SIZE_MAX;
+        for (size_t slot = slotOf(id); slots[slot].id != EMPTY; slot = (slot + 1) & (slots.size() - 1)) {
+            if (slots[slot].id == id) return slot;
+        }
+        return SIZE_MAX;
+    }
+
+    void rehash(size_t capacity) {
+        vector<Slot> old(capacity, Slot{ EMPTY, 0 });
+        old.swap(slots);
+        for (const Slot& entry : old) {
+            if (entry.id == EMPTY) continue;
+            size_t slot = slotOf(entry.id);
+            while (slots[slot].id != EMPTY) slot = (slot + 1) & (slots.size() - 1);
+            slots[slot] = entry;
+        }
+    }
+
+public:
+    size_t size() const { return count; }
+
+    void reserve(size_t n) {
+        size_t capacity = 8;
+        while (capacity < n * 2) capacity *= 2;
+        if (capacity > slots.size()) rehash(capacity);
+    }
+
+    bool contains(uint32_t id) const { return find(id) != SIZE_MAX; }
+
+    // The id's label; the id must be present
+    uint64_t get(uint32_t id) const { return slots[find(id)].label; }
+
+    // Adds the id or relabels it
+    void set(uint32_t id, uint64_t label) {
+        if ((count + 1) * 2 > slots.size()) reserve(count + 1);
+        size_t slot = slotOf(id);
+        for (; slots[slot].id != EMPTY; slot = (slot + 1) & (slots.size() - 1)) {
+            if (slots[slot].id == id) {
+                slots[slot].label = label;
+                return;
+            }
+        }
+        slots[slot] = Slot{ id, label };
+        count++;
+    }
+
+    bool erase(uint32_t id) {
+        size_t hole = find(id);
+        if (hole == SIZE_MAX) return false;
+        size_t mask = slots.size() - 1;
+        for (size_t next = (hole + 1) & mask; slots[next].id != EMPTY; next = (next + 1) & mask) {
+            size_t home = slotOf(slots[next].id);
+            if (((next - home) & mask) >= ((next - hole) & mask)) {
+                slots[hole] = slots[next];
+                hole = next;
+            }
+        }
+        slots[hole].id = EMPTY;
+        count--;
+        return true;
+    }
+};
+
+// One version of a playlist's contents. Holding on to one keeps it readable,
+// unchanged and at no copying cost, while the playlist goes on changing.
+struct PlaylistVersion {
+    uint64_t number = 0;
+    PersistentList<SongRef> songs;
+};
+
+// A version kept for undo. When the edit that followed it inserted, removed
+// or moved songs in place, undo reverts that edit rather than swapping in
+// the whole version. An undo is itself followed by a new version, so
+// version numbers only increase; the revisions it leaves are marked so
+// undo carries on further back instead of redoing.
+struct PlaylistRevision : PlaylistVersion {
+    enum Edit : uint8_t { BULK, INSERTED, REMOVED, MOVED, UNDO };
+
+    Edit edit = BULK;
+    bool undone = false;    // The edit that followed it has been undone
+    SongRef song;           // The song inserted or removed
+    uint32_t position = 0;  // Where it was inserted or removed, or the first moved
+    uint32_t count = 0;     // How many songs were moved
+    uint32_t target = 0;    // Where the first moved song went
+};
+
+// What changed from one version of a playlist to another
+struct PlaylistDiff {
+    vector<SongRef> added;      // Only in the newer version, in its order
+    vector<SongRef> removed;    // Only in the older version, in its order
+    bool reordered = false;     // Songs in both are in a different order
+};
+
+// Playlist class definition
+class Playlist {
+private:
+    static uint32_t nextId;
+
+    // Order labels are in [1, LABEL_LIMIT). Songs labelled from scratch, and
+    // songs added at either end, are LABEL_STEP apart while that fits.
+    static constexpr unsigned LABEL_BITS = 62;
+    static constexpr uint64_t LABEL_LIMIT = uint64_t(1) << LABEL_BITS;
+    static constexpr uint64_t LABEL_STEP = uint64_t(1) << 32;
+
+    uint32_t id;
+    uint32_t nameId;
+    PersistentList<SongRef> songs;
+    User* creator;
+    bool isPublic;
+    OrderLabels labels;                // Membership, and the order label of each song
+    vector<PlaylistCursor*> cursors;   // Playback positions of users playing this playlist
+    uint64_t version = 0;
+    deque<PlaylistRevision> history;   // Versions before recent edits, oldest first
+
+    // Files the current contents in the history ahead of an edit
+    void remember(PlaylistRevision::Edit edit = PlaylistRevision::BULK, SongRef song = SongRef(),
+        size_t position = 0, size_t count = 0, size_t target = 0) {
+        history.push_back({ { version, songs }, edit, false, song, static_cast<uint32_t>(position),
+            static_cast<uint32_t>(count), static_cast<uint32_t>(target) });
+        if (history.size() > HISTORY_LIMIT) history.pop_front();
+        version++;
+    }
+
+    // The part of the playlist the recommender counts
+    vector<SongRef> basket() const { return songs.prefix(Recommender::BASKET_LIMIT); }
+
+    uint64_t labelAt(size_t position) const { return labels.get(songs[position]->getId()); }
+
+    // How many songs have labels below `label`
+    size_t rankOf(uint64_t label) const {
+        return songs.partitionPoint([this, label](SongRef song) { return labels.get(song->getId()) < label; });
+    }
+
+    void labelsFor(size_t position, size_t count, uint64_t& first, uint64_t& step);
+    void spreadLabels(size_t position, size_t count);
+    void labelAll();
+
+    // Edits below the history and the log: contents, labels,
+    // back-references, the recommender, cursors and shuffle orders
+    void insertAt(SongRef song, size_t position) {
+        uint64_t label, step;
+        labelsFor(position, 1, label, step);
+        // The song pushes another out of the counted part of a full basket
+        bool counted = recommender.isTracking() && position < Recommender::BASKET_LIMIT;
+        bool full = songs.size() >= Recommender::BASKET_LIMIT;
+        vector<SongRef> before;
+        if (counted && full) before = basket();
+        // A cursor stays on its track; one on a removed track or past the end
+        // moves on to the inserted song
+        for (auto cursor : cursors) {
+            bool onTrack = cursor->index < songs.size() && !cursor->removed;
+            if (cursor->index > position || (cursor->index == position && onTrack)) cursor->index++;
+            cursor->shuffle.insert(position);
+        }
+        labels.set(song->getId(), label);
+        songs.insert(position, song);
+        song->attachPlaylist(this);
+        if (counted && full) {
+            recommender.changed(before, basket());
+        }
+        else if (counted) {
+            // Baskets are unordered, so the song can be linked as if appended
+            vector<SongRef> basketNow = basket();
+            basketNow.erase(basketNow.begin() + position);
+            basketNow.push_back(song);
+            recommender.added(basketNow);
+        }
+    }
+
+    void eraseAt(size_t position) {
+        SongRef song = songs[position];
+        labels.erase(song->getId());
+        songs.erase(position);
+        for (auto cursor : cursors) {
+            if (cursor->index > position) cursor->index--;
+            else if (cursor->index == position) cursor->removed = true;
+            cursor->shuffle.erase(position);
+        }
+        song->detachPlaylist(this);
+        if (recommender.isTracking()) recommender.removed(song, position, basket());
+    }
+
+    void moveAt(size_t from, size_t count, size_t to);
+
+    // Swaps in `next` (distinct songs), keeping back-references, the
+    // recommender, cursors and shuffle orders in step
+    void replaceSongs(const vector<SongRef>& next);
+    void logSongs() const;
+
+public:
+    static const size_t HISTORY_LIMIT = 32;
+
+    Playlist(string_view name, User* creator, bool isPublic = true)
+        : id(nextId++), nameId(namePool.intern(name)), creator(creator), isPublic(isPublic) {}
+
+    // Restores a persisted playlist under its original id
+    Playlist(uint32_t id, string_view name, User* creator, bool isPublic)
+        : id(id), nameId(namePool.intern(name)), creator(creator), isPublic(isPublic) {
+        nextId = max(nextId, id + 1);
+    }
+
+    static SlabPool<Playlist> pool;
+
+    static uint32_t getNextId() { return nextId; }
+    static void reserveIds(uint32_t next) { nextId = max(nextId, next); }
+    static void resetIds() { nextId = 0; }
+
+    uint32_t getId() const { return id; }
+    string_view getName() const { return namePool.view(nameId); }
+    int getSongCount() const { return songs.size(); }
+    const PersistentList<SongRef>& getSongs() const { return songs; }
+    User* getCreator() const { return creator; }
+    bool getIsPublic() const { return isPublic; }
+
+    // The current contents, in O(1)
+    PlaylistVersion snapshot() const { return { version, songs }; }
+    uint64_t getVersion() const { return version; }
+    // Earlier versions still available to undo, oldest first
+    const deque<PlaylistRevision>& getHistory() const { return history; }
+    // The current version or one still in the history
+    bool findVersion(uint64_t number, PlaylistVersion& found) const;
+
+    static PlaylistDiff diff(const PersistentList<SongRef>& older, const PersistentList<SongRef>& newer);
+
+    bool containsSong(SongRef song) const { return labels.contains(song->getId()); }
+
+    // The song's position, or SIZE_MAX if it is not in the playlist
+    size_t positionOf(SongRef song) const {
+        return labels.contains(song->getId()) ? rankOf(labels.get(song->getId())) : SIZE_MAX;
+    }
+
+    // Sets the contents of a playlist being restored, with no history or logging
+    void restoreSongs(const vector<SongRef>& restored);
+
+    void addSong(SongRef song) {
+        if (!labels.contains(song->getId())) {
+            remember(PlaylistRevision::INSERTED, song, songs.size());
+            insertAt(song, songs.size());
+            wal.log(WriteAheadLog::PLAYLIST_ADD_SONG, id, song->getId());
+        }
+    }
+
+    // Inserts `song` before `position` (at most the song count)
+    void insertSong(SongRef song, size_t position) {
+        if (!labels.contains(song->getId())) {
+            position = min(position, songs.size());
+            remember(PlaylistRevision::INSERTED, song, position);
+            insertAt(song, position);
+            wal.insertPlaylistSong(id, song->getId(), position);
+        }
+    }
+
+    void removeSong(SongRef song) {
+        size_t position = positionOf(song);
+        if (position != SIZE_MAX) {
+            remember(PlaylistRevision::REMOVED, song, position);
+            eraseAt(position);
+            wal.log(WriteAheadLog::PLAYLIST_REMOVE_SONG, id, song->getId());
+        }
+    }
+
+    // Moves songs [from, from + count) so that the first of them ends up at
+    // `to`, counted in the finished order. Returns false if the range or the
+    // target is out of bounds.
+    bool moveSongs(size_t from, size_t count, size_t to) {
+        if (count == 0 || from + count > songs.size() || to + count > songs.size()) return false;
+        if (from == to) return true;
+        remember(PlaylistRevision::MOVED, SongRef(), from, count, to);
+        moveAt(from, count, to);
+        wal.movePlaylistSongs(id, from, count, to);
+        return true;
+    }
+
+    // Puts the given songs first, in that order, and the rest after them in
+    // their current order. Songs not in the playlist are skipped.
+    void reorderSongs(const vector<SongRef>& order);
+    // Reorders by title, release year or artist; ties keep their order
+    void sortSongs(SongOrder order);
+
+    // Removes every song matching `pred` in a single pass
+    template <typename Pred>
+    void removeSongsIf(Pred pred) {
+        if (none_of(songs.begin(), songs.end(), pred)) return;
+        vector<SongRef> current = songs.toVector();
+        vector<SongRef> before = basket();
+        bool shuffled = any_of(cursors.begin(), cursors.end(),
+            [](const PlaylistCursor* cursor) { return cursor->shuffle.isActive(); });
+        vector<uint32_t> newPositions(shuffled ? current.size() : 0);
+
+        size_t kept = 0;
+        for (size_t i = 0; i < current.size(); i++) {
+            bool drop = pred(current[i]);
+            if (shuffled) newPositions[i] = drop ? UINT32_MAX : static_cast<uint32_t>(kept);
+            // A cursor on slot i lands on i's new slot, or the next kept one
+            for (auto cursor : cursors) {
+                if (cursor->index == i) {
+                    cursor->index = kept;
+                    if (drop) cursor->removed = true;
+                }
+            }
+            // The songs kept stay in order, so their labels stay valid
+            if (drop) {
+                labels.erase(current[i]->getId());
+                current[i]->detachPlaylist(this);
+            }
+            else {
+                current[kept++] = current[i];
+            }
+        }
+        for (auto cursor : cursors) {
+            if (cursor->index > kept) cursor->index = kept;
+            if (shuffled) cursor->shuffle.remap(newPositions);
+        }
+        current.resize(kept);
+        remember();
+        songs.assign(current.begin(), current.end());
+        recommender.changed(before, basket());
+    }
+
+    // Replaces the contents in one logged edit; duplicates keep their first
+    // place
+    void setSongs(const vector<SongRef>& next);
+
+    // Reverts the last edit not yet undone, leaving out songs that have
+    // since left the catalog, and records the result as a new version.
+    // Returns false if there is nothing to undo.
+    bool undo();
+
+    // Playback cursors, maintained by User
+    void attachCursor(PlaylistCursor* cursor) { cursors.push_back(cursor); }
+    void detachCursor(PlaylistCursor* cursor) {
+        auto it = find(cursors.begin(), cursors.end(), cursor);
+        if (it != cursors.end()) {
+            *it = cursors.back();
+            cursors.pop_back();
+        }
+    }
+
+    void display() const;
+
+    ~Playlist() {
+        recommender.removeBasket(basket());
+        for (auto& song : songs) song->detachPlaylist(this);
+        for (auto cursor : cursors) *cursor = PlaylistCursor();
+    }
+};
+
+// Playback state of one listening session: the playlist being played, the
+// position in it and the playback options. It belongs to the session rather
+// than the account, so one user can listen in several sessions at once.
+class Player {
+private:
+    PlaylistCursor playback;
+    SongRef currentSong;
+    PlaybackMode playbackMode = PlaybackMode::SEQUENTIAL;
+    bool isLooping = false;
+
+    SongRef songAt(size_t index) const;
+    size_t nextIndex();
+    size_t previousIndex() const;
+    void moveTo(size_t index);
+    void startShuffle();
+
+public:
+    Player() {}
+    // The playlist holds on to the cursor's address
+    Player(const Player&) = delete;
+    Player& operator=(const Player&) = delete;
+
+    ~Player() {
+        if (playback.playlist) playback.playlist->detachCursor(&playback);
+    }
+
+    Playlist* getCurrentPlaylist() const { return playback.playlist; }
+    Song* getCurrentSong() const { return currentSong.get(); }
+    PlaybackMode getPlaybackMode() const { return playbackMode; }
+    bool isLoopingEnabled() const { return isLooping; }
+
+    void setCurrentPlaylist(Playlist* playlist) {
+        TIME_SCOPE(PLAYBACK);
+        if (playback.playlist) playback.playlist->detachCursor(&playback);
+        playback = PlaylistCursor();
+        playback.playlist = playlist;
+        if (playlist) playlist->attachCursor(&playback);
+        playFrom(0);
+    }
+
+    // Starts playback at a position in the current playlist
+    void playFrom(size_t index) {
+        moveTo(index);
+        if (playbackMode == PlaybackMode::RANDOM) startShuffle();
+    }
+
+    void setPlaybackMode(PlaybackMode mode) {
+        playbackMode = mode;
+        if (mode == PlaybackMode::RANDOM) startShuffle();
+        else playback.shuffle.stop();
+    }
+
+    void toggleLoop() {
+        isLooping = !isLooping;
+    }
+
+    SongRef getNextSong() { return songAt(nextIndex()); }
+    SongRef getPreviousSong() const { return songAt(previousIndex()); }
+
+    // Advance playback and return the new current song, or null at either end
+    SongRef playNext();
+    SongRef playPrevious();
+};
+
+// User base class definition
+class User {
+private:
+    static uint32_t nextId;
+
+protected:
+    uint32_t id;
+    uint32_t usernameId;
+    PasswordHash password;
+    vector<SongRef> favoriteSongs;
+    vector<Playlist*> favoritePlaylists;
+    IdSet favoriteSongIds;
+    IdSet favoritePlaylistIds;
+    vector<Playlist*> personalPlaylists;
+
+public:
+    User(const string& username, const string& password)
+        : id(nextId++), usernameId(namePool.intern(username)), password(PasswordHash::create(password)) {}
+
+    // Restores a persisted account under its original id
+    User(uint32_t id, string_view username, const PasswordHash& password)
+        : id(id), usernameId(namePool.intern(username)), password(password) {
+        nextId = max(nextId, id + 1);
+    }
+
+    static uint32_t getNextId() { return nextId; }
+    static void reserveIds(uint32_t next) { nextId = max(nextId, next); }
+    static void resetIds() { nextId = 0; }
+
+    uint32_t getId() const { return id; }
+    string_view getUsername() const { return namePool.view(usernameId); }
+    const PasswordHash& getPasswordHash() const { return password; }
+    const vector<SongRef>& getFavoriteSongs() const { return favoriteSongs; }
+    const vector<Playlist*>& getFavoritePlaylists() const { return favoritePlaylists; }
+    const vector<Playlist*>& getPersonalPlaylists() const { return personalPlaylists; }
+
+    bool authenticate(const string& uname, const string& pwd) const {
+        return getUsername() == uname && password.verify(pwd);
+    }
+
+    void createPlaylist(const string& name, bool isPublic = true);
+    void deletePlaylist(Playlist* playlist);
+    void adoptPlaylist(Playlist* playlist) { personalPlaylists.push_back(playlist); }
+
+    void reserveFavorites(size_t songs, size_t playlists) {
+        favoriteSongs.reserve(songs);
+        favoriteSongIds.reserve(songs);
+        favoritePlaylists.reserve(playlists);
+        favoritePlaylistIds.reserve(playlists);
+    }
+
+    bool isFavoriteSong(SongRef song) const { return favoriteSongIds.contains(song->getId()); }
+    bool isFavoritePlaylist(Playlist* playlist) const { return favoritePlaylistIds.contains(playlist->getId()); }
+
+    void addFavoriteSong(SongRef song) {
+        if (favoriteSongIds.insert(song->getId())) {
+            favoriteSongs.push_back(song);
+            song->attachFavorite(this);
+            recommender.added(favoriteSongs);
+            wal.log(WriteAheadLog::FAVORITE_SONG_ADD, id, song->getId());
+        }
+    }
+
+    void removeFavoriteSong(SongRef song) {
+        if (favoriteSongIds.erase(song->getId())) {
+            auto it = find(favoriteSongs.begin(), favoriteSongs.end(), song);
+            size_t position = it - favoriteSongs.begin();
+            favoriteSongs.erase(it);
+            song->detachFavorite(this);
+            recommender.removed(song, position, favoriteSongs);
+            wal.log(WriteAheadLog::FAVORITE_SONG_REMOVE, id, song->getId());
+        }
+    }
+
+    // Removes every favorite song matching `pred` in a single pass
+    template <typename Pred>
+    void removeFavoriteSongsIf(Pred pred) {
+        if (none_of(favoriteSongs.begin(), favoriteSongs.end(), pred)) return;
+        recommender.removeBasket(favoriteSongs);
+        favoriteSongs.erase(remove_if(favoriteSongs.begin(), favoriteSongs.end(), [this, &pred](SongRef song) {
+            if (!pred(song)) return false;
+            favoriteSongIds.erase(song->getId());
+            song->detachFavorite(this);
+            return true;
+        }), favoriteSongs.end());
+        recommender.addBasket(favoriteSongs);
+    }
+
+    void addFavoritePlaylist(Playlist* playlist) {
+        if (favoritePlaylistIds.insert(playlist->getId())) {
+            favoritePlaylists.push_back(playlist);
+            wal.log(WriteAheadLog::FAVORITE_PLAYLIST_ADD, id, playlist->getId());
+        }
+    }
+
+    void removeFavoritePlaylist(Playlist* playlist) {
+        if (favoritePlaylistIds.erase(playlist->getId())) {
+            favoritePlaylists.erase(find(favoritePlaylists.begin(), favoritePlaylists.end(), playlist));
+            wal.log(WriteAheadLog::FAVORITE_PLAYLIST_REMOVE, id, playlist->getId());
+        }
+    }
+
+
+    // Search the live catalog, or a published view of it
+    vector<SongRef> searchSongs(const string& query) const;
+    vector<SongRef> searchSongs(const string& query, const CatalogView& view) const;
+    vector<Playlist*> searchPlaylists(const string& query) const;
+    vector<Playlist*> searchPlaylists(const string& query, const CatalogView& view) const;
+
+    // Typo-tolerant song search, best matches first; the last word of the
+    // query also matches as a prefix
+    vector<SongRef> rankSongs(const string& query, size_t limit) const;
+    vector<SongRef> rankSongs(const string& query, size_t limit, const CatalogView& view) const;
+    // Ways to finish the last word of `text`, most common first
+    vector<string> completeQuery(const string& text, size_t limit) const;
+    vector<string> completeQuery(const string& text, size_t limit, const CatalogView& view) const;
+
+    // Songs often kept together with `song`, and songs for this user based
+    // on their favorites, best first
+    vector<SongRef> similarSongs(SongRef song, size_t limit) const;
+    vector<SongRef> recommendedSongs(size_t limit) const;
+
+    void displayFavoriteSongs() const;
+    void displayFavoritePlaylists() const;
+    void displayPersonalPlaylists() const;
+
+    virtual void displayMenu();
+    virtual ~User();
+};
+
+// Admin class definition
+class Admin : public User {
+public:
+    Admin(const string& username, const string& password)
+        : User(username, password) {}
+    Admin(uint32_t id, string_view username, const PasswordHash& password)
+        : User(id, username, password) {}
+
+    void addSong(const string& title, Artist* artist, int year, const string& genre);
+    void removeSong(SongRef song);
+    void createArtist(const string& name);
+    void removeArtist(Artist* artist);
+    void createAlbum(Artist* artist, const string& name);
+
+    void displayMenu() override;
+};
+
+// Fork-join thread pool for data-parallel catalog work. Every worker owns a
+// deque of tasks: it pushes and pops at the back and, when it runs dry,
+// steals from the front of another deque, where the biggest pieces of a
+// split range sit. A thread that starts a parallel loop from outside the
+// pool queues into a shared deque and runs tasks until its loop is done, so
+// a pool of `threads` has threads - 1 workers and nested loops cannot
+// deadlock.
+class WorkStealingPool {
+private:
+    struct Queue {
+        mutex lock;
+        deque<function<void()>> tasks;
+    };
+
+    vector<unique_ptr<Queue>> queues;   // Shared queue first, then one per worker
+    vector<thread> workers;
+    atomic<size_t> queued{ 0 };
+    atomic<int> sleeping{ 0 };
+    atomic<bool> stopping{ false };
+    mutex idleLock;
+    condition_variable idle;
+
+    static size_t& currentQueue() {
+        thread_local size_t index = 0;
+        return index;
+    }
+
+    void push(function<void()> task) {
+        Queue& queue = *queues[currentQueue() < queues.size() ? currentQueue() : 0];
+        {
+            lock_guard<mutex> lock(queue.lock);
+            queue.tasks.push_back(move(task));
+        }
+        queued.fetch_add(1);
+        if (sleeping.load() > 0) {
+            lock_guard<mutex> lock(idleLock);
+            idle.notify_one();
+        }
+    }
+
+    // Runs one task: the newest from this thread's queue, or else the oldest
+    // from any other
+    bool runOne(size_t self) {
+        function<void()> task;
+        for (size_t n = 0; n < queues.size() && !task; n++) {
+            Queue& queue = *queues[(self + n) % queues.size()];
+            lock_guard<mutex> lock(queue.lock);
+            if (queue.tasks.empty()) continue;
+            if (n == 0) {
+                task = move(queue.tasks.back());
+                queue.tasks.pop_back();
+            }
+            else {
+                task = move(queue.tasks.front());
+                queue.tasks.pop_front();
+            }
+        }
+        if (!task) return false;
+        queued.fetch_sub(1);
+        task();
+        return true;
+    }
+
+    void work(size_t self) {
+        currentQueue() = self;
+        while (!stopping.load()) {
+            if (runOne(self)) continue;
+            unique_lock<mutex> lock(idleLock);
+            sleeping.fetch_add(1);
+            idle.wait(lock, [this] { return stopping.load() || queued.load() > 0; });
+            sleeping.fetch_sub(1);
+        }
+    }
+
+    template <typename Body>
+    struct Split {
+        WorkStealingPool& pool;
+        atomic<size_t>& pending;
+        size_t grain;
+        Body& body;
+
+        // Hands off the upper halves of [begin, end) and runs the lowest piece
+        void operator()(size_t begin, size_t end) const {
+            while (end - begin > grain) {
+                size_t mid = begin + (end - begin + grain) / (2 * grain) * grain;
+                pending.fetch_add(1);
+                Split split = *this;
+                pool.push([split, mid, end] { split(mid, end); });
+                end = mid;
+            }
+            body(begin, end);
+            pending.fetch_sub(1, memory_order_release);
+        }
+    };
+
+public:
+    explicit WorkStealingPool(unsigned threads) {
+        queues.push_back(make_unique<Queue>());
+        for (unsigned i = 1; i < max(1u, threads); i++) queues.push_back(make_unique<Queue>());
+        for (size_t i = 1; i < queues.size(); i++) workers.emplace_back(&WorkStealingPool::work, this, i);
+    }
+
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+    ~WorkStealingPool() {
+        {
+            lock_guard<mutex> lock(idleLock);
+            stopping.store(true);
+        }
+        idle.notify_all();
+        for (auto& worker : workers) worker.join();
+    }
+
+    // Threads that work on a loop, the calling thread included
+    unsigned size() const { return static_cast<unsigned>(queues.size()); }
+
+    // Calls body(begin, end) over [0, count) in pieces of `grain`; every
+    // piece but the last is exactly `grain` long and starts at a multiple of
+    // it. Returns once every piece has run.
+    template <typename Body>
+    void parallelFor(size_t count, size_t grain, Body body) {
+        if (count == 0) return;
+        grain = max<size_t>(1, grain);
+        atomic<size_t> pending{ 1 };
+        Split<Body>{ *this, pending, grain, body }(0, count);
+        size_t self = currentQueue() < queues.size() ? currentQueue() : 0;
+        while (pending.load(memory_order_acquire) > 0) {
+            if (!runOne(self)) this_thread::yield();
+        }
+    }
+};
+
+// The pool browse queries run on, one thread per core, started on first use
+WorkStealingPool& queryPool();
+
+enum class SongOrder {
+    TITLE,
+    YEAR,
+    ARTIST
+};
+
+// A browse query over SongColumns. Every filter that is set must match.
+struct SongQuery {
+    string artist;              // Substring of the artist name; empty matches any
+    string genre;               // Substring of the genre; empty matches any
+    int yearFrom = INT_MIN;     // Inclusive range of release years
+    int yearTo = INT_MAX;
+    bool sorted = false;        // Otherwise results come in catalog order
+    SongOrder order = SongOrder::TITLE;
+    size_t limit = 0;           // Only the first `limit` results; 0 keeps all
+};
+
+// Column store for the song catalog, one row per song in song id order.
+// Browse filters and sorts read only the narrow column they need, so they run
+// as simple loops over contiguous arrays instead of chasing Song pointers.
+// Columns are chunked copy-on-write so catalog views can share them. A
+// removed song leaves a null row behind until enough of them pile up to be
+// worth compacting.
+class SongColumns {
+private:
+    ChunkedVector<SongRef> songs;           // Null in removed rows
+    ChunkedVector<uint32_t> songIds;        // Ascending, removed rows included
+    size_t removedRows = 0;
+    ChunkedVector<uint32_t> artistIds;
+    ChunkedVector<uint32_t> artistNameIds;
+    ChunkedVector<uint32_t> genreIds;
+    ChunkedVector<int32_t> years;
+    ChunkedVector<uint32_t> titleIds;
+    PoolSubset artistNames;                 // Every artist name id in artistNameIds
+
+    vector<SongRef> gather(const vector<uint32_t>& rows) const {
+        vector<SongRef> result(rows.size());
+        for (size_t i = 0; i < rows.size(); i++) result[i] = songs[rows[i]];
+        return result;
+    }
+
+    // Keeps the rows for which keep[row] is set, in order. Rows before the
+    // first dropped one are not rewritten, so their chunks stay shared.
+    void compact(const vector<uint8_t>& keep) {
+        size_t out = 0;
+        for (size_t row = 0; row < songs.size(); row++) {
+            if (!keep[row]) continue;
+            if (out != row) {
+                songs.set(out, songs[row]);
+                songIds.set(out, songIds[row]);
+                artistIds.set(out, artistIds[row]);
+                artistNameIds.set(out, artistNameIds[row]);
+                genreIds.set(out, genreIds[row]);
+                years.set(out, years[row]);
+                titleIds.set(out, titleIds[row]);
+            }
+            out++;
+        }
+        songs.resize(out);
+        songIds.resize(out);
+        artistIds.resize(out);
+        artistNameIds.resize(out);
+        genreIds.resize(out);
+        years.resize(out);
+        titleIds.resize(out);
+        removedRows = 0;
+    }
+
+    // Row of the song with id `id`, or SIZE_MAX
+    size_t rowOf(uint32_t id) const {
+        size_t lo = 0, hi = songIds.size();
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (songIds[mid] < id) lo = mid + 1;
+            else hi = mid;
+        }
+        return lo < songIds.size() && songIds[lo] == id ? lo : SIZE_MAX;
+    }
+
+    // Drops removed rows from rows[first...]
+    void dropRemoved(vector<uint32_t>& rows, size_t first = 0) const {
+        if (removedRows == 0) return;
+        size_t kept = first;
+        for (size_t i = first; i < rows.size(); i++) {
+            rows[kept] = rows[i];
+            kept += songs[rows[i]].value() != 0;
+        }
+        rows.resize(kept);
+    }
+
+    static const size_t SCAN_GRAIN = 16384;   // Rows per scan task
+    static const size_t MERGE_GRAIN = 65536;  // Results per merge task
+
+    // A matching row with its sort key; rows are in song id order, so the
+    // row breaks ties the way SongOrderIndex does
+    template <typename Key>
+    struct Keyed {
+        Key key;
+        uint32_t row;
+
+        bool operator<(const Keyed& other) const {
+            return key < other.key || (key == other.key && row < other.row);
+        }
+    };
+
+    // A query with its names resolved to per-id match tables
+    struct RowFilter {
+        const uint8_t* artists;     // Indexed by artist name id; null matches any
+        const uint8_t* genres;      // Indexed by genre id; null matches any
+        int32_t yearFrom;
+        int32_t yearTo;
+    };
+
+    // Keeps the rows from `first` on whose entry in `ids` is flagged in `table`
+    static void narrow(vector<uint32_t>& rows, size_t first, const ChunkedVector<uint32_t>& ids, const uint8_t* table) {
+        size_t kept = first;
+        for (size_t i = first; i < rows.size(); i++) {
+            rows[kept] = rows[i];
+            kept += table[ids[rows[i]]];
+        }
+        rows.resize(kept);
+    }
+
+    // Appends the rows in [begin, end) that pass `filter`. The year range is
+    // checked a column chunk at a time without branches, then the artist and
+    // genre tables narrow the survivors. The range must not be inverted:
+    // its span would wrap and let every year through.
+    void selectRows(size_t begin, size_t end, const RowFilter& filter, vector<uint32_t>& rows) const {
+        size_t first = rows.size();
+        rows.resize(first + (end - begin));
+        size_t kept = first;
+        uint32_t span = uint32_t(int64_t(filter.yearTo) - filter.yearFrom);
+        for (size_t row = begin; row < end;) {
+            size_t length;
+            const int32_t* year = years.run(row, length);
+            length = min(length, end - row);
+            for (size_t i = 0; i < length; i++) {
+                rows[kept] = static_cast<uint32_t>(row + i);
+                kept += uint32_t(int64_t(year[i]) - filter.yearFrom) <= span;
+            }
+            row += length;
+        }
+        rows.resize(kept);
+        dropRemoved(rows, first);
+        if (filter.artists) narrow(rows, first, artistNameIds, filter.artists);
+        if (filter.genres) narrow(rows, first, genreIds, filter.genres);
+    }
+
+    // Which strings of `pool` contain `text`, one flag per id
+    static vector<uint8_t> matchingIds(const StringPool& pool, const string& text, WorkStealingPool& workers) {
+        vector<uint8_t> matches(pool.size());
+        workers.parallelFor(matches.size(), SCAN_GRAIN, [&](size_t begin, size_t end) {
+            for (size_t id = begin; id < end; id++) {
+                matches[id] = pool.view(static_cast<uint32_t>(id)).find(text) != string::npos;
+            }
+        });
+        return matches;
+    }
+
+    // Which artist names contain `text`, one flag per name id. Only the
+    // artist names are tested, not the usernames and playlist names that
+    // share namePool with them.
+    vector<uint8_t> matchingArtists(const string& text, WorkStealingPool& workers) const {
+        vector<uint8_t> matches(artistNames.limit());
+        workers.parallelFor(artistNames.size(), SCAN_GRAIN, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                uint32_t id = artistNames[i];
+                matches[id] = namePool.view(id).find(text) != string::npos;
+            }
+        });
+        return matches;
+    }
+
+    // Merges sorted runs `a` and `b` into `out` in pieces of MERGE_GRAIN
+    // outputs; each piece finds where it starts in both runs by binary search
+    template <typename T>
+    static void parallelMerge(const vector<T>& a, const vector<T>& b, T* out, WorkStealingPool& workers) {
+        auto splitAt = [&a, &b](size_t diagonal) {
+            size_t lo = diagonal > b.size() ? diagonal - b.size() : 0;
+            size_t hi = min(diagonal, a.size());
+            while (lo < hi) {
+                size_t mid = lo + (hi - lo) / 2;
+                if (a[mid] < b[diagonal - mid - 1]) lo = mid + 1;
+                else hi = mid;
+            }
+            return lo;
+        };
+        workers.parallelFor(a.size() + b.size(), MERGE_GRAIN, [&](size_t begin, size_t end) {
+            size_t i = splitAt(begin), iEnd = splitAt(end);
+            merge(a.begin() + i, a.begin() + iEnd, b.begin() + (begin - i), b.begin() + (end - iEnd), out + begin);
+        });
+    }
+
+    // Filters in SCAN_GRAIN pieces, sorts each piece (or keeps its top
+    // `limit`), then combines the pieces: a heap merge of the top lists, or
+    // rounds of pairwise parallel merges
+    template <typename Key, typename KeyOf>
+    vector<uint32_t> sortedRows(const SongQuery& query, KeyOf keyOf, const RowFilter& filter,
+        WorkStealingPool& workers) const {
+        size_t pieces = (songs.size() + SCAN_GRAIN - 1) / SCAN_GRAIN;
+        vector<vector<Keyed<Key>>> runs(pieces);
+        workers.parallelFor(songs.size(), SCAN_GRAIN, [&](size_t begin, size_t end) {
+            vector<uint32_t> rows;
+            selectRows(begin, end, filter, rows);
+            vector<Keyed<Key>>& run = runs[begin / SCAN_GRAIN];
+            run.reserve(rows.size());
+            for (uint32_t row : rows) run.push_back({ keyOf(row), row });
+            if (query.limit > 0 && run.size() > query.limit) {
+                nth_element(run.begin(), run.begin() + query.limit, run.end());
+                run.resize(query.limit);
+            }
+            sort(run.begin(), run.end());
+        });
+
+        vector<uint32_t> rows;
+        if (query.limit > 0) {
+            typedef pair<Keyed<Key>, size_t> Head;  // Next entry of a run, and which run
+            auto later = [](const Head& a, const Head& b) { return b.first < a.first; };
+            priority_queue<Head, vector<Head>, decltype(later)> heads(later);
+            vector<size_t> next(pieces, 1);
+            for (size_t i = 0; i < pieces; i++) {
+                if (!runs[i].empty()) heads.push({ runs[i][0], i });
+            }
+            while (!heads.empty() && rows.size() < query.limit) {
+                Head head = heads.top();
+                heads.pop();
+                rows.push_back(head.first.row);
+                size_t i = head.second;
+                if (next[i] < runs[i].size()) heads.push({ runs[i][next[i]++], i });
+            }
+            return rows;
+        }
+
+        runs.erase(remove_if(runs.begin(), runs.end(), [](const vector<Keyed<Key>>& run) { return run.empty(); }),
+            runs.end());
+        while (runs.size() > 1) {
+            vector<vector<Keyed<Key>>> merged((runs.size() + 1) / 2);
+            workers.parallelFor(merged.size(), 1, [&](size_t begin, size_t end) {
+                for (size_t i = begin; i < end; i++) {
+                    if (2 * i + 1 == runs.size()) {
+                        merged[i] = move(runs[2 * i]);
+                        continue;
+                    }
+                    merged[i].resize(runs[2 * i].size() + runs[2 * i + 1].size());
+                    parallelMerge(runs[2 * i], runs[2 * i + 1], merged[i].data(), workers);
+                    vector<Keyed<Key>>().swap(runs[2 * i]);
+                    vector<Keyed<Key>>().swap(runs[2 * i + 1]);
+                }
+            });
+            runs.swap(merged);
+        }
+        if (!runs.empty()) {
+            rows.resize(runs[0].size());
+            workers.parallelFor(rows.size(), MERGE_GRAIN, [&](size_t begin, size_t end) {
+                for (size_t i = begin; i < end; i++) rows[i] = runs[0][i].row;
+            });
+        }
+        return rows;
+    }
+
+    // Matching rows in catalog order: each piece collects its own, then they
+    // are copied into place behind a prefix sum of the piece sizes
+    vector<uint32_t> matchingRows(const SongQuery& query, const RowFilter& filter, WorkStealingPool& workers) const {
+        size_t pieces = (songs.size() + SCAN_GRAIN - 1) / SCAN_GRAIN;
+        vector<vector<uint32_t>> found(pieces);
+        workers.parallelFor(songs.size(), SCAN_GRAIN, [&](size_t begin, size_t end) {
+            vector<uint32_t>& rows = found[begin / SCAN_GRAIN];
+            selectRows(begin, end, filter, rows);
+            if (query.limit > 0 && rows.size() > query.limit) rows.resize(query.limit);
+        });
+        vector<size_t> offsets(pieces + 1, 0);
+        for (size_t i = 0; i < pieces; i++) offsets[i + 1] = offsets[i] + found[i].size();
+        size_t total = query.limit > 0 ? min(query.limit, offsets[pieces]) : offsets[pieces];
+        vector<uint32_t> rows(total);
+        workers.parallelFor(pieces, 1, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end && offsets[i] < total; i++) {
+                size_t count = min(found[i].size(), total - offsets[i]);
+                copy(found[i].begin(), found[i].begin() + count, rows.begin() + offsets[i]);
+            }
+        });
+        return rows;
+    }
+
+    vector<SongRef> gather(const vector<uint32_t>& rows, WorkStealingPool& workers) const {
+        vector<SongRef> result(rows.size());
+        workers.parallelFor(rows.size(), MERGE_GRAIN, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) result[i] = songs[rows[i]];
+        });
+        return result;
+    }
+
+public:
+    size_t size() const { return songs.size() - removedRows; }
+
+    void reserve(size_t rows) {
+        songs.reserve(rows);
+        songIds.reserve(rows);
+        artistIds.reserve(rows);
+        artistNameIds.reserve(rows);
+        genreIds.reserve(rows);
+        years.reserve(rows);
+        titleIds.reserve(rows);
+    }
+
+    void append(const Song* song) {
+        songs.push_back(song->getRef());
+        songIds.push_back(song->getId());
+        artistIds.push_back(song->getArtist()->getId());
+        artistNameIds.push_back(song->getArtist()->getNameId());
+        artistNames.add(song->getArtist()->getNameId());
+        genreIds.push_back(song->getGenreId());
+        years.push_back(song->getReleaseYear());
+        titleIds.push_back(song->getTitleId());
+    }
+
+    // Nulls the song's row, found by id. The removed rows are compacted away
+    // once they make up an eighth of the table, so a removal costs O(log n)
+    // amortized instead of a pass over every column.
+    void remove(SongRef song) {
+        size_t row = rowOf(song->getId());
+        if (row == SIZE_MAX || songs[row] != song) return;
+        songs.set(row, SongRef());
+        if (++removedRows * 8 >= songs.size()) compactRemoved();
+    }
+
+    void compactRemoved() {
+        vector<uint8_t> keep(songs.size());
+        for (size_t row = 0; row < songs.size(); row++) keep[row] = songs[row].value() != 0;
+        compact(keep);
+    }
+
+    void removeArtist(uint32_t artistId) {
+        vector<uint8_t> keep(songs.size());
+        for (size_t row = 0; row < songs.size(); row++) {
+            keep[row] = artistIds[row] != artistId && songs[row].value() != 0;
+        }
+        compact(keep);
+    }
+
+    // Runs a filter and sort over the columns on `workers`. Filters resolve
+    // artist and genre names once per distinct name, then every row costs a
+    // few integer compares. A year range that ends before it starts matches
+    // nothing.
+    vector<SongRef> query(const SongQuery& query, WorkStealingPool& workers = queryPool()) const {
+        TIME_SCOPE(BROWSE_FILTER);
+        if (query.yearFrom > query.yearTo) return {};
+        vector<uint8_t> artistMatches, genreMatches;
+        if (!query.artist.empty()) artistMatches = matchingArtists(query.artist, workers);
+        if (!query.genre.empty()) genreMatches = matchingIds(genrePool, query.genre, workers);
+        RowFilter filter = { query.artist.empty() ? nullptr : artistMatches.data(),
+            query.genre.empty() ? nullptr : genreMatches.data(), query.yearFrom, query.yearTo };
+
+        vector<uint32_t> rows;
+        if (!query.sorted) {
+            rows = matchingRows(query, filter, workers);
+        }
+        else if (query.order == SongOrder::YEAR) {
+            rows = sortedRows<int32_t>(query, [this](size_t row) { return years[row]; }, filter, workers);
+        }
+        else if (query.order == SongOrder::ARTIST) {
+            rows = sortedRows<string_view>(query,
+                [this](size_t row) { return namePool.view(artistNameIds[row]); }, filter, workers);
+        }
+        else {
+            rows = sortedRows<string_view>(query,
+                [this](size_t row) { return titlePool.view(titleIds[row]); }, filter, workers);
+        }
+        return gather(rows, workers);
+    }
+
+    vector<SongRef> filterByYear(int year) const {
+        SongQuery filter;
+        filter.yearFrom = filter.yearTo = year;
+        return query(filter);
+    }
+
+    // Exact genre match: a single interned-id compare per row
+    vector<SongRef> filterByGenreId(uint32_t genreId) const {
+        TIME_SCOPE(BROWSE_FILTER);
+        vector<uint32_t> rows;
+        for (size_t row = 0; row < genreIds.size(); row++) {
+            if (genreIds[row] == genreId) rows.push_back(static_cast<uint32_t>(row));
+        }
+        dropRemoved(rows);
+        return gather(rows);
+    }
+
+    // Substring match on the genre
+    vector<SongRef> filterByGenre(const string& genre) const {
+        SongQuery filter;
+        filter.genre = genre;
+        return query(filter);
+    }
+
+    // Substring match on the artist name
+    vector<SongRef> filterByArtist(const string& name) const {
+        SongQuery filter;
+        filter.artist = name;
+        return query(filter);
+    }
+
+    // Equal titles keep catalog order: rows are in id order, so the row
+    // breaks ties the same way the song id does in SongOrderIndex
+    vector<SongRef> sortedByTitle() const {
+        vector<uint32_t> rows(songs.size());
+        for (size_t row = 0; row < rows.size(); row++) rows[row] = static_cast<uint32_t>(row);
+        sort(rows.begin(), rows.end(), [this](uint32_t a, uint32_t b) {
+            if (titleIds[a] == titleIds[b]) return a < b;
+            return titlePool.view(titleIds[a]) < titlePool.view(titleIds[b]);
+        });
+        dropRemoved(rows);
+        return gather(rows);
+    }
+
+    // Counting sort over the year column; ties keep catalog order
+    vector<SongRef> sortedByYear() const {
+        if (years.empty()) return vector<SongRef>();
+        int32_t lowest = years[0], highest = years[0];
+        for (size_t row = 1; row < years.size(); row++) {
+            lowest = min(lowest, years[row]);
+            highest = max(highest, years[row]);
+        }
+        int64_t minYear = lowest;
+        int64_t span = int64_t(highest) - minYear + 1;
+        vector<uint32_t> rows(years.size());
+        if (span > (1 << 20)) {
+            for (size_t row = 0; row < rows.size(); row++) rows[row] = static_cast<uint32_t>(row);
+            stable_sort(rows.begin(), rows.end(), [this](uint32_t a, uint32_t b) { return years[a] < years[b]; });
+            dropRemoved(rows);
+            return gather(rows);
+        }
+        vector<uint32_t> starts(span + 1, 0);
+        for (size_t row = 0; row < years.size(); row++) starts[years[row] - minYear + 1]++;
+        for (int64_t i = 1; i <= span; i++) starts[i] += starts[i - 1];
+        for (size_t row = 0; row < years.size(); row++) {
+            rows[starts[years[row] - minYear]++] = static_cast<uint32_t>(row);
+        }
+        dropRemoved(rows);
+        return gather(rows);
+    }
+};
+
+// Position in a listing. Keyed listings remember the sort key and id of the
+// last item returned, so the next page starts after it even if songs were
+// added or removed in between; plain lists remember an offset.
+struct BrowseCursor {
+    bool started = false;
+    string_view text;
+    int32_t year = 0;
+    uint32_t id = 0;
+    size_t offset = 0;
+};
+
+template <typename T>
+struct BrowsePage {
+    vector<T> items;
+    BrowseCursor next;
+    bool hasMore = false;
+};
+
+// Sorted sequence stored as a list of small sorted chunks. Inserts and erases
+// touch one chunk plus, now and then, the chunk list, and a scan can start
+// anywhere after a binary search, without the per-node cost of a tree. Chunks
+// are shared copy-on-write, so copying the list for a catalog view only
+// copies the chunk pointers.
+template <typename Entry>
+class ChunkedSortedList {
+private:
+    typedef vector<Entry> Chunk;
+    static const size_t MAX_CHUNK = 512;
+
+    vector<shared_ptr<Chunk>> chunks;
+    size_t count = 0;
+
+    // First chunk whose last entry is not below `entry`, or the last chunk
+    size_t chunkFor(const Entry& entry) const {
+        auto it = partition_point(chunks.begin(), chunks.end(),
+            [&entry](const shared_ptr<Chunk>& chunk) { return chunk->back() < entry; });
+        return it == chunks.end() ? chunks.size() - 1 : it - chunks.begin();
+    }
+
+public:
+    size_t size() const { return count; }
+
+    // Replaces the contents with `entries`, which must already be sorted
+    void assign(const vector<Entry>& entries) {
+        chunks.clear();
+        for (size_t i = 0; i < entries.size(); i += MAX_CHUNK / 2) {
+            size_t end = min(entries.size(), i + MAX_CHUNK / 2);
+            chunks.push_back(make_shared<Chunk>(entries.begin() + i, entries.begin() + end));
+        }
+        count = entries.size();
+    }
+
+    void insert(const Entry& entry) {
+        if (chunks.empty()) {
+            chunks.push_back(make_shared<Chunk>(1, entry));
+            count = 1;
+            return;
+        }
+        size_t c = chunkFor(entry);
+        Chunk& chunk = writable(chunks[c]);
+        chunk.insert(lower_bound(chunk.begin(), chunk.end(), entry), entry);
+        count++;
+        if (chunk.size() > MAX_CHUNK) {
+            auto upper = make_shared<Chunk>(chunk.begin() + chunk.size() / 2, chunk.end());
+            chunk.resize(chunk.size() / 2);
+            chunks.insert(chunks.begin() + c + 1, std::move(upper));
+        }
+    }
+
+    bool erase(const Entry& entry) {
+        if (chunks.empty()) return false;
+        size_t c = chunkFor(entry);
+        const Chunk& shared = *chunks[c];
+        auto found = lower_bound(shared.begin(), shared.end(), entry);
+        if (found == shared.end() || entry < *found) return false;
+        size_t offset = found - shared.begin();
+        Chunk& chunk = writable(chunks[c]);
+        chunk.erase(chunk.begin() + offset);
+        count--;
+        if (chunk.empty()) chunks.erase(chunks.begin() + c);
+        return true;
+    }
+
+    // Appends up to `limit` entries that sort after `after` (or from the
+    // start when it is null); returns true if more entries follow
+    bool scan(const Entry* after, size_t limit, vector<Entry>& out) const {
+        size_t c = 0;
+        size_t pos = 0;
+        if (after) {
+            auto it = partition_point(chunks.begin(), chunks.end(),
+                [after](const shared_ptr<Chunk>& chunk) { return !(*after < chunk->back()); });
+            c = it - chunks.begin();
+            if (c < chunks.size()) {
+                pos = upper_bound(chunks[c]->begin(), chunks[c]->end(), *after) - chunks[c]->begin();
+            }
+        }
+        for (; c < chunks.size(); c++, pos = 0) {
+            const Chunk& chunk = *chunks[c];
+            for (; pos < chunk.size(); pos++) {
+                if (limit == 0) return true;
+                out.push_back(chunk[pos]);
+                limit--;
+            }
+        }
+        return false;
+    }
+};
+
+// Secondary indexes over the catalog in title, year and artist order. Ties
+// are broken by song id, which is also catalog order.
+class SongOrderIndex {
+private:
+    template <typename Key>
+    struct Entry {
+        Key key;
+        uint32_t songId;
+        SongRef song;
+
+        bool operator<(const Entry& other) const {
+            return key < other.key || (key == other.key && songId < other.songId);
+        }
+    };
+    typedef Entry<string_view> TextEntry;
+    typedef Entry<int32_t> YearEntry;
+
+    ChunkedSortedList<TextEntry> byTitle;
+    ChunkedSortedList<YearEntry> byYear;
+    ChunkedSortedList<TextEntry> byArtist;
+
+    static TextEntry titleEntry(const Song* song) { return { song->getTitle(), song->getId(), song->getRef() }; }
+    static YearEntry yearEntry(const Song* song) { return { song->getReleaseYear(), song->getId(), song->getRef() }; }
+    static TextEntry artistEntry(const Song* song) { return { song->getArtist()->getName(), song->getId(), song->getRef() }; }
+
+    template <typename Key, typename ToCursor>
+    static BrowsePage<SongRef> pageOf(const ChunkedSortedList<Entry<Key>>& list, const Entry<Key>& after,
+        bool started, size_t limit, ToCursor toCursor) {
+        vector<Entry<Key>> entries;
+        entries.reserve(limit);
+        BrowsePage<SongRef> page;
+        page.hasMore = list.scan(started ? &after : nullptr, limit, entries);
+        page.items.reserve(entries.size());
+        for (const auto& entry : entries) page.items.push_back(entry.song);
+        if (!entries.empty()) {
+            page.next.started = true;
+            page.next.id = entries.back().songId;
+            toCursor(entries.back().key, page.next);
+        }
+        else {
+            page.next = BrowseCursor();
+        }
+        return page;
+    }
+
+public:
+    size_t size() const { return byTitle.size(); }
+
+    void add(const Song* song) {
+        byTitle.insert(titleEntry(song));
+        byYear.insert(yearEntry(song));
+        byArtist.insert(artistEntry(song));
+    }
+
+    void remove(const Song* song) {
+        byTitle.erase(titleEntry(song));
+        byYear.erase(yearEntry(song));
+        byArtist.erase(artistEntry(song));
+    }
+
+    // Builds all three orders from scratch in O(n log n), sorting them on
+    // separate threads
+    void rebuild(const IdOrderedList<SongRef>& songs) {
+        vector<TextEntry> titles, artists;
+        vector<YearEntry> years;
+        titles.reserve(songs.size());
+        artists.reserve(songs.size());
+        years.reserve(songs.size());
+        for (const auto& song : songs) {
+            titles.push_back(titleEntry(song.get()));
+            years.push_back(yearEntry(song.get()));
+            artists.push_back(artistEntry(song.get()));
+        }
+        thread yearSort([&years] { sort(years.begin(), years.end()); });
+        thread artistSort([&artists] { sort(artists.begin(), artists.end()); });
+        sort(titles.begin(), titles.end());
+        yearSort.join();
+        artistSort.join();
+        byTitle.assign(titles);
+        byYear.assign(years);
+        byArtist.assign(artists);
+    }
+
+    BrowsePage<SongRef> page(SongOrder order, const BrowseCursor& after, size_t limit) const {
+        TIME_SCOPE(BROWSE_SORT);
+        auto setText = [](string_view key, BrowseCursor& cursor) { cursor.text = key; };
+        switch (order) {
+        case SongOrder::YEAR:
+            return pageOf(byYear, YearEntry{ after.year, after.id, SongRef() }, after.started, limit,
+                [](int32_t key, BrowseCursor& cursor) { cursor.year = key; });
+        case SongOrder::ARTIST:
+            return pageOf(byArtist, TextEntry{ after.text, after.id, SongRef() }, after.started, limit, setText);
+        default:
+            return pageOf(byTitle, TextEntry{ after.text, after.id, SongRef() }, after.started, limit, setText);
+        }
+    }
+};
+
+// Username index over allUsers and the admin account
+class UserDirectory {
+private:
+    unordered_map<string_view, User*> byName;
+
+    // Hashed on the first unknown name rather than with every directory, so
+    // that restarting the library does not pay for a full-strength hash
+    static const PasswordHash& decoy() {
+        static const PasswordHash hash = PasswordHash::create("");
+        return hash;
+    }
+
+public:
+    void reserve(size_t count) { byName.reserve(count); }
+    size_t size() const { return byName.size(); }
+    bool contains(const string& username) const { return byName.count(username) != 0; }
+
+    User* find(const string& username) const {
+        auto it = byName.find(username);
+        return it == byName.end() ? nullptr : it->second;
+    }
+
+    // Returns false if the username is already taken
+    bool add(User* user) {
+        return byName.emplace(user->getUsername(), user).second;
+    }
+
+    void remove(User* user) {
+        auto it = byName.find(user->getUsername());
+        if (it != byName.end() && it->second == user) byName.erase(it);
+    }
+
+    // Unknown names still pay for one hash so they are not faster to reject
+    User* authenticate(const string& username, const string& password) const {
+        TIME_SCOPE(AUTHENTICATE);
+        User* user = find(username);
+        if (!user) {
+            decoy().verify(password);
+            COUNT_METRIC(FAILED_LOGINS, 1);
+            return nullptr;
+        }
+        if (user->authenticate(username, password)) return user;
+        COUNT_METRIC(FAILED_LOGINS, 1);
+        return nullptr;
+    }
+};
+
+// Per-column indexes for filter expressions, all keyed by song id: an
+// ordered year index for ranges, one bitmap per genre, and one posting list
+// per artist name. Conditions on several columns are answered by
+// intersecting bitmaps instead of scanning the catalog.
+class SongFilterIndex {
+private:
+    ChunkedVector<SongRef> songsById;       // Null where a song was removed
+    IdBitmap everything;
+    map<int32_t, IdBitmap> byYear;
+    ChunkedVector<IdBitmap> byGenre;        // By genre id
+    ChunkedVector<vector<uint32_t>> byArtist;  // Sorted song ids, by artist name id
+    PoolSubset artistNames;                 // Name ids with a slot in byArtist
+
+    template <typename T>
+    static T& slot(ChunkedVector<T>& entries, uint32_t id) {
+        if (id >= entries.size()) entries.resize(id + 1);
+        return entries.modify(id);
+    }
+
+    // Id of the pool string equal to `text` if it is below `limit`, found
+    // by hash rather than by comparing every string
+    static vector<uint32_t> equalTo(const StringPool& pool, size_t limit, const string& text) {
+        uint32_t id = pool.find(text);
+        return id != StringPool::NONE && id < limit ? vector<uint32_t>{ id } : vector<uint32_t>();
+    }
+
+public:
+    size_t size() const { return everything.size(); }
+    const IdBitmap& all() const { return everything; }
+
+    void add(const Song* song) {
+        uint32_t id = song->getId();
+        if (id >= songsById.size()) songsById.resize(id + 1);
+        songsById.set(id, song->getRef());
+        everything.add(id);
+        byYear[song->getReleaseYear()].add(id);
+        slot(byGenre, song->getGenreId()).add(id);
+        vector<uint32_t>& songs = slot(byArtist, song->getArtist()->getNameId());
+        songs.insert(upper_bound(songs.begin(), songs.end(), id), id);
+        artistNames.add(song->getArtist()->getNameId());
+    }
+
+    void remove(const Song* song) {
+        uint32_t id = song->getId();
+        if (id >= songsById.size() || !songsById[id]) return;
+        songsById.set(id, SongRef());
+        everything.remove(id);
+        auto year = byYear.find(song->getReleaseYear());
+        year->second.remove(id);
+        if (year->second.empty()) byYear.erase(year);
+        byGenre.modify(song->getGenreId()).remove(id);
+        vector<uint32_t>& songs = byArtist.modify(song->getArtist()->getNameId());
+        songs.erase(lower_bound(songs.begin(), songs.end(), id));
+    }
+
+    // Songs released in [from, to]. A range that spans most years is taken
+    // as everything minus the years outside it.
+    IdBitmap years(int32_t from, int32_t to) const {
+        if (from > to) return IdBitmap();
+        auto begin = byYear.lower_bound(from), end = byYear.upper_bound(to);
+        size_t inside = distance(begin, end);
+        vector<const IdBitmap*> hits;
+        if (inside * 2 <= byYear.size()) {
+            for (auto it = begin; it != end; ++it) hits.push_back(&it->second);
+            return IdBitmap::uniteAll(hits);
+        }
+        for (auto it = byYear.begin(); it != begin; ++it) hits.push_back(&it->second);
+        for (auto it = end; it != byYear.end(); ++it) hits.push_back(&it->second);
+        return IdBitmap::subtract(everything, IdBitmap::uniteAll(hits));
+    }
+
+    IdBitmap genres(const string& text, bool exact) const {
+        vector<uint32_t> ids;
+        if (exact) {
+            ids = equalTo(genrePool, byGenre.size(), text);
+        }
+        else {
+            for (uint32_t id = 0; id < byGenre.size(); id++) {
+                if (genrePool.view(id).find(text) != string_view::npos) ids.push_back(id);
+            }
+        }
+        vector<const IdBitmap*> hits;
+        for (uint32_t id : ids) hits.push_back(&byGenre[id]);
+        return IdBitmap::uniteAll(hits);
+    }
+
+    // Artists have few songs each, so their posting lists are plain id
+    // arrays; several are merged through a flat bitset over all song ids.
+    // A substring is looked for in artist names only, not in every name in
+    // namePool.
+    IdBitmap artists(const string& text, bool exact) const {
+        vector<uint32_t> ids;
+        if (exact) {
+            ids = equalTo(namePool, byArtist.size(), text);
+        }
+        else {
+            for (size_t i = 0; i < artistNames.size(); i++) {
+                if (namePool.view(artistNames[i]).find(text) != string_view::npos) ids.push_back(artistNames[i]);
+            }
+        }
+        if (ids.size() == 1) return IdBitmap::fromSorted(byArtist[ids[0]]);
+        vector<uint64_t> words((songsById.size() + 63) / 64);
+        for (uint32_t id : ids) {
+            for (uint32_t song : byArtist[id]) words[song >> 6] |= uint64_t(1) << (song & 63);
+        }
+        return IdBitmap::fromBits(words);
+    }
+
+    // The songs of `ids` in catalog order, at most `limit` of them (0 for all)
+    vector<SongRef> songsOf(const IdBitmap& ids, size_t limit = 0) const {
+        vector<SongRef> songs;
+        songs.reserve(limit > 0 ? min(limit, ids.size()) : ids.size());
+        ids.forEach([&](uint32_t id) {
+            if (limit == 0 || songs.size() < limit) songs.push_back(songsById[id]);
+        });
+        return songs;
+    }
+};
+
+// A parsed filter expression such as
+//     genre=Rock AND year>=2015 AND artist~"Two"
+// Conditions compare artist, genre or year with =, !=, <, <=, > or >=; ~
+// tests whether an artist or genre contains the text. They combine with
+// AND, OR, NOT and parentheses; AND binds tighter than OR, and keywords may
+// be written in any case. Text with spaces or operators goes in double
+// quotes. Matching is case-sensitive, like the browse filters.
+class SongFilter {
+public:
+    enum class Field { ARTIST, GENRE, YEAR };
+    enum class Compare { EQUAL, NOT_EQUAL, LESS, LESS_EQUAL, GREATER, GREATER_EQUAL, CONTAINS };
+
+private:
+    struct Node {
+        enum Kind { AND, OR, NOT, TEST } kind;
+        vector<unique_ptr<Node>> children;
+        Field field = Field::YEAR;
+        Compare compare = Compare::EQUAL;
+        string text;
+        int32_t year = 0;
+    };
+
+    class Parser;
+    unique_ptr<Node> root;
+
+    static IdBitmap evaluate(const Node& node, const SongFilterIndex& index);
+
+public:
+    // Parses `text`; on failure returns false and describes the problem in `error`
+    bool parse(const string& text, string& error);
+
+    IdBitmap evaluate(const SongFilterIndex& index) const;
+    vector<SongRef> run(const SongFilterIndex& index, size_t limit = 0) const;
+};
+
+// Everything the song catalog is read through: search indexes over allSongs
+// (title, artist name) and allPlaylists (name), the word dictionary for ranked
+// song search, the scan-friendly column copy for browse filters, the sorted
+// listings and the bitmap indexes for filter expressions. Every part shares
+// its storage copy-on-write, so copying a whole view is cheap.
+struct CatalogView {
+    SearchIndex<Song, SongRef> songSearch;
+    SearchIndex<Playlist> playlistSearch;
+    TermIndex<Song, SongRef> songTerms;
+    SongColumns columns;
+    SongOrderIndex orders;
+    SongFilterIndex filters;
+};
+
+// The live catalog indexes. Writers update them in place; a SessionHost
+// publishes read-only copies for its sessions.
+extern CatalogView catalog;
+
+// Epoch-based reclamation for data that lock-free readers may still be using.
+// A reader announces the current epoch for as long as it holds pointers; an
+// object the writer retires is freed once every active reader has announced a
+// later epoch. Until deferral is switched on (by a SessionHost), nothing reads
+// without the writer knowing, so retired objects are freed at once.
+class EpochDomain {
+public:
+    static const size_t MAX_READERS = 1024;
+
+private:
+    static const uint64_t IDLE = UINT64_MAX;
+
+    struct alignas(64) Slot {
+        atomic<uint64_t> epoch{ IDLE };
+        atomic<bool> claimed{ false };
+    };
+
+    // A thread's slot, claimed on its first read and given back when it exits
+    struct ThreadSlot {
+        Slot* slot = nullptr;
+        int depth = 0;
+        ~ThreadSlot() {
+            if (slot) slot->claimed.store(false, memory_order_release);
+        }
+    };
+
+    Slot slots[MAX_READERS];
+    atomic<size_t> slotsInUse{ 0 };
+    atomic<uint64_t> epoch{ 1 };
+    vector<pair<uint64_t, function<void()>>> retired;
+    bool deferring = false;
+
+    Slot* claimSlot() {
+        for (size_t i = 0; i < MAX_READERS; i++) {
+            bool expected = false;
+            if (slots[i].claimed.compare_exchange_strong(expected, true)) {
+                size_t inUse = slotsInUse.load();
+                while (inUse < i + 1 && !slotsInUse.compare_exchange_weak(inUse, i + 1)) {}
+                return &slots[i];
+            }
+        }
+        throw runtime_error("too many reader threads");
+    }
+
+public:
+    // Read-side critical section; guards nest within a thread
+    class Guard {
+    private:
+        ThreadSlot& state;
+
+        static ThreadSlot& threadSlot() {
+            thread_local ThreadSlot state;
+            return state;
+        }
+
+    public:
+        explicit Guard(EpochDomain& domain) : state(threadSlot()) {
+            if (!state.slot) state.slot = domain.claimSlot();
+            if (state.depth++ > 0) return;
+            // Re-check so a writer scanning the slots cannot miss us
+            uint64_t seen;
+            do {
+                seen = domain.epoch.load();
+                state.slot->epoch.store(seen);
+            } while (domain.epoch.load() != seen);
+        }
+
+        ~Guard() {
+            if (--state.depth == 0) state.slot->epoch.store(IDLE, memory_order_release);
+        }
+
+        Guard(const Guard&) = delete;
+        Guard& operator=(const Guard&) = delete;
+    };
+
+    // The rest is for the single writer
+
+    void setDeferring(bool on) {
+        deferring = on;
+        if (!on) reclaim();
+    }
+
+    // Frees `release` once no reader can see what it frees: after the next
+    // advance() and once the readers of earlier epochs are done
+    void retire(function<void()> release) {
+        if (!deferring) {
+            release();
+            return;
+        }
+        retired.emplace_back(epoch.load() + 1, std::move(release));
+    }
+
+    // Starts a new epoch; call after unlinking or replacing what was retired
+    void advance() { epoch.fetch_add(1); }
+
+    void reclaim() {
+        uint64_t oldest = epoch.load();
+        size_t inUse = slotsInUse.load();
+        for (size_t i = 0; i < inUse; i++) oldest = min(oldest, slots[i].epoch.load());
+        if (!deferring) oldest = UINT64_MAX;
+
+        size_t done = 0;
+        while (done < retired.size() && retired[done].first <= oldest) {
+            retired[done].second();
+            done++;
+        }
+        retired.erase(retired.begin(), retired.begin() + done);
+    }
+
+    size_t pending() const { return retired.size(); }
+};
+
+extern EpochDomain catalogEpochs;
+
+extern UserDirectory userDirectory;
+
+// Catalog life cycle and persistence, implemented in MusicLibrary.cpp
+const char* const SNAPSHOT_PATH = "music_library.snapshot";
+
+// Builds the demo catalog and the admin account
+void initializeSystem();
+// Frees every object, empties the global collections and indexes and starts
+// the id counters over
+void shutdownSystem();
+bool saveSnapshot(const string& path);
+// Returns false, leaving the system empty, if the file is missing or invalid.
+// The catalog indexes are not built until indexCatalog runs.
+bool loadSnapshot(const string& path);
+// Builds the catalog indexes a snapshot load left out; returns at once when
+// they are up to date. Everything that reads or edits `catalog` calls it
+// first, from the writer's side.
+void indexCatalog();
+// Returns the length of the intact prefix of the log that was applied
+uint64_t replayWriteAheadLog(const string& path, size_t* applied = nullptr);
+// Recounts song co-occurrence from every playlist and favorites list
+void rebuildRecommendations(unsigned threads);
+// Creates a regular account; returns nullptr if the username is taken
+User* registerUser(const string& username, const string& password);
+
+// Streaming bulk loader for CSV or TSV files with the columns title, artist,
+// year, genre and an optional album (a header row is skipped). The file is
+// read in fixed-size blocks, so memory stays bounded whatever its length; a
+// row cut off by the end of a block is carried over to the next one. Each
+// block is cut at row ends into one chunk per worker thread; workers parse
+// their rows and precompute the search grams, then the main thread applies
+// the rows in file order. Artist and album names resolve through hash maps.
+// Rows longer than maxRowSize, and CSV rows with a line break inside a quoted
+// field, are rejected and counted. Imports bypass the WAL: callers
+// checkpoint afterwards.
+class CatalogImporter {
+public:
+    struct Options {
+        size_t blockSize = 8 << 20;
+        size_t maxRowSize = 1 << 20;
+        unsigned threads = max(1u, thread::hardware_concurrency());
+    };
+
+    struct Result {
+        size_t rows = 0;
+        size_t skipped = 0;         // Every row not imported, including the two below
+        size_t tooLong = 0;         // Rows longer than maxRowSize
+        size_t multiline = 0;       // Rows with a line break in a quoted field
+        size_t artistsCreated = 0;
+        size_t albumsCreated = 0;
+    };
+
+private:
+    struct Row {
+        string_view title, artist, genre, album;
+        int year = 0;
+        size_t gramsBegin = 0, gramsEnd = 0;
+    };
+
+    struct Chunk {
+        char* begin;
+        char* end;
+        bool firstOfFile;
+        vector<Row> rows;
+        vector<uint32_t> grams;
+        size_t skipped = 0;
+        size_t tooLong = 0;
+        size_t multiline = 0;
+    };
+
+    Admin* owner;
+    Options options;
+    char delimiter = 0;
+    bool quotes = false;    // The current block is CSV with quote characters in it
+    Result result;
+    unordered_map<string_view, Artist*> artistsByName;
+    unordered_map<uint32_t, unordered_map<string_view, Playlist*>> albumsByArtist;
+
+    static string_view trimmed(const char* begin, const char* end) {
+        while (begin < end && isspace(static_cast<unsigned char>(*begin))) begin++;
+        while (end > begin && isspace(static_cast<unsigned char>(end[-1]))) end--;
+        return string_view(begin, end - begin);
+    }
+
+    // Splits one line in place. Quoted CSV fields are unescaped into the
+    // buffer itself, which is safe because the result is never longer.
+    size_t splitLine(char* begin, char* end, string_view* fields, size_t maxFields) const {
+        size_t count = 0;
+        char* pos = begin;
+        while (true) {
+            if (count == maxFields) return maxFields + 1;
+            char* fieldStart = pos;
+            while (pos < end && (*pos == ' ' || *pos == '\t') && *pos != delimiter) pos++;
+            if (delimiter == ',' && pos < end && *pos == '"') {
+                char* out = fieldStart;
+                for (pos++; pos < end; pos++) {
+                    if (*pos == '"') {
+                        if (pos + 1 < end && pos[1] == '"') pos++;
+                        else break;
+                    }
+                    *out++ = *pos;
+                }
+                fields[count++] = string_view(fieldStart, out - fieldStart);
+                while (pos < end && *pos != delimiter) pos++;
+            }
+            else {
+                pos = fieldStart;
+                while (pos < end && *pos != delimiter) pos++;
+                fields[count++] = trimmed(fieldStart, pos);
+            }
+            if (pos >= end) return count;
+            pos++;
+        }
+    }
+
+    // End of the row starting at `pos`: just past its newline, or nullptr if
+    // the row does not end before `end`. A newline inside a quoted CSV field
+    // does not end the row; `multiline` is set instead. Quotes only open a
+    // field at its start, the same rule splitLine follows.
+    char* rowEnd(char* pos, char* end, bool& multiline) const {
+        multiline = false;
+        if (!quotes) {
+            char* newline = static_cast<char*>(memchr(pos, '\n', end - pos));
+            return newline ? newline + 1 : nullptr;
+        }
+        bool fieldStart = true, quoted = false;
+        for (; pos < end; pos++) {
+            if (quoted) {
+                if (*pos == '"') {
+                    if (pos + 1 < end && pos[1] == '"') pos++;
+                    else quoted = false;
+                }
+                else if (*pos == '\n') {
+                    multiline = true;
+                }
+            }
+            else if (*pos == '\n') {
+                return pos + 1;
+            }
+            else if (*pos == delimiter) {
+                fieldStart = true;
+            }
+            else if (*pos == '"' && fieldStart) {
+                quoted = true;
+                fieldStart = false;
+            }
+            else if (*pos != ' ' && *pos != '\t') {
+                fieldStart = false;
+            }
+        }
+        return nullptr;
+    }
+
+    // End of the last whole row in [begin, end), or `begin` if there is none
+    char* lastRowEnd(char* begin, char* end) const {
+        if (quotes) {
+            char* last = begin;
+            bool multiline;
+            while (char* next = rowEnd(last, end, multiline)) last = next;
+            return last;
+        }
+        char* last = end;
+        while (last > begin && last[-1] != '\n') last--;
+        return last;
+    }
+
+    void parseChunk(Chunk& chunk) const {
+        string_view fields[5];
+        char* line = chunk.begin;
+        bool first = chunk.firstOfFile;
+        while (line < chunk.end) {
+            bool multiline = false;
+            char* next = rowEnd(line, chunk.end, multiline);
+            if (!next) next = chunk.end;
+            char* lineEnd = next[-1] == '\n' ? next - 1 : next;
+            if (lineEnd > line && lineEnd[-1] == '\r') lineEnd--;
+            if (multiline || size_t(lineEnd - line) > options.maxRowSize) {
+                first = false;
+                line = next;
+                chunk.skipped++;
+                if (multiline) chunk.multiline++;
+                else chunk.tooLong++;
+                continue;
+            }
+
+            size_t count = lineEnd > line ? splitLine(line, lineEnd, fields, 5) : 0;
+            bool header = first && count >= 1 && fields[0].size() == 5 &&
+                equal(fields[0].begin(), fields[0].end(), "title",
+                    [](char a, char b) { return tolower(static_cast<unsigned char>(a)) == b; });
+            first = false;
+            line = next;
+            if (count == 0 || header) continue;
+
+            Row row;
+            const char* yearEnd = count >= 4 ? fields[2].data() + fields[2].size() : nullptr;
+            if (count < 4 || count > 5 || fields[0].empty() || fields[1].empty() || fields[2].empty() ||
+                from_chars(fields[2].data(), yearEnd, row.year).ptr != yearEnd) {
+                chunk.skipped++;
+                continue;
+            }
+            row.title = fields[0];
+            row.artist = fields[1];
+            row.genre = fields[3];
+            if (count == 5) row.album = fields[4];
+
+            row.gramsBegin = chunk.grams.size();
+            vector<uint32_t> grams = SearchIndex<Song, SongRef>::gramsOf({ row.title, row.artist });
+            chunk.grams.insert(chunk.grams.end(), grams.begin(), grams.end());
+            row.gramsEnd = chunk.grams.size();
+            chunk.rows.push_back(row);
+        }
+    }
+
+    Artist* resolveArtist(string_view name) {
+        auto found = artistsByName.find(name);
+        if (found != artistsByName.end()) return found->second;
+        owner->createArtist(string(name));
+        Artist* artist = allArtists.back();
+        artistsByName.emplace(artist->getName(), artist);
+        result.artistsCreated++;
+        return artist;
+    }
+
+    Playlist* resolveAlbum(Artist* artist, string_view name) {
+        auto inserted = albumsByArtist.try_emplace(artist->getId());
+        auto& albums = inserted.first->second;
+        if (inserted.second) {
+            for (auto album : artist->getAlbums()) albums.emplace(album->getName(), album);
+        }
+        auto found = albums.find(name);
+        if (found != albums.end()) return found->second;
+        owner->createAlbum(artist, string(name));
+        Playlist* album = allPlaylists.back();
+        albums.emplace(album->getName(), album);
+        result.albumsCreated++;
+        return album;
+    }
+
+    // The steps of Admin::addSong, minus the WAL record and, on large
+    // imports, the sort orders (rebuilt once at the end)
+    void apply(const Chunk& chunk, bool maintainOrders) {
+        for (const Row& row : chunk.rows) {
+            Artist* artist = resolveArtist(row.artist);
+            Song* song = Song::pool.create(row.title, artist, row.year, row.genre);
+            allSongs.push_back(song);
+            catalog.columns.append(song);
+            catalog.filters.add(song);
+            if (maintainOrders) catalog.orders.add(song);
+            artist->addSong(song);
+            catalog.songSearch.addGrams(song, chunk.grams.data() + row.gramsBegin, chunk.grams.data() + row.gramsEnd);
+            catalog.songTerms.add(song, { song->getTitle(), artist->getName() });
+            if (!row.album.empty()) resolveAlbum(artist, row.album)->addSong(song);
+        }
+        result.rows += chunk.rows.size();
+        result.skipped += chunk.skipped;
+        result.tooLong += chunk.tooLong;
+        result.multiline += chunk.multiline;
+    }
+
+    // Cuts [begin, end) into `parts` pieces that end on row boundaries. With
+    // quotes in play a row end can only be found by walking the rows from
+    // the start, which is one pass over the block in all.
+    vector<pair<char*, char*>> cutAtRows(char* begin, char* end, size_t parts) const {
+        vector<pair<char*, char*>> pieces;
+        char* start = begin;
+        for (size_t i = 1; i <= parts && start < end; i++) {
+            char* stop = i == parts ? end : max(start, begin + (end - begin) * i / parts);
+            if (stop < end && quotes) {
+                char* row = start;
+                bool multiline;
+                while (row < stop) {
+                    char* next = rowEnd(row, end, multiline);
+                    row = next ? next : end;
+                }
+                stop = row;
+            }
+            else if (stop < end) {
+                char* newline = static_cast<char*>(memchr(stop, '\n', end - stop));
+                stop = newline ? newline + 1 : end;
+            }
+            pieces.emplace_back(start, stop);
+            start = stop;
+        }
+        return pieces;
+    }
+
+public:
+    explicit CatalogImporter(Admin* owner) : owner(owner) {}
+
+    void setOptions(const Options& newOptions) { options = newOptions; }
+
+    bool importFile(const string& path) {
+        ifstream file(path, ios::binary | ios::ate);
+        if (!file) return false;
+        uint64_t fileSize = static_cast<uint64_t>(file.tellg());
+        file.seekg(0);
+
+        indexCatalog();
+        WriteAheadLog::Mute mute(wal);
+        artistsByName.reserve(allArtists.size());
+        for (auto artist : allArtists) artistsByName.emplace(artist->getName(), artist);
+
+        // Small imports into a large catalog keep the sort orders up to date
+        // row by row; large ones rebuild them once at the end
+        size_t before = allSongs.size();
+        bool rebuildOrders = fileSize / 64 > before / 4;
+        // Album co-occurrence is recounted afterwards too, if it is kept at all
+        bool recountRecommendations = rebuildOrders && recommender.isTracking();
+        if (recountRecommendations) recommender.clear();
+
+        vector<char> block(options.blockSize + 1);
+        size_t carried = 0;
+        bool firstBlock = true;
+        bool reserved = false;
+        bool droppingRow = false;   // Skipping the rest of a row rejected as too long
+        while (true) {
+            file.read(block.data() + carried, block.size() - 1 - carried);
+            size_t length = carried + static_cast<size_t>(file.gcount());
+            char* data = block.data();
+            if (droppingRow) {
+                char* newline = static_cast<char*>(memchr(data, '\n', length));
+                if (!newline) {
+                    if (!file) break;
+                    carried = 0;
+                    continue;
+                }
+                droppingRow = false;
+                length -= newline + 1 - data;
+                memmove(data, newline + 1, length);
+            }
+            if (length == 0) break;
+
+            char* end = data + length;
+            if (!delimiter) {
+                char* firstEnd = static_cast<char*>(memchr(data, '\n', length));
+                delimiter = memchr(data, '\t', (firstEnd ? firstEnd : end) - data) ? '\t' : ',';
+            }
+            quotes = delimiter == ',' && memchr(data, '"', length);
+
+            // Keep a trailing partial row for the next block, unless the file
+            // is done. A block without one whole row grows, up to
+            // maxRowSize; a row longer than that is rejected, and reading
+            // picks up again after the end of its first line.
+            if (file) {
+                end = lastRowEnd(data, end);
+                if (end == data) {
+                    size_t capacity = block.size() - 1;
+                    if (capacity < options.maxRowSize) {
+                        block.resize(min(2 * capacity, options.maxRowSize) + 1);
+                        carried = length;
+                        continue;
+                    }
+                    result.skipped++;
+                    result.tooLong++;
+                    firstBlock = false;
+                    char* newline = static_cast<char*>(memchr(data, '\n', length));
+                    carried = newline ? data + length - (newline + 1) : 0;
+                    if (newline) memmove(data, newline + 1, carried);
+                    else droppingRow = true;
+                    continue;
+                }
+            }
+
+            vector<Chunk> chunks;
+            for (auto& piece : cutAtRows(data, end, options.threads)) {
+                chunks.push_back({ piece.first, piece.second, firstBlock && piece.first == data, {}, {}, 0, 0, 0 });
+            }
+            if (chunks.size() == 1) {
+                parseChunk(chunks[0]);
+            }
+            else {
+                vector<thread> workers;
+                for (size_t i = 1; i < chunks.size(); i++) {
+                    workers.emplace_back([this, &chunks, i] { parseChunk(chunks[i]); });
+                }
+                parseChunk(chunks[0]);
+                for (auto& worker : workers) worker.join();
+            }
+
+            if (!reserved) {
+                // Estimate the row count from the first block
+                size_t rows = 0;
+                for (const auto& chunk : chunks) rows += chunk.rows.size();
+                size_t expected = before + static_cast<size_t>(double(rows) * fileSize / max<size_t>(end - data, 1));
+                allSongs.reserve(expected);
+                catalog.columns.reserve(expected);
+                titlePool.reserve(titlePool.size() + expected - before);
+                catalog.songSearch.reserve(Song::getNextId() + expected - before);
+                catalog.songTerms.reserve(Song::getNextId() + expected - before);
+                reserved = true;
+            }
+            for (const auto& chunk : chunks) apply(chunk, !rebuildOrders);
+
+            if (!file) break;
+            carried = data + length - end;
+            memmove(data, end, carried);
+            firstBlock = false;
+        }
+        if (rebuildOrders) catalog.orders.rebuild(allSongs);
+        if (recountRecommendations) rebuildRecommendations(options.threads);
+        return true;
+    }
+
+    const Result& getResult() const { return result; }
+};
+
+// Paging over lists kept in id order (allSongs, allPlaylists)
+template <typename T>
+BrowsePage<T> idOrderPage(const vector<T>& items, const BrowseCursor& after, size_t limit) {
+    BrowsePage<T> page;
+    auto it = items.begin();
+    if (after.started) {
+        it = upper_bound(items.begin(), items.end(), after.id,
+            [](uint32_t id, const T& item) { return id < item->getId(); });
+    }
+    size_t count = min(limit, static_cast<size_t>(items.end() - it));
+    page.items.assign(it, it + count);
+    page.hasMore = it + count != items.end();
+    if (count > 0) {
+        page.next.started = true;
+        page.next.id = page.items.back()->getId();
+    }
+    return page;
+}
+
+template <typename T>
+BrowsePage<T> idOrderPage(const IdOrderedList<T>& items, const BrowseCursor& after, size_t limit) {
+    BrowsePage<T> page;
+    auto it = after.started ? items.after(after.id) : items.begin();
+    for (; it != items.end() && page.items.size() < limit; ++it) page.items.push_back(*it);
+    page.hasMore = it != items.end();
+    if (!page.items.empty()) {
+        page.next.started = true;
+        page.next.id = page.items.back()->getId();
+    }
+    return page;
+}
+
+// Paging over a one-off result list
+template <typename T>
+BrowsePage<T> offsetPage(const vector<T>& items, const BrowseCursor& after, size_t limit) {
+    BrowsePage<T> page;
+    size_t begin = min(after.offset, items.size());
+    size_t end = min(items.size(), begin + limit);
+    page.items.assign(items.begin() + begin, items.begin() + end);
+    page.hasMore = end < items.size();
+    page.next.started = true;
+    page.next.offset = end;
+    return page;
+}
+
+// Finds an item by id in a list kept in id order (allSongs, allArtists, allPlaylists)
+template <typename T>
+T findById(const vector<T>& items, uint32_t id) {
+    auto it = lower_bound(items.begin(), items.end(), id,
+        [](const T& item, uint32_t id) { return item->getId() < id; });
+    return it != items.end() && (*it)->getId() == id ? *it : T();
+}
+
+template <typename T>
+T findById(const IdOrderedList<T>& items, uint32_t id) {
+    return items.find(id);
+}
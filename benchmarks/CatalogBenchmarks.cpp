@@ -0,0 +1,490 @@
+// Regression benchmarks for the catalog, search and playback hot paths. Every
+// benchmark runs against synthetic catalogs of 1K to 10M songs; set
+// MUSIC_BENCH_MAX_SONGS to stop at a smaller size. Catalogs are generated
+// once per size, so benchmarks are registered size by size.
+#include "MusicLibrary.h"
+
+#include <benchmark/benchmark.h>
+
+#include <filesystem>
+
+namespace {
+
+const size_t CATALOG_SIZES[] = { 1000, 10000, 100000, 1000000, 10000000 };
+
+const char* const GENRES[] = { "Pop", "Rock", "Jazz", "Electronic", "Hip Hop", "Classical", "Folk", "Metal" };
+
+// Words are drawn with a Zipf-like skew, so common words hit many songs and
+// most words hit few, as in real titles
+class WordSource {
+private:
+    vector<string> words;
+    vector<double> cumulative;
+    mt19937_64& rng;
+
+public:
+    explicit WordSource(mt19937_64& rng) : rng(rng) {
+        static const char* const syllables[] = { "ka", "lo", "ve", "ri", "mon", "sta", "bel", "dar", "ne", "tu",
+            "shi", "ra", "gon", "fel", "mi", "zor", "pa", "len", "qui", "to" };
+        static const char* const common[] = { "love", "night", "heart", "baby", "dance", "fire", "blue", "dream",
+            "light", "home", "rain", "summer" };
+        words.assign(begin(common), end(common));
+        unordered_set<string> seen(words.begin(), words.end());
+        while (words.size() < 60000) {
+            string word;
+            for (size_t n = 1 + rng() % 4; n > 0; n--) word += syllables[rng() % size(syllables)];
+            if (seen.insert(word).second) words.push_back(word);
+        }
+        double total = 0;
+        for (size_t i = 0; i < words.size(); i++) {
+            total += 1.0 / pow(i + 1, 0.9);
+            cumulative.push_back(total);
+        }
+    }
+
+    const string& next() {
+        double pick = uniform_real_distribution<double>(0, cumulative.back())(rng);
+        return words[lower_bound(cumulative.begin(), cumulative.end(), pick) - cumulative.begin()];
+    }
+
+    string phrase(size_t count) {
+        string text = next();
+        while (--count > 0) text += " " + next();
+        return text;
+    }
+};
+
+// What the benchmarks look things up by
+struct SyntheticCatalog {
+    size_t songs = 0;
+    size_t accounts = 0;
+    vector<string> songQueries;
+    vector<string> playlistQueries;
+    vector<string> artistNames;
+    vector<string> usernames;
+};
+
+SyntheticCatalog current;
+
+// Replaces the whole system with a generated catalog of `songs` songs: about
+// 50 songs per artist, albums of about a dozen songs, and one account per
+// thousand songs (at least 100). Songs go through the CSV importer like a
+// real bulk load; the log is never opened, so nothing touches the disk
+// beyond the temporary import file.
+void buildCatalog(size_t songs) {
+    if (current.songs == songs) return;
+    shutdownSystem();
+    initializeSystem();
+    current = SyntheticCatalog();
+    current.songs = songs;
+
+    mt19937_64 rng(songs);
+    WordSource words(rng);
+    size_t artists = max<size_t>(10, songs / 50);
+    for (size_t i = 0; i < artists; i++) current.artistNames.push_back(words.phrase(2) + " " + to_string(i));
+
+    string path = (filesystem::temp_directory_path() / ("music_bench_" + to_string(songs) + ".csv")).string();
+    {
+        ofstream file(path, ios::binary);
+        for (size_t i = 0; i < songs; i++) {
+            size_t artist = rng() % artists;
+            file << words.phrase(1 + rng() % 4) << ',' << current.artistNames[artist] << ','
+                << 1960 + rng() % 65 << ',' << GENRES[rng() % size(GENRES)] << ','
+                << current.artistNames[artist] << " Vol " << rng() % 4 << '\n';
+        }
+    }
+    CatalogImporter importer(admin);
+    bool imported = importer.importFile(path);
+    filesystem::remove(path);
+    if (!imported) throw runtime_error("cannot write " + path);
+
+    for (size_t i = 0; i < 1000; i++) {
+        current.songQueries.push_back(i % 2 ? words.next() : words.next().substr(0, 3));
+        current.playlistQueries.push_back(current.artistNames[rng() % artists].substr(0, 6));
+    }
+
+    // Accounts are hashed with a single iteration: lookups are measured, not PBKDF2
+    uint32_t iterations = PasswordHash::defaultIterations;
+    PasswordHash::defaultIterations = 1;
+    for (size_t i = 0; i < max<size_t>(100, songs / 1000); i++) {
+        current.usernames.push_back("listener" + to_string(i));
+        registerUser(current.usernames.back(), "secret");
+    }
+    PasswordHash::defaultIterations = iterations;
+}
+
+User* listener() {
+    return userDirectory.find(current.usernames.front());
+}
+
+void searchSongs(benchmark::State& state) {
+    User* user = listener();
+    size_t i = 0, results = 0;
+    for (auto _ : state) {
+        auto found = user->searchSongs(current.songQueries[i++ % current.songQueries.size()]);
+        results += found.size();
+        benchmark::DoNotOptimize(found.data());
+    }
+    state.counters["results"] = benchmark::Counter(double(results), benchmark::Counter::kAvgIterations);
+}
+
+void searchPlaylists(benchmark::State& state) {
+    User* user = listener();
+    size_t i = 0, results = 0;
+    for (auto _ : state) {
+        auto found = user->searchPlaylists(current.playlistQueries[i++ % current.playlistQueries.size()]);
+        results += found.size();
+        benchmark::DoNotOptimize(found.data());
+    }
+    state.counters["results"] = benchmark::Counter(double(results), benchmark::Counter::kAvgIterations);
+}
+
+void filterByArtist(benchmark::State& state) {
+    size_t i = 0;
+    for (auto _ : state) {
+        auto found = catalog.columns.filterByArtist(current.artistNames[i++ % current.artistNames.size()]);
+        benchmark::DoNotOptimize(found.data());
+    }
+}
+
+void filterByGenre(benchmark::State& state) {
+    size_t i = 0;
+    for (auto _ : state) {
+        auto found = catalog.columns.filterByGenre(GENRES[i++ % size(GENRES)]);
+        benchmark::DoNotOptimize(found.data());
+    }
+}
+
+void filterByYear(benchmark::State& state) {
+    int year = 1960;
+    for (auto _ : state) {
+        auto found = catalog.columns.filterByYear(year);
+        benchmark::DoNotOptimize(found.data());
+        year = year == 2024 ? 1960 : year + 1;
+    }
+}
+
+// A combined artist, genre and year query, sorted by title, on a pool of
+// `threads`; the same query at 1, 2, 4 and 8 threads shows the scaling
+void parallelQuery(benchmark::State& state, unsigned threads, size_t limit) {
+    WorkStealingPool pool(threads);
+    SongQuery query;
+    query.genre = "o";
+    query.yearFrom = 1970;
+    query.yearTo = 2009;
+    query.sorted = true;
+    query.limit = limit;
+    size_t i = 0, results = 0;
+    for (auto _ : state) {
+        query.artist = current.artistNames[i++ % current.artistNames.size()].substr(0, 2);
+        auto found = catalog.columns.query(query, pool);
+        results += found.size();
+        benchmark::DoNotOptimize(found.data());
+    }
+    state.counters["results"] = benchmark::Counter(double(results), benchmark::Counter::kAvgIterations);
+}
+
+// A three-way conjunction, answered from the bitmap indexes
+void filterExpression(benchmark::State& state) {
+    size_t i = 0, results = 0;
+    for (auto _ : state) {
+        const string& artist = current.artistNames[i % current.artistNames.size()];
+        SongFilter filter;
+        string error;
+        filter.parse("genre=\"" + string(GENRES[i++ % size(GENRES)]) + "\" AND year>=2000 AND artist~\"" +
+            artist.substr(0, 3) + "\"", error);
+        auto found = filter.run(catalog.filters);
+        results += found.size();
+        benchmark::DoNotOptimize(found.data());
+    }
+    state.counters["results"] = benchmark::Counter(double(results), benchmark::Counter::kAvgIterations);
+}
+
+// Walks a sorted listing a page at a time, starting over at the end
+void sortedPages(benchmark::State& state, SongOrder order) {
+    BrowseCursor cursor;
+    for (auto _ : state) {
+        BrowsePage<SongRef> page = catalog.orders.page(order, cursor, 20);
+        cursor = page.hasMore ? page.next : BrowseCursor();
+        benchmark::DoNotOptimize(page.items.data());
+    }
+}
+
+// Removes a random song; a replacement is added untimed to keep the size
+void removeSong(benchmark::State& state) {
+    mt19937_64 rng(1);
+    auto pick = [&rng] {
+        SongRef song;
+        while (!song) song = allSongs.find(static_cast<uint32_t>(rng() % Song::getNextId()));
+        return song;
+    };
+    SongRef song = pick();
+    for (auto _ : state) {
+        Artist* artist = song->getArtist();
+        admin->removeSong(song);
+        state.PauseTiming();
+        admin->addSong("replacement", artist, 2000, "Pop");
+        song = pick();
+        state.ResumeTiming();
+    }
+}
+
+// Removes an artist with 50 songs and an album, created untimed
+void removeArtist(benchmark::State& state) {
+    size_t created = 0;
+    for (auto _ : state) {
+        state.PauseTiming();
+        admin->createArtist("Benchmark Artist " + to_string(created++));
+        Artist* artist = allArtists.back();
+        for (int i = 0; i < 50; i++) admin->addSong("benchmark song " + to_string(i), artist, 2000, "Pop");
+        admin->createAlbum(artist, "Benchmark Album");
+        for (const auto& song : artist->getSongs()) artist->getAlbums().back()->addSong(song);
+        state.ResumeTiming();
+        admin->removeArtist(artist);
+    }
+}
+
+// Adds a song and publishes a copy of the catalog view, as the session host
+// does after each command that edits it
+void publishView(benchmark::State& state) {
+    Artist* artist = allArtists.front();
+    for (auto _ : state) {
+        admin->addSong("published song", artist, 2000, "Pop");
+        auto view = make_shared<CatalogView>(catalog);
+        benchmark::DoNotOptimize(view.get());
+    }
+}
+
+void loginLookup(benchmark::State& state) {
+    size_t i = 0;
+    for (auto _ : state) {
+        // Every fourth name is unknown
+        const string& name = current.usernames[i % current.usernames.size()];
+        User* user = userDirectory.find(i++ % 4 ? name : name + "?");
+        benchmark::DoNotOptimize(user);
+    }
+}
+
+// Steps through the largest album, looping
+void getNextSong(benchmark::State& state, PlaybackMode mode) {
+    Playlist* album = *max_element(allPlaylists.begin(), allPlaylists.end(),
+        [](Playlist* a, Playlist* b) { return a->getSongCount() < b->getSongCount(); });
+    Player player;
+    player.setCurrentPlaylist(album);
+    player.setPlaybackMode(mode);
+    player.toggleLoop();
+    for (auto _ : state) {
+        SongRef next = player.getNextSong();
+        benchmark::DoNotOptimize(next);
+        player.playNext();
+    }
+    state.counters["playlist"] = double(album->getSongCount());
+}
+
+// A personal playlist holding every song in the catalog, built untimed; the
+// benchmark deletes it so later ones do not pay for its upkeep
+Playlist* everythingPlaylist() {
+    listener()->createPlaylist("everything");
+    Playlist* playlist = listener()->getPersonalPlaylists().back();
+    playlist->setSongs(vector<SongRef>(allSongs.begin(), allSongs.end()));
+    return playlist;
+}
+
+// Takes a snapshot of the whole-catalog playlist and reads from its middle
+void playlistSnapshot(benchmark::State& state) {
+    Playlist* playlist = everythingPlaylist();
+    for (auto _ : state) {
+        PlaylistVersion version = playlist->snapshot();
+        SongRef song = version.songs[version.songs.size() / 2];
+        benchmark::DoNotOptimize(song);
+    }
+    listener()->deletePlaylist(playlist);
+}
+
+// Removes a random song from the whole-catalog playlist and appends it again
+void playlistEdit(benchmark::State& state) {
+    Playlist* playlist = everythingPlaylist();
+    mt19937_64 rng(1);
+    for (auto _ : state) {
+        SongRef song = playlist->getSongs()[rng() % playlist->getSongCount()];
+        playlist->removeSong(song);
+        playlist->addSong(song);
+    }
+    listener()->deletePlaylist(playlist);
+}
+
+// Removes a random song from the whole-catalog playlist and inserts it again
+// at another random position
+void playlistInsert(benchmark::State& state) {
+    Playlist* playlist = everythingPlaylist();
+    mt19937_64 rng(1);
+    for (auto _ : state) {
+        size_t count = playlist->getSongCount();
+        SongRef song = playlist->getSongs()[rng() % count];
+        playlist->removeSong(song);
+        playlist->insertSong(song, rng() % count);
+    }
+    listener()->deletePlaylist(playlist);
+}
+
+// Moves a song from past the recommender's basket limit to a random spot
+// before it, with the recommender counting, so every insert pushes another
+// song out of the counted part of a full basket
+void playlistInsertCounted(benchmark::State& state) {
+    Playlist* playlist = everythingPlaylist();
+    rebuildRecommendations(1);
+    mt19937_64 rng(1);
+    size_t uncounted = playlist->getSongCount() - Recommender::BASKET_LIMIT;
+    for (auto _ : state) {
+        SongRef song = playlist->getSongs()[Recommender::BASKET_LIMIT + rng() % uncounted];
+        playlist->removeSong(song);
+        playlist->insertSong(song, rng() % Recommender::BASKET_LIMIT);
+    }
+    listener()->deletePlaylist(playlist);
+    recommender.clear();
+}
+
+// Moves a block of 16 songs between random positions of the whole-catalog
+// playlist
+void playlistMove(benchmark::State& state) {
+    Playlist* playlist = everythingPlaylist();
+    mt19937_64 rng(1);
+    size_t span = playlist->getSongCount() - 16 + 1;
+    for (auto _ : state) {
+        bool moved = playlist->moveSongs(rng() % span, 16, rng() % span);
+        benchmark::DoNotOptimize(moved);
+    }
+    listener()->deletePlaylist(playlist);
+}
+
+// Appends a song to the whole-catalog playlist and undoes it
+void playlistUndo(benchmark::State& state) {
+    Playlist* playlist = everythingPlaylist();
+    SongRef song = playlist->getSongs()[0];
+    playlist->removeSong(song);
+    for (auto _ : state) {
+        playlist->addSong(song);
+        playlist->undo();
+    }
+    listener()->deletePlaylist(playlist);
+}
+
+// Throws the system away and starts it again from a snapshot of the current
+// catalog, saved once untimed. The records are read in place from the mapped
+// file and the n-gram, term, filter and sort indexes are left for the first
+// search or edit, so the reload is object creation alone. With `indexed` the
+// indexes are built as well, which is what the first query after a start
+// pays: several microseconds per song.
+void coldStart(benchmark::State& state, bool indexed) {
+    string path = (filesystem::temp_directory_path() / ("music_bench_" + to_string(current.songs) + ".snapshot")).string();
+    if (!saveSnapshot(path)) {
+        state.SkipWithError("cannot write the snapshot");
+        return;
+    }
+    for (auto _ : state) {
+        shutdownSystem();
+        if (!loadSnapshot(path)) {
+            state.SkipWithError("cannot load the snapshot");
+            break;
+        }
+        if (indexed) indexCatalog();
+    }
+    state.counters["bytes"] = double(filesystem::file_size(path));
+    filesystem::remove(path);
+}
+
+// Replaces the whole system with `accounts` registered users and the sample
+// catalog, hashed with a single iteration: the directory lookup is measured,
+// not PBKDF2. Logins are sized by accounts rather than songs, so they build
+// their own system.
+void buildAccounts(size_t accounts) {
+    if (current.songs == 0 && current.accounts == accounts) return;
+    shutdownSystem();
+    initializeSystem();
+    current = SyntheticCatalog();
+    current.accounts = accounts;
+    uint32_t iterations = PasswordHash::defaultIterations;
+    PasswordHash::defaultIterations = 1;
+    allUsers.reserve(accounts);
+    userDirectory.reserve(accounts);
+    for (size_t i = 0; i < accounts; i++) registerUser("account" + to_string(i), "secret");
+    PasswordHash::defaultIterations = iterations;
+    // A thousand names spread over the whole directory
+    for (size_t i = 0; i < 1000; i++) current.usernames.push_back("account" + to_string(i * accounts / 1000));
+}
+
+// Full logins through UserDirectory::authenticate; every fourth password is
+// wrong. Unknown names are left out, since they pay for the full-strength
+// decoy hash.
+void login(benchmark::State& state) {
+    size_t i = 0, failed = 0;
+    for (auto _ : state) {
+        const string& name = current.usernames[i % current.usernames.size()];
+        User* user = userDirectory.authenticate(name, i++ % 4 ? "secret" : "wrong");
+        failed += user == nullptr;
+        benchmark::DoNotOptimize(user);
+    }
+    state.counters["accounts"] = double(userDirectory.size());
+    state.counters["failed"] = benchmark::Counter(double(failed), benchmark::Counter::kAvgIterations);
+}
+
+template <typename Body>
+benchmark::internal::Benchmark* registerAt(const string& name, size_t songs, Body body) {
+    return benchmark::RegisterBenchmark((name + "/" + to_string(songs)).c_str(), [songs, body](benchmark::State& state) {
+        buildCatalog(songs);
+        body(state);
+    });
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) return 1;
+
+    const char* limit = getenv("MUSIC_BENCH_MAX_SONGS");
+    size_t maxSongs = limit ? strtoull(limit, nullptr, 10) : SIZE_MAX;
+    for (size_t songs : CATALOG_SIZES) {
+        if (songs > maxSongs) break;
+        registerAt("SearchSongs", songs, searchSongs);
+        registerAt("SearchPlaylists", songs, searchPlaylists);
+        registerAt("FilterByArtist", songs, filterByArtist);
+        registerAt("FilterByGenre", songs, filterByGenre);
+        registerAt("FilterByYear", songs, filterByYear);
+        registerAt("FilterExpression", songs, filterExpression);
+        for (unsigned threads : { 1u, 2u, 4u, 8u }) {
+            registerAt("ParallelQuery/Sorted/" + to_string(threads) + "t", songs,
+                [threads](benchmark::State& state) { parallelQuery(state, threads, 0); });
+            registerAt("ParallelQuery/Top100/" + to_string(threads) + "t", songs,
+                [threads](benchmark::State& state) { parallelQuery(state, threads, 100); });
+        }
+        registerAt("SortedPage/Title", songs, [](benchmark::State& state) { sortedPages(state, SongOrder::TITLE); });
+        registerAt("SortedPage/Year", songs, [](benchmark::State& state) { sortedPages(state, SongOrder::YEAR); });
+        registerAt("SortedPage/Artist", songs, [](benchmark::State& state) { sortedPages(state, SongOrder::ARTIST); });
+        registerAt("LoginLookup", songs, loginLookup);
+        registerAt("GetNextSong/Sequential", songs,
+            [](benchmark::State& state) { getNextSong(state, PlaybackMode::SEQUENTIAL); });
+        registerAt("GetNextSong/Random", songs, [](benchmark::State& state) { getNextSong(state, PlaybackMode::RANDOM); });
+        registerAt("PlaylistSnapshot", songs, playlistSnapshot);
+        registerAt("PlaylistEdit", songs, playlistEdit);
+        registerAt("PlaylistInsert", songs, playlistInsert);
+        registerAt("PlaylistInsert/Counted", songs, playlistInsertCounted);
+        registerAt("PlaylistMove", songs, playlistMove);
+        registerAt("PlaylistUndo", songs, playlistUndo);
+        registerAt("RemoveSong", songs, removeSong);
+        registerAt("RemoveArtist", songs, removeArtist);
+        registerAt("PublishView", songs, publishView);
+        registerAt("ColdStart", songs, [](benchmark::State& state) { coldStart(state, false); })
+            ->Unit(benchmark::kMillisecond);
+        registerAt("ColdStart/Indexed", songs, [](benchmark::State& state) { coldStart(state, true); })
+            ->Unit(benchmark::kMillisecond);
+        benchmark::RegisterBenchmark(("Login/" + to_string(songs)).c_str(), [songs](benchmark::State& state) {
+            buildAccounts(songs);
+            login(state);
+        });
+    }
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    shutdownSystem();
+    return 0;
+}
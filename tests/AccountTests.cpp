@@ -0,0 +1,45 @@
+// Accounts: registration, duplicate names and logging in
+#include "LibraryTest.h"
+
+namespace {
+
+class AccountTest : public LibraryTest {};
+
+TEST_F(AccountTest, RegisteredUserCanLogIn) {
+    User* user = newUser("listener");
+    ASSERT_NE(user, nullptr);
+    EXPECT_EQ(userDirectory.authenticate("listener", "password1"), user);
+    EXPECT_EQ(userDirectory.authenticate("admin", "admin123"), admin);
+    EXPECT_EQ(userDirectory.size(), 2u);
+    EXPECT_EQ(allUsers, vector<User*>{ user });
+}
+
+TEST_F(AccountTest, WrongPasswordsAndUnknownNamesAreRejected) {
+    newUser("listener");
+    EXPECT_EQ(userDirectory.authenticate("listener", "password2"), nullptr);
+    EXPECT_EQ(userDirectory.authenticate("listener", ""), nullptr);
+    EXPECT_EQ(userDirectory.authenticate("Listener", "password1"), nullptr);
+    EXPECT_EQ(userDirectory.authenticate("listener ", "password1"), nullptr);
+    EXPECT_EQ(userDirectory.authenticate("nobody", "password1"), nullptr);
+    EXPECT_EQ(userDirectory.authenticate("admin", "password1"), nullptr);
+}
+
+TEST_F(AccountTest, DuplicateRegistrationIsRejected) {
+    User* user = newUser("listener");
+    EXPECT_EQ(registerUser("listener", "other"), nullptr);
+    EXPECT_EQ(registerUser("admin", "other"), nullptr);
+    EXPECT_EQ(allUsers, vector<User*>{ user });
+    EXPECT_EQ(userDirectory.size(), 2u);
+
+    // The first account keeps its password
+    EXPECT_EQ(userDirectory.authenticate("listener", "password1"), user);
+    EXPECT_EQ(userDirectory.authenticate("listener", "other"), nullptr);
+    EXPECT_EQ(userDirectory.authenticate("admin", "admin123"), admin);
+
+    // Names differing only in case are different accounts
+    User* other = registerUser("Listener", "other");
+    ASSERT_NE(other, nullptr);
+    EXPECT_EQ(userDirectory.authenticate("Listener", "other"), other);
+}
+
+}  // namespace
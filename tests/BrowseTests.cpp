@@ -0,0 +1,90 @@
+// SongColumns browse queries: filters, sorting and limits
+#include "LibraryTest.h"
+
+namespace {
+
+class BrowseTest : public LibraryTest {
+protected:
+    vector<string> titles(const SongQuery& query) {
+        vector<string> result;
+        for (const auto& song : catalog.columns.query(query)) result.push_back(string(song->getTitle()));
+        return result;
+    }
+};
+
+typedef vector<string> Titles;
+
+TEST_F(BrowseTest, YearRangeIsInclusive) {
+    SongQuery query;
+    query.yearFrom = 2020;
+    query.yearTo = 2021;
+    EXPECT_EQ(titles(query), (Titles{ "Song One", "Song Two" }));
+    query.yearFrom = query.yearTo = 2019;
+    EXPECT_EQ(titles(query), (Titles{ "Song Three" }));
+}
+
+TEST_F(BrowseTest, InvertedYearRangeMatchesNothing) {
+    SongQuery query;
+    query.yearFrom = 2022;
+    query.yearTo = 2019;
+    EXPECT_EQ(titles(query), Titles());
+    query.sorted = true;
+    query.order = SongOrder::YEAR;
+    EXPECT_EQ(titles(query), Titles());
+    query.yearFrom = INT_MAX;
+    query.yearTo = INT_MIN;
+    EXPECT_EQ(titles(query), Titles());
+}
+
+TEST_F(BrowseTest, NamesMatchAsSubstrings) {
+    SongQuery query;
+    query.artist = "Two";
+    EXPECT_EQ(titles(query), (Titles{ "Song Three", "Song Four" }));
+    query.artist.clear();
+    query.genre = "ock";
+    EXPECT_EQ(titles(query), (Titles{ "Song Two" }));
+}
+
+TEST_F(BrowseTest, ArtistFilterSkipsOtherNames) {
+    newPlaylist(newUser("Artist Three"), "Artist Four");
+    SongQuery query;
+    query.artist = "Three";
+    EXPECT_EQ(titles(query), Titles());
+    query.artist = "Artist";
+    EXPECT_EQ(titles(query), (Titles{ "Song One", "Song Two", "Song Three", "Song Four" }));
+
+    admin->createArtist("Artist Three");
+    admin->addSong("Song Five", allArtists.back(), 2023, "Pop");
+    query.artist = "Three";
+    EXPECT_EQ(titles(query), (Titles{ "Song Five" }));
+}
+
+TEST_F(BrowseTest, SortsAndLimits) {
+    SongQuery query;
+    query.sorted = true;
+    query.order = SongOrder::YEAR;
+    EXPECT_EQ(titles(query), (Titles{ "Song Three", "Song One", "Song Two", "Song Four" }));
+    query.order = SongOrder::TITLE;
+    query.limit = 2;
+    EXPECT_EQ(titles(query), (Titles{ "Song Four", "Song One" }));
+}
+
+TEST_F(BrowseTest, EqualTitlesKeepCatalogOrder) {
+    // Enough songs with the same titles that an unstable sort would reorder them
+    for (int i = 0; i < 40; i++) admin->addSong(i % 2 ? "Same" : "Song Same", allArtists[i % 2], 2000 + i, "Pop");
+    vector<SongRef> sorted = catalog.columns.sortedByTitle();
+    ASSERT_EQ(sorted.size(), allSongs.size());
+    for (size_t i = 1; i < sorted.size(); i++) {
+        ASSERT_LE(sorted[i - 1]->getTitle(), sorted[i]->getTitle());
+        if (sorted[i - 1]->getTitle() == sorted[i]->getTitle()) {
+            EXPECT_LT(sorted[i - 1]->getId(), sorted[i]->getId());
+        }
+    }
+
+    SongQuery query;
+    query.sorted = true;
+    query.order = SongOrder::TITLE;
+    EXPECT_EQ(idsOf(catalog.columns.query(query)), idsOf(sorted));
+}
+
+}  // namespace
@@ -0,0 +1,227 @@
+// Catalog upkeep: the id-ordered song list, the search indexes and every
+// reference to a song as songs and artists come and go
+#include "LibraryTest.h"
+
+namespace {
+
+class CatalogTest : public LibraryTest {
+protected:
+    static vector<uint32_t> catalogIds() {
+        vector<uint32_t> ids;
+        for (const auto& song : allSongs) ids.push_back(song->getId());
+        return ids;
+    }
+
+    // Word completions with their document counts
+    static vector<string> completions(const string& prefix) {
+        vector<string> result;
+        for (const auto& completion : catalog.songTerms.complete(prefix, 10)) {
+            result.push_back(completion.term + " " + to_string(completion.documents));
+        }
+        sort(result.begin(), result.end());
+        return result;
+    }
+
+    // Where the song `id` is still listed: the catalog, its artist, albums,
+    // personal playlists, favorites, and each of the catalog indexes
+    static vector<string> referencesTo(uint32_t id, const string& title, const string& artist) {
+        auto holds = [id](const auto& songs) {
+            for (const auto& song : songs) {
+                if (song->getId() == id) return true;
+            }
+            return false;
+        };
+        vector<string> found;
+        if (findById(allSongs, id)) found.push_back("catalog");
+        for (const auto& each : allArtists) {
+            if (holds(each->getSongs())) found.push_back("artist " + string(each->getName()));
+        }
+        for (const auto& album : allPlaylists) {
+            if (holds(album->getSongs())) found.push_back("album " + string(album->getName()));
+        }
+        vector<User*> accounts(allUsers);
+        accounts.push_back(admin);
+        for (const auto& user : accounts) {
+            if (holds(user->getFavoriteSongs())) found.push_back("favorites " + string(user->getUsername()));
+            for (const auto& playlist : user->getPersonalPlaylists()) {
+                if (holds(playlist->getSongs())) found.push_back("playlist " + string(playlist->getName()));
+            }
+        }
+        if (holds(admin->searchSongs(title))) found.push_back("search");
+        if (holds(admin->rankSongs(title, 100))) found.push_back("terms");
+        if (holds(catalog.orders.page(SongOrder::YEAR, BrowseCursor(), allSongs.size() + 10).items)) {
+            found.push_back("orders");
+        }
+        SongFilter filter;
+        string error;
+        EXPECT_TRUE(filter.parse("artist=\"" + artist + "\"", error)) << error;
+        if (holds(filter.run(catalog.filters))) found.push_back("filters");
+        if (holds(catalog.columns.filterByArtist(artist))) found.push_back("columns");
+        return found;
+    }
+
+    // What searchSongs should find, by checking every song
+    static vector<uint32_t> scanFor(const string& query) {
+        vector<uint32_t> ids;
+        for (const auto& song : allSongs) {
+            if (song->getTitle().find(query) != string::npos ||
+                song->getArtist()->getName().find(query) != string::npos) ids.push_back(song->getId());
+        }
+        return ids;
+    }
+};
+
+TEST_F(CatalogTest, SongListSkipsRemovedSongs) {
+    for (int i = 0; i < 200; i++) admin->addSong("Song " + to_string(i), allArtists[i % 2], 2000, "Pop");
+    vector<uint32_t> expected = catalogIds();
+    mt19937 rng(7);
+    for (int round = 0; round < 150; round++) {
+        size_t at = rng() % expected.size();
+        admin->removeSong(findById(allSongs, expected[at]));
+        EXPECT_EQ(findById(allSongs, expected[at]), SongRef());
+        expected.erase(expected.begin() + at);
+
+        ASSERT_EQ(catalogIds(), expected);
+        ASSERT_EQ(allSongs.size(), expected.size());
+        EXPECT_EQ(allSongs.back()->getId(), expected.back());
+        size_t probe = rng() % expected.size();
+        EXPECT_EQ(allSongs[probe]->getId(), expected[probe]);
+        EXPECT_EQ(findById(allSongs, expected[probe])->getId(), expected[probe]);
+    }
+
+    // New songs go after the survivors, and browse pages step over the gaps
+    admin->addSong("Song Last", allArtists[0], 2000, "Pop");
+    expected.push_back(allSongs.back()->getId());
+    EXPECT_EQ(catalogIds(), expected);
+    vector<uint32_t> paged;
+    BrowseCursor cursor;
+    do {
+        BrowsePage<SongRef> page = idOrderPage(allSongs, cursor, 7);
+        for (const auto& song : page.items) paged.push_back(song->getId());
+        cursor = page.hasMore ? page.next : BrowseCursor();
+    } while (cursor.started);
+    EXPECT_EQ(paged, expected);
+}
+
+TEST_F(CatalogTest, RemovedArtistLeavesNoPostings) {
+    admin->createArtist("Zebra Crossing");
+    Artist* zebra = allArtists.back();
+    for (int i = 0; i < 30; i++) admin->addSong("Zebra Song " + to_string(i), zebra, 2000, "Pop");
+    admin->addSong("Zebra Song", allArtists[0], 2001, "Rock");
+    EXPECT_EQ(completions("zeb"), (vector<string>{ "zebra 31" }));
+    EXPECT_EQ(completions("song"), (vector<string>{ "song 35" }));
+
+    admin->removeArtist(zebra);
+    EXPECT_EQ(completions("zeb"), (vector<string>{ "zebra 1" }));
+    EXPECT_EQ(completions("song"), (vector<string>{ "song 5" }));
+    EXPECT_EQ(completions("cross"), vector<string>());
+    EXPECT_EQ(idsOf(admin->searchSongs("Zebra")), vector<uint32_t>{ allSongs.back()->getId() });
+    EXPECT_EQ(idsOf(admin->rankSongs("zebra song", 10)), vector<uint32_t>{ allSongs.back()->getId() });
+    EXPECT_EQ(catalog.songTerms.rank("crossing", 10).size(), 0u);
+    EXPECT_EQ(allSongs.size(), 5u);
+
+    // The same words come back for songs added afterwards
+    admin->addSong("Crossing Zebra", allArtists[1], 2002, "Jazz");
+    EXPECT_EQ(completions("zeb"), (vector<string>{ "zebra 2" }));
+    EXPECT_EQ(idsOf(admin->searchSongs("Crossing")), vector<uint32_t>{ allSongs.back()->getId() });
+}
+
+TEST_F(CatalogTest, RemovedSongLeavesNoReferences) {
+    catalogEpochs.setDeferring(true);   // Keeps the removed song readable
+    User* user = newUser("listener");
+    Playlist* mix = newPlaylist(user, "mix");
+    SongRef song = allSongs[1];
+    mix->addSong(allSongs[0]);
+    mix->addSong(song);
+    user->addFavoriteSong(song);
+    admin->addFavoriteSong(song);
+    Player player;
+    player.setCurrentPlaylist(mix);
+    player.playNext();
+
+    uint32_t id = song->getId();
+    EXPECT_EQ(referencesTo(id, "Song Two", "Artist One"), (vector<string>{ "catalog", "artist Artist One",
+        "album First Album", "favorites listener", "playlist mix", "favorites admin", "search", "terms", "orders",
+        "filters", "columns" }));
+
+    admin->removeSong(song);
+    EXPECT_EQ(referencesTo(id, "Song Two", "Artist One"), vector<string>());
+    EXPECT_FALSE(user->isFavoriteSong(song));
+    EXPECT_EQ(idsOf(mix->getSongs()), vector<uint32_t>{ allSongs[0]->getId() });
+    EXPECT_EQ(player.getNextSong(), SongRef());
+    EXPECT_EQ(player.getPreviousSong(), allSongs[0]);
+    catalogEpochs.setDeferring(false);
+}
+
+TEST_F(CatalogTest, RemovedArtistLeavesNoReferences) {
+    catalogEpochs.setDeferring(true);
+    Artist* artist = allArtists[1];
+    vector<SongRef> songs = artist->getSongs();
+    ASSERT_EQ(songs.size(), 2u);
+    User* user = newUser("listener");
+    Playlist* mix = newPlaylist(user, "mix");
+    for (const auto& song : { songs[0], allSongs[0], songs[1] }) mix->addSong(song);
+    user->addFavoriteSong(songs[1]);
+    user->addFavoriteSong(allSongs[1]);
+    EXPECT_EQ(referencesTo(songs[1]->getId(), "Song Four", "Artist Two"), (vector<string>{ "catalog",
+        "artist Artist Two", "album Debut Album", "favorites listener", "playlist mix", "search", "terms", "orders",
+        "filters", "columns" }));
+
+    admin->removeArtist(artist);
+    EXPECT_EQ(referencesTo(songs[0]->getId(), "Song Three", "Artist Two"), vector<string>());
+    EXPECT_EQ(referencesTo(songs[1]->getId(), "Song Four", "Artist Two"), vector<string>());
+    EXPECT_EQ(allArtists.size(), 1u);
+    EXPECT_TRUE(admin->searchSongs("Artist Two").empty());
+    EXPECT_EQ(idsOf(mix->getSongs()), vector<uint32_t>{ allSongs[0]->getId() });
+    EXPECT_EQ(idsOf(user->getFavoriteSongs()), vector<uint32_t>{ allSongs[1]->getId() });
+    EXPECT_EQ(allSongs.size(), 2u);
+    catalogEpochs.setDeferring(false);
+}
+
+TEST_F(CatalogTest, SearchFindsWhatAScanFinds) {
+    const char* syllables[] = { "ka", "Lo", "ve", "ri", "NE", "tu", "x", "q" };
+    mt19937 rng(11);
+    for (int i = 0; i < 300; i++) {
+        string title;
+        for (int s = 1 + rng() % 4; s > 0; s--) title += syllables[rng() % 8];
+        admin->addSong(title, allArtists[i % 2], 2000, "Pop");
+    }
+    for (int i = 0; i < 40; i++) admin->removeSong(allSongs[rng() % allSongs.size()]);
+
+    // The searches a published view answers stay put while the catalog
+    // changes; removed songs stay alive for it until it is retired
+    catalogEpochs.setDeferring(true);
+    CatalogView before = catalog;
+    vector<string> queries = { "k", "L", "l", "x", "q", "a", "e", "z", "ka", "Lo", "ov", "aL", "xq", "e ", "So",
+        "kaL", "veri", "NEtu", "Song", "ong " };
+    vector<vector<uint32_t>> found;
+    for (const string& query : queries) {
+        found.push_back(idsOf(admin->searchSongs(query)));
+        EXPECT_EQ(found.back(), scanFor(query)) << "query '" << query << "'";
+    }
+    for (int i = 0; i < 40; i++) admin->removeSong(allSongs[rng() % allSongs.size()]);
+    admin->addSong("kaLo xq", allArtists[0], 2001, "Rock");
+    for (size_t i = 0; i < queries.size(); i++) {
+        EXPECT_EQ(idsOf(admin->searchSongs(queries[i], before)), found[i]) << "query '" << queries[i] << "'";
+        EXPECT_EQ(idsOf(admin->searchSongs(queries[i])), scanFor(queries[i])) << "query '" << queries[i] << "'";
+    }
+    catalogEpochs.setDeferring(false);
+}
+
+TEST_F(CatalogTest, PlaylistSearchFindsWhatAScanFinds) {
+    const char* words[] = { "Live", "live", "Best Of", "Vol", "Sessions", "Remixes", "B" };
+    mt19937 rng(5);
+    for (int i = 0; i < 60; i++) {
+        admin->createAlbum(allArtists[i % 2], string(words[rng() % 7]) + " " + words[rng() % 7] + " " + to_string(i));
+    }
+    vector<string> queries = { "L", "l", "iv", "Live", "Best Of", "s 1", "Vol 4", "B", "x", "Album" };
+    for (const string& query : queries) {
+        vector<Playlist*> expected;
+        for (const auto& album : allPlaylists) {
+            if (album->getName().find(query) != string::npos) expected.push_back(album);
+        }
+        EXPECT_EQ(admin->searchPlaylists(query), expected) << "query '" << query << "'";
+    }
+}
+
+}  // namespace
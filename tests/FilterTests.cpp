@@ -0,0 +1,97 @@
+// SongFilter: parsing, error reporting and evaluation against the indexes
+#include "LibraryTest.h"
+
+namespace {
+
+class FilterTest : public LibraryTest {
+protected:
+    // Titles of the songs matching `expression`, in id order
+    vector<string> titles(const string& expression) {
+        SongFilter filter;
+        string error;
+        EXPECT_TRUE(filter.parse(expression, error)) << expression << ": " << error;
+        vector<string> result;
+        for (const auto& song : filter.run(catalog.filters)) result.push_back(string(song->getTitle()));
+        return result;
+    }
+
+    string parseError(const string& expression) {
+        SongFilter filter;
+        string error;
+        EXPECT_FALSE(filter.parse(expression, error)) << expression;
+        return error;
+    }
+};
+
+typedef vector<string> Titles;
+
+TEST_F(FilterTest, SingleConditions) {
+    EXPECT_EQ(titles("genre=Pop"), (Titles{ "Song One" }));
+    EXPECT_EQ(titles("genre!=Pop"), (Titles{ "Song Two", "Song Three", "Song Four" }));
+    EXPECT_EQ(titles("artist=\"Artist Two\""), (Titles{ "Song Three", "Song Four" }));
+    EXPECT_EQ(titles("artist~One"), (Titles{ "Song One", "Song Two" }));
+    EXPECT_EQ(titles("year=2021"), (Titles{ "Song Two" }));
+    EXPECT_EQ(titles("year<2021"), (Titles{ "Song One", "Song Three" }));
+    EXPECT_EQ(titles("year<=2021"), (Titles{ "Song One", "Song Two", "Song Three" }));
+    EXPECT_EQ(titles("year>2021"), (Titles{ "Song Four" }));
+    EXPECT_EQ(titles("year>=2021"), (Titles{ "Song Two", "Song Four" }));
+    EXPECT_EQ(titles("genre=Metal"), Titles());
+}
+
+TEST_F(FilterTest, AndBindsTighterThanOr) {
+    EXPECT_EQ(titles("genre=Pop OR genre=Jazz AND year>2020"), (Titles{ "Song One" }));
+    EXPECT_EQ(titles("(genre=Pop OR genre=Jazz) AND year<2020"), (Titles{ "Song Three" }));
+    EXPECT_EQ(titles("artist~Two AND year>=2020 OR genre=Rock"), (Titles{ "Song Two", "Song Four" }));
+}
+
+TEST_F(FilterTest, NotAndKeywordsInAnyCase) {
+    EXPECT_EQ(titles("NOT year<2021"), (Titles{ "Song Two", "Song Four" }));
+    EXPECT_EQ(titles("not (artist~One or genre=Jazz)"), (Titles{ "Song Four" }));
+    EXPECT_EQ(titles("NOT NOT genre=Rock"), (Titles{ "Song Two" }));
+}
+
+TEST_F(FilterTest, QuotedValuesKeepSpacesAndEscapes) {
+    admin->addSong("Odd", allArtists[0], 2000, "Drum \"n\" Bass");
+    admin->addSong("Odder", allArtists[0], 2000, "Back\\slash");
+    EXPECT_EQ(titles("genre=\"Drum \\\"n\\\" Bass\""), (Titles{ "Odd" }));
+    EXPECT_EQ(titles("genre=\"Back\\\\slash\""), (Titles{ "Odder" }));
+}
+
+TEST_F(FilterTest, FollowsCatalogChanges) {
+    admin->addSong("New One", allArtists[1], 2021, "Pop");
+    EXPECT_EQ(titles("genre=Pop"), (Titles{ "Song One", "New One" }));
+    admin->removeSong(allSongs[0]);
+    EXPECT_EQ(titles("genre=Pop"), (Titles{ "New One" }));
+    EXPECT_EQ(titles("year=2021"), (Titles{ "Song Two", "New One" }));
+}
+
+TEST_F(FilterTest, ArtistConditionsSkipOtherNames) {
+    // Usernames and playlist names share the name pool with artist names
+    newPlaylist(newUser("Artist Three"), "Artist Four");
+    EXPECT_EQ(titles("artist=\"Artist Three\""), Titles());
+    EXPECT_EQ(titles("artist~Three OR artist~Four"), Titles());
+    EXPECT_EQ(titles("artist~Artist"), (Titles{ "Song One", "Song Two", "Song Three", "Song Four" }));
+    EXPECT_EQ(titles("artist!=\"Artist One\""), (Titles{ "Song Three", "Song Four" }));
+
+    admin->createArtist("Artist Three");
+    admin->addSong("Song Five", allArtists.back(), 2023, "Pop");
+    EXPECT_EQ(titles("artist=\"Artist Three\""), (Titles{ "Song Five" }));
+    EXPECT_EQ(titles("artist~Three"), (Titles{ "Song Five" }));
+}
+
+TEST_F(FilterTest, ReportsWhatWentWrongAndWhere) {
+    EXPECT_EQ(parseError("title=x"), "unknown field 'title' at position 1");
+    EXPECT_EQ(parseError("year~20"), "~ does not apply to year at position 5");
+    EXPECT_EQ(parseError("year=soon"), "year must be a number at position 6");
+    EXPECT_EQ(parseError("genre=Pop OR year >= \"20x\""), "year must be a number at position 22");
+    EXPECT_EQ(parseError("genre<Pop"), "only = != ~ apply to genre at position 6");
+    EXPECT_EQ(parseError("genre Pop"), "expected one of = != < <= > >= ~ at position 7");
+    EXPECT_EQ(parseError("genre=\"Pop"), "unterminated quote at position 11");
+    EXPECT_EQ(parseError("(genre=Pop"), "expected ) at position 11");
+    EXPECT_EQ(parseError("genre=Pop )"), "unexpected ')' at position 11");
+    EXPECT_EQ(parseError("genre=Pop AND"), "expected a condition at position 14");
+    EXPECT_EQ(parseError("genre="), "expected a value at position 7");
+    EXPECT_EQ(parseError(""), "expected a condition at position 1");
+}
+
+}  // namespace
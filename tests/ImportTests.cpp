@@ -0,0 +1,134 @@
+// CatalogImporter: CSV and TSV parsing, rows that cross block boundaries,
+// and rows it has to reject
+#include "LibraryTest.h"
+
+#include <fstream>
+
+namespace {
+
+class ImportTest : public LibraryTest {
+protected:
+    CatalogImporter::Result result;
+
+    // Imports `text` from a file, reading it in blocks of `blockSize` bytes
+    // with `threads` workers; returns the titles of the songs added
+    vector<string> import(const string& text, size_t blockSize = 1 << 20, unsigned threads = 1,
+        size_t maxRowSize = 1 << 20) {
+        string file = path("import.csv");
+        ofstream(file, ios::binary) << text;
+        size_t before = allSongs.size();
+        CatalogImporter importer(admin);
+        CatalogImporter::Options options;
+        options.blockSize = blockSize;
+        options.threads = threads;
+        options.maxRowSize = maxRowSize;
+        importer.setOptions(options);
+        EXPECT_TRUE(importer.importFile(file));
+        result = importer.getResult();
+        vector<string> titles;
+        for (size_t i = before; i < allSongs.size(); i++) titles.push_back(string(allSongs[i]->getTitle()));
+        return titles;
+    }
+};
+
+typedef vector<string> Titles;
+
+TEST_F(ImportTest, ReadsCsvAndTsvWithHeader) {
+    EXPECT_EQ(import("title,artist,year,genre,album\nA,Artist One,2001,Pop\nB , New Artist , 2002 , Rock , Live\n"),
+        (Titles{ "A", "B" }));
+    EXPECT_EQ(result.rows, 2u);
+    EXPECT_EQ(result.skipped, 0u);
+    EXPECT_EQ(result.artistsCreated, 1u);
+    EXPECT_EQ(result.albumsCreated, 1u);
+    EXPECT_EQ(allArtists.back()->getName(), "New Artist");
+    EXPECT_EQ(allArtists.back()->getAlbums().back()->getName(), "Live");
+
+    EXPECT_EQ(import("C, D\tArtist One\t2003\tJazz\r\n"), (Titles{ "C, D" }));
+    EXPECT_EQ(allSongs.back()->getGenre(), "Jazz");
+}
+
+TEST_F(ImportTest, UnescapesQuotedFields) {
+    EXPECT_EQ(import("\"Hello, World\",Artist One,2020,Pop\n  \"Say \"\"Hi\"\"\"  ,\"Artist, Two\",2021,Rock\n"),
+        (Titles{ "Hello, World", "Say \"Hi\"" }));
+    EXPECT_EQ(allArtists.back()->getName(), "Artist, Two");
+    EXPECT_EQ(result.skipped, 0u);
+}
+
+TEST_F(ImportTest, SkipsMalformedRows) {
+    EXPECT_EQ(import("A,Artist One,2001,Pop\nB,Artist One,year,Pop\nC,Artist One\n,Artist One,2001,Pop\n"
+        "D,Artist One,2001,Pop,Album,Extra\n\nE,Artist One,2002,Pop"), (Titles{ "A", "E" }));
+    EXPECT_EQ(result.skipped, 4u);
+    EXPECT_EQ(result.tooLong, 0u);
+}
+
+TEST_F(ImportTest, RowsLongerThanABlockAreCarriedOver) {
+    string title(300, 'x');
+    string text;
+    for (int i = 0; i < 20; i++) text += title + to_string(i) + ",Artist One,2000,Pop\nShort,Artist Two,2001,Rock\n";
+    for (size_t blockSize : { 16, 64, 500, 1 << 20 }) {
+        for (unsigned threads : { 1, 3 }) {
+            vector<string> titles = import(text, blockSize, threads);
+            ASSERT_EQ(titles.size(), 40u) << "block " << blockSize << ", threads " << threads;
+            for (int i = 0; i < 20; i++) {
+                EXPECT_EQ(titles[2 * i], title + to_string(i));
+                EXPECT_EQ(titles[2 * i + 1], "Short");
+            }
+            EXPECT_EQ(result.skipped, 0u);
+        }
+    }
+}
+
+TEST_F(ImportTest, RejectsRowsOverTheLimit) {
+    string text = "A,Artist One,2001,Pop\n" + string(500, 'x') + ",Artist One,2002,Pop\nB,Artist One,2003,Pop\n"
+        + string(100, 'y') + ",Artist One,2004,Pop\n";
+    for (size_t blockSize : { 32, 200, 1 << 20 }) {
+        EXPECT_EQ(import(text, blockSize, 2, 200), (Titles{ "A", "B", string(100, 'y') })) << "block " << blockSize;
+        EXPECT_EQ(result.skipped, 1u);
+        EXPECT_EQ(result.tooLong, 1u);
+    }
+}
+
+TEST_F(ImportTest, RejectsLineBreaksInQuotedFields) {
+    string text = "A,Artist One,2001,Pop\n\"Two\nLines\",Artist One,2002,Pop\nB,\"Artist\r\nOne\",2003,Pop\n"
+        "\"C \"\"quoted\"\"\",Artist One,2004,Pop\n";
+    for (size_t blockSize : { 8, 24, 1 << 20 }) {
+        for (unsigned threads : { 1, 4 }) {
+            EXPECT_EQ(import(text, blockSize, threads), (Titles{ "A", "C \"quoted\"" }))
+                << "block " << blockSize << ", threads " << threads;
+            EXPECT_EQ(result.skipped, 2u);
+            EXPECT_EQ(result.multiline, 2u);
+        }
+    }
+}
+
+TEST_F(ImportTest, QuotedFieldsSurviveBlockBoundaries) {
+    string text = "title,artist,year,genre\n";
+    Titles expected;
+    for (int i = 0; i < 30; i++) {
+        string title = "Say \"\"" + to_string(i) + "\"\", then, go";
+        text += "\"" + title + "\",\"Artist, Two\",2001,\"Pop\"" + (i % 3 ? "\n" : "\r\n");
+        expected.push_back("Say \"" + to_string(i) + "\", then, go");
+    }
+    for (size_t blockSize : { 7, 40, 1 << 20 }) {
+        for (unsigned threads : { 1, 3 }) {
+            EXPECT_EQ(import(text, blockSize, threads), expected) << "block " << blockSize << ", threads " << threads;
+            EXPECT_EQ(result.skipped, 0u);
+            EXPECT_EQ(allSongs.back()->getArtist()->getName(), "Artist, Two");
+        }
+    }
+}
+
+TEST_F(ImportTest, RejectsOverLongLastRowWithoutNewline) {
+    string quoted = "\"" + string(150, 'q') + ", with a comma\"";
+    string text = "A,Artist One,2001,Pop\n" + quoted + ",Artist One,2002,Pop\nB,Artist One,2003,Pop\n"
+        + string(300, 'z') + ",Artist One,2004,Pop";
+    for (size_t blockSize : { 16, 100, 1 << 20 }) {
+        EXPECT_EQ(import(text, blockSize, 2, 120), (Titles{ "A", "B" })) << "block " << blockSize;
+        EXPECT_EQ(result.rows, 2u);
+        EXPECT_EQ(result.skipped, 2u);
+        EXPECT_EQ(result.tooLong, 2u);
+        EXPECT_EQ(result.multiline, 0u);
+    }
+}
+
+}  // namespace
@@ -0,0 +1,105 @@
+// Shared fixture for the model tests. Every test starts from the built-in
+// sample catalog (two artists, four songs, two albums) with a fresh scratch
+// directory for the files it writes, and passwords hashed with a single
+// iteration so accounts are cheap to create.
+#pragma once
+
+#include "MusicLibrary.h"
+
+#include <gtest/gtest.h>
+
+#include <filesystem>
+#include <sstream>
+
+class LibraryTest : public ::testing::Test {
+protected:
+    filesystem::path directory;
+    uint32_t iterations = 0;
+
+    void SetUp() override {
+        shutdownSystem();
+        initializeSystem();
+        iterations = PasswordHash::defaultIterations;
+        PasswordHash::defaultIterations = 1;
+        const ::testing::TestInfo* test = ::testing::UnitTest::GetInstance()->current_test_info();
+        directory = filesystem::temp_directory_path() / "music_tests" /
+            (string(test->test_suite_name()) + "." + test->name());
+        filesystem::remove_all(directory);
+        filesystem::create_directories(directory);
+    }
+
+    void TearDown() override {
+        wal.close();
+        shutdownSystem();
+        PasswordHash::defaultIterations = iterations;
+        filesystem::remove_all(directory);
+    }
+
+    string path(const string& name) const { return (directory / name).string(); }
+
+    // Drops everything in memory and restarts from the snapshot at `snapshot`
+    // and the log at `log`, the way the program starts; returns the number of
+    // log records applied
+    size_t restart(const string& snapshot, const string& log) {
+        wal.close();
+        shutdownSystem();
+        EXPECT_TRUE(loadSnapshot(snapshot));
+        size_t applied = 0;
+        replayWriteAheadLog(log, &applied);
+        return applied;
+    }
+
+    static vector<uint32_t> idsOf(const PersistentList<SongRef>& songs) {
+        vector<uint32_t> ids;
+        for (const auto& song : songs) ids.push_back(song->getId());
+        return ids;
+    }
+
+    static vector<uint32_t> idsOf(const vector<SongRef>& songs) {
+        vector<uint32_t> ids;
+        for (const auto& song : songs) ids.push_back(song->getId());
+        return ids;
+    }
+
+    // Everything persistence has to keep, one line per object, so two states
+    // can be compared with a readable difference on failure
+    static vector<string> describeLibrary() {
+        vector<string> lines;
+        auto songList = [](const auto& songs) {
+            ostringstream out;
+            for (const auto& song : songs) out << ' ' << song->getId();
+            return out.str();
+        };
+        for (const auto& artist : allArtists) {
+            ostringstream out;
+            out << "artist " << artist->getId() << ' ' << artist->getName() << ':' << songList(artist->getSongs());
+            for (const auto& album : artist->getAlbums()) out << " / " << album->getName() << ':' << songList(album->getSongs());
+            lines.push_back(out.str());
+        }
+        for (const auto& song : allSongs) {
+            ostringstream out;
+            out << "song " << song->getId() << ' ' << song->getTitle() << ' ' << song->getArtist()->getId() << ' '
+                << song->getReleaseYear() << ' ' << song->getGenre();
+            lines.push_back(out.str());
+        }
+        vector<User*> accounts(allUsers);
+        if (admin) accounts.push_back(admin);
+        for (const auto& user : accounts) {
+            ostringstream out;
+            out << "user " << user->getId() << ' ' << user->getUsername() << " favorites:" << songList(user->getFavoriteSongs());
+            for (const auto& playlist : user->getPersonalPlaylists()) {
+                out << " / " << playlist->getId() << ' ' << playlist->getName() << (playlist->getIsPublic() ? "" : " private")
+                    << ':' << songList(playlist->getSongs());
+            }
+            lines.push_back(out.str());
+        }
+        return lines;
+    }
+
+    static User* newUser(const string& name) { return registerUser(name, "password1"); }
+
+    static Playlist* newPlaylist(User* user, const string& name) {
+        user->createPlaylist(name);
+        return user->getPersonalPlaylists().back();
+    }
+};
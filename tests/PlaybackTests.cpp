@@ -0,0 +1,105 @@
+// Shuffle playback: every track once per round, stepping back through the
+// dealt order, reshuffling when looping, and tracks removed mid-shuffle
+#include "LibraryTest.h"
+
+#include <set>
+
+namespace {
+
+class PlaybackTest : public LibraryTest {
+protected:
+    static constexpr size_t TRACKS = 12;
+
+    Playlist* playlist = nullptr;
+    Player player;
+
+    void SetUp() override {
+        LibraryTest::SetUp();
+        for (size_t i = allSongs.size(); i < TRACKS; i++) {
+            admin->addSong("Track " + to_string(i), allArtists[i % 2], 2000, "Pop");
+        }
+        playlist = newPlaylist(newUser("listener"), "mix");
+        for (const auto& song : allSongs) playlist->addSong(song);
+        player.setCurrentPlaylist(playlist);
+        player.setPlaybackMode(PlaybackMode::RANDOM);
+    }
+
+    uint32_t current() const { return player.getCurrentSong()->getId(); }
+
+    // Plays `count` more tracks; returns the ids of the tracks played
+    vector<uint32_t> play(size_t count) {
+        vector<uint32_t> played;
+        for (size_t i = 0; i < count; i++) {
+            SongRef song = player.playNext();
+            if (!song) break;
+            played.push_back(song->getId());
+        }
+        return played;
+    }
+
+    static vector<uint32_t> sorted(vector<uint32_t> ids) {
+        sort(ids.begin(), ids.end());
+        return ids;
+    }
+};
+
+TEST_F(PlaybackTest, ShuffleDealsEveryTrackOnce) {
+    vector<uint32_t> order = { current() };
+    for (uint32_t id : play(TRACKS)) order.push_back(id);
+    EXPECT_EQ(sorted(order), idsOf(playlist->getSongs()));
+    EXPECT_EQ(player.getNextSong(), SongRef());
+    EXPECT_EQ(player.playNext(), SongRef());
+}
+
+TEST_F(PlaybackTest, PreviousRetracesTheShuffleAndNextReplaysIt) {
+    vector<uint32_t> order = { current() };
+    for (uint32_t id : play(7)) order.push_back(id);
+    ASSERT_EQ(order.size(), 8u);
+
+    for (size_t i = order.size() - 1; i > 0; i--) {
+        EXPECT_EQ(player.getPreviousSong()->getId(), order[i - 1]);
+        ASSERT_TRUE(player.playPrevious());
+        EXPECT_EQ(current(), order[i - 1]);
+    }
+    EXPECT_EQ(player.getPreviousSong(), SongRef());
+    EXPECT_EQ(player.playPrevious(), SongRef());
+    EXPECT_EQ(current(), order[0]);
+
+    // Forward again replays what was dealt, then deals the rest
+    EXPECT_EQ(play(7), vector<uint32_t>(order.begin() + 1, order.end()));
+    vector<uint32_t> rest = play(TRACKS);
+    EXPECT_EQ(rest.size(), TRACKS - order.size());
+    order.insert(order.end(), rest.begin(), rest.end());
+    EXPECT_EQ(sorted(order), idsOf(playlist->getSongs()));
+}
+
+TEST_F(PlaybackTest, LoopReshufflesWithoutRepeatingTheLastTrack) {
+    player.toggleLoop();
+    play(TRACKS - 1);
+    for (int round = 0; round < 20; round++) {
+        uint32_t last = current();
+        vector<uint32_t> dealt = play(TRACKS);
+        ASSERT_EQ(dealt.size(), TRACKS);
+        EXPECT_NE(dealt[0], last) << "round " << round;
+        EXPECT_EQ(sorted(dealt), idsOf(playlist->getSongs())) << "round " << round;
+    }
+}
+
+TEST_F(PlaybackTest, RemovingTheCurrentTrackKeepsTheShuffle) {
+    vector<uint32_t> order = { current() };
+    for (uint32_t id : play(3)) order.push_back(id);
+    SongRef removed = player.getCurrentSong()->getRef();
+    playlist->removeSong(removed);
+
+    // Back goes to the track dealt before the removed one, and forward deals
+    // each remaining track once
+    EXPECT_EQ(player.getPreviousSong()->getId(), order[2]);
+    vector<uint32_t> rest = play(TRACKS);
+    EXPECT_EQ(rest.size(), TRACKS - order.size());
+    set<uint32_t> heard(order.begin(), order.end());
+    for (uint32_t id : rest) EXPECT_TRUE(heard.insert(id).second) << "track " << id << " dealt twice";
+    heard.erase(removed->getId());
+    EXPECT_EQ(vector<uint32_t>(heard.begin(), heard.end()), idsOf(playlist->getSongs()));
+}
+
+}  // namespace
@@ -0,0 +1,198 @@
+// Playlist editing: positions, moves, reorders, versions, diffs and undo
+#include "LibraryTest.h"
+
+namespace {
+
+class PlaylistTest : public LibraryTest {
+protected:
+    User* user = nullptr;
+    Playlist* playlist = nullptr;
+    vector<uint32_t> ids;   // The sample songs' ids, in catalog order
+
+    void SetUp() override {
+        LibraryTest::SetUp();
+        user = newUser("listener");
+        playlist = newPlaylist(user, "mix");
+        for (const auto& song : allSongs) {
+            playlist->addSong(song);
+            ids.push_back(song->getId());
+        }
+    }
+
+    vector<uint32_t> order(initializer_list<size_t> positions) const {
+        vector<uint32_t> result;
+        for (size_t i : positions) result.push_back(ids[i]);
+        return result;
+    }
+
+    vector<uint32_t> songs() const { return idsOf(playlist->getSongs()); }
+};
+
+TEST_F(PlaylistTest, InsertAtPositionAndFindIt) {
+    SongRef song = allSongs[2];
+    playlist->removeSong(song);
+    playlist->insertSong(song, 0);
+    EXPECT_EQ(songs(), order({ 2, 0, 1, 3 }));
+    EXPECT_EQ(playlist->positionOf(song), 0u);
+    EXPECT_EQ(playlist->positionOf(allSongs[3]), 3u);
+
+    // Duplicates are ignored and positions past the end append
+    playlist->insertSong(song, 2);
+    EXPECT_EQ(songs(), order({ 2, 0, 1, 3 }));
+    playlist->removeSong(song);
+    playlist->insertSong(song, 99);
+    EXPECT_EQ(songs(), order({ 0, 1, 3, 2 }));
+
+    playlist->removeSong(song);
+    EXPECT_EQ(playlist->positionOf(song), SIZE_MAX);
+}
+
+TEST_F(PlaylistTest, MoveSongsCountsTargetInFinishedOrder) {
+    EXPECT_TRUE(playlist->moveSongs(0, 2, 2));
+    EXPECT_EQ(songs(), order({ 2, 3, 0, 1 }));
+    EXPECT_TRUE(playlist->moveSongs(3, 1, 0));
+    EXPECT_EQ(songs(), order({ 1, 2, 3, 0 }));
+    EXPECT_TRUE(playlist->moveSongs(1, 1, 1));
+    EXPECT_EQ(songs(), order({ 1, 2, 3, 0 }));
+}
+
+TEST_F(PlaylistTest, MoveSongsRejectsRangesOutOfBounds) {
+    uint64_t version = playlist->getVersion();
+    EXPECT_FALSE(playlist->moveSongs(3, 2, 0));
+    EXPECT_FALSE(playlist->moveSongs(0, 2, 3));
+    EXPECT_FALSE(playlist->moveSongs(0, 0, 1));
+    EXPECT_EQ(songs(), order({ 0, 1, 2, 3 }));
+    EXPECT_EQ(playlist->getVersion(), version);
+}
+
+TEST_F(PlaylistTest, MovesKeepOrderThroughManyEditsAtOneSpot) {
+    // Enough songs that repeated inserts and moves at the same spot exhaust
+    // the gaps between order labels and force relabelling
+    vector<SongRef> extra;
+    for (int i = 0; i < 300; i++) {
+        admin->addSong("extra " + to_string(i), allArtists[i % 2], 2000, "Pop");
+        extra.push_back(allSongs.back());
+    }
+    vector<uint32_t> model = songs();
+    for (size_t i = 0; i < extra.size(); i++) {
+        playlist->insertSong(extra[i], 1);
+        model.insert(model.begin() + 1, extra[i]->getId());
+        if (i % 3 == 0) {
+            ASSERT_TRUE(playlist->moveSongs(model.size() - 2, 2, 1));
+            vector<uint32_t> moved(model.end() - 2, model.end());
+            model.erase(model.end() - 2, model.end());
+            model.insert(model.begin() + 1, moved.begin(), moved.end());
+        }
+    }
+    ASSERT_EQ(songs(), model);
+    for (size_t i = 0; i < model.size(); i++) EXPECT_EQ(playlist->positionOf(findById(allSongs, model[i])), i);
+}
+
+TEST_F(PlaylistTest, ReorderPutsListedSongsFirst) {
+    playlist->reorderSongs({ allSongs[3], allSongs[1], allSongs[3] });
+    EXPECT_EQ(songs(), order({ 3, 1, 0, 2 }));
+}
+
+TEST_F(PlaylistTest, SortIsStable) {
+    playlist->sortSongs(SongOrder::YEAR);
+    EXPECT_EQ(songs(), order({ 2, 0, 1, 3 }));
+    playlist->sortSongs(SongOrder::ARTIST);
+    EXPECT_EQ(songs(), order({ 0, 1, 2, 3 }));
+    playlist->sortSongs(SongOrder::TITLE);
+    EXPECT_EQ(songs(), order({ 3, 0, 2, 1 }));
+}
+
+TEST_F(PlaylistTest, UndoRevertsEditsNewestFirst) {
+    playlist->removeSong(allSongs[1]);
+    playlist->moveSongs(0, 1, 2);
+    playlist->sortSongs(SongOrder::YEAR);
+    playlist->insertSong(allSongs[1], 1);
+    EXPECT_EQ(songs(), order({ 2, 1, 0, 3 }));
+
+    vector<vector<uint32_t>> expected = { order({ 2, 0, 3 }), order({ 2, 3, 0 }), order({ 0, 2, 3 }),
+        order({ 0, 1, 2, 3 }), order({ 0, 1, 2 }) };
+    for (size_t i = 0; i < expected.size(); i++) {
+        ASSERT_TRUE(playlist->undo());
+        EXPECT_EQ(songs(), expected[i]) << "after undo " << i + 1;
+    }
+}
+
+TEST_F(PlaylistTest, UndoRecordsANewVersion) {
+    playlist->removeSong(allSongs[1]);
+    PlaylistVersion edited = playlist->snapshot();
+    ASSERT_TRUE(playlist->undo());
+    EXPECT_EQ(playlist->getVersion(), edited.number + 1);
+    EXPECT_EQ(songs(), order({ 0, 1, 2, 3 }));
+
+    // The version undone is still there to compare with
+    PlaylistVersion found;
+    ASSERT_TRUE(playlist->findVersion(edited.number, found));
+    EXPECT_EQ(idsOf(found.songs), order({ 0, 2, 3 }));
+    PlaylistDiff diff = Playlist::diff(found.songs, playlist->getSongs());
+    EXPECT_EQ(idsOf(diff.added), order({ 1 }));
+
+    // A further undo goes on back rather than redoing, and an edit after
+    // an undo is undone first
+    ASSERT_TRUE(playlist->undo());
+    EXPECT_EQ(songs(), order({ 0, 1, 2 }));
+    playlist->moveSongs(0, 1, 2);
+    ASSERT_TRUE(playlist->undo());
+    EXPECT_EQ(songs(), order({ 0, 1, 2 }));
+    ASSERT_TRUE(playlist->undo());
+    EXPECT_EQ(songs(), order({ 0, 1 }));
+    EXPECT_EQ(playlist->getVersion(), edited.number + 5);
+
+    const auto& history = playlist->getHistory();
+    for (size_t i = 1; i < history.size(); i++) EXPECT_GT(history[i].number, history[i - 1].number);
+    EXPECT_GT(playlist->getVersion(), history.back().number);
+}
+
+TEST_F(PlaylistTest, UndoLeavesOutSongsRemovedFromCatalog) {
+    playlist->setSongs({ allSongs[3], allSongs[2], allSongs[1], allSongs[0] });
+    admin->removeSong(allSongs[1]);
+    ASSERT_TRUE(playlist->undo());
+    EXPECT_EQ(songs(), order({ 0, 2, 3 }));
+}
+
+TEST_F(PlaylistTest, SnapshotsStayFixedWhileThePlaylistChanges) {
+    PlaylistVersion before = playlist->snapshot();
+    playlist->moveSongs(0, 1, 3);
+    playlist->removeSong(allSongs[2]);
+    EXPECT_EQ(idsOf(before.songs), order({ 0, 1, 2, 3 }));
+    EXPECT_EQ(songs(), order({ 1, 3, 0 }));
+    EXPECT_GT(playlist->getVersion(), before.number);
+
+    PlaylistVersion found;
+    ASSERT_TRUE(playlist->findVersion(before.number, found));
+    EXPECT_EQ(idsOf(found.songs), order({ 0, 1, 2, 3 }));
+    EXPECT_FALSE(playlist->findVersion(playlist->getVersion() + 1, found));
+}
+
+TEST_F(PlaylistTest, DiffListsAddedRemovedAndReordered) {
+    PlaylistVersion before = playlist->snapshot();
+    playlist->removeSong(allSongs[1]);
+    admin->addSong("Song Five", allArtists[0], 2023, "Pop");
+    playlist->addSong(allSongs.back());
+    PlaylistDiff diff = Playlist::diff(before.songs, playlist->getSongs());
+    EXPECT_EQ(idsOf(diff.added), vector<uint32_t>{ allSongs.back()->getId() });
+    EXPECT_EQ(idsOf(diff.removed), order({ 1 }));
+    EXPECT_FALSE(diff.reordered);
+
+    PlaylistVersion middle = playlist->snapshot();
+    playlist->moveSongs(2, 1, 0);
+    diff = Playlist::diff(middle.songs, playlist->getSongs());
+    EXPECT_TRUE(diff.added.empty());
+    EXPECT_TRUE(diff.removed.empty());
+    EXPECT_TRUE(diff.reordered);
+}
+
+TEST_F(PlaylistTest, PlaybackFollowsMovedSongs) {
+    Player player;
+    player.setCurrentPlaylist(playlist);
+    ASSERT_EQ(player.playNext(), allSongs[1]);
+    playlist->moveSongs(1, 1, 3);   // The current song goes last
+    EXPECT_EQ(player.getNextSong(), SongRef());
+    EXPECT_EQ(player.getPreviousSong(), allSongs[3]);
+}
+
+}  // namespace
@@ -0,0 +1,102 @@
+// Recommender: incremental basket updates agree with counting from scratch
+#include "LibraryTest.h"
+
+namespace {
+
+class RecommenderTest : public LibraryTest {
+protected:
+    void SetUp() override {
+        LibraryTest::SetUp();
+        for (int i = 0; i < 300; i++) admin->addSong("extra " + to_string(i), allArtists[i % 2], 2000, "Pop");
+    }
+
+    void TearDown() override {
+        recommender.clear();
+        LibraryTest::TearDown();
+    }
+
+    vector<SongRef> songs(size_t first, size_t count) const {
+        vector<SongRef> result;
+        for (size_t i = first; i < first + count; i++) result.push_back(allSongs[i]);
+        return result;
+    }
+
+    // Every song's neighbours and scores, for comparing two recommenders
+    static vector<string> describe(const Recommender& counts) {
+        vector<string> lines;
+        for (const auto& song : allSongs) {
+            vector<Recommender::Scored> similar = counts.similar(song, allSongs.size());
+            sort(similar.begin(), similar.end(), [](const Recommender::Scored& a, const Recommender::Scored& b) {
+                return a.song->getId() < b.song->getId();
+            });
+            string line = to_string(song->getId()) + ":";
+            for (const auto& match : similar) line += " " + to_string(match.song->getId()) + "=" + to_string(match.score);
+            lines.push_back(line);
+        }
+        return lines;
+    }
+
+    // A recommender that counted `baskets` from scratch
+    static vector<string> recount(const vector<vector<SongRef>>& baskets) {
+        Recommender fresh;
+        vector<const vector<SongRef>*> all;
+        for (const auto& basket : baskets) all.push_back(&basket);
+        fresh.rebuild(all, 1);
+        return describe(fresh);
+    }
+};
+
+TEST_F(RecommenderTest, ChangedMatchesRecount) {
+    Recommender counts;
+    counts.rebuild({}, 1);
+    vector<SongRef> first = songs(0, 20), second = songs(10, 20), other = songs(5, 12);
+    counts.addBasket(first);
+    counts.addBasket(other);
+
+    counts.changed(first, second);
+    EXPECT_EQ(describe(counts), recount({ second, other }));
+    vector<SongRef> reordered(second.rbegin(), second.rend());
+    counts.changed(second, reordered);
+    EXPECT_EQ(describe(counts), recount({ second, other }));
+    counts.changed(reordered, vector<SongRef>());
+    EXPECT_EQ(describe(counts), recount({ other }));
+    counts.changed(vector<SongRef>(), first);
+    EXPECT_EQ(describe(counts), recount({ first, other }));
+}
+
+TEST_F(RecommenderTest, PlaylistEditsMatchRecount) {
+    rebuildRecommendations(1);
+    Playlist* playlist = newPlaylist(newUser("listener"), "mix");
+    playlist->setSongs(songs(0, 30));
+    playlist->insertSong(allSongs[40], 3);
+    playlist->moveSongs(0, 5, 20);
+    playlist->setSongs(songs(20, 25));
+    playlist->sortSongs(SongOrder::TITLE);
+    playlist->undo();
+    admin->removeSong(allSongs[25]);
+    vector<string> updated = describe(recommender);
+    rebuildRecommendations(1);
+    EXPECT_EQ(updated, describe(recommender));
+}
+
+TEST_F(RecommenderTest, SongPushedOutOfFullBasketLosesItsPairs) {
+    rebuildRecommendations(1);
+    Playlist* playlist = newPlaylist(newUser("listener"), "mix");
+    playlist->setSongs(songs(0, Recommender::BASKET_LIMIT + 10));
+    SongRef last = playlist->getSongs()[Recommender::BASKET_LIMIT - 1];
+    SongRef added = allSongs[Recommender::BASKET_LIMIT + 50];
+    ASSERT_FALSE(recommender.similar(last, 10).empty());
+
+    playlist->insertSong(added, 0);
+    EXPECT_TRUE(recommender.similar(last, 10).empty());
+    EXPECT_FALSE(recommender.similar(added, 10).empty());
+    for (const auto& match : recommender.similar(playlist->getSongs()[1], allSongs.size())) {
+        EXPECT_NE(match.song, last);
+    }
+
+    // Moving it back into the counted part pairs it up again
+    playlist->moveSongs(Recommender::BASKET_LIMIT, 1, 0);
+    EXPECT_FALSE(recommender.similar(last, 10).empty());
+}
+
+}  // namespace
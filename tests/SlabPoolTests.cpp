@@ -0,0 +1,90 @@
+// SlabPool and Handle: generation checks, slot reuse and teardown
+#include "MusicLibrary.h"
+
+#include <gtest/gtest.h>
+
+namespace {
+
+struct Item {
+    static SlabPool<Item> pool;
+    static int destroyed;
+
+    int value;
+
+    explicit Item(int value) : value(value) {
+        if (value < 0) throw runtime_error("negative");
+    }
+    ~Item() { destroyed++; }
+};
+
+SlabPool<Item> Item::pool;
+int Item::destroyed = 0;
+
+class SlabPoolTest : public ::testing::Test {
+protected:
+    void SetUp() override {
+        Item::pool.clear();
+        Item::destroyed = 0;
+    }
+    void TearDown() override { Item::pool.clear(); }
+};
+
+TEST_F(SlabPoolTest, HandleResolvesWhileObjectLives) {
+    Item* item = Item::pool.create(7);
+    Handle<Item> handle(item);
+    ASSERT_TRUE(handle);
+    EXPECT_EQ(handle.get(), item);
+    EXPECT_EQ(handle->value, 7);
+    EXPECT_EQ(Item::pool.size(), 1u);
+}
+
+TEST_F(SlabPoolTest, NullAndOutOfRangeHandlesDoNotResolve) {
+    EXPECT_FALSE(Handle<Item>());
+    EXPECT_EQ(Handle<Item>(static_cast<const Item*>(nullptr)).value(), 0u);
+    Item::pool.create(1);
+    EXPECT_EQ(Item::pool.get((1u << SlabPool<Item>::INDEX_BITS) | 5), nullptr);
+}
+
+TEST_F(SlabPoolTest, HandleGoesStaleWhenObjectIsDestroyed) {
+    Item* item = Item::pool.create(1);
+    Handle<Item> handle(item);
+    Item::pool.destroy(item);
+    EXPECT_FALSE(handle);
+    EXPECT_EQ(handle.get(), nullptr);
+    EXPECT_EQ(Item::destroyed, 1);
+    EXPECT_EQ(Item::pool.size(), 0u);
+}
+
+TEST_F(SlabPoolTest, ReusedSlotDoesNotReviveOldHandle) {
+    Item* first = Item::pool.create(1);
+    Handle<Item> stale(first);
+    Item::pool.destroy(first);
+    Item* second = Item::pool.create(2);
+    Handle<Item> fresh(second);
+    EXPECT_EQ(static_cast<void*>(second), static_cast<void*>(first));
+    EXPECT_NE(fresh, stale);
+    EXPECT_EQ(stale.get(), nullptr);
+    EXPECT_EQ(fresh->value, 2);
+}
+
+TEST_F(SlabPoolTest, ThrowingConstructorLeavesSlotDead) {
+    EXPECT_THROW(Item::pool.create(-1), runtime_error);
+    EXPECT_EQ(Item::pool.size(), 0u);
+    EXPECT_EQ(Item::pool.get((1u << SlabPool<Item>::INDEX_BITS) | 0), nullptr);
+    Item* item = Item::pool.create(3);
+    EXPECT_EQ(Handle<Item>(item)->value, 3);
+    Item::pool.clear();
+    EXPECT_EQ(Item::destroyed, 1);
+}
+
+TEST_F(SlabPoolTest, ClearDestroysEveryLiveObject) {
+    vector<Handle<Item>> handles;
+    for (int i = 0; i < 3000; i++) handles.push_back(Item::pool.create(i));
+    for (int i = 0; i < 3000; i += 3) Item::pool.destroy(handles[i].get());
+    Item::pool.clear();
+    EXPECT_EQ(Item::destroyed, 3000);
+    EXPECT_EQ(Item::pool.size(), 0u);
+    for (const auto& handle : handles) EXPECT_FALSE(handle);
+}
+
+}  // namespace
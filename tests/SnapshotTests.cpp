@@ -0,0 +1,105 @@
+// Snapshots: a saved library loads back unchanged, and a bad file loads nothing
+#include "LibraryTest.h"
+
+namespace {
+
+class SnapshotTest : public LibraryTest {
+protected:
+    // Adds an account with playlists and favorites to the sample catalog
+    void addListener() {
+        User* user = newUser("listener");
+        Playlist* mix = newPlaylist(user, "mix");
+        for (size_t i : { 3, 0, 2 }) mix->addSong(allSongs[i]);
+        user->createPlaylist("private", false);
+        user->getPersonalPlaylists().back()->addSong(allSongs[1]);
+        user->addFavoriteSong(allSongs[2]);
+        user->addFavoriteSong(allSongs[0]);
+    }
+};
+
+TEST_F(SnapshotTest, RoundTripKeepsTheWholeLibrary) {
+    addListener();
+    admin->removeSong(allSongs[1]);
+    vector<string> before = describeLibrary();
+    uint32_t nextSong = Song::getNextId(), nextUser = User::getNextId();
+    ASSERT_TRUE(saveSnapshot(path("library.snapshot")));
+
+    shutdownSystem();
+    ASSERT_TRUE(allSongs.empty());
+    ASSERT_TRUE(loadSnapshot(path("library.snapshot")));
+    EXPECT_EQ(describeLibrary(), before);
+    EXPECT_GE(Song::getNextId(), nextSong);
+    EXPECT_GE(User::getNextId(), nextUser);
+}
+
+TEST_F(SnapshotTest, LoadedAccountsKeepTheirPasswords) {
+    addListener();
+    ASSERT_TRUE(saveSnapshot(path("library.snapshot")));
+    shutdownSystem();
+    ASSERT_TRUE(loadSnapshot(path("library.snapshot")));
+
+    User* user = userDirectory.authenticate("listener", "password1");
+    ASSERT_NE(user, nullptr);
+    EXPECT_EQ(user->getUsername(), "listener");
+    EXPECT_EQ(userDirectory.authenticate("listener", "password2"), nullptr);
+    EXPECT_EQ(userDirectory.authenticate("admin", "admin123"), admin);
+    EXPECT_EQ(registerUser("listener", "password3"), nullptr);
+}
+
+TEST_F(SnapshotTest, LoadedCatalogIsIndexedOnFirstUse) {
+    ASSERT_TRUE(saveSnapshot(path("library.snapshot")));
+    shutdownSystem();
+    ASSERT_TRUE(loadSnapshot(path("library.snapshot")));
+    EXPECT_EQ(catalog.columns.size(), 0u);
+
+    // A search builds every index, not just its own
+    vector<SongRef> four = admin->searchSongs("Four");
+    ASSERT_EQ(four.size(), 1u);
+    EXPECT_EQ(four[0]->getTitle(), "Song Four");
+    EXPECT_EQ(catalog.columns.size(), 4u);
+    EXPECT_EQ(catalog.orders.size(), 4u);
+    EXPECT_EQ(idsOf(admin->rankSongs("three", 10)), vector<uint32_t>{ allSongs[2]->getId() });
+    EXPECT_EQ(admin->searchPlaylists("Debut").size(), 1u);
+
+    SongFilter filter;
+    string error;
+    ASSERT_TRUE(filter.parse("artist=\"Artist Two\" AND year>2020", error)) << error;
+    vector<SongRef> found = filter.run(catalog.filters);
+    ASSERT_EQ(found.size(), 1u);
+    EXPECT_EQ(found[0]->getTitle(), "Song Four");
+
+    // New ids carry on after the loaded ones
+    uint32_t last = allSongs.back()->getId();
+    admin->addSong("Song Five", allArtists[0], 2023, "Pop");
+    EXPECT_GT(allSongs.back()->getId(), last);
+}
+
+TEST_F(SnapshotTest, MissingFileLoadsNothing) {
+    shutdownSystem();
+    EXPECT_FALSE(loadSnapshot(path("missing.snapshot")));
+    EXPECT_TRUE(allSongs.empty());
+    EXPECT_EQ(admin, nullptr);
+}
+
+TEST_F(SnapshotTest, DamagedFileLoadsNothing) {
+    addListener();
+    ASSERT_TRUE(saveSnapshot(path("library.snapshot")));
+    uintmax_t size = filesystem::file_size(path("library.snapshot"));
+
+    filesystem::copy_file(path("library.snapshot"), path("short.snapshot"));
+    filesystem::resize_file(path("short.snapshot"), size / 2);
+    shutdownSystem();
+    EXPECT_FALSE(loadSnapshot(path("short.snapshot")));
+    EXPECT_TRUE(allSongs.empty());
+    EXPECT_TRUE(allUsers.empty());
+
+    {
+        fstream file(path("library.snapshot"), ios::in | ios::out | ios::binary);
+        file.put('X');
+    }
+    EXPECT_FALSE(loadSnapshot(path("library.snapshot")));
+    EXPECT_TRUE(allSongs.empty());
+    EXPECT_TRUE(allArtists.empty());
+}
+
+}  // namespace
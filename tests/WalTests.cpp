@@ -0,0 +1,136 @@
+// Write-ahead log: replay on top of a snapshot, and recovery from a torn tail
+#include "LibraryTest.h"
+
+namespace {
+
+class WalTest : public LibraryTest {
+protected:
+    string snapshotPath, logPath;
+
+    // Saves the sample catalog and starts logging every edit straight to disk
+    void SetUp() override {
+        LibraryTest::SetUp();
+        snapshotPath = path("library.snapshot");
+        logPath = path("library.wal");
+        ASSERT_TRUE(saveSnapshot(snapshotPath));
+        wal.setOptions({ 1, chrono::milliseconds(0), false });
+        ASSERT_TRUE(wal.open(logPath, 0));
+    }
+
+    void TearDown() override {
+        wal.setOptions(WriteAheadLog::Options());
+        LibraryTest::TearDown();
+    }
+
+    // Eight logged edits: a song, an account, a playlist, three songs added
+    // to it and a move, then a favorite
+    void edit() {
+        admin->addSong("Song Five", allArtists[1], 2023, "Soul");
+        User* user = newUser("listener");
+        Playlist* playlist = newPlaylist(user, "mix");
+        playlist->addSong(allSongs[0]);
+        playlist->addSong(allSongs[4]);
+        playlist->insertSong(allSongs[2], 0);
+        playlist->moveSongs(0, 1, 2);
+        user->addFavoriteSong(allSongs[4]);
+    }
+};
+
+TEST_F(WalTest, ReplayRestoresEditsMadeAfterSnapshot) {
+    edit();
+    admin->removeSong(allSongs[1]);
+    vector<string> expected = describeLibrary();
+
+    EXPECT_EQ(restart(snapshotPath, logPath), 9u);
+    EXPECT_EQ(describeLibrary(), expected);
+    EXPECT_NE(userDirectory.authenticate("listener", "password1"), nullptr);
+}
+
+TEST_F(WalTest, ReplayStopsBeforeTornTail) {
+    edit();
+    User* user = userDirectory.find("listener");
+    user->removeFavoriteSong(allSongs[4]);
+    vector<string> withoutLast = describeLibrary();
+    user->addFavoriteSong(allSongs[4]);
+    wal.close();
+
+    // A crash partway through writing the last record
+    uintmax_t size = filesystem::file_size(logPath);
+    filesystem::resize_file(logPath, size - 3);
+    size_t applied = 0;
+    shutdownSystem();
+    ASSERT_TRUE(loadSnapshot(snapshotPath));
+    uint64_t validLength = replayWriteAheadLog(logPath, &applied);
+    EXPECT_EQ(applied, 9u);
+    EXPECT_LT(validLength, size - 3);
+    EXPECT_EQ(describeLibrary(), withoutLast);
+
+    // Reopening cuts the torn record off, so new records follow intact ones
+    ASSERT_TRUE(wal.open(logPath, validLength));
+    EXPECT_EQ(filesystem::file_size(logPath), validLength);
+    userDirectory.find("listener")->addFavoriteSong(allSongs[0]);
+    vector<string> expected = describeLibrary();
+    EXPECT_EQ(restart(snapshotPath, logPath), 10u);
+    EXPECT_EQ(describeLibrary(), expected);
+}
+
+TEST_F(WalTest, ReplayStopsAtCorruptRecord) {
+    admin->addSong("Song Five", allArtists[1], 2023, "Soul");
+    uintmax_t first = filesystem::file_size(logPath);
+    admin->addSong("Song Six", allArtists[1], 2024, "Soul");
+    wal.close();
+
+    {
+        // Flip a byte inside the second record's title
+        fstream file(logPath, ios::in | ios::out | ios::binary);
+        file.seekp(filesystem::file_size(logPath) - 6);
+        file.put('#');
+    }
+    shutdownSystem();
+    ASSERT_TRUE(loadSnapshot(snapshotPath));
+    size_t applied = 0;
+    EXPECT_EQ(replayWriteAheadLog(logPath, &applied), first);
+    EXPECT_EQ(applied, 1u);
+    EXPECT_EQ(allSongs.back()->getTitle(), "Song Five");
+}
+
+TEST_F(WalTest, ReplayStopsAtRecordWithUnexpectedId) {
+    admin->createArtist("Artist Three");
+    admin->addSong("Song Five", allArtists.back(), 2023, "Soul");
+    wal.close();
+
+    // State the log does not fit: the next artist id has moved on, so the
+    // first record is rejected before anything is created
+    shutdownSystem();
+    ASSERT_TRUE(loadSnapshot(snapshotPath));
+    Artist::reserveIds(Artist::getNextId() + 1);
+    vector<string> expected = describeLibrary();
+    size_t applied = 0;
+    EXPECT_EQ(replayWriteAheadLog(logPath, &applied), 0u);
+    EXPECT_EQ(applied, 0u);
+    EXPECT_EQ(describeLibrary(), expected);
+
+    // Same for a song: the artist record applies, the song leaves no trace in
+    // the catalog or its indexes
+    shutdownSystem();
+    ASSERT_TRUE(loadSnapshot(snapshotPath));
+    Song::reserveIds(Song::getNextId() + 1);
+    EXPECT_GT(replayWriteAheadLog(logPath, &applied), 0u);
+    EXPECT_EQ(applied, 1u);
+    EXPECT_EQ(allArtists.back()->getName(), "Artist Three");
+    EXPECT_TRUE(allArtists.back()->getSongs().empty());
+    EXPECT_EQ(allSongs.size(), 4u);
+    EXPECT_TRUE(admin->searchSongs("Song Five").empty());
+    EXPECT_EQ(catalog.columns.size(), 4u);
+    EXPECT_EQ(catalog.orders.size(), 4u);
+}
+
+TEST_F(WalTest, MissingLogReplaysNothing) {
+    wal.close();
+    filesystem::remove(logPath);
+    vector<string> expected = describeLibrary();
+    EXPECT_EQ(restart(snapshotPath, logPath), 0u);
+    EXPECT_EQ(describeLibrary(), expected);
+}
+
+}  // namespace